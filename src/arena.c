@@ -0,0 +1,196 @@
+/* arena.c
+** strophe XMPP client library -- bump allocator
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Bump allocator.
+ *
+ *  An arena hands out memory by bumping a pointer through large blocks,
+ *  and frees all of it at once when its last reference is released.
+ *  The parser builds each stanza in an arena of its own, so that a tree
+ *  of dozens of nodes, names, attributes and text costs a few
+ *  allocations instead of dozens.  The first block is allocated along
+ *  with the arena, and each further block is twice as large as the one
+ *  before, up to ARENA_BLOCK_MAX.  Requests too large for that get a
+ *  block of their own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "arena.h"
+
+/* size of the block allocated along with an arena */
+#define ARENA_BLOCK_SIZE 1024
+/* largest size blocks grow to */
+#define ARENA_BLOCK_MAX 16384
+/* memory is handed out in multiples of this, so that it is aligned for
+ * any of the structures put in it */
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* blocks after the first, linked through a header at their start */
+typedef struct _arena_block_t arena_block_t;
+struct _arena_block_t {
+    arena_block_t *next;
+};
+
+struct _arena_t {
+    xmpp_ctx_t *ctx;
+    unsigned int ref;
+    arena_block_t *blocks;
+    char *free; /* start of the unused part of the current block */
+    size_t left; /* bytes left in the current block */
+    size_t size; /* size of the current block */
+};
+
+/** Allocate a new arena.
+ *
+ *  @param ctx the Strophe context object to allocate blocks with
+ *
+ *  @return a new arena with a reference count of 1, or NULL on memory
+ *      allocation failure
+ */
+arena_t *arena_new(xmpp_ctx_t * const ctx)
+{
+    arena_t *arena;
+
+    arena = xmpp_alloc(ctx, ARENA_ROUND(sizeof(arena_t)) + ARENA_BLOCK_SIZE);
+    if (!arena) return NULL;
+
+    arena->ctx = ctx;
+    arena->ref = 1;
+    arena->blocks = NULL;
+    arena->free = (char *)arena + ARENA_ROUND(sizeof(arena_t));
+    arena->left = ARENA_BLOCK_SIZE;
+    arena->size = ARENA_BLOCK_SIZE;
+
+    return arena;
+}
+
+/** Obtain a new reference to an arena.
+ *
+ *  @param arena an arena
+ *
+ *  @return the arena
+ */
+arena_t *arena_clone(arena_t * const arena)
+{
+    arena->ref++;
+
+    return arena;
+}
+
+/** Release a reference to an arena.
+ *  All memory carved from the arena is freed along with the last
+ *  reference.
+ *
+ *  @param arena an arena
+ */
+void arena_release(arena_t * const arena)
+{
+    arena_block_t *block, *next;
+
+    if (--arena->ref > 0) return;
+
+    for (block = arena->blocks; block; block = next) {
+	next = block->next;
+	xmpp_free(arena->ctx, block);
+    }
+    xmpp_free(arena->ctx, arena);
+}
+
+/* allocate a block with room for size bytes and link it to the arena */
+static char *_arena_block(arena_t * const arena, const size_t size)
+{
+    arena_block_t *block;
+
+    block = xmpp_alloc(arena->ctx, ARENA_ROUND(sizeof(arena_block_t)) + size);
+    if (!block) return NULL;
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    return (char *)block + ARENA_ROUND(sizeof(arena_block_t));
+}
+
+/** Carve memory from an arena.
+ *  The memory is aligned for any structure and is only freed with the
+ *  arena.
+ *
+ *  @param arena an arena
+ *  @param size the number of bytes wanted
+ *
+ *  @return a pointer to the memory or NULL on memory allocation failure
+ */
+void *arena_alloc(arena_t * const arena, const size_t size)
+{
+    size_t need = ARENA_ROUND(size);
+    char *p;
+
+    if (need > arena->left) {
+	/* don't waste the rest of the current block on a large request */
+	if (need > ARENA_BLOCK_MAX / 4)
+	    return _arena_block(arena, need);
+
+	do {
+	    if (arena->size < ARENA_BLOCK_MAX) arena->size *= 2;
+	} while (arena->size < need);
+	p = _arena_block(arena, arena->size);
+	if (!p) return NULL;
+	arena->free = p;
+	arena->left = arena->size;
+    }
+
+    p = arena->free;
+    arena->free += need;
+    arena->left -= need;
+
+    return p;
+}
+
+/** Copy a string of a given length into an arena.
+ *  The copy is null-terminated.
+ *
+ *  @param arena an arena
+ *  @param s the string
+ *  @param len the length of the string
+ *
+ *  @return the copy or NULL on memory allocation failure
+ */
+char *arena_strndup(arena_t * const arena, const char * const s,
+		    const size_t len)
+{
+    char *copy;
+
+    copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+/** Copy a null-terminated string into an arena.
+ *
+ *  @param arena an arena
+ *  @param s the string
+ *
+ *  @return the copy or NULL on memory allocation failure
+ */
+char *arena_strdup(arena_t * const arena, const char * const s)
+{
+    return arena_strndup(arena, s, strlen(s));
+}
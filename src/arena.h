@@ -0,0 +1,45 @@
+/* arena.h
+** strophe XMPP client library -- bump allocator interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Bump allocator API.
+ */
+
+#ifndef __LIBSTROPHE_ARENA_H__
+#define __LIBSTROPHE_ARENA_H__
+
+typedef struct _arena_t arena_t;
+
+/** allocate a new arena with a reference count of 1 */
+arena_t *arena_new(xmpp_ctx_t * const ctx);
+
+/** obtain a new reference to an arena */
+arena_t *arena_clone(arena_t * const arena);
+
+/** release a reference to an arena, freeing all memory carved from it
+ *  along with the last one */
+void arena_release(arena_t * const arena);
+
+/** carve a block of memory from an arena.  it is only freed with the
+ *  arena */
+void *arena_alloc(arena_t * const arena, const size_t size);
+
+/** copy a string of a given length into an arena, null-terminated */
+char *arena_strndup(arena_t * const arena, const char * const s,
+		    const size_t len);
+
+/** copy a null-terminated string into an arena */
+char *arena_strdup(arena_t * const arena, const char * const s);
+
+#endif /* __LIBSTROPHE_ARENA_H__ */
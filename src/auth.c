@@ -78,6 +78,15 @@ static int _handle_digestmd5_rspauth(xmpp_conn_t * const conn,
 
 static int _handle_missing_features_sasl(xmpp_conn_t * const conn,
 					 void * const userdata);
+static int _handle_compress_result(xmpp_conn_t * const conn,
+				   xmpp_stanza_t * const stanza,
+				   void * const userdata);
+static void _bind(xmpp_conn_t * const conn);
+static void _resume_or_bind(xmpp_conn_t * const conn);
+static int _handle_resume_result(xmpp_conn_t * const conn,
+				 xmpp_stanza_t * const stanza,
+				 void * const userdata);
+static void _session_ready(xmpp_conn_t * const conn);
 static int _handle_missing_bind(xmpp_conn_t * const conn,
 				void * const userdata);
 static int _handle_bind(xmpp_conn_t * const conn,
@@ -374,7 +383,7 @@ static int _handle_digestmd5_challenge(xmpp_conn_t * const conn,
 	handler_add(conn, _handle_digestmd5_rspauth, 
 		    XMPP_NS_SASL, NULL, NULL, NULL);
 
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
 
     } else {
@@ -407,7 +416,7 @@ static int _handle_digestmd5_rspauth(xmpp_conn_t * const conn,
 	}	
 	xmpp_stanza_set_name(auth, "response");
 	xmpp_stanza_set_ns(auth, XMPP_NS_SASL);
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
     } else {
 	return _handle_sasl_result(conn, stanza, "DIGEST-MD5");
@@ -492,7 +501,7 @@ static void _auth(xmpp_conn_t * const conn)
 	handler_add(conn, _handle_proceedtls_default, 
 		    XMPP_NS_TLS, NULL, NULL, NULL);
 
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
 
 	/* TLS was tried, unset flag */
@@ -508,7 +517,7 @@ static void _auth(xmpp_conn_t * const conn)
 	handler_add(conn, _handle_sasl_result, XMPP_NS_SASL,
 	            NULL, NULL, "ANONYMOUS");
 
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
 
 	/* SASL ANONYMOUS was tried, unset flag */
@@ -528,7 +537,7 @@ static void _auth(xmpp_conn_t * const conn)
 	handler_add(conn, _handle_digestmd5_challenge, 
 		    XMPP_NS_SASL, NULL, NULL, NULL);
 
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
 
 	/* SASL DIGEST-MD5 was tried, unset flag */
@@ -563,7 +572,7 @@ static void _auth(xmpp_conn_t * const conn)
 	handler_add(conn, _handle_sasl_result,
 		    XMPP_NS_SASL, NULL, NULL, "PLAIN");
 
-	xmpp_send(conn, auth);
+	xmpp_send_lane(conn, auth, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(auth);
 
 	/* SASL PLAIN was tried */
@@ -668,7 +677,7 @@ static void _auth(xmpp_conn_t * const conn)
 	handler_add_timed(conn, _handle_missing_legacy, 
 			  LEGACY_TIMEOUT, NULL);
 
-	xmpp_send(conn, iq);
+	xmpp_send_lane(conn, iq, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(iq);
     }
 }
@@ -711,12 +720,39 @@ static void _handle_open_sasl(xmpp_conn_t * const conn)
 		      FEATURES_TIMEOUT, NULL);
 }
 
+/* returns true if stream features offer zlib compression */
+static int _compression_offered(xmpp_conn_t * const conn,
+				xmpp_stanza_t * const features)
+{
+    xmpp_stanza_t *child, *method;
+    char *text;
+    int found = 0;
+
+    child = xmpp_stanza_get_child_by_name(features, "compression");
+    if (!child || !xmpp_stanza_get_ns(child) ||
+	strcmp(xmpp_stanza_get_ns(child), XMPP_NS_FEATURE_COMPRESSION) != 0)
+	return 0;
+
+    for (method = xmpp_stanza_get_children(child); method && !found;
+	 method = xmpp_stanza_get_next(method)) {
+	if (!xmpp_stanza_get_name(method) ||
+	    strcmp(xmpp_stanza_get_name(method), "method") != 0)
+	    continue;
+	text = xmpp_stanza_get_text(method);
+	if (text) {
+	    found = strcmp(text, "zlib") == 0;
+	    xmpp_free(conn->ctx, text);
+	}
+    }
+
+    return found;
+}
+
 static int _handle_features_sasl(xmpp_conn_t * const conn,
 				 xmpp_stanza_t * const stanza,
 				 void * const userdata)
 {
-    xmpp_stanza_t *bind, *session, *iq, *res, *text;
-    char *resource;
+    xmpp_stanza_t *bind, *session, *sm, *compress, *method, *text;
 
     /* remove missing features handler */
     xmpp_timed_handler_delete(conn, _handle_missing_features_sasl);
@@ -736,6 +772,84 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 	conn->session_required = 1;
     }
 
+    sm = xmpp_stanza_get_child_by_name(stanza, "sm");
+    conn->sm_support = sm && xmpp_stanza_get_ns(sm) &&
+	strcmp(xmpp_stanza_get_ns(sm), XMPP_NS_SM) == 0;
+
+    /* compression is negotiated before binding, as the stream restarts
+       once it is on */
+    if (conn->compression_level && !conn->compress &&
+	_compression_offered(conn, stanza)) {
+	compress = xmpp_stanza_new(conn->ctx);
+	method = xmpp_stanza_new(conn->ctx);
+	text = xmpp_stanza_new(conn->ctx);
+	if (!compress || !method || !text) {
+	    if (compress) xmpp_stanza_release(compress);
+	    if (method) xmpp_stanza_release(method);
+	    if (text) xmpp_stanza_release(text);
+	    disconnect_mem_error(conn);
+	    return 0;
+	}
+
+	xmpp_stanza_set_name(compress, "compress");
+	xmpp_stanza_set_ns(compress, XMPP_NS_COMPRESSION);
+	xmpp_stanza_set_name(method, "method");
+	xmpp_stanza_set_text(text, "zlib");
+	xmpp_stanza_add_child(method, text);
+	xmpp_stanza_release(text);
+	xmpp_stanza_add_child(compress, method);
+	xmpp_stanza_release(method);
+
+	handler_add(conn, _handle_compress_result,
+		    XMPP_NS_COMPRESSION, NULL, NULL, NULL);
+
+	xmpp_send_lane(conn, compress, XMPP_LANE_CONTROL);
+	xmpp_stanza_release(compress);
+
+	return 0;
+    }
+
+    _resume_or_bind(conn);
+
+    return 0;
+}
+
+static int _handle_compress_result(xmpp_conn_t * const conn,
+				   xmpp_stanza_t * const stanza,
+				   void * const userdata)
+{
+    char *name;
+
+    name = xmpp_stanza_get_name(stanza);
+    if (strcmp(name, "compressed") == 0) {
+	xmpp_debug(conn->ctx, "xmpp", "Stream compression enabled.");
+
+	conn->compress = compress_new(conn->ctx, conn->compression_level);
+	if (!conn->compress) {
+	    disconnect_mem_error(conn);
+	    return 0;
+	}
+
+	/* everything from here on is compressed, starting with a new
+	   stream */
+	conn_prepare_reset(conn, _handle_open_sasl);
+	conn_open_stream(conn);
+    } else {
+	/* the server may refuse, which leaves the stream as it was */
+	xmpp_debug(conn->ctx, "xmpp", "Stream compression refused, "\
+		   "continuing without it.");
+	_resume_or_bind(conn);
+    }
+
+    return 0;
+}
+
+/* start binding a resource, which is how a client session begins */
+static void _bind(xmpp_conn_t * const conn)
+{
+    xmpp_stanza_t *bind, *iq, *res, *text;
+    char *resource;
+
     /* if bind is required, go ahead and start it */
     if (conn->bind_required) {
 	/* bind resource */
@@ -749,19 +863,21 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 	iq = xmpp_stanza_new(conn->ctx);
 	if (!iq) {
 	    disconnect_mem_error(conn);
-	    return 0;
+	    return;
 	}
 
 	xmpp_stanza_set_name(iq, "iq");
 	xmpp_stanza_set_type(iq, "set");
 	xmpp_stanza_set_id(iq, "_xmpp_bind1");
 
-	bind = xmpp_stanza_copy(bind);
+	bind = xmpp_stanza_new(conn->ctx);
 	if (!bind) {
 	    xmpp_stanza_release(iq);
 	    disconnect_mem_error(conn);
-	    return 0;
+	    return;
 	}
+	xmpp_stanza_set_name(bind, "bind");
+	xmpp_stanza_set_ns(bind, XMPP_NS_BIND);
 
 	/* request a specific resource if we have one */
         resource = xmpp_jid_resource(conn->ctx, conn->jid);
@@ -779,7 +895,7 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 		xmpp_stanza_release(bind);
 		xmpp_stanza_release(iq);
 		disconnect_mem_error(conn);
-		return 0;
+		return;
 	    }
 	    xmpp_stanza_set_name(res, "resource");
 	    text = xmpp_stanza_new(conn->ctx);
@@ -788,7 +904,7 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 		xmpp_stanza_release(bind);
 		xmpp_stanza_release(iq);
 		disconnect_mem_error(conn);
-		return 0;
+		return;
 	    }
 	    xmpp_stanza_set_text(text, resource);
 	    xmpp_stanza_add_child(res, text);
@@ -802,7 +918,7 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 	xmpp_stanza_release(bind);
 
 	/* send bind request */
-	xmpp_send(conn, iq);
+	xmpp_send_lane(conn, iq, XMPP_LANE_CONTROL);
 	xmpp_stanza_release(iq);
     } else {
 	/* can't bind, disconnect */
@@ -810,10 +926,98 @@ static int _handle_features_sasl(xmpp_conn_t * const conn,
 		   "resource bind.");
 	xmpp_disconnect(conn);
     }
+}
+
+/* pick up the session of a broken connection if there is one, or start
+ * a new one */
+static void _resume_or_bind(xmpp_conn_t * const conn)
+{
+    xmpp_stanza_t *resume;
+    char h[16];
+
+    if (!conn->sm_id) {
+	_bind(conn);
+	return;
+    }
+
+    if (!conn->sm_support) {
+	xmpp_debug(conn->ctx, "xmpp", "Server no longer offers stream "\
+		   "management, starting a new session.");
+	sm_reset(conn);
+	_bind(conn);
+	return;
+    }
+
+    resume = xmpp_stanza_new(conn->ctx);
+    if (!resume) {
+	disconnect_mem_error(conn);
+	return;
+    }
+    xmpp_snprintf(h, sizeof(h), "%u", conn->sm_handled);
+    xmpp_stanza_set_name(resume, "resume");
+    xmpp_stanza_set_ns(resume, XMPP_NS_SM);
+    xmpp_stanza_set_attribute(resume, "h", h);
+    xmpp_stanza_set_attribute(resume, "previd", conn->sm_id);
+
+    handler_add(conn, _handle_resume_result, XMPP_NS_SM, NULL, NULL, NULL);
+
+    xmpp_send_lane(conn, resume, XMPP_LANE_CONTROL);
+    xmpp_stanza_release(resume);
+}
+
+static int _handle_resume_result(xmpp_conn_t * const conn,
+				 xmpp_stanza_t * const stanza,
+				 void * const userdata)
+{
+    char *name, *h;
+
+    name = xmpp_stanza_get_name(stanza);
+    if (strcmp(name, "resumed") == 0) {
+	h = xmpp_stanza_get_attribute(stanza, "h");
+	if (!h || sm_ack(conn, (unsigned int)strtoul(h, NULL, 10)) != 0) {
+	    xmpp_error(conn->ctx, "xmpp", "Server acknowledged stanzas it "\
+		       "was never sent.");
+	    xmpp_disconnect(conn);
+	    return 0;
+	}
+	xmpp_debug(conn->ctx, "xmpp", "Session resumed.");
+
+	conn->sm_state = SM_ON;
+	conn->sm_resumed = 1;
+	sm_resend(conn);
+	_session_ready(conn);
+    } else if (strcmp(name, "failed") == 0) {
+	/* the server forgot the session, what it didn't acknowledge is
+	   lost */
+	xmpp_debug(conn->ctx, "xmpp", "Session could not be resumed, "\
+		   "starting a new one.");
+	sm_reset(conn);
+	_bind(conn);
+    } else {
+	return 1;
+    }
 
     return 0;
 }
 
+/* the session is ready for the user's stanzas */
+static void _session_ready(xmpp_conn_t * const conn)
+{
+    if (conn->sm_state == SM_ON)
+	sm_start(conn);
+    else if (conn->sm_wanted && conn->sm_support)
+	sm_enable(conn);
+
+    /* stanzas which were waiting when the last connection broke */
+    sm_requeue(conn);
+
+    conn->authenticated = 1;
+    handler_schedule_timed(conn);
+
+    /* call connection handler */
+    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+}
+
 static int _handle_missing_features_sasl(xmpp_conn_t * const conn,
 					 void * const userdata)
 {
@@ -846,6 +1050,7 @@ static int _handle_bind(xmpp_conn_t * const conn,
             xmpp_stanza_t *jid_stanza = xmpp_stanza_get_child_by_name(binding,
                                                                       "jid");
             if (jid_stanza) {
+                if (conn->bound_jid) xmpp_free(conn->ctx, conn->bound_jid);
                 conn->bound_jid = xmpp_stanza_get_text(jid_stanza);
             }
         }
@@ -881,14 +1086,10 @@ static int _handle_bind(xmpp_conn_t * const conn,
 	    xmpp_stanza_release(session);
 
 	    /* send session establishment request */
-	    xmpp_send(conn, iq);
+	    xmpp_send_lane(conn, iq, XMPP_LANE_CONTROL);
 	    xmpp_stanza_release(iq);
 	} else {
-	    conn->authenticated = 1;
-	   
-	    /* call connection handler */
-	    conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, 
-			       conn->userdata);
+	    _session_ready(conn);
 	}
     } else {
 	xmpp_error(conn->ctx, "xmpp", "Server sent malformed bind reply.");
@@ -923,10 +1124,7 @@ static int _handle_session(xmpp_conn_t * const conn,
     } else if (type && strcmp(type, "result") == 0) {
 	xmpp_debug(conn->ctx, "xmpp", "Session establishment successful.");
 
-	conn->authenticated = 1;
-	
-	/* call connection handler */
-	conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
+	_session_ready(conn);
     } else {
 	xmpp_error(conn->ctx, "xmpp", "Server sent malformed session reply.");
 	xmpp_disconnect(conn);
@@ -968,6 +1166,7 @@ static int _handle_legacy(xmpp_conn_t * const conn,
 	xmpp_debug(conn->ctx, "xmpp", "Legacy auth succeeded.");
 
 	conn->authenticated = 1;
+	handler_schedule_timed(conn);
 	conn->conn_handler(conn, XMPP_CONN_CONNECT, 0, NULL, conn->userdata);
     } else {
 	xmpp_error(conn->ctx, "xmpp", "Server sent us a legacy authentication "\
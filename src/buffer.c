@@ -0,0 +1,181 @@
+/* buffer.c
+** strophe XMPP client library -- shared send buffers
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Shared send buffers.
+ */
+
+/** @defgroup Buffers Shared send buffers
+ *  A buffer holds data to be sent to any number of connections without
+ *  copying it for each of them.  Each connection's send queue holds a
+ *  reference to the buffer until the data has been written, and the
+ *  buffer is freed once the last reference is released.  Buffers are
+ *  immutable, and their reference counts are atomic, so a buffer may be
+ *  sent to connections of different event loop threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+
+/** Create a buffer which adopts data.
+ *  The buffer takes ownership of the data.  It is freed with the free
+ *  callback once the buffer is released for the last time, or with
+ *  xmpp_free() if the callback is NULL, in which case the data must have
+ *  been allocated with the context's allocator, like the text returned
+ *  by xmpp_stanza_to_text().  If the buffer can't be created, the data
+ *  is freed right away.
+ *
+ *  @param ctx a Strophe context object
+ *  @param data the data
+ *  @param len the length of the data
+ *  @param free_cb function to free the data or NULL
+ *  @param userdata an opaque data pointer passed to the free callback
+ *
+ *  @return a new buffer with a reference count of 1, or NULL on memory
+ *      allocation failure
+ *
+ *  @ingroup Buffers
+ */
+xmpp_buffer_t *xmpp_buffer_adopt(xmpp_ctx_t * const ctx, char * const data,
+				 const size_t len,
+				 xmpp_free_callback free_cb,
+				 void * const userdata)
+{
+    xmpp_buffer_t *buffer;
+
+    buffer = xmpp_alloc(ctx, sizeof(xmpp_buffer_t));
+    if (!buffer) {
+	if (free_cb) free_cb(data, userdata);
+	else xmpp_free(ctx, data);
+	return NULL;
+    }
+
+    buffer->ref = 1;
+    buffer->ctx = ctx;
+    buffer->data = data;
+    buffer->len = len;
+    buffer->free_cb = free_cb;
+    buffer->userdata = userdata;
+
+    return buffer;
+}
+
+/** Create a buffer holding a copy of some data.
+ *
+ *  @param ctx a Strophe context object
+ *  @param data the data
+ *  @param len the length of the data
+ *
+ *  @return a new buffer with a reference count of 1, or NULL on memory
+ *      allocation failure
+ *
+ *  @ingroup Buffers
+ */
+xmpp_buffer_t *xmpp_buffer_new(xmpp_ctx_t * const ctx,
+			       const char * const data, const size_t len)
+{
+    char *copy;
+
+    copy = xmpp_alloc(ctx, len);
+    if (!copy) return NULL;
+    memcpy(copy, data, len);
+
+    return xmpp_buffer_adopt(ctx, copy, len, NULL, NULL);
+}
+
+/** Create a buffer holding a serialized stanza.
+ *  The stanza is rendered once, however many connections the buffer is
+ *  sent to.
+ *
+ *  @param ctx a Strophe context object
+ *  @param stanza a Strophe stanza object
+ *
+ *  @return a new buffer with a reference count of 1, or NULL on an error
+ *
+ *  @ingroup Buffers
+ */
+xmpp_buffer_t *xmpp_buffer_from_stanza(xmpp_ctx_t * const ctx,
+				       xmpp_stanza_t * const stanza)
+{
+    char *buf;
+    size_t len;
+
+    if (xmpp_stanza_to_text(stanza, &buf, &len) != 0) return NULL;
+
+    return xmpp_buffer_adopt(ctx, buf, len, NULL, NULL);
+}
+
+/** Clone a buffer.
+ *  This only increments the reference count and may be called from any
+ *  thread.
+ *
+ *  @param buffer a buffer
+ *
+ *  @return the same buffer
+ *
+ *  @ingroup Buffers
+ */
+xmpp_buffer_t *xmpp_buffer_clone(xmpp_buffer_t * const buffer)
+{
+    atomic_add_int(&buffer->ref, 1);
+    return buffer;
+}
+
+/** Release a buffer.
+ *  The data is freed once the last reference is released.  This may be
+ *  called from any thread.
+ *
+ *  @param buffer a buffer
+ *
+ *  @ingroup Buffers
+ */
+void xmpp_buffer_release(xmpp_buffer_t * const buffer)
+{
+    if (atomic_add_int(&buffer->ref, -1) > 0) return;
+
+    if (buffer->free_cb)
+	buffer->free_cb(buffer->data, buffer->userdata);
+    else
+	xmpp_free(buffer->ctx, buffer->data);
+    xmpp_free(buffer->ctx, buffer);
+}
+
+/** Get the data of a buffer.
+ *
+ *  @param buffer a buffer
+ *
+ *  @return the data, which must not be modified
+ *
+ *  @ingroup Buffers
+ */
+const char *xmpp_buffer_get_data(const xmpp_buffer_t * const buffer)
+{
+    return buffer->data;
+}
+
+/** Get the length of a buffer's data.
+ *
+ *  @param buffer a buffer
+ *
+ *  @return the length in bytes
+ *
+ *  @ingroup Buffers
+ */
+size_t xmpp_buffer_get_len(const xmpp_buffer_t * const buffer)
+{
+    return buffer->len;
+}
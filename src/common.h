@@ -24,14 +24,27 @@
 #ifndef _WIN32
 #include <stdint.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 
 #include "strophe.h"
 #include "sock.h"
 #include "tls.h"
 #include "hash.h"
+#include "arena.h"
+#include "intern.h"
 #include "util.h"
 #include "parser.h"
+#include "thread.h"
+#include "wheel.h"
+#include "mpsc.h"
+#include "logring.h"
+#include "compress.h"
 
 /** run-time context **/
 
@@ -41,19 +54,130 @@ typedef enum {
     XMPP_LOOP_QUIT
 } xmpp_loop_status_t;
 
-typedef struct _xmpp_connlist_t {
+typedef enum {
+    XMPP_EVENT_SELECT,
+    XMPP_EVENT_EPOLL,
+    XMPP_EVENT_URING,
+    XMPP_EVENT_EXTERNAL
+} xmpp_event_backend_t;
+
+/* socket events a connection is waiting for */
+#define EVENT_READ XMPP_IO_READ
+#define EVENT_WRITE XMPP_IO_WRITE
+
+/* an entry of a connection in one of its loop's lists.  the lists are
+ * circular and headed by an entry without a connection, so that entries
+ * are added and removed in constant time */
+typedef struct _xmpp_connlist_t xmpp_connlist_t;
+struct _xmpp_connlist_t {
     xmpp_conn_t *conn;
-    struct _xmpp_connlist_t *next;
-} xmpp_connlist_t;
+    xmpp_connlist_t *next; /* NULL while not in a list */
+    xmpp_connlist_t *prev;
+};
+
+#ifdef HAVE_IO_URING
+typedef struct _uring_conn_t uring_conn_t;
+#endif
+
+/* an event loop drives a shard of a context's connections.  each loop
+ * is only touched by the thread running it, except for the fields
+ * guarded by a lock */
+typedef struct _xmpp_loop_t xmpp_loop_t;
+struct _xmpp_loop_t {
+    xmpp_ctx_t *ctx;
+    xmpp_connlist_t connlist;
+    int load; /* connections given to this loop, guarded by ctx->lock */
+    int migrating; /* connections waiting to move to another loop */
+
+    /* connections which need work on the next iteration, so that idle
+     * connections cost nothing per iteration */
+    xmpp_connlist_t output; /* send queues waiting to be flushed */
+    xmpp_connlist_t resets; /* parsers waiting to be reset */
+    xmpp_connlist_t readable; /* decrypted data left buffered by TLS */
+    mpsc_queue_t posted; /* connections other threads posted data to */
+
+    /* small queued items are packed into one TLS record here */
+    char *tls_batch;
+
+    /* connections handed over by other threads, guarded by lock */
+    mutex_t *lock;
+    xmpp_connlist_t adopt;
+    thread_t *thread;
+
+    /* timed handlers and connection timeouts */
+    wheel_t *wheel;
+
+    /* wakes the loop up when other threads post data, -1 if the
+     * platform has no way to do this */
+    int wake_rd;
+    int wake_wr;
+    volatile int woken; /* a wakeup is pending */
+
+    /* event notification backend */
+    xmpp_event_backend_t ev_backend;
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event *ev_ready;
+    int ev_nready;
+#endif
+#ifdef HAVE_IO_URING
+    uring_t *ring;
+    char *ring_bufs;
+    /* what didn't fit into the submission queue, submitted again once
+     * the ring has room */
+    xmpp_connlist_t ring_rearm; /* connections to re-arm */
+    int *ring_lost_bufs; /* receive buffers to hand back */
+    int ring_nlost_bufs;
+    int ring_wake_lost; /* the wakeup channel isn't watched */
+    uring_conn_t *ring_cancels; /* gone connections left to cancel */
+    /* how long to wait.  the kernel reads it when the timeout is
+     * submitted, which may be on a later iteration */
+    struct __kernel_timespec ring_timeout;
+    int ring_timeout_queued; /* not submitted yet */
+    unsigned int ring_timeout_pos; /* its place in the submission queue */
+#endif
+};
 
 struct _xmpp_ctx_t {
     const xmpp_mem_t *mem;
     const xmpp_log_t *log;
-
-    xmpp_loop_status_t loop_status;
-    xmpp_connlist_t *connlist;
+    int log_level; /* messages below are dropped before formatting */
+    log_ring_t *log_ring; /* passes messages on from a thread if set */
+    unsigned long log_dropped; /* by rings released before */
+
+    /* an xmpp_loop_status_t, read by the loop threads and set by
+     * whichever thread calls xmpp_stop(), so only accessed atomically */
+    volatile int loop_status;
+
+    /* event loops, one per thread */
+    mutex_t *lock;
+    xmpp_loop_t *loops;
+    int nloops;
+    /* loops are being run by their own threads.  connections may be
+     * handed over from any thread, so only accessed atomically */
+    volatile int threaded;
+
+    /* socket interest is reported to an external event loop */
+    xmpp_watch_handler watch_handler;
+    void *watch_userdata;
+
+    /* recycled send pages, linked through their first bytes */
+    mutex_t *pages_lock;
+    char *pages;
+    int npages;
+
+    /* names, attribute names and namespaces shared by all stanzas */
+    intern_t *intern;
 };
 
+/* stanzas are rendered for sending into pages of this size */
+#define SEND_PAGE_SIZE 16384
+/* most free pages kept by a context */
+#define SEND_PAGE_POOL 64
+
+char *ctx_page_get(xmpp_ctx_t * const ctx);
+void ctx_page_put(char * const page, void * const userdata);
+
 
 /* convenience functions for accessing the context */
 void *xmpp_alloc(const xmpp_ctx_t * const ctx, const size_t size);
@@ -85,6 +209,40 @@ void xmpp_debug(const xmpp_ctx_t * const ctx,
 		const char * const fmt,
 		...);
 
+/* the level of a context without a logger */
+#define XMPP_LEVEL_NONE (XMPP_LEVEL_ERROR + 1)
+
+/* whether messages of a level reach the logger.  callers check this
+ * before doing work only needed for the message, such as rendering a
+ * stanza.  building with XMPP_NO_DEBUG_LOG removes debug logging along
+ * with the evaluation of its arguments */
+#define xmpp_log_enabled(ctx, level) ((int)(level) >= (ctx)->log_level)
+#ifdef XMPP_NO_DEBUG_LOG
+#define xmpp_debug_enabled(ctx) 0
+#define xmpp_debug while (0) xmpp_debug
+#else
+#define xmpp_debug_enabled(ctx) xmpp_log_enabled(ctx, XMPP_LEVEL_DEBUG)
+#endif
+
+/* event loop and backend management */
+xmpp_loop_t *event_loops_new(xmpp_ctx_t * const ctx, const int count);
+void event_loops_free(xmpp_ctx_t * const ctx, xmpp_loop_t * const loops,
+		      const int count);
+void event_init(xmpp_loop_t * const loop);
+void event_shutdown(xmpp_loop_t * const loop);
+void event_conn_init(xmpp_conn_t * const conn);
+int event_conn_attach(xmpp_conn_t * const conn);
+void event_conn_detach(xmpp_conn_t * const conn);
+void event_conn_update(xmpp_conn_t * const conn);
+void event_conn_remove(xmpp_conn_t * const conn);
+void event_conn_queued(xmpp_conn_t * const conn);
+void event_conn_flush(xmpp_conn_t * const conn);
+void event_conn_reset(xmpp_conn_t * const conn);
+void event_conn_overflow(xmpp_conn_t * const conn, const int error);
+size_t event_conn_pinned(const xmpp_conn_t * const conn);
+void event_loop_wake(xmpp_loop_t * const loop);
+void event_conn_posted(xmpp_conn_t * const conn);
+
 /** jid */
 /* these return new strings that must be xmpp_free()'d */
 char *xmpp_jid_new(xmpp_ctx_t *ctx, const char *node,
@@ -105,15 +263,55 @@ typedef enum {
     XMPP_STATE_CONNECTED
 } xmpp_conn_state_t;
 
+/* send queue item flags */
+#define SEND_DROPPABLE 0x1 /* may be dropped when the queue overflows */
+#define SEND_CONTINUED 0x2 /* continues the stanza of the previous item */
+#define SEND_BARRIER 0x4 /* goes out after everything queued before */
+#define SEND_STANZA 0x8 /* starts a stanza stream management counts */
+
+/* stream management states */
+#define SM_OFF 0
+#define SM_REQUESTED 1 /* enable sent, stanzas sent are counted */
+#define SM_ON 2 /* enabled or resumed, stanzas received are counted too */
+
+#define SEND_LANES 3
+
 typedef struct _xmpp_send_queue_t xmpp_send_queue_t;
 struct _xmpp_send_queue_t {
+    mpsc_node_t node; /* must be first, links items posted by threads */
     char *data;
     size_t len;
     size_t written;
+    unsigned int flags;
+
+    /* who owns data: a shared buffer, the free callback, or the
+     * context's allocator if both are NULL */
+    xmpp_buffer_t *buffer;
+    xmpp_free_callback free_cb;
+    void *userdata;
 
     xmpp_send_queue_t *next;
 };
 
+/* stanzas waiting for their turn to be written */
+typedef struct _xmpp_send_lane_t xmpp_send_lane_t;
+struct _xmpp_send_lane_t {
+    xmpp_send_queue_t *head;
+    xmpp_send_queue_t *tail;
+    size_t bytes;
+    unsigned int weight;
+    size_t deficit; /* bytes the lane may still move in this round */
+};
+
+struct _xmpp_buffer_t {
+    volatile int ref;
+    xmpp_ctx_t *ctx;
+    char *data;
+    size_t len;
+    xmpp_free_callback free_cb;
+    void *userdata;
+};
+
 typedef struct _xmpp_handlist_t xmpp_handlist_t;
 struct _xmpp_handlist_t {
     /* common members */
@@ -130,6 +328,8 @@ struct _xmpp_handlist_t {
 	struct {
 	    unsigned long period;
 	    uint64_t last_stamp;
+	    xmpp_conn_t *conn;
+	    wheel_timer_t timer; /* pending while the handler may fire */
 	};
 	/* id handlers */
 	struct {
@@ -140,6 +340,7 @@ struct _xmpp_handlist_t {
 	    char *ns;
 	    char *name;
 	    char *type;
+	    int interned; /* ns and name are interned, not copies */
 	};
     };
 };
@@ -160,6 +361,19 @@ struct _xmpp_conn_t {
     int error;
     xmpp_stream_error_t *stream_error;
     sock_t sock;
+    xmpp_loop_t *loop; /* event loop driving this connection */
+    xmpp_loop_t *migrate_to; /* loop this connection is moving to */
+    unsigned int ev_mask; /* events registered with the event backend */
+    int ev_want_write; /* output is waiting for the socket to drain */
+    int ev_linked; /* in the connection list of its loop */
+    xmpp_connlist_t ev_link; /* entry in the loop's or adopt list */
+    xmpp_connlist_t ev_output;
+    xmpp_connlist_t ev_reset;
+    xmpp_connlist_t ev_readable;
+#ifdef HAVE_IO_URING
+    uring_conn_t *uring; /* operations in flight on the io_uring engine */
+    xmpp_connlist_t ev_rearm;
+#endif
     tls_t *tls;
 
     int tls_support;
@@ -168,6 +382,26 @@ struct _xmpp_conn_t {
     int sasl_support; /* if true, field is a bitfield of supported 
 			 mechanisms */ 
     int secured; /* set when stream is secured with TLS */
+    int compression_level; /* zlib level to ask for, 0 for none */
+    compress_t *compress; /* set once the stream is compressed */
+
+    /* stream management (XEP-0198).  the counters wrap around like the
+     * server's */
+    int sm_wanted; /* enable it if the server supports it */
+    int sm_support; /* the server offered it on this stream */
+    int sm_state;
+    int sm_resumed; /* the session was resumed rather than started */
+    char *sm_id; /* id the session can be resumed with, or NULL */
+    unsigned int sm_sent; /* stanzas sent */
+    unsigned int sm_acked; /* stanzas the server acknowledged */
+    unsigned int sm_handled; /* stanzas received */
+    int sm_requested; /* waiting for an acknowledgement */
+    unsigned long sm_ack_interval;
+    /* stanzas sent and not acknowledged yet, in the order sent */
+    xmpp_send_queue_t *sm_unacked_head;
+    xmpp_send_queue_t *sm_unacked_tail;
+    /* stanzas left in the lanes when the stream broke */
+    xmpp_send_lane_t sm_parked[SEND_LANES];
 
     /* if server returns <bind/> or <session/> we must do them */
     int bind_required;
@@ -186,15 +420,49 @@ struct _xmpp_conn_t {
     int blocking_send;
     int send_queue_max;
     int send_queue_len;
+    size_t send_queue_max_bytes;
+    size_t send_queue_bytes; /* not yet written */
+    xmpp_queue_policy_t send_queue_policy;
+    size_t send_queue_high;
+    size_t send_queue_low;
+    int send_queue_above; /* the high watermark was crossed */
+    xmpp_queue_handler send_queue_handler;
+    void *send_queue_userdata;
+    int send_overflow; /* error to be disconnected with for overflowing,
+			* or for failing to compress */
+    wheel_timer_t overflow_timer;
+    xmpp_send_lane_t send_lanes[SEND_LANES];
+    size_t send_lanes_bytes;
+    /* stanzas picked from the lanes, written in this order */
     xmpp_send_queue_t *send_queue_head;
     xmpp_send_queue_t *send_queue_tail;
+    mpsc_queue_t posted; /* items sent from other threads */
+    mpsc_node_t post_node; /* entry in its loop's posted list */
+    volatile int post_state;
+    size_t tls_retry; /* length of a TLS write which must be repeated */
+    xmpp_buffer_t *send_page; /* page stanzas are rendered on into */
+    size_t send_page_len; /* bytes of it in use */
+
+    /* receive buffer and parameters */
+    char *recv_buf;
+    size_t recv_buf_len; /* allocated size of recv_buf */
+    size_t recv_buf_size;
+    size_t read_budget;
+    unsigned int stanza_budget;
+    unsigned int stanza_quota; /* stanzas left in this iteration */
+
+    size_t write_budget;
+    xmpp_conn_stats_t stats;
 
     /* xml parser */
     int reset_parser;
     parser_t *parser;
+    xmpp_stanza_filter stanza_filter;
+    void *stanza_filter_userdata;
 
     /* timeouts */
     unsigned int connect_timeout;
+    wheel_timer_t connect_timer;
 
     /* event handlers */    
 
@@ -219,6 +487,21 @@ void conn_disconnect_clean(xmpp_conn_t * const conn);
 void conn_open_stream(xmpp_conn_t * const conn);
 void conn_prepare_reset(xmpp_conn_t * const conn, xmpp_open_handler handler);
 void conn_parser_reset(xmpp_conn_t * const conn);
+void conn_free_queue_item(xmpp_ctx_t * const ctx,
+			  xmpp_send_queue_t * const item);
+xmpp_send_queue_t *conn_new_buffer_item(xmpp_conn_t * const conn,
+					xmpp_buffer_t * const buffer);
+void conn_send_string(xmpp_conn_t * const conn, const xmpp_lane_t lane,
+		      const unsigned int flags, const char * const fmt, ...);
+void conn_queue(xmpp_conn_t * const conn, xmpp_send_queue_t * const items,
+		const xmpp_lane_t lane, const unsigned int flags);
+void conn_queue_batch(xmpp_conn_t * const conn,
+		      xmpp_send_queue_t * const items,
+		      const xmpp_lane_t lane, const unsigned int flags);
+void conn_queue_pick(xmpp_conn_t * const conn, const size_t want);
+void conn_queue_sent(xmpp_conn_t * const conn, const size_t bytes,
+		     const int items);
+void conn_release_page(xmpp_conn_t * const conn);
 
 
 typedef enum {
@@ -240,14 +523,58 @@ struct _xmpp_stanza_t {
 
     char *data;
 
-    hash_t *attributes;
+    /* attributes as pairs of key and value, in the order they were
+     * first set.  lookups scan them, or a hash table of their positions
+     * once there are many */
+    char **attrs;
+    int nattrs;
+    int attrs_size; /* pairs there is room for */
+    hash_t *attr_index;
+
+    /* nodes built by the parser are carved from an arena shared by the
+     * tree, and each holds a reference to it.  until they are changed,
+     * their data and attributes live in the arena too */
+    arena_t *arena;
+    int arena_data;
+    int arena_attrs;
 };
 
+/* output of the stanza renderer.  when buf is full, next is called to
+ * provide a new buffer with room to spare, either a larger one holding
+ * what was rendered so far or a fresh one to carry on in */
+typedef struct _render_t render_t;
+struct _render_t {
+    char *buf;
+    size_t len; /* bytes rendered into buf */
+    size_t size;
+    int (*next)(render_t * const render);
+    void *userdata;
+};
+
+int stanza_render(xmpp_stanza_t * const stanza, render_t * const render);
+xmpp_stanza_t *stanza_arena_tag(xmpp_ctx_t * const ctx,
+				arena_t * const arena,
+				const char * const name,
+				const char * const * const attrs);
+xmpp_stanza_t *stanza_arena_text(xmpp_ctx_t * const ctx,
+				 arena_t * const arena,
+				 const char * const text, const size_t len);
+int stanza_render_all(xmpp_ctx_t * const ctx,
+		      xmpp_stanza_t * const * const stanzas,
+		      const size_t count, char ** const buf,
+		      size_t * const ends);
+xmpp_stanza_t *stanza_get_child_by_interned_ns(xmpp_stanza_t * const stanza,
+					       const char * const ns);
+
 /* handler management */
 void handler_fire_stanza(xmpp_conn_t * const conn,
 			 xmpp_stanza_t * const stanza);
-uint64_t handler_fire_timed(xmpp_ctx_t * const ctx);
+int handler_wants(xmpp_conn_t * const conn, const char * const name,
+		  const char * const id, const char * const type);
 void handler_reset_timed(xmpp_conn_t *conn, int user_only);
+void handler_schedule_timed(xmpp_conn_t * const conn);
+void handler_cancel_timed(xmpp_conn_t * const conn);
+void handler_clear_system(xmpp_conn_t * const conn);
 void handler_add_timed(xmpp_conn_t * const conn,
 		       xmpp_timed_handler handler,
 		       const unsigned long period,
@@ -269,6 +596,19 @@ void disconnect_mem_error(xmpp_conn_t * const conn);
 /* auth functions */
 void auth_handle_open(xmpp_conn_t * const conn);
 
+/* stream management functions */
+int sm_counts(const char * const name);
+int sm_is_stanza(const char * const data, const size_t len);
+int sm_keep(xmpp_conn_t * const conn, xmpp_send_queue_t * const first);
+int sm_ack(xmpp_conn_t * const conn, const unsigned int h);
+void sm_handled(xmpp_conn_t * const conn, const char * const name);
+void sm_enable(xmpp_conn_t * const conn);
+void sm_start(xmpp_conn_t * const conn);
+void sm_resend(xmpp_conn_t * const conn);
+void sm_park(xmpp_conn_t * const conn);
+void sm_requeue(xmpp_conn_t * const conn);
+void sm_reset(xmpp_conn_t * const conn);
+
 /* replacement snprintf and vsnprintf */
 int xmpp_snprintf (char *str, size_t count, const char *fmt, ...);
 int xmpp_vsnprintf (char *str, size_t count, const char *fmt, va_list arg);
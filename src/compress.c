@@ -0,0 +1,278 @@
+/* compress.c
+** strophe XMPP client library -- stream compression
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Stream compression.
+ *
+ *  A compressed stream (XEP-0138) keeps one zlib deflate state for the
+ *  data it sends and one inflate state for the data it receives for as
+ *  long as the connection lasts, so that every stanza is compressed
+ *  against the ones before it.  Each stanza is flushed with
+ *  Z_SYNC_FLUSH, which lets the peer decompress it as soon as it
+ *  arrives.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "compress.h"
+
+/* the most data decompressed at once */
+#define COMPRESS_CHUNK 16384
+
+struct _compress_t {
+    const xmpp_ctx_t *ctx;
+    z_stream out;
+    z_stream in;
+
+    /* input copied by compress_keep() */
+    char *kept;
+    int in_kept; /* the input left is in kept */
+    int more; /* inflate may have output left without more input */
+
+    char buf[COMPRESS_CHUNK];
+};
+
+/* zlib allocates through the context */
+static voidpf _zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return xmpp_alloc((const xmpp_ctx_t *)opaque, (size_t)items * size);
+}
+
+static void _zfree(voidpf opaque, voidpf p)
+{
+    xmpp_free((const xmpp_ctx_t *)opaque, p);
+}
+
+/** Allocate the compression state of a stream.
+ *
+ *  @param ctx a Strophe context object
+ *  @param level the zlib compression level, from 1 (fastest) to 9 (best)
+ *
+ *  @return the new state or NULL on failure
+ */
+compress_t *compress_new(const xmpp_ctx_t * const ctx, const int level)
+{
+    compress_t *z;
+
+    z = xmpp_alloc(ctx, sizeof(compress_t));
+    if (!z) return NULL;
+
+    memset(z, 0, sizeof(compress_t));
+    z->ctx = ctx;
+    z->out.zalloc = _zalloc;
+    z->out.zfree = _zfree;
+    z->out.opaque = (voidpf)ctx;
+    z->in.zalloc = _zalloc;
+    z->in.zfree = _zfree;
+    z->in.opaque = (voidpf)ctx;
+
+    if (deflateInit(&z->out, level) != Z_OK) {
+	xmpp_free(ctx, z);
+	return NULL;
+    }
+    if (inflateInit(&z->in) != Z_OK) {
+	deflateEnd(&z->out);
+	xmpp_free(ctx, z);
+	return NULL;
+    }
+
+    return z;
+}
+
+/** Release the compression state of a stream.
+ *
+ *  @param z a compression state
+ */
+void compress_free(compress_t * const z)
+{
+    deflateEnd(&z->out);
+    inflateEnd(&z->in);
+    if (z->kept) xmpp_free(z->ctx, z->kept);
+    xmpp_free(z->ctx, z);
+}
+
+/** Compress data for sending.
+ *  The compressed data is appended to a buffer allocated from the
+ *  stream's context, which is grown as needed.
+ *
+ *  @param z a compression state
+ *  @param data the data to compress
+ *  @param len the length of the data
+ *  @param flush true to flush everything compressed so far
+ *  @param buf the buffer, or NULL to allocate one
+ *  @param used the bytes in use at the start of the buffer
+ *  @param size the size of the buffer
+ *
+ *  @return 0 on success, XMPP_EMEM if the buffer could not be grown or
+ *      XMPP_EINVOP if zlib failed
+ */
+int compress_deflate(compress_t * const z, const char * const data,
+		     const size_t len, const int flush, char ** const buf,
+		     size_t * const used, size_t * const size)
+{
+    char *grown;
+    size_t want;
+
+    z->out.next_in = (Bytef *)data;
+    z->out.avail_in = (uInt)len;
+
+    do {
+	/* text compresses well, so start out with half the space */
+	if (*size - *used < 64) {
+	    want = *size ? *size * 2 : len / 2 + 64;
+	    grown = xmpp_realloc(z->ctx, *buf, want);
+	    if (!grown) return XMPP_EMEM;
+	    *buf = grown;
+	    *size = want;
+	}
+
+	z->out.next_out = (Bytef *)*buf + *used;
+	z->out.avail_out = (uInt)(*size - *used);
+	if (deflate(&z->out, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH) ==
+	    Z_STREAM_ERROR)
+	    return XMPP_EINVOP;
+	*used = *size - z->out.avail_out;
+    } while (z->out.avail_in || !z->out.avail_out);
+
+    return 0;
+}
+
+/** Hand received data to a stream for decompression.
+ *  Data left over from before is kept in front of it.
+ *
+ *  @param z a compression state
+ *  @param data the received data
+ *  @param len the length of the data
+ *
+ *  @return 0 on success or XMPP_EMEM
+ */
+int compress_input(compress_t * const z, char * const data,
+		   const size_t len)
+{
+    char *joined;
+
+    if (!z->in.avail_in) {
+	if (z->in_kept) {
+	    xmpp_free(z->ctx, z->kept);
+	    z->kept = NULL;
+	}
+	z->in.next_in = (Bytef *)data;
+	z->in.avail_in = (uInt)len;
+	z->in_kept = 0;
+	return 0;
+    }
+
+    /* append to the input left over */
+    joined = xmpp_alloc(z->ctx, z->in.avail_in + len);
+    if (!joined) return XMPP_EMEM;
+    memcpy(joined, z->in.next_in, z->in.avail_in);
+    memcpy(joined + z->in.avail_in, data, len);
+
+    if (z->kept) xmpp_free(z->ctx, z->kept);
+    z->kept = joined;
+    z->in.next_in = (Bytef *)joined;
+    z->in.avail_in += (uInt)len;
+    z->in_kept = 1;
+
+    return 0;
+}
+
+/** Decompress received data.
+ *  This is called until it returns 0 or the caller stops to do other
+ *  things, in which case compress_keep() saves the rest of the input.
+ *
+ *  @param z a compression state
+ *  @param out set to the decompressed data, which is valid until the
+ *      next call
+ *
+ *  @return the number of bytes decompressed, 0 if the input is used
+ *      up, or -1 on corrupt input
+ */
+int compress_inflate(compress_t * const z, char ** const out)
+{
+    int ret, len;
+
+    while (z->in.avail_in || z->more) {
+	z->in.next_out = (Bytef *)z->buf;
+	z->in.avail_out = COMPRESS_CHUNK;
+	ret = inflate(&z->in, Z_SYNC_FLUSH);
+	if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR ||
+	    ret == Z_MEM_ERROR || ret == Z_STREAM_ERROR)
+	    return -1;
+
+	len = COMPRESS_CHUNK - z->in.avail_out;
+	z->more = !z->in.avail_out;
+	if (ret == Z_STREAM_END) {
+	    /* the peer ended its stream; what follows starts a new one */
+	    inflateReset(&z->in);
+	    z->more = 0;
+	}
+	if (len) {
+	    *out = z->buf;
+	    return len;
+	}
+	if (ret == Z_BUF_ERROR) break;
+    }
+
+    z->more = 0;
+    if (z->in_kept) {
+	xmpp_free(z->ctx, z->kept);
+	z->kept = NULL;
+	z->in_kept = 0;
+    }
+
+    return 0;
+}
+
+/** Check for received data not yet decompressed.
+ *
+ *  @param z a compression state
+ *
+ *  @return true if compress_inflate() has more to return
+ */
+int compress_pending(const compress_t * const z)
+{
+    return z->in.avail_in || z->more;
+}
+
+/** Keep the received data not yet decompressed.
+ *  The data handed to compress_input() may be reused by the caller once
+ *  this returns.
+ *
+ *  @param z a compression state
+ *
+ *  @return 0 on success or XMPP_EMEM
+ */
+int compress_keep(compress_t * const z)
+{
+    char *copy;
+
+    if (!z->in.avail_in || z->in_kept) return 0;
+
+    copy = xmpp_alloc(z->ctx, z->in.avail_in);
+    if (!copy) return XMPP_EMEM;
+    memcpy(copy, z->in.next_in, z->in.avail_in);
+
+    if (z->kept) xmpp_free(z->ctx, z->kept);
+    z->kept = copy;
+    z->in.next_in = (Bytef *)copy;
+    z->in_kept = 1;
+
+    return 0;
+}
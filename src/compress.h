@@ -0,0 +1,58 @@
+/* compress.h
+** strophe XMPP client library -- stream compression interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Stream compression API.
+ */
+
+#ifndef __LIBSTROPHE_COMPRESS_H__
+#define __LIBSTROPHE_COMPRESS_H__
+
+#include <stddef.h>
+
+typedef struct _compress_t compress_t;
+
+/** allocate the deflate and inflate state of a stream, compressing at
+ *  a zlib level from 1 to 9 */
+compress_t *compress_new(const xmpp_ctx_t * const ctx, const int level);
+
+/** release the state of a stream */
+void compress_free(compress_t * const z);
+
+/** compress data, appending the result to a buffer of size bytes with
+ *  used bytes in use, which is grown as needed.  flush is true at the
+ *  end of a stanza so that the peer can decompress it whole */
+int compress_deflate(compress_t * const z, const char * const data,
+		     const size_t len, const int flush, char ** const buf,
+		     size_t * const used, size_t * const size);
+
+/** hand received data to the stream.  the data is only referenced
+ *  until compress_inflate() returns 0 or compress_keep() is called.
+ *  returns 0 or XMPP_EMEM */
+int compress_input(compress_t * const z, char * const data,
+		   const size_t len);
+
+/** decompress the next piece of input.  returns the number of bytes
+ *  stored at *out, 0 if everything was decompressed, or -1 if the
+ *  input is corrupt */
+int compress_inflate(compress_t * const z, char ** const out);
+
+/** return true if there is input left to decompress */
+int compress_pending(const compress_t * const z);
+
+/** copy the input left to decompress, so that the caller's buffer can
+ *  be reused.  returns 0 or XMPP_EMEM */
+int compress_keep(compress_t * const z);
+
+#endif /* __LIBSTROPHE_COMPRESS_H__ */
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include <strophe.h>
 
@@ -29,11 +30,69 @@
 #include "util.h"
 #include "parser.h"
 
+#if defined(_WIN32) && !defined(ENOBUFS)
+#define ENOBUFS WSAENOBUFS
+#endif
+
 #ifndef DEFAULT_SEND_QUEUE_MAX
 /** @def DEFAULT_SEND_QUEUE_MAX
- *  The default maximum send queue size.  This is currently unused.
+ *  The default maximum number of stanzas in the send queue.  The
+ *  default of 0 puts no limit on the send queue.
+ */
+#define DEFAULT_SEND_QUEUE_MAX 0
+#endif
+#ifndef DEFAULT_RECV_BUFFER_SIZE
+/** @def DEFAULT_RECV_BUFFER_SIZE
+ *  The default size of a connection's receive buffer.  This is the most
+ *  data read from the socket at once.
+ */
+#define DEFAULT_RECV_BUFFER_SIZE 16384
+#endif
+#ifndef DEFAULT_READ_BUDGET
+/** @def DEFAULT_READ_BUDGET
+ *  The default number of bytes read from a connection in one iteration
+ *  of the event loop before moving on to other connections.
+ */
+#define DEFAULT_READ_BUDGET 65536
+#endif
+#ifndef DEFAULT_STANZA_BUDGET
+/** @def DEFAULT_STANZA_BUDGET
+ *  The default number of stanzas handled for a connection in one
+ *  iteration of the event loop before moving on to other connections.
+ */
+#define DEFAULT_STANZA_BUDGET 64
+#endif
+#ifndef DEFAULT_WRITE_BUDGET
+/** @def DEFAULT_WRITE_BUDGET
+ *  The default number of bytes written to a connection in one iteration
+ *  of the event loop before moving on to other connections.
+ */
+#define DEFAULT_WRITE_BUDGET 65536
+#endif
+#ifndef SEND_LANE_QUANTUM
+/** @def SEND_LANE_QUANTUM
+ *  The number of bytes a send lane may pick for writing per unit of its
+ *  weight each time the lanes take turns.
+ */
+#define SEND_LANE_QUANTUM 4096
+#endif
+#ifndef DEFAULT_CONTROL_WEIGHT
+/** @def DEFAULT_CONTROL_WEIGHT
+ *  The default weight of a connection's control send lane.
+ */
+#define DEFAULT_CONTROL_WEIGHT 16
+#endif
+#ifndef DEFAULT_INTERACTIVE_WEIGHT
+/** @def DEFAULT_INTERACTIVE_WEIGHT
+ *  The default weight of a connection's interactive send lane.
  */
-#define DEFAULT_SEND_QUEUE_MAX 64
+#define DEFAULT_INTERACTIVE_WEIGHT 4
+#endif
+#ifndef DEFAULT_BULK_WEIGHT
+/** @def DEFAULT_BULK_WEIGHT
+ *  The default weight of a connection's bulk send lane.
+ */
+#define DEFAULT_BULK_WEIGHT 1
 #endif
 #ifndef DISCONNECT_TIMEOUT
 /** @def DISCONNECT_TIMEOUT 
@@ -49,6 +108,14 @@
  */
 #define CONNECT_TIMEOUT 5000 /* 5 seconds */
 #endif
+#ifndef DEFAULT_ACK_INTERVAL
+/** @def DEFAULT_ACK_INTERVAL
+ *  The default time (in milliseconds) between requests for the server
+ *  to acknowledge stanzas while stream management is on.  The default
+ *  is 5 seconds.
+ */
+#define DEFAULT_ACK_INTERVAL 5000 /* 5 seconds */
+#endif
 
 static int _disconnect_cleanup(xmpp_conn_t * const conn, 
 			       void * const userdata);
@@ -59,6 +126,9 @@ static void _handle_stream_end(char *name,
                                void * const userdata);
 static void _handle_stream_stanza(xmpp_stanza_t *stanza,
                                   void * const userdata);
+static int _handle_stream_filter(char *name, char **attrs,
+				 void * const userdata);
+static void _handle_stream_skipped(char *name, void * const userdata);
 
 /** Create a new Strophe connection object.
  *
@@ -71,7 +141,7 @@ static void _handle_stream_stanza(xmpp_stanza_t *stanza,
 xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
 {
     xmpp_conn_t *conn = NULL;
-    xmpp_connlist_t *tail, *item;
+    int i;
 
     if (ctx == NULL) return NULL;
 	conn = xmpp_alloc(ctx, sizeof(xmpp_conn_t));
@@ -82,6 +152,12 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
 	conn->type = XMPP_UNKNOWN;
         conn->state = XMPP_STATE_DISCONNECTED;
 	conn->sock = -1;
+	conn->loop = NULL;
+	conn->migrate_to = NULL;
+	event_conn_init(conn);
+#ifdef HAVE_IO_URING
+	conn->uring = NULL;
+#endif
 	conn->tls = NULL;
 	conn->timeout_stamp = 0;
 	conn->error = 0;
@@ -91,11 +167,46 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
 	conn->blocking_send = 0;
 	conn->send_queue_max = DEFAULT_SEND_QUEUE_MAX;
 	conn->send_queue_len = 0;
+	conn->send_queue_max_bytes = 0;
+	conn->send_queue_bytes = 0;
+	conn->send_queue_policy = XMPP_QUEUE_REJECT;
+	conn->send_queue_high = 0;
+	conn->send_queue_low = 0;
+	conn->send_queue_above = 0;
+	conn->send_queue_handler = NULL;
+	conn->send_queue_userdata = NULL;
+	conn->send_overflow = 0;
+	for (i = 0; i < SEND_LANES; i++) {
+	    conn->send_lanes[i].head = NULL;
+	    conn->send_lanes[i].tail = NULL;
+	    conn->send_lanes[i].bytes = 0;
+	    conn->send_lanes[i].deficit = 0;
+	}
+	conn->send_lanes[XMPP_LANE_CONTROL].weight = DEFAULT_CONTROL_WEIGHT;
+	conn->send_lanes[XMPP_LANE_INTERACTIVE].weight =
+	    DEFAULT_INTERACTIVE_WEIGHT;
+	conn->send_lanes[XMPP_LANE_BULK].weight = DEFAULT_BULK_WEIGHT;
+	conn->send_lanes_bytes = 0;
 	conn->send_queue_head = NULL;
 	conn->send_queue_tail = NULL;
+	mpsc_init(&conn->posted);
+	conn->tls_retry = 0;
+	conn->send_page = NULL;
+	conn->send_page_len = 0;
+
+	/* default receive parameters, the buffer is allocated on first use */
+	conn->recv_buf = NULL;
+	conn->recv_buf_len = 0;
+	conn->recv_buf_size = DEFAULT_RECV_BUFFER_SIZE;
+	conn->read_budget = DEFAULT_READ_BUDGET;
+	conn->stanza_budget = DEFAULT_STANZA_BUDGET;
+	conn->stanza_quota = DEFAULT_STANZA_BUDGET;
+	conn->write_budget = DEFAULT_WRITE_BUDGET;
+	memset(&conn->stats, 0, sizeof(conn->stats));
 
 	/* default timeouts */
 	conn->connect_timeout = CONNECT_TIMEOUT;
+	wheel_timer_init(&conn->connect_timer, NULL, conn);
 
 	conn->lang = xmpp_strdup(conn->ctx, "en");
 	if (!conn->lang) {
@@ -113,6 +224,25 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
 	conn->tls_failed = 0;
 	conn->sasl_support = 0;
         conn->secured = 0;
+	conn->compression_level = 0;
+	conn->compress = NULL;
+
+	conn->sm_wanted = 0;
+	conn->sm_support = 0;
+	conn->sm_state = SM_OFF;
+	conn->sm_resumed = 0;
+	conn->sm_id = NULL;
+	conn->sm_sent = 0;
+	conn->sm_acked = 0;
+	conn->sm_handled = 0;
+	conn->sm_requested = 0;
+	conn->sm_ack_interval = DEFAULT_ACK_INTERVAL;
+	conn->sm_unacked_head = NULL;
+	conn->sm_unacked_tail = NULL;
+	for (i = 0; i < SEND_LANES; i++) {
+	    conn->sm_parked[i].head = NULL;
+	    conn->sm_parked[i].tail = NULL;
+	}
 
 	conn->bind_required = 0;
 	conn->session_required = 0;
@@ -122,6 +252,11 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
                                   _handle_stream_end,
                                   _handle_stream_stanza,
                                   conn);
+	if (conn->parser)
+	    parser_set_filter(conn->parser, _handle_stream_filter,
+			      _handle_stream_skipped);
+	conn->stanza_filter = NULL;
+	conn->stanza_filter_userdata = NULL;
         conn->reset_parser = 0;
         conn_prepare_reset(conn, auth_handle_open);
 
@@ -136,24 +271,7 @@ xmpp_conn_t *xmpp_conn_new(xmpp_ctx_t * const ctx)
 	/* give the caller a reference to connection */
 	conn->ref = 1;
 
-	/* add connection to ctx->connlist */
-	tail = conn->ctx->connlist;
-	while (tail && tail->next) tail = tail->next;
-
-	item = xmpp_alloc(conn->ctx, sizeof(xmpp_connlist_t));
-	if (!item) {
-	    xmpp_error(conn->ctx, "xmpp", "failed to allocate memory");
-	    xmpp_free(conn->ctx, conn->lang);
-            parser_free(conn->parser);
-	    xmpp_free(conn->ctx, conn);
-	    conn = NULL;
-	} else {
-	    item->conn = conn;
-	    item->next = NULL;
-
-	    if (tail) tail->next = item;
-	    else conn->ctx->connlist = item;
-	}
+	/* the connection joins an event loop once it connects */
     }
     
     return conn;
@@ -187,37 +305,46 @@ xmpp_conn_t *xmpp_conn_clone(xmpp_conn_t * const conn)
 int xmpp_conn_release(xmpp_conn_t * const conn)
 {
     xmpp_ctx_t *ctx;
-    xmpp_connlist_t *item, *prev;
     xmpp_handlist_t *hlitem, *thli;
+    xmpp_send_queue_t *sq;
     hash_iterator_t *iter;
     const char *key;
     int released = 0;
+    int i;
 
     if (conn->ref > 1) 
 	conn->ref--;
     else {
 	ctx = conn->ctx;
 
-	/* remove connection from context's connlist */
-	if (ctx->connlist->conn == conn) {
-	    item = ctx->connlist;
-	    ctx->connlist = item->next;
-	    xmpp_free(ctx, item);
-	} else {
-	    prev = NULL;
-	    item = ctx->connlist;
-	    while (item && item->conn != conn) {
-		prev = item;
-		item = item->next;
-	    }
+	/* remove connection from its event loop */
+	event_conn_detach(conn);
+
+	/* drop data other threads posted too late */
+	while ((sq = (xmpp_send_queue_t *)mpsc_pop(&conn->posted)))
+	    conn_free_queue_item(ctx, sq);
 
-	    if (!item) {
-		xmpp_error(ctx, "xmpp", "Connection not in context's list\n");
-	    } else {
-		prev->next = item->next;
-		xmpp_free(ctx, item);
+	/* and data that was never written */
+	while ((sq = conn->send_queue_head)) {
+	    conn->send_queue_head = sq->next;
+	    conn_free_queue_item(ctx, sq);
+	}
+	conn->send_queue_tail = NULL;
+	conn_release_page(conn);
+	for (i = 0; i < SEND_LANES; i++) {
+	    while ((sq = conn->send_lanes[i].head)) {
+		conn->send_lanes[i].head = sq->next;
+		conn_free_queue_item(ctx, sq);
+	    }
+	    while ((sq = conn->sm_parked[i].head)) {
+		conn->sm_parked[i].head = sq->next;
+		conn_free_queue_item(ctx, sq);
 	    }
 	}
+	if (conn->compress) compress_free(conn->compress);
+
+	/* and what stream management kept for resending */
+	sm_reset(conn);
 
 	/* free handler stuff
 	 * note that userdata is the responsibility of the client
@@ -253,8 +380,10 @@ int xmpp_conn_release(xmpp_conn_t * const conn)
 	    thli = hlitem;
 	    hlitem = hlitem->next;
 
-	    if (thli->ns) xmpp_free(ctx, thli->ns);
-	    if (thli->name) xmpp_free(ctx, thli->name);
+	    if (!thli->interned) {
+		if (thli->ns) xmpp_free(ctx, thli->ns);
+		if (thli->name) xmpp_free(ctx, thli->name);
+	    }
 	    if (thli->type) xmpp_free(ctx, thli->type);
 	    xmpp_free(ctx, thli);
 	}
@@ -274,6 +403,7 @@ int xmpp_conn_release(xmpp_conn_t * const conn)
 	if (conn->pass) xmpp_free(ctx, conn->pass);
 	if (conn->stream_id) xmpp_free(ctx, conn->stream_id);
 	if (conn->lang) xmpp_free(ctx, conn->lang);
+	if (conn->recv_buf) xmpp_free(ctx, conn->recv_buf);
 	xmpp_free(ctx, conn);
 	released = 1;
     }
@@ -369,6 +499,62 @@ xmpp_ctx_t* xmpp_conn_get_context(xmpp_conn_t * const conn)
 	return conn->ctx;
 }
 
+/* clear what the last connection left behind, so that the connection
+ * object can connect again.  with a session to resume, its unsent
+ * stanzas are kept along with the ones the server didn't acknowledge */
+static void _conn_reuse(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *sq;
+    int i;
+
+    xmpp_free(conn->ctx, conn->domain);
+    conn->domain = NULL;
+    if (conn->stream_error) {
+	xmpp_stanza_release(conn->stream_error->stanza);
+	if (conn->stream_error->text)
+	    xmpp_free(conn->ctx, conn->stream_error->text);
+	xmpp_free(conn->ctx, conn->stream_error);
+	conn->stream_error = NULL;
+    }
+    conn->error = 0;
+    conn->tls_support = 0;
+    conn->tls_failed = 0;
+    conn->sasl_support = 0;
+    conn->secured = 0;
+    conn->bind_required = 0;
+    conn->session_required = 0;
+    conn->authenticated = 0;
+    conn->sm_support = 0;
+    conn->sm_resumed = 0;
+    conn->sm_state = SM_OFF;
+    conn->sm_requested = 0;
+
+    /* what was picked for writing is part of the old stream */
+    while ((sq = conn->send_queue_head)) {
+	conn->send_queue_head = sq->next;
+	conn_free_queue_item(conn->ctx, sq);
+    }
+    conn->send_queue_tail = NULL;
+
+    if (conn->sm_id)
+	sm_park(conn);
+    else
+	sm_reset(conn);
+    for (i = 0; i < SEND_LANES; i++) {
+	while ((sq = conn->send_lanes[i].head)) {
+	    conn->send_lanes[i].head = sq->next;
+	    conn_free_queue_item(conn->ctx, sq);
+	}
+	conn->send_lanes[i].tail = NULL;
+	conn->send_lanes[i].bytes = 0;
+	conn->send_lanes[i].deficit = 0;
+    }
+    conn->send_lanes_bytes = 0;
+    conn_queue_sent(conn, conn->send_queue_bytes, conn->send_queue_len);
+
+    conn_prepare_reset(conn, auth_handle_open);
+}
+
 /** Initiate a connection to the XMPP server.
  *  This function returns immediately after starting the connection
  *  process to the XMPP server, and notifiations of connection state changes
@@ -400,6 +586,9 @@ int xmpp_connect_client(xmpp_conn_t * const conn,
     int connectport;
     const char * domain;
 
+    if (conn->state != XMPP_STATE_DISCONNECTED) return -1;
+    if (conn->domain) _conn_reuse(conn);
+
     conn->type = XMPP_CLIENT;
 
     conn->domain = xmpp_jid_domain(conn->ctx, conn->jid);
@@ -437,6 +626,12 @@ int xmpp_connect_client(xmpp_conn_t * const conn,
 
     conn->state = XMPP_STATE_CONNECTING;
     conn->timeout_stamp = time_stamp();
+    if (event_conn_attach(conn) < 0) {
+	sock_close(conn->sock);
+	conn->sock = -1;
+	conn->state = XMPP_STATE_DISCONNECTED;
+	return -1;
+    }
     xmpp_debug(conn->ctx, "xmpp", "attempting to connect to %s", connectdomain);
 
     return 0;
@@ -466,10 +661,18 @@ void conn_disconnect(xmpp_conn_t * const conn)
 {
     xmpp_debug(conn->ctx, "xmpp", "Closing socket.");
     conn->state = XMPP_STATE_DISCONNECTED;
+    conn->send_overflow = 0;
+    conn_release_page(conn);
+    if (conn->compress) {
+	compress_free(conn->compress);
+	conn->compress = NULL;
+    }
+    event_conn_remove(conn);
     if (conn->tls) {
 	tls_stop(conn->tls);
 	tls_free(conn->tls);
 	conn->tls = NULL;
+	conn->tls_retry = 0;
     }
     sock_close(conn->sock);
 
@@ -484,6 +687,7 @@ void conn_prepare_reset(xmpp_conn_t * const conn, xmpp_open_handler handler)
 {
     conn->reset_parser = 1;
     conn->open_handler = handler;
+    event_conn_reset(conn);
 }
 
 /* reset the parser */
@@ -520,254 +724,1617 @@ void xmpp_disconnect(xmpp_conn_t * const conn)
 	conn->state != XMPP_STATE_CONNECTED)
 	return;
 
-    /* close the stream */
-    xmpp_send_raw_string(conn, "</stream:stream>");
+    /* a session closed cleanly can't be resumed */
+    if (conn->sm_id) {
+	xmpp_free(conn->ctx, conn->sm_id);
+	conn->sm_id = NULL;
+    }
+
+    /* close the stream once everything queued before is written */
+    conn_send_string(conn, XMPP_LANE_CONTROL, SEND_BARRIER,
+		     "</stream:stream>");
 
     /* setup timed handler in case disconnect takes too long */
     handler_add_timed(conn, _disconnect_cleanup,
 		      DISCONNECT_TIMEOUT, NULL);
 }
 
-/** Send a raw string to the XMPP server.
- *  This function is a convenience function to send raw string data to the 
- *  XMPP server.  It is used by Strophe to send short messages instead of
- *  building up an XML stanza with DOM methods.  This should be used with care
- *  as it does not validate the data; invalid data may result in immediate
- *  stream termination by the XMPP server.
+/** Free a send queue item and release the data it holds.
  *
- *  @param conn a Strophe connection object
- *  @param fmt a printf-style format string followed by a variable list of
- *      arguments to format
+ *  @param ctx the Strophe context object the item was allocated with
+ *  @param item a send queue item
  */
-void xmpp_send_raw_string(xmpp_conn_t * const conn, 
-			  const char * const fmt, ...)
+void conn_free_queue_item(xmpp_ctx_t * const ctx,
+			  xmpp_send_queue_t * const item)
 {
-    va_list ap;
-    size_t len;
-    char buf[1024]; /* small buffer for common case */
-    char *bigbuf;
-
-    va_start(ap, fmt);
-    len = xmpp_vsnprintf(buf, 1024, fmt, ap);
-    va_end(ap);
-
-    if (len >= 1024) {
-	/* we need more space for this data, so we allocate a big 
-	 * enough buffer and print to that */
-	len++; /* account for trailing \0 */
-	bigbuf = xmpp_alloc(conn->ctx, len);
-	if (!bigbuf) {
-	    xmpp_debug(conn->ctx, "xmpp", "Could not allocate memory for send_raw_string");
-	    return;
-	}
-	va_start(ap, fmt);
-	xmpp_vsnprintf(bigbuf, len, fmt, ap);
-	va_end(ap);
+    if (item->buffer)
+	xmpp_buffer_release(item->buffer);
+    else if (item->free_cb)
+	item->free_cb(item->data, item->userdata);
+    else
+	xmpp_free(ctx, item->data);
+    xmpp_free(ctx, item);
+}
 
-	xmpp_debug(conn->ctx, "conn", "SENT: %s", bigbuf);
+/* make a send queue item holding data.  the item owns the data, which is
+ * released right away if the item can't be allocated */
+static xmpp_send_queue_t *_conn_new_item(xmpp_conn_t * const conn,
+					 char * const data, const size_t len,
+					 xmpp_free_callback free_cb,
+					 void * const userdata)
+{
+    xmpp_send_queue_t *item;
 
-	/* len - 1 so we don't send trailing \0 */
-	xmpp_send_raw(conn, bigbuf, len - 1);
+    item = xmpp_alloc(conn->ctx, sizeof(xmpp_send_queue_t));
+    if (!item) {
+	if (free_cb) free_cb(data, userdata);
+	else xmpp_free(conn->ctx, data);
+	return NULL;
+    }
 
-	xmpp_free(conn->ctx, bigbuf);
-    } else {
-	xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
+    item->data = data;
+    item->len = len;
+    item->written = 0;
+    item->flags = 0;
+    item->buffer = NULL;
+    item->free_cb = free_cb;
+    item->userdata = userdata;
+    item->next = NULL;
 
-	xmpp_send_raw(conn, buf, len);
-    }
+    return item;
 }
 
-/** Send raw bytes to the XMPP server.
- *  This function is a convenience function to send raw bytes to the 
- *  XMPP server.  It is usedly primarly by xmpp_send_raw_string.  This 
- *  function should be used with care as it does not validate the bytes and
- *  invalid data may result in stream termination by the XMPP server.
+/** Make a send queue item holding a reference to a shared buffer.
  *
  *  @param conn a Strophe connection object
- *  @param data a buffer of raw bytes
- *  @param len the length of the data in the buffer
+ *  @param buffer a buffer
+ *
+ *  @return the item or NULL on memory allocation failure
  */
-void xmpp_send_raw(xmpp_conn_t * const conn,
-		   const char * const data, const size_t len)
+xmpp_send_queue_t *conn_new_buffer_item(xmpp_conn_t * const conn,
+					xmpp_buffer_t * const buffer)
 {
     xmpp_send_queue_t *item;
 
-    if (conn->state != XMPP_STATE_CONNECTED) return;
-
-    /* create send queue item for queue */
     item = xmpp_alloc(conn->ctx, sizeof(xmpp_send_queue_t));
-    if (!item) return;
+    if (!item) return NULL;
 
-    item->data = xmpp_alloc(conn->ctx, len);
-    if (!item->data) {
-	xmpp_free(conn->ctx, item);
-	return;
-    }
-    memcpy(item->data, data, len);
-    item->len = len;
-    item->next = NULL;
+    item->data = buffer->data;
+    item->len = buffer->len;
     item->written = 0;
+    item->flags = 0;
+    item->buffer = xmpp_buffer_clone(buffer);
+    item->free_cb = NULL;
+    item->userdata = NULL;
+    item->next = NULL;
 
-    /* add item to the send queue */
-    if (!conn->send_queue_tail) {
-	/* first item, set head and tail */
-	conn->send_queue_head = item;
-	conn->send_queue_tail = item;
-    } else {
-	/* add to the tail */
-	conn->send_queue_tail->next = item;
-	conn->send_queue_tail = item;
-    }
-    conn->send_queue_len++;
+    return item;
 }
 
-/** Send an XML stanza to the XMPP server.
- *  This is the main way to send data to the XMPP server.  The function will
- *  terminate without action if the connection state is not CONNECTED.
- *
- *  @param conn a Strophe connection object
- *  @param stanza a Strophe stanza object
- *
- *  @ingroup Connections
- */
-void xmpp_send(xmpp_conn_t * const conn,
-	       xmpp_stanza_t * const stanza)
+/* whether queueing more would break the send queue limits.  an empty
+ * queue takes anything, so that oversized stanzas can still be sent */
+static int _conn_queue_full(const xmpp_conn_t * const conn,
+			    const size_t bytes, const int stanzas)
+{
+    if (!conn->send_queue_len) return 0;
+
+    if (conn->send_queue_max_bytes &&
+	conn->send_queue_bytes + bytes > conn->send_queue_max_bytes)
+	return 1;
+    if (conn->send_queue_max > 0 &&
+	conn->send_queue_len + stanzas > conn->send_queue_max)
+	return 1;
+
+    return 0;
+}
+
+/* the number of bytes left of the stanza starting at an item */
+static size_t _stanza_len(const xmpp_send_queue_t *item)
 {
-    char *buf;
     size_t len;
-    int ret;
 
-    if (conn->state == XMPP_STATE_CONNECTED) {
-	if ((ret = xmpp_stanza_to_text(stanza, &buf, &len)) == 0) {
-	    xmpp_send_raw(conn, buf, len);
-	    xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
-	    xmpp_free(conn->ctx, buf);
-	}
+    len = item->len - item->written;
+    while (item->next && (item->next->flags & SEND_CONTINUED)) {
+	item = item->next;
+	len += item->len - item->written;
     }
+
+    return len;
 }
 
-/** Send the opening &lt;stream:stream&gt; tag to the server.
- *  This function is used by Strophe to begin an XMPP stream.  It should
- *  not be used outside of the library.
- *
- *  @param conn a Strophe connection object
- */
-void conn_open_stream(xmpp_conn_t * const conn)
+/* drop the oldest droppable stanzas of a lane, or of the stanzas picked
+ * for writing if lane is NULL, until there is room for more.  stanzas
+ * which are partly written, or which a write in progress still refers
+ * to, are left alone */
+static void _conn_drop_from(xmpp_conn_t * const conn,
+			    xmpp_send_lane_t * const lane,
+			    size_t pinned, const size_t bytes)
 {
-    xmpp_send_raw_string(conn, 
-			 "<?xml version=\"1.0\"?>"			\
-			 "<stream:stream to=\"%s\" "			\
-			 "xml:lang=\"%s\" "				\
-			 "version=\"1.0\" "				\
-			 "xmlns=\"%s\" "				\
-			 "xmlns:stream=\"%s\">", 
-			 conn->domain,
-			 conn->lang,
-			 conn->type == XMPP_CLIENT ? XMPP_NS_CLIENT : XMPP_NS_COMPONENT,
-			 XMPP_NS_STREAMS);
+    xmpp_send_queue_t **link, **tail, *item, *prev, *next;
+    size_t dropped;
+
+    link = lane ? &lane->head : &conn->send_queue_head;
+    tail = lane ? &lane->tail : &conn->send_queue_tail;
+    prev = NULL;
+    while (*link && _conn_queue_full(conn, bytes, 1)) {
+	item = *link;
+	if (!(item->flags & SEND_DROPPABLE) ||
+	    (item->flags & SEND_CONTINUED) ||
+	    item->written || pinned) {
+	    dropped = item->len - item->written;
+	    pinned = pinned > dropped ? pinned - dropped : 0;
+	    prev = item;
+	    link = &item->next;
+	    continue;
+	}
+
+	/* unlink all items of the stanza */
+	dropped = 0;
+	do {
+	    next = item->next;
+	    dropped += item->len;
+	    conn_free_queue_item(conn->ctx, item);
+	    item = next;
+	} while (item && (item->flags & SEND_CONTINUED));
+	*link = item;
+	if (!item) *tail = prev;
+
+	if (lane) {
+	    lane->bytes -= dropped;
+	    conn->send_lanes_bytes -= dropped;
+	}
+	conn->stats.send_queue_dropped++;
+	conn_queue_sent(conn, dropped, 1);
+    }
 }
 
-/** Disable TLS for this connection, called by users of the library.
- *  Occasionally a server will be misconfigured to send the starttls
- *  feature, but wil not support the handshake.
- *
- *  @param conn a Strophe connection object
- */
-void xmpp_conn_disable_tls(xmpp_conn_t * const conn)
+/* append a stanza's items to a list */
+static void _stanza_append(xmpp_send_queue_t ** const head,
+			   xmpp_send_queue_t ** const tail,
+			   xmpp_send_queue_t * const first,
+			   xmpp_send_queue_t * const last)
 {
-    conn->tls_disabled = 1;
+    if (!*tail) {
+	/* first item, set head and tail */
+	*head = first;
+	*tail = last;
+    } else {
+	/* add to the tail */
+	(*tail)->next = first;
+	*tail = last;
+    }
 }
 
-static void _log_open_tag(xmpp_conn_t *conn, char **attrs)
+/* add a stanza to the stanzas picked for writing.  stream management
+ * counts and keeps stanzas here, in the order the server will see them.
+ * once the stream is compressed, stanzas are compressed here too, and
+ * each is flushed so the peer can handle it right away */
+static void _conn_wire_append(xmpp_conn_t * const conn,
+			      xmpp_send_queue_t * const first,
+			      xmpp_send_queue_t * const last)
 {
-    char buf[4096];
-    size_t len, pos;
-    int i;
-    
-    if (!attrs) return;
+    xmpp_send_queue_t *item, *next;
+    char *buf = NULL;
+    size_t used = 0, size = 0, bytes = 0;
+    int ret = 0;
+
+    if (conn->sm_state != SM_OFF && sm_keep(conn, first) < 0) {
+	/* the server's count of what we sent would be off */
+	xmpp_error(conn->ctx, "conn", "Failed to keep a stanza for resending.");
+	event_conn_overflow(conn, ENOMEM);
+    }
 
-    pos = 0;
-    len = xmpp_snprintf(buf, 4096, "<stream:stream");
-    if (len < 0) return;
-    
-    pos += len;
-    
-    for (i = 0; attrs[i]; i += 2) {
-        len = xmpp_snprintf(&buf[pos], 4096 - pos, " %s='%s'",
-                            attrs[i], attrs[i+1]);
-        if (len < 0) return;
-        pos += len;
+    if (!conn->compress) {
+	_stanza_append(&conn->send_queue_head, &conn->send_queue_tail,
+		       first, last);
+	return;
     }
 
-    len = xmpp_snprintf(&buf[pos], 4096 - pos, ">");
-    if (len < 0) return;
+    for (item = first; item; item = next) {
+	next = item->next;
+	if (ret == 0)
+	    ret = compress_deflate(conn->compress,
+				   &item->data[item->written],
+				   item->len - item->written, !next,
+				   &buf, &used, &size);
+	bytes += item->len - item->written;
+	conn_free_queue_item(conn->ctx, item);
+    }
 
-    xmpp_debug(conn->ctx, "xmpp", "RECV: %s", buf);
+    item = NULL;
+    if (ret == 0)
+	item = _conn_new_item(conn, buf, used, NULL, NULL);
+    else if (buf)
+	xmpp_free(conn->ctx, buf);
+
+    if (!item) {
+	/* the compressor is left out of step with the peer */
+	xmpp_error(conn->ctx, "conn", "Failed to compress a stanza.");
+	conn_queue_sent(conn, bytes, 1);
+	event_conn_overflow(conn, ENOMEM);
+	return;
+    }
+
+    conn->stats.compress_bytes_in += bytes;
+    conn->stats.compress_bytes_out += used;
+    _stanza_append(&conn->send_queue_head, &conn->send_queue_tail,
+		   item, item);
+
+    if (used > bytes)
+	conn->send_queue_bytes += used - bytes;
+    else
+	conn_queue_sent(conn, bytes - used, 0);
 }
 
-static char *_get_stream_attribute(char **attrs, char *name)
+/* move the stanza at the front of a lane to the stanzas picked for
+ * writing.  returns its length */
+static size_t _conn_pick_stanza(xmpp_conn_t * const conn,
+				xmpp_send_lane_t * const lane)
 {
-    int i;
+    xmpp_send_queue_t *first, *last;
+    size_t bytes;
+
+    first = lane->head;
+    last = first;
+    bytes = last->len;
+    while (last->next && (last->next->flags & SEND_CONTINUED)) {
+	last = last->next;
+	bytes += last->len;
+    }
 
-    if (!attrs) return NULL;
+    lane->head = last->next;
+    if (!lane->head) lane->tail = NULL;
+    last->next = NULL;
+    lane->bytes -= bytes;
+    conn->send_lanes_bytes -= bytes;
 
-    for (i = 0; attrs[i]; i += 2)
-        if (strcmp(name, attrs[i]) == 0)
-            return attrs[i+1];
+    _conn_wire_append(conn, first, last);
 
-    return NULL;
+    return bytes;
 }
 
-static void _handle_stream_start(char *name, char **attrs, 
-                                 void * const userdata)
+/** Pick stanzas from the send lanes for writing.
+ *  Stanzas are written in the order they are picked, so only a write's
+ *  worth of data is picked ahead, and stanzas sent to a more urgent lane
+ *  later on can still overtake bulk data.  The lanes are served by
+ *  deficit round robin: each round, a lane may move whole stanzas worth
+ *  up to its weight times SEND_LANE_QUANTUM bytes, and what it doesn't
+ *  use is carried over to the next round while it has stanzas waiting.
+ *
+ *  @param conn a Strophe connection object
+ *  @param want the number of bytes to have picked for writing
+ */
+void conn_queue_pick(xmpp_conn_t * const conn, const size_t want)
 {
-    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
-    char *id;
-
-    if (strcmp(name, "stream:stream") != 0) {
-        printf("name = %s\n", name);
-        xmpp_error(conn->ctx, "conn", "Server did not open valid stream.");
-        conn_disconnect(conn);
-    } else {
-        _log_open_tag(conn, attrs);
-        
-        if (conn->stream_id) xmpp_free(conn->ctx, conn->stream_id);
-
-        id = _get_stream_attribute(attrs, "id");
-        if (id)
-            conn->stream_id = xmpp_strdup(conn->ctx, id);
+    xmpp_send_lane_t *lane;
+    size_t picked, len;
+    int i;
 
-        if (!conn->stream_id) {
-            xmpp_error(conn->ctx, "conn", "Memory allocation failed.");
-            conn_disconnect(conn);
-        }
+    /* at least one stanza is picked, whatever the budget */
+    picked = conn->send_queue_bytes - conn->send_lanes_bytes;
+    while ((picked < want || !conn->send_queue_head) &&
+	   (conn->send_lanes[0].head || conn->send_lanes[1].head ||
+	    conn->send_lanes[2].head)) {
+	for (i = 0; i < SEND_LANES; i++) {
+	    lane = &conn->send_lanes[i];
+	    if (!lane->head) continue;
+
+	    lane->deficit += lane->weight * SEND_LANE_QUANTUM;
+	    while (lane->head) {
+		len = _stanza_len(lane->head);
+		if (len > lane->deficit) break;
+		lane->deficit -= _conn_pick_stanza(conn, lane);
+		picked += len;
+	    }
+	    if (!lane->head) lane->deficit = 0;
+	}
     }
-    
-    /* call stream open handler */
-    conn->open_handler(conn);
 }
 
-static void _handle_stream_end(char *name,
-                               void * const userdata)
+/* pick everything left in the lanes, most urgent first */
+static void _conn_pick_all(xmpp_conn_t * const conn)
 {
-    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+    int i;
 
-    /* stream is over */
-    xmpp_debug(conn->ctx, "xmpp", "RECV: </stream:stream>");
-    conn_disconnect_clean(conn);
+    for (i = 0; i < SEND_LANES; i++) {
+	while (conn->send_lanes[i].head)
+	    _conn_pick_stanza(conn, &conn->send_lanes[i]);
+	conn->send_lanes[i].deficit = 0;
+    }
 }
 
-static void _handle_stream_stanza(xmpp_stanza_t *stanza,
-                                  void * const userdata)
+/* queue the items of one stanza, or with batch set, items which are
+ * each a stanza of their own.  the items are let in or turned away
+ * together.  whether a unit is a stanza stream management counts is
+ * decided here, since its first item may only hold the first bytes of
+ * it once it is picked: units held in one item are looked at, those
+ * rendered into several pages are marked by the caller */
+static void _conn_queue(xmpp_conn_t * const conn,
+			xmpp_send_queue_t * const items,
+			const xmpp_lane_t lane, const unsigned int flags,
+			const int batch)
 {
-    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
-    char *buf;
-    size_t len;
+    xmpp_send_queue_t *item, *next, *last;
+    size_t bytes;
+    int i, stanzas;
+
+    if (!items) return;
+
+    last = items;
+    bytes = 0;
+    stanzas = 0;
+    for (item = items; item; item = item->next) {
+	if (item == items || batch) {
+	    item->flags = flags;
+	    if ((batch || !items->next) && sm_is_stanza(item->data, item->len))
+		item->flags |= SEND_STANZA;
+	    stanzas++;
+	} else {
+	    item->flags = flags | SEND_CONTINUED;
+	}
+	bytes += item->len - item->written;
+	last = item;
+    }
 
-    if (xmpp_stanza_to_text(stanza, &buf, &len) == 0) {
-        xmpp_debug(conn->ctx, "xmpp", "RECV: %s", buf);
-        xmpp_free(conn->ctx, buf);
+    if (_conn_queue_full(conn, bytes, stanzas)) {
+	if (conn->send_queue_policy == XMPP_QUEUE_DROP_OLDEST) {
+	    /* stream management already counted and kept the stanzas
+	     * picked for writing, so they must go out as they are */
+	    if (conn->sm_state == SM_OFF)
+		_conn_drop_from(conn, NULL, event_conn_pinned(conn), bytes);
+	    for (i = SEND_LANES - 1; i >= 0; i--)
+		_conn_drop_from(conn, &conn->send_lanes[i], 0, bytes);
+	}
+
+	if (_conn_queue_full(conn, bytes, stanzas)) {
+	    conn->stats.send_queue_rejected += stanzas;
+	    for (item = items; item; item = next) {
+		next = item->next;
+		conn_free_queue_item(conn->ctx, item);
+	    }
+	    if (conn->send_queue_policy == XMPP_QUEUE_DISCONNECT)
+		event_conn_overflow(conn, ENOBUFS);
+	    return;
+	}
     }
 
-    handler_fire_stanza(conn, stanza);
+    /* add items to the send queue */
+    conn->send_queue_len += stanzas;
+    conn->send_queue_bytes += bytes;
+    if ((flags & SEND_BARRIER) && batch) {
+	_conn_pick_all(conn);
+	for (item = items; item; item = next) {
+	    next = item->next;
+	    item->next = NULL;
+	    _conn_wire_append(conn, item, item);
+	}
+    } else if (flags & SEND_BARRIER) {
+	_conn_pick_all(conn);
+	_conn_wire_append(conn, items, last);
+    } else {
+	_stanza_append(&conn->send_lanes[lane].head,
+		       &conn->send_lanes[lane].tail, items, last);
+	conn->send_lanes[lane].bytes += bytes;
+	conn->send_lanes_bytes += bytes;
+    }
+
+    event_conn_queued(conn);
+
+    if (conn->send_queue_high && !conn->send_queue_above &&
+	conn->send_queue_bytes >= conn->send_queue_high) {
+	conn->send_queue_above = 1;
+	if (conn->send_queue_handler)
+	    conn->send_queue_handler(conn, XMPP_QUEUE_HIGH,
+				     conn->send_queue_userdata);
+    }
+}
+
+/** Add a stanza to the send queue.
+ *  The items, linked through their next pointers, hold one stanza or
+ *  some other unit of data and are queued together on a send lane.  If
+ *  the send queue limits don't leave room for them, the connection's
+ *  overflow policy decides whether the items are dropped, older
+ *  droppable stanzas are dropped to make room, or the connection is
+ *  closed.  Items sent with SEND_BARRIER skip the lanes and are only
+ *  written once everything queued before them is.
+ *
+ *  @param conn a Strophe connection object
+ *  @param items the first item to queue or NULL
+ *  @param lane the lane to queue the items on
+ *  @param flags SEND_DROPPABLE if the stanza may be dropped on overflow,
+ *      SEND_BARRIER to keep it behind everything queued before,
+ *      SEND_STANZA if stream management counts it
+ */
+void conn_queue(xmpp_conn_t * const conn, xmpp_send_queue_t * const items,
+		const xmpp_lane_t lane, const unsigned int flags)
+{
+    _conn_queue(conn, items, lane, flags, 0);
+}
+
+/** Add a batch of stanzas to the send queue.
+ *  This is conn_queue() for items which each hold a whole stanza.  The
+ *  stanzas stay separate units for the lanes and stream management,
+ *  but the send queue limits are checked, and the loop is told about
+ *  them, once for the whole batch.  If there is no room for all of
+ *  them, none is queued.
+ *
+ *  @param conn a Strophe connection object
+ *  @param items the first item to queue or NULL
+ *  @param lane the lane to queue the items on
+ *  @param flags SEND_DROPPABLE if the stanzas may be dropped on
+ *      overflow, SEND_BARRIER to keep them behind everything queued
+ *      before
+ */
+void conn_queue_batch(xmpp_conn_t * const conn,
+		      xmpp_send_queue_t * const items,
+		      const xmpp_lane_t lane, const unsigned int flags)
+{
+    _conn_queue(conn, items, lane, flags, 1);
+}
+
+/** Account for data which left the send queue.
+ *  This calls the watermark handler once the queue has drained to its
+ *  low watermark.
+ *
+ *  @param conn a Strophe connection object
+ *  @param bytes the number of bytes written or dropped
+ *  @param stanzas the number of stanzas which left the queue completely
+ */
+void conn_queue_sent(xmpp_conn_t * const conn, const size_t bytes,
+		     const int stanzas)
+{
+    conn->send_queue_bytes -= bytes;
+    conn->send_queue_len -= stanzas;
+
+    /* an idle connection doesn't hold on to a page */
+    if (!conn->send_queue_bytes) conn_release_page(conn);
+
+    if (conn->send_queue_above &&
+	conn->send_queue_bytes <= conn->send_queue_low) {
+	conn->send_queue_above = 0;
+	if (conn->send_queue_handler)
+	    conn->send_queue_handler(conn, XMPP_QUEUE_LOW,
+				     conn->send_queue_userdata);
+    }
+}
+
+/* queue an item for the connection's event loop to send */
+static void _conn_post(xmpp_conn_t * const conn,
+		       xmpp_send_queue_t * const item)
+{
+    if (!item) return;
+
+    mpsc_push(&conn->posted, &item->node);
+    event_conn_posted(conn);
+}
+
+/* copy data and queue it */
+static void _conn_send_raw(xmpp_conn_t * const conn,
+			   const char * const data, const size_t len,
+			   const xmpp_lane_t lane, const unsigned int flags)
+{
+    char *copy;
+
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    copy = xmpp_alloc(conn->ctx, len);
+    if (!copy) return;
+    memcpy(copy, data, len);
+
+    conn_queue(conn, _conn_new_item(conn, copy, len, NULL, NULL), lane,
+	       flags);
+}
+
+/** Send raw bytes to the XMPP server.
+ *  This function is a convenience function to send raw bytes to the 
+ *  XMPP server.  It is usedly primarly by xmpp_send_raw_string.  This 
+ *  function should be used with care as it does not validate the bytes and
+ *  invalid data may result in stream termination by the XMPP server.
+ *
+ *  @param conn a Strophe connection object
+ *  @param data a buffer of raw bytes
+ *  @param len the length of the data in the buffer
+ */
+void xmpp_send_raw(xmpp_conn_t * const conn,
+		   const char * const data, const size_t len)
+{
+    _conn_send_raw(conn, data, len, XMPP_LANE_INTERACTIVE, 0);
+}
+
+/** Send raw bytes to the XMPP server on a send lane.
+ *  This is xmpp_send_raw() for data which is more or less urgent than
+ *  the default interactive traffic.
+ *
+ *  @param conn a Strophe connection object
+ *  @param data a buffer of raw bytes
+ *  @param len the length of the data in the buffer
+ *  @param lane the send lane
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_raw_lane(xmpp_conn_t * const conn,
+			const char * const data, const size_t len,
+			const xmpp_lane_t lane)
+{
+    _conn_send_raw(conn, data, len, lane, 0);
+}
+
+/* format a string and queue it.  the arguments are passed twice, since
+ * strings too long for the buffer on the stack are formatted again */
+static void _conn_send_vstring(xmpp_conn_t * const conn,
+			       const xmpp_lane_t lane,
+			       const unsigned int flags,
+			       const char * const fmt,
+			       va_list ap, va_list ap2)
+{
+    size_t len;
+    char buf[1024]; /* small buffer for common case */
+    char *bigbuf;
+
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    len = xmpp_vsnprintf(buf, 1024, fmt, ap);
+
+    if (len >= 1024) {
+	/* we need more space for this data, so we allocate a big 
+	 * enough buffer and print to that */
+	len++; /* account for trailing \0 */
+	bigbuf = xmpp_alloc(conn->ctx, len);
+	if (!bigbuf) {
+	    xmpp_debug(conn->ctx, "xmpp", "Could not allocate memory for send_raw_string");
+	    return;
+	}
+	xmpp_vsnprintf(bigbuf, len, fmt, ap2);
+
+	xmpp_debug(conn->ctx, "conn", "SENT: %s", bigbuf);
+
+	/* len - 1 so we don't send trailing \0 */
+	conn_queue(conn, _conn_new_item(conn, bigbuf, len - 1, NULL, NULL),
+		   lane, flags);
+    } else {
+	xmpp_debug(conn->ctx, "conn", "SENT: %s", buf);
+
+	_conn_send_raw(conn, buf, len, lane, flags);
+    }
+}
+
+/** Format a string and queue it.
+ *  This is how the library sends the short bits of the protocol it
+ *  doesn't build stanzas for.
+ *
+ *  @param conn a Strophe connection object
+ *  @param lane the lane to queue the string on
+ *  @param flags send queue item flags, like SEND_BARRIER
+ *  @param fmt a printf-style format string followed by a variable list
+ *      of arguments to format
+ */
+void conn_send_string(xmpp_conn_t * const conn, const xmpp_lane_t lane,
+		      const unsigned int flags, const char * const fmt, ...)
+{
+    va_list ap, ap2;
+
+    va_start(ap, fmt);
+    va_start(ap2, fmt);
+    _conn_send_vstring(conn, lane, flags, fmt, ap, ap2);
+    va_end(ap2);
+    va_end(ap);
+}
+
+/** Send a raw string to the XMPP server.
+ *  This function is a convenience function to send raw string data to the 
+ *  XMPP server.  It is used by Strophe to send short messages instead of
+ *  building up an XML stanza with DOM methods.  This should be used with care
+ *  as it does not validate the data; invalid data may result in immediate
+ *  stream termination by the XMPP server.
+ *
+ *  @param conn a Strophe connection object
+ *  @param fmt a printf-style format string followed by a variable list of
+ *      arguments to format
+ */
+void xmpp_send_raw_string(xmpp_conn_t * const conn, 
+			  const char * const fmt, ...)
+{
+    va_list ap, ap2;
+
+    va_start(ap, fmt);
+    va_start(ap2, fmt);
+    _conn_send_vstring(conn, XMPP_LANE_INTERACTIVE, 0, fmt, ap, ap2);
+    va_end(ap2);
+    va_end(ap);
+}
+
+/** Send raw bytes to the XMPP server without copying them.
+ *  The connection takes ownership of the data and keeps it on the send
+ *  queue until it has been written.  The data is then freed with the
+ *  free callback, which is called from the thread running the
+ *  connection's event loop, or with xmpp_free() if the callback is NULL.
+ *  In that case the data must come from the context's allocator, like
+ *  the text returned by xmpp_stanza_to_text().  The data must not be
+ *  modified until it is freed.  If the connection is not connected, the
+ *  data is freed right away.
+ *
+ *  @param conn a Strophe connection object
+ *  @param data a buffer of raw bytes
+ *  @param len the length of the data in the buffer
+ *  @param free_cb function to free the data or NULL
+ *  @param userdata an opaque data pointer passed to the free callback
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_adopt(xmpp_conn_t * const conn,
+		     char * const data, const size_t len,
+		     xmpp_free_callback free_cb, void * const userdata)
+{
+    if (conn->state != XMPP_STATE_CONNECTED) {
+	if (free_cb) free_cb(data, userdata);
+	else xmpp_free(conn->ctx, data);
+	return;
+    }
+
+    conn_queue(conn, _conn_new_item(conn, data, len, free_cb, userdata),
+	       XMPP_LANE_INTERACTIVE, 0);
+}
+
+/** Send a shared buffer to the XMPP server.
+ *  The connection takes a reference to the buffer until its data has
+ *  been written; the caller keeps its own reference.  One buffer may be
+ *  sent to any number of connections without copying the data.
+ *
+ *  @param conn a Strophe connection object
+ *  @param buffer a buffer
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_buffer(xmpp_conn_t * const conn,
+		      xmpp_buffer_t * const buffer)
+{
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    conn_queue(conn, conn_new_buffer_item(conn, buffer),
+	       XMPP_LANE_INTERACTIVE, 0);
+}
+
+/** Let go of the page a connection renders stanzas into.
+ *  Stanzas queued from it keep it until they have been written, and
+ *  it goes back to the context's pool after that.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_release_page(xmpp_conn_t * const conn)
+{
+    if (!conn->send_page) return;
+
+    xmpp_buffer_release(conn->send_page);
+    conn->send_page = NULL;
+    conn->send_page_len = 0;
+}
+
+/* pages a stanza is rendered into for sending */
+typedef struct _page_chain_t {
+    xmpp_conn_t *conn;
+    xmpp_buffer_t *page; /* the page being rendered into */
+    xmpp_send_queue_t *head;
+    xmpp_send_queue_t *tail;
+} page_chain_t;
+
+/* queue what was rendered into the current page as a slice of it */
+static int _chain_page(page_chain_t * const chain, render_t * const render)
+{
+    xmpp_send_queue_t *item;
+
+    if (!render->len) return XMPP_EOK;
+
+    item = conn_new_buffer_item(chain->conn, chain->page);
+    if (!item) return XMPP_EMEM;
+    item->data = render->buf;
+    item->len = render->len;
+
+    if (chain->tail)
+	chain->tail->next = item;
+    else
+	chain->head = item;
+    chain->tail = item;
+
+    return XMPP_EOK;
+}
+
+/* queue the full page and carry on rendering into a fresh one */
+static int _chain_next(render_t * const render)
+{
+    page_chain_t *chain = (page_chain_t *)render->userdata;
+    xmpp_ctx_t *ctx = chain->conn->ctx;
+    char *page;
+
+    if (chain->page) {
+	if (_chain_page(chain, render)) return XMPP_EMEM;
+	xmpp_buffer_release(chain->page);
+	chain->page = NULL;
+    }
+
+    page = ctx_page_get(ctx);
+    if (!page) return XMPP_EMEM;
+    chain->page = xmpp_buffer_adopt(ctx, page, SEND_PAGE_SIZE,
+				    ctx_page_put, ctx);
+    if (!chain->page) return XMPP_EMEM;
+
+    render->buf = chain->page->data;
+    render->len = 0;
+    render->size = SEND_PAGE_SIZE;
+
+    return XMPP_EOK;
+}
+
+/* render a stanza into pages and queue them as one unit.  the stanza
+ * goes on from where the last one ended, and each part of it is queued
+ * as a slice holding a reference to its page, so small stanzas share
+ * pages without being copied.  a page is only written to past the
+ * slices taken from it */
+static void _conn_send_stanza(xmpp_conn_t * const conn,
+			      xmpp_stanza_t * const stanza,
+			      const xmpp_lane_t lane,
+			      const unsigned int flags)
+{
+    page_chain_t chain;
+    render_t render;
+    xmpp_send_queue_t *item;
+    unsigned int stanza_flags = flags;
+    int ret;
+
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    if (sm_counts(xmpp_stanza_get_name(stanza)))
+	stanza_flags |= SEND_STANZA;
+
+    /* the chain takes over the connection's reference to its page */
+    chain.conn = conn;
+    chain.page = conn->send_page;
+    chain.head = NULL;
+    chain.tail = NULL;
+    conn->send_page = NULL;
+
+    if (chain.page) {
+	render.buf = chain.page->data + conn->send_page_len;
+	render.size = SEND_PAGE_SIZE - conn->send_page_len;
+    } else {
+	render.buf = NULL;
+	render.size = 0;
+    }
+    render.len = 0;
+    render.next = _chain_next;
+    render.userdata = &chain;
+
+    ret = stanza_render(stanza, &render);
+    if (ret == XMPP_EOK && chain.page)
+	ret = _chain_page(&chain, &render);
+
+    /* keep the last page for the next stanzas while it has room */
+    if (ret == XMPP_EOK && chain.page && render.len < render.size) {
+	conn->send_page = chain.page;
+	conn->send_page_len = render.buf + render.len - chain.page->data;
+    } else {
+	if (chain.page) xmpp_buffer_release(chain.page);
+	conn->send_page_len = 0;
+    }
+
+    if (ret != XMPP_EOK) {
+	while ((item = chain.head)) {
+	    chain.head = item->next;
+	    conn_free_queue_item(conn->ctx, item);
+	}
+	return;
+    }
+
+    if (xmpp_debug_enabled(conn->ctx))
+	for (item = chain.head; item; item = item->next)
+	    xmpp_debug(conn->ctx, "conn", "SENT: %.*s", (int)item->len,
+		       item->data);
+    conn_queue(conn, chain.head, lane, stanza_flags);
+}
+
+/** Send an XML stanza to the XMPP server.
+ *  This is the main way to send data to the XMPP server.  The function will
+ *  terminate without action if the connection state is not CONNECTED.
+ *
+ *  The stanza is rendered in a single pass straight into pages which
+ *  are queued for sending as they are, so it is never copied.  Small
+ *  stanzas share pages with the ones sent before them.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza a Strophe stanza object
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send(xmpp_conn_t * const conn,
+	       xmpp_stanza_t * const stanza)
+{
+    _conn_send_stanza(conn, stanza, XMPP_LANE_INTERACTIVE, 0);
+}
+
+/** Send an XML stanza which may be dropped under backpressure.
+ *  This is xmpp_send() for stanzas that are worthless once outdated,
+ *  like presence updates or chat state notifications.  If the send
+ *  queue overflows with the XMPP_QUEUE_DROP_OLDEST policy, the oldest
+ *  such stanzas which have not started to be written are dropped to
+ *  make room for new data.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza a Strophe stanza object
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_droppable(xmpp_conn_t * const conn,
+			 xmpp_stanza_t * const stanza)
+{
+    _conn_send_stanza(conn, stanza, XMPP_LANE_INTERACTIVE, SEND_DROPPABLE);
+}
+
+/** Send an XML stanza to the XMPP server on a send lane.
+ *  Each connection has a control, an interactive and a bulk lane.
+ *  xmpp_send() uses the interactive lane.  Stanzas of one lane are
+ *  written in the order they were sent, while the lanes take turns by
+ *  their weights, so that an IQ result doesn't wait behind megabytes
+ *  of bulk data.  Stanzas are never interleaved with each other.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza a Strophe stanza object
+ *  @param lane the send lane
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_lane(xmpp_conn_t * const conn,
+		    xmpp_stanza_t * const stanza,
+		    const xmpp_lane_t lane)
+{
+    _conn_send_stanza(conn, stanza, lane, 0);
+}
+
+/* queue a batch of stanzas rendered into one buffer */
+static void _conn_send_rendered(xmpp_conn_t * const conn,
+				xmpp_buffer_t * const buffer,
+				const size_t * const ends,
+				const size_t count, const int flush)
+{
+    xmpp_send_queue_t *head = NULL, *tail = NULL, *item;
+    size_t i, start;
+
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    for (i = 0, start = 0; i < count; start = ends[i++]) {
+	item = conn_new_buffer_item(conn, buffer);
+	if (!item) break;
+	item->data = buffer->data + start;
+	item->len = ends[i] - start;
+	if (!tail) head = item;
+	else tail->next = item;
+	tail = item;
+    }
+    if (i < count) {
+	while ((item = head)) {
+	    head = item->next;
+	    conn_free_queue_item(conn->ctx, item);
+	}
+	return;
+    }
+
+    if (xmpp_debug_enabled(conn->ctx))
+	xmpp_debug(conn->ctx, "conn", "SENT: %.*s", (int)buffer->len,
+		   buffer->data);
+    conn_queue_batch(conn, head, XMPP_LANE_INTERACTIVE, 0);
+    if (flush) event_conn_flush(conn);
+}
+
+/** Send many XML stanzas to many connections at once.
+ *  The stanzas are rendered once, back to back into one buffer, which
+ *  all the connections share.  Each connection queues the whole batch
+ *  in one go, so that the send queue limits are checked and the event
+ *  loop is told about it once; the stanzas are still written in order
+ *  on the interactive lane like stanzas passed to xmpp_send().  If a
+ *  connection's send queue has no room for the whole batch, none of it
+ *  is queued on that connection.  Connections which are not connected
+ *  are skipped.
+ *
+ *  If flush is non-zero, each connection writes what it can right away
+ *  instead of on the next iteration of its event loop.
+ *
+ *  The connections must share one context and, if it runs several
+ *  event loops, all be run by the calling thread.
+ *
+ *  @param conns an array of Strophe connection objects
+ *  @param nconns the number of connections in the array
+ *  @param stanzas an array of Strophe stanza objects
+ *  @param count the number of stanzas in the array
+ *  @param flush whether to write the stanzas right away
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_batch_multi(xmpp_conn_t * const * const conns,
+			   const size_t nconns,
+			   xmpp_stanza_t * const * const stanzas,
+			   const size_t count, const int flush)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_buffer_t *buffer;
+    size_t *ends, i;
+    char *buf;
+
+    if (!nconns || !count) return;
+    ctx = conns[0]->ctx;
+
+    ends = xmpp_alloc(ctx, count * sizeof(size_t));
+    if (!ends) return;
+    if (stanza_render_all(ctx, stanzas, count, &buf, ends) != XMPP_EOK) {
+	xmpp_free(ctx, ends);
+	return;
+    }
+    buffer = xmpp_buffer_adopt(ctx, buf, ends[count - 1], NULL, NULL);
+
+    if (buffer) {
+	for (i = 0; i < nconns; i++)
+	    _conn_send_rendered(conns[i], buffer, ends, count, flush);
+	xmpp_buffer_release(buffer);
+    }
+    xmpp_free(ctx, ends);
+}
+
+/** Send many XML stanzas to the XMPP server at once.
+ *  This is xmpp_send() for fan-out code which would otherwise call it in
+ *  a loop.  The stanzas are rendered into one buffer and queued in one
+ *  go, as described for xmpp_send_batch_multi().
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanzas an array of Strophe stanza objects
+ *  @param count the number of stanzas in the array
+ *  @param flush whether to write the stanzas right away
+ *
+ *  @ingroup Connections
+ */
+void xmpp_send_batch(xmpp_conn_t * const conn,
+		     xmpp_stanza_t * const * const stanzas,
+		     const size_t count, const int flush)
+{
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    xmpp_send_batch_multi(&conn, 1, stanzas, count, flush);
+}
+
+/** Send raw bytes to the XMPP server from any thread.
+ *  Unlike xmpp_send_raw(), this function may be called from threads
+ *  other than the one running the connection's event loop.  The data is
+ *  put on a lock-free queue and the event loop is woken up to move it
+ *  to the send queue, so no locks are taken.  Data posted by one thread
+ *  is sent in the order it was posted.  Like xmpp_send_raw(), data is
+ *  dropped if the connection is not connected when the event loop
+ *  picks it up.
+ *
+ *  The connection's memory allocator must be usable from several
+ *  threads at once, which the default one is.  Applications that drive
+ *  the library from their own event loop must call xmpp_run_timers()
+ *  for posted data to be sent.
+ *
+ *  @param conn a Strophe connection object
+ *  @param data a buffer of raw bytes
+ *  @param len the length of the data in the buffer
+ *
+ *  @ingroup Connections
+ */
+void xmpp_post_raw(xmpp_conn_t * const conn,
+		   const char * const data, const size_t len)
+{
+    char *copy;
+
+    copy = xmpp_alloc(conn->ctx, len);
+    if (!copy) return;
+    memcpy(copy, data, len);
+
+    _conn_post(conn, _conn_new_item(conn, copy, len, NULL, NULL));
+}
+
+/** Send an XML stanza to the XMPP server from any thread.
+ *  This is xmpp_send() for threads other than the one running the
+ *  connection's event loop.  The stanza is serialized by the calling
+ *  thread, which must own it, and then posted as with xmpp_post_raw().
+ *
+ *  @param conn a Strophe connection object
+ *  @param stanza a Strophe stanza object
+ *
+ *  @ingroup Connections
+ */
+void xmpp_post(xmpp_conn_t * const conn,
+	       xmpp_stanza_t * const stanza)
+{
+    char *buf;
+    size_t len;
+
+    if (xmpp_stanza_to_text(stanza, &buf, &len) == 0) {
+	xmpp_debug(conn->ctx, "conn", "POSTED: %s", buf);
+	_conn_post(conn, _conn_new_item(conn, buf, len, NULL, NULL));
+    }
+}
+
+/** Send raw bytes to the XMPP server from any thread without copying them.
+ *  This is xmpp_send_adopt() for threads other than the one running the
+ *  connection's event loop.  The data is freed from the event loop's
+ *  thread once it has been written, or if the connection is not
+ *  connected when the event loop picks it up.
+ *
+ *  @param conn a Strophe connection object
+ *  @param data a buffer of raw bytes
+ *  @param len the length of the data in the buffer
+ *  @param free_cb function to free the data or NULL
+ *  @param userdata an opaque data pointer passed to the free callback
+ *
+ *  @ingroup Connections
+ */
+void xmpp_post_adopt(xmpp_conn_t * const conn,
+		     char * const data, const size_t len,
+		     xmpp_free_callback free_cb, void * const userdata)
+{
+    _conn_post(conn, _conn_new_item(conn, data, len, free_cb, userdata));
+}
+
+/** Send a shared buffer to the XMPP server from any thread.
+ *  This is xmpp_send_buffer() for threads other than the one running
+ *  the connection's event loop.  A broadcast to connections spread over
+ *  several event loops can post the same buffer to each of them.
+ *
+ *  @param conn a Strophe connection object
+ *  @param buffer a buffer
+ *
+ *  @ingroup Connections
+ */
+void xmpp_post_buffer(xmpp_conn_t * const conn,
+		      xmpp_buffer_t * const buffer)
+{
+    _conn_post(conn, conn_new_buffer_item(conn, buffer));
+}
+
+/** Send the opening &lt;stream:stream&gt; tag to the server.
+ *  This function is used by Strophe to begin an XMPP stream.  It should
+ *  not be used outside of the library.
+ *
+ *  @param conn a Strophe connection object
+ */
+void conn_open_stream(xmpp_conn_t * const conn)
+{
+    conn_send_string(conn, XMPP_LANE_CONTROL, 0,
+		      "<?xml version=\"1.0\"?>"			\
+		      "<stream:stream to=\"%s\" "			\
+		      "xml:lang=\"%s\" "				\
+		      "version=\"1.0\" "				\
+		      "xmlns=\"%s\" "				\
+		      "xmlns:stream=\"%s\">", 
+		      conn->domain,
+		      conn->lang,
+		      conn->type == XMPP_CLIENT ? XMPP_NS_CLIENT : XMPP_NS_COMPONENT,
+		      XMPP_NS_STREAMS);
+}
+
+/** Disable TLS for this connection, called by users of the library.
+ *  Occasionally a server will be misconfigured to send the starttls
+ *  feature, but wil not support the handshake.
+ *
+ *  @param conn a Strophe connection object
+ */
+void xmpp_conn_disable_tls(xmpp_conn_t * const conn)
+{
+    conn->tls_disabled = 1;
+}
+
+/** Ask for a compressed stream.
+ *  If the server offers zlib stream compression (XEP-0138) after
+ *  authentication, the stream is compressed before the resource is
+ *  bound.  Stanzas are compressed against all those sent before them
+ *  and flushed one by one, and received data is decompressed before it
+ *  is parsed.  Verbose traffic such as rosters and room history often
+ *  shrinks five to ten times, for some CPU time on both ends.
+ *  Compression is off by default.  The connection's statistics report
+ *  how much data went into and came out of the compressor.
+ *
+ *  @param conn a Strophe connection object
+ *  @param level the zlib compression level from 1 (fastest) to 9
+ *      (smallest), or 0 to not ask for compression
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_compression(xmpp_conn_t * const conn, const int level)
+{
+    if (level < 0)
+	conn->compression_level = 0;
+    else
+	conn->compression_level = level > 9 ? 9 : level;
+}
+
+/** Check whether a connection's stream is compressed.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return true if the stream is compressed
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_is_compressed(const xmpp_conn_t * const conn)
+{
+    return conn->compress != NULL;
+}
+
+/** Ask for stream management (XEP-0198) on a connection.
+ *  If the server supports it, stanzas are counted and acknowledged, and
+ *  a connection which breaks can pick up its session again when
+ *  xmpp_connect_client() is called on it.  Stanzas the server didn't
+ *  acknowledge are sent again then, and stanzas still waiting to be sent
+ *  are kept.  This takes effect the next time the connection connects.
+ *
+ *  @param conn a Strophe connection object
+ *  @param enable true to ask for stream management
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_stream_management(xmpp_conn_t * const conn,
+				     const int enable)
+{
+    conn->sm_wanted = enable ? 1 : 0;
+}
+
+/** Set how often the server is asked to acknowledge stanzas.
+ *  The server is only asked while there are stanzas it hasn't
+ *  acknowledged.
+ *
+ *  @param conn a Strophe connection object
+ *  @param period the time between requests in milliseconds
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_ack_interval(xmpp_conn_t * const conn,
+				const unsigned long period)
+{
+    conn->sm_ack_interval = period ? period : DEFAULT_ACK_INTERVAL;
+}
+
+/** Check whether a connection resumed its previous session.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return true if the session was resumed rather than started anew
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_is_resumed(const xmpp_conn_t * const conn)
+{
+    return conn->sm_resumed;
+}
+
+/** Get the number of stanzas the server hasn't acknowledged yet.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the number of stanzas sent and not acknowledged
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_get_unacked(const xmpp_conn_t * const conn)
+{
+    return (int)(conn->sm_sent - conn->sm_acked);
+}
+
+/** Set the size of a connection's receive buffer.
+ *  This is the most data read from the socket, or from the TLS layer,
+ *  at once.  Larger buffers mean fewer system calls for connections
+ *  receiving a lot of data, at the cost of memory for each connection.
+ *  The default is DEFAULT_RECV_BUFFER_SIZE.
+ *
+ *  @param conn a Strophe connection object
+ *  @param size the buffer size in bytes
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_recv_buffer_size(xmpp_conn_t * const conn,
+				    const size_t size)
+{
+    /* the buffer may be in use, the next read will replace it */
+    if (size) conn->recv_buf_size = size;
+}
+
+/** Set how much a connection may read in one event loop iteration.
+ *  A readable connection is read until the socket has no more data or
+ *  this many bytes have been read, so that large stanzas are parsed in
+ *  few iterations without one busy connection starving the others.
+ *  The default is DEFAULT_READ_BUDGET.  A budget smaller than the
+ *  receive buffer still allows one full read per iteration.
+ *
+ *  @param conn a Strophe connection object
+ *  @param budget the number of bytes
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_read_budget(xmpp_conn_t * const conn,
+			       const size_t budget)
+{
+    conn->read_budget = budget;
+}
+
+/** Set how many stanzas a connection may handle in one event loop
+ *  iteration.
+ *  Once a connection has handled this many stanzas, parsing of the data
+ *  read for it is suspended and continued on the next iteration, so
+ *  that a flood on one connection does not delay the handlers of the
+ *  others.  The default is DEFAULT_STANZA_BUDGET.  A budget of 0 still
+ *  allows one stanza per iteration.
+ *
+ *  @param conn a Strophe connection object
+ *  @param budget the number of stanzas
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_stanza_budget(xmpp_conn_t * const conn,
+				 const unsigned int budget)
+{
+    conn->stanza_budget = budget;
+}
+
+/** Set how much may be written to a connection in one event loop
+ *  iteration.
+ *  The rest of the send queue is written on the next iteration.  The
+ *  default is DEFAULT_WRITE_BUDGET.  A budget smaller than the first
+ *  queued item still allows that item to be written.
+ *
+ *  @param conn a Strophe connection object
+ *  @param budget the number of bytes
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_write_budget(xmpp_conn_t * const conn,
+				const size_t budget)
+{
+    conn->write_budget = budget;
+}
+
+/** Get the budget statistics of a connection.
+ *  The counters tell how often a connection used up its read, stanza
+ *  or write budget in an event loop iteration.  Whatever work was left
+ *  at that point was carried over to the next iteration.
+ *
+ *  @param conn a Strophe connection object
+ *  @param stats a structure which is filled in
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_get_stats(const xmpp_conn_t * const conn,
+			 xmpp_conn_stats_t * const stats)
+{
+    *stats = conn->stats;
+}
+
+/** Set a filter for received stanzas.
+ *  The filter sees the name and attributes of each message, presence
+ *  and iq stanza as soon as its start tag arrives.  If it returns
+ *  false, the stanza is skipped: it is not built and no handler sees
+ *  it, so it costs little more than reading it.  Stanzas which no
+ *  handler could match are skipped even without a filter.  The
+ *  attributes are a NULL terminated array of names and values.
+ *
+ *  @param conn a Strophe connection object
+ *  @param filter the filter, or NULL for none
+ *  @param userdata an opaque data pointer which will be passed to the
+ *      filter
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_stanza_filter(xmpp_conn_t * const conn,
+				 xmpp_stanza_filter filter,
+				 void * const userdata)
+{
+    conn->stanza_filter = filter;
+    conn->stanza_filter_userdata = userdata;
+}
+
+/** Limit the size of a connection's send queue.
+ *  Once queueing a stanza would take the send queue past either limit,
+ *  the policy decides what happens: XMPP_QUEUE_REJECT drops the new
+ *  stanza, XMPP_QUEUE_DROP_OLDEST first drops the oldest stanzas sent
+ *  with xmpp_send_droppable() to make room, except for those stream
+ *  management already counted, and XMPP_QUEUE_DISCONNECT closes the
+ *  connection on its next event loop iteration.  Rejected and dropped
+ *  stanzas are counted in the connection's statistics.  A stanza is
+ *  always taken into an empty queue, however large.  By default there
+ *  are no limits.
+ *
+ *  Data posted from other threads is subject to the limits once the
+ *  event loop moves it to the send queue.
+ *
+ *  @param conn a Strophe connection object
+ *  @param max_bytes the most bytes waiting to be written, or 0
+ *  @param max_items the most stanzas waiting to be written, or 0
+ *  @param policy what to do with data that doesn't fit
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_send_queue_max(xmpp_conn_t * const conn,
+				  const size_t max_bytes, const int max_items,
+				  const xmpp_queue_policy_t policy)
+{
+    conn->send_queue_max_bytes = max_bytes;
+    conn->send_queue_max = max_items;
+    conn->send_queue_policy = policy;
+}
+
+/** Set the watermarks of a connection's send queue.
+ *  The handler is called with XMPP_QUEUE_HIGH when the bytes waiting
+ *  to be written reach the high watermark, and with XMPP_QUEUE_LOW when
+ *  they have drained to the low watermark again, so that producers can
+ *  throttle themselves before any limit is hit.  A high watermark of 0
+ *  disables the handler.
+ *
+ *  @param conn a Strophe connection object
+ *  @param high the high watermark in bytes
+ *  @param low the low watermark in bytes, no more than high
+ *  @param handler the watermark handler or NULL
+ *  @param userdata an opaque data pointer passed to the handler
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_send_queue_watermarks(xmpp_conn_t * const conn,
+					 const size_t high, const size_t low,
+					 xmpp_queue_handler handler,
+					 void * const userdata)
+{
+    conn->send_queue_high = high;
+    conn->send_queue_low = low < high ? low : high;
+    conn->send_queue_handler = handler;
+    conn->send_queue_userdata = userdata;
+    conn->send_queue_above = high && conn->send_queue_bytes >= high;
+}
+
+/** Set the weight of one of a connection's send lanes.
+ *  While several lanes have stanzas waiting, each may have its weight
+ *  times SEND_LANE_QUANTUM bytes picked for writing in turn.  By default
+ *  the control lane weighs DEFAULT_CONTROL_WEIGHT, the interactive lane
+ *  DEFAULT_INTERACTIVE_WEIGHT and the bulk lane DEFAULT_BULK_WEIGHT.
+ *
+ *  @param conn a Strophe connection object
+ *  @param lane the send lane
+ *  @param weight the weight, at least 1
+ *
+ *  @ingroup Connections
+ */
+void xmpp_conn_set_lane_weight(xmpp_conn_t * const conn,
+			       const xmpp_lane_t lane,
+			       const unsigned int weight)
+{
+    conn->send_lanes[lane].weight = weight ? weight : 1;
+}
+
+/** Get the number of bytes waiting in a connection's send queue.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the number of bytes not yet written
+ *
+ *  @ingroup Connections
+ */
+size_t xmpp_conn_get_send_queue_bytes(const xmpp_conn_t * const conn)
+{
+    return conn->send_queue_bytes;
+}
+
+/** Get the number of stanzas waiting in a connection's send queue.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the number of stanzas not completely written
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_get_send_queue_len(const xmpp_conn_t * const conn)
+{
+    return conn->send_queue_len;
+}
+
+/** Move a connection to another event loop thread.
+ *  The connection leaves its current loop between two iterations of
+ *  that loop, once no socket operation is outstanding for it, and its
+ *  handlers are called from the thread of the new loop afterwards.
+ *  This is meant for rebalancing idle connections, and should be
+ *  called from a handler of the connection or while the event loop is
+ *  not running.  A connection which is not connected yet will be given
+ *  to the requested loop when it connects.
+ *
+ *  @param conn a Strophe connection object
+ *  @param thread the index of the target loop, counting from 0
+ *
+ *  @return 0 on success or a number less than 0 on failure
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_migrate(xmpp_conn_t * const conn, const int thread)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+
+    if (thread < 0 || thread >= ctx->nloops) return XMPP_EINVOP;
+    if (conn->loop == &ctx->loops[thread] && !conn->migrate_to) return 0;
+
+    if (conn->loop && !conn->migrate_to) conn->loop->migrating++;
+    conn->migrate_to = &ctx->loops[thread];
+
+    return 0;
+}
+
+/** Get the socket of a connection.
+ *  This is meant for applications which drive the library from their
+ *  own event loop, see xmpp_ctx_set_watch_handler().
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the socket descriptor, or -1 if the connection has none
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_get_fd(const xmpp_conn_t * const conn)
+{
+    return (int)conn->sock;
+}
+
+/** Get the socket events a connection is waiting for.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return a combination of XMPP_IO_READ and XMPP_IO_WRITE, 0 if the
+ *      connection is not waiting for its socket
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_get_events(const xmpp_conn_t * const conn)
+{
+    return (int)conn->ev_mask;
+}
+
+/** Get the event loop thread of a connection.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the index of the connection's loop, or -1 if the connection
+ *      has not been given to a loop yet
+ *
+ *  @ingroup Connections
+ */
+int xmpp_conn_get_thread(const xmpp_conn_t * const conn)
+{
+    if (!conn->loop) return -1;
+    return (int)(conn->loop - conn->ctx->loops);
+}
+
+static void _log_open_tag(xmpp_conn_t *conn, char **attrs)
+{
+    char buf[4096];
+    size_t len, pos;
+    int i;
+    
+    if (!attrs || !xmpp_debug_enabled(conn->ctx)) return;
+
+    pos = 0;
+    len = xmpp_snprintf(buf, 4096, "<stream:stream");
+    if (len < 0) return;
+    
+    pos += len;
+    
+    for (i = 0; attrs[i]; i += 2) {
+        len = xmpp_snprintf(&buf[pos], 4096 - pos, " %s='%s'",
+                            attrs[i], attrs[i+1]);
+        if (len < 0) return;
+        pos += len;
+    }
+
+    len = xmpp_snprintf(&buf[pos], 4096 - pos, ">");
+    if (len < 0) return;
+
+    xmpp_debug(conn->ctx, "xmpp", "RECV: %s", buf);
+}
+
+static char *_get_stream_attribute(char **attrs, char *name)
+{
+    int i;
+
+    if (!attrs) return NULL;
+
+    for (i = 0; attrs[i]; i += 2)
+        if (strcmp(name, attrs[i]) == 0)
+            return attrs[i+1];
+
+    return NULL;
+}
+
+static void _handle_stream_start(char *name, char **attrs, 
+                                 void * const userdata)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+    char *id;
+
+    if (strcmp(name, "stream:stream") != 0) {
+        printf("name = %s\n", name);
+        xmpp_error(conn->ctx, "conn", "Server did not open valid stream.");
+        conn_disconnect(conn);
+    } else {
+        _log_open_tag(conn, attrs);
+        
+        if (conn->stream_id) xmpp_free(conn->ctx, conn->stream_id);
+
+        id = _get_stream_attribute(attrs, "id");
+        if (id)
+            conn->stream_id = xmpp_strdup(conn->ctx, id);
+
+        if (!conn->stream_id) {
+            xmpp_error(conn->ctx, "conn", "Memory allocation failed.");
+            conn_disconnect(conn);
+        }
+    }
+    
+    /* call stream open handler */
+    conn->open_handler(conn);
+}
+
+static void _handle_stream_end(char *name,
+                               void * const userdata)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+
+    /* stream is over */
+    xmpp_debug(conn->ctx, "xmpp", "RECV: </stream:stream>");
+    conn_disconnect_clean(conn);
+}
+
+static void _handle_stream_stanza(xmpp_stanza_t *stanza,
+                                  void * const userdata)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+    char *buf;
+    size_t len;
+
+    /* only render the stanza if anyone is going to see it */
+    if (xmpp_debug_enabled(conn->ctx) &&
+	xmpp_stanza_to_text(stanza, &buf, &len) == 0) {
+        xmpp_debug(conn->ctx, "xmpp", "RECV: %s", buf);
+        xmpp_free(conn->ctx, buf);
+    }
+
+    handler_fire_stanza(conn, stanza);
+    if (conn->sm_state == SM_ON)
+	sm_handled(conn, xmpp_stanza_get_name(stanza));
+
+    /* leave the rest of the received data to the next iteration once
+     * the connection has used up its share of this one */
+    if (conn->stanza_quota > 1) {
+	conn->stanza_quota--;
+    } else {
+	conn->stanza_quota = 0;
+	conn->stats.stanza_budget_hits++;
+	parser_pause(conn->parser);
+    }
+}
+
+/* decide from the start tag of a stanza whether to build it at all */
+static int _handle_stream_filter(char *name, char **attrs,
+				 void * const userdata)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+
+    if (!handler_wants(conn, name, _get_stream_attribute(attrs, "id"),
+		       _get_stream_attribute(attrs, "type")))
+	return 0;
+
+    /* the rest are the library's business */
+    if (conn->stanza_filter && (strcmp(name, "message") == 0 ||
+				strcmp(name, "presence") == 0 ||
+				strcmp(name, "iq") == 0))
+	return conn->stanza_filter(conn, name, (const char * const *)attrs,
+				   conn->stanza_filter_userdata);
+
+    return 1;
+}
+
+static void _handle_stream_skipped(char *name, void * const userdata)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)userdata;
+
+    xmpp_debug(conn->ctx, "xmpp", "RECV: <%s> skipped", name);
+    conn->stats.stanzas_skipped++;
+    if (conn->sm_state == SM_ON) sm_handled(conn, name);
 }
@@ -228,12 +228,63 @@ void *xmpp_realloc(const xmpp_ctx_t * const ctx, void *p,
     return ctx->mem->realloc(p, size, ctx->mem->userdata);
 }
 
+/** Get a send page.
+ *  Stanzas are rendered into pages of SEND_PAGE_SIZE bytes which are
+ *  queued for sending as they are.  Pages are recycled through a small
+ *  pool shared by the context's event loops.
+ *
+ *  @param ctx a Strophe context object
+ *
+ *  @return a page or NULL on memory allocation failure
+ */
+char *ctx_page_get(xmpp_ctx_t * const ctx)
+{
+    char *page;
+
+    mutex_lock(ctx->pages_lock);
+    page = ctx->pages;
+    if (page) {
+	ctx->pages = *(char **)page;
+	ctx->npages--;
+    }
+    mutex_unlock(ctx->pages_lock);
+
+    if (!page) page = xmpp_alloc(ctx, SEND_PAGE_SIZE);
+
+    return page;
+}
+
+/** Return a send page to the pool.
+ *  This has the signature of a free callback so that pages can be
+ *  queued for sending with the context as the callback's userdata.
+ *
+ *  @param page a page from ctx_page_get()
+ *  @param userdata the Strophe context object
+ */
+void ctx_page_put(char * const page, void * const userdata)
+{
+    xmpp_ctx_t *ctx = (xmpp_ctx_t *)userdata;
+
+    mutex_lock(ctx->pages_lock);
+    if (ctx->npages < SEND_PAGE_POOL) {
+	*(char **)page = ctx->pages;
+	ctx->pages = page;
+	ctx->npages++;
+	mutex_unlock(ctx->pages_lock);
+	return;
+    }
+    mutex_unlock(ctx->pages_lock);
+
+    xmpp_free(ctx, page);
+}
+
 /** Write a log message to the logger.
  *  Write a log message to the logger for the context for the specified
  *  level and area.  This function takes a printf-style format string and a
  *  variable argument list (in va_list) format.  This function is not meant
  *  to be called directly, but is used via xmpp_error, xmpp_warn, xmpp_info, 
- *  and xmpp_debug.
+ *  and xmpp_debug.  Messages below the context's log level are dropped
+ *  without being formatted.
  *
  *  @param ctx a Strophe context object
  *  @param level the level at which to log
@@ -252,6 +303,13 @@ void xmpp_log(const xmpp_ctx_t * const ctx,
     char *buf;
     va_list copy;
 
+    if (!xmpp_log_enabled(ctx, level)) return;
+
+    if (ctx->log_ring) {
+	log_ring_put(ctx->log_ring, level, area, fmt, ap);
+	return;
+    }
+
     buf = smbuf;
     va_copy(copy, ap);
     ret = xmpp_vsnprintf(buf, 1023, fmt, ap);
@@ -265,8 +323,10 @@ void xmpp_log(const xmpp_ctx_t * const ctx,
 	}
 	oldret = ret;
 	ret = xmpp_vsnprintf(buf, ret + 1, fmt, copy);
+	va_end(copy);
 	if (ret > oldret) {
 	    xmpp_error(ctx, "log", "Unexpected error");
+	    xmpp_free(ctx, buf);
 	    return;
 	}
     } else {
@@ -275,6 +335,8 @@ void xmpp_log(const xmpp_ctx_t * const ctx,
 
     if (ctx->log->handler)
         ctx->log->handler(ctx->log->userdata, level, area, buf);
+
+    if (buf != smbuf) xmpp_free(ctx, buf);
 }
 
 /** Write to the log at the ERROR level.
@@ -343,6 +405,9 @@ void xmpp_info(const xmpp_ctx_t * const ctx,
     va_end(ap);
 }
 
+/* the wrapper compiled out by XMPP_NO_DEBUG_LOG is still exported */
+#undef xmpp_debug
+
 /** Write to the log at the DEBUG level.
  *  This is a convenience function for writing to the log at the DEBUG level.
  *  It takes a printf-style format string followed by a variable list of
@@ -400,8 +465,38 @@ xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem,
 	else
 	    ctx->log = log;
 
-	ctx->connlist = NULL;
+	/* the default loggers filter by the level they were made for, and
+	 * custom loggers see everything until told otherwise */
+	if (!ctx->log->handler)
+	    ctx->log_level = XMPP_LEVEL_NONE;
+	else if (ctx->log->handler == xmpp_default_logger)
+	    ctx->log_level = *(xmpp_log_level_t *)ctx->log->userdata;
+	else
+	    ctx->log_level = XMPP_LEVEL_DEBUG;
+	ctx->log_ring = NULL;
+	ctx->log_dropped = 0;
+
 	ctx->loop_status = XMPP_LOOP_NOTSTARTED;
+	ctx->threaded = 0;
+	ctx->watch_handler = NULL;
+	ctx->watch_userdata = NULL;
+	ctx->pages = NULL;
+	ctx->npages = 0;
+
+	/* a single event loop until told otherwise */
+	ctx->nloops = 1;
+	ctx->lock = mutex_create(ctx);
+	ctx->pages_lock = mutex_create(ctx);
+	ctx->intern = intern_new(ctx);
+	ctx->loops = ctx->lock && ctx->pages_lock && ctx->intern ?
+	    event_loops_new(ctx, 1) : NULL;
+	if (!ctx->loops) {
+	    if (ctx->lock) mutex_destroy(ctx->lock);
+	    if (ctx->pages_lock) mutex_destroy(ctx->pages_lock);
+	    if (ctx->intern) intern_free(ctx->intern);
+	    xmpp_free(ctx, ctx);
+	    ctx = NULL;
+	}
     }
 
     return ctx;
@@ -415,7 +510,196 @@ xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem,
  */
 void xmpp_ctx_free(xmpp_ctx_t * const ctx)
 {
+    char *page;
+
+    event_loops_free(ctx, ctx->loops, ctx->nloops);
+    mutex_destroy(ctx->lock);
+
+    while ((page = ctx->pages)) {
+	ctx->pages = *(char **)page;
+	xmpp_free(ctx, page);
+    }
+    mutex_destroy(ctx->pages_lock);
+    intern_free(ctx->intern);
+
+    /* pass on what is left to log before the logger goes away */
+    if (ctx->log_ring) log_ring_free(ctx->log_ring);
+
     /* mem and log are owned by their suppliers */
     xmpp_free(ctx, ctx); /* pull the hole in after us */
 }
 
+/** Set the log level of a context.
+ *  Log messages below the level are dropped before they are formatted,
+ *  and debug output that needs stanzas to be rendered is skipped
+ *  entirely, so a quiet logger costs next to nothing.  A context made
+ *  with a logger from xmpp_get_default_logger() starts at that logger's
+ *  level, one made with a custom logger at XMPP_LEVEL_DEBUG.  Setting a
+ *  level on a context without a logger has no effect.
+ *
+ *  Debug logging can also be removed from the library at build time by
+ *  defining XMPP_NO_DEBUG_LOG, which configure does for
+ *  --disable-debug-log.
+ *
+ *  @param ctx a Strophe context object
+ *  @param level the lowest level passed on to the logger
+ *
+ *  @ingroup Context
+ */
+void xmpp_ctx_set_log_level(xmpp_ctx_t * const ctx,
+			    const xmpp_log_level_t level)
+{
+    if (ctx->log->handler)
+	ctx->log_level = level;
+}
+
+/** Make the logger of a context asynchronous.
+ *  Log messages are then formatted into a ring of size slots and passed
+ *  on to the logger by a thread of their own, so that a logger which
+ *  blocks, say on a full disk or a stalled syslog socket, doesn't hold
+ *  up the event loop.  Logging never waits for the logger: messages
+ *  that find the ring full are dropped and counted, see
+ *  xmpp_ctx_get_log_dropped(), and messages longer than 1023 bytes are
+ *  truncated.  The logger must be safe to call from the logging thread.
+ *  Messages still in the ring when the context is freed are passed on
+ *  before xmpp_ctx_free() returns.
+ *
+ *  The logger can only be switched while the event loop is not
+ *  running.  A size of 0 passes on the messages left and makes the
+ *  logger synchronous again.
+ *
+ *  @param ctx a Strophe context object
+ *  @param size the number of messages the ring holds, or 0
+ *
+ *  @return 0 on success or a number less than 0 on failure
+ *
+ *  @ingroup Context
+ */
+int xmpp_ctx_set_log_async(xmpp_ctx_t * const ctx, const int size)
+{
+    log_ring_t *ring = NULL;
+
+    if (size < 0 || !ctx->log->handler ||
+	atomic_get_int(&ctx->loop_status) == XMPP_LOOP_RUNNING)
+	return XMPP_EINVOP;
+
+    if (size) {
+	ring = log_ring_new(ctx, ctx->log, size);
+	if (!ring) return XMPP_EMEM;
+    }
+
+    if (ctx->log_ring) {
+	ctx->log_dropped += log_ring_dropped(ctx->log_ring);
+	log_ring_free(ctx->log_ring);
+    }
+    ctx->log_ring = ring;
+
+    return 0;
+}
+
+/** Get the number of log messages dropped by a context.
+ *  Messages are only dropped by asynchronous loggers whose ring is
+ *  full.
+ *
+ *  @param ctx a Strophe context object
+ *
+ *  @return the number of messages dropped
+ *
+ *  @ingroup Context
+ */
+unsigned long xmpp_ctx_get_log_dropped(const xmpp_ctx_t * const ctx)
+{
+    unsigned long dropped = ctx->log_dropped;
+
+    if (ctx->log_ring) dropped += log_ring_dropped(ctx->log_ring);
+
+    return dropped;
+}
+
+/** Set the number of event loop threads of a context.
+ *  The connections of a context are spread over its event loops, and
+ *  xmpp_run() drives each loop from a thread of its own, so that
+ *  parsing, TLS and handlers of different connections run in parallel.
+ *  Each new connection is given to the loop with the fewest
+ *  connections when it connects, and can later be moved with
+ *  xmpp_conn_migrate().  Handlers of a connection are always called
+ *  from the thread of its loop.
+ *
+ *  A context starts out with a single loop.  The number of loops can
+ *  only be changed while the event loop is not running and no
+ *  connection of the context is connected.  When several loops are
+ *  used, the memory allocator and logger of the context must be safe
+ *  to call from several threads at once.
+ *
+ *  @param ctx a Strophe context object
+ *  @param threads the number of event loops, at least 1
+ *
+ *  @return 0 on success or a number less than 0 on failure
+ *
+ *  @ingroup Context
+ */
+int xmpp_ctx_set_threads(xmpp_ctx_t * const ctx, const int threads)
+{
+    xmpp_loop_t *loops;
+    int i;
+
+    if (threads < 1 || atomic_get_int(&ctx->loop_status) == XMPP_LOOP_RUNNING)
+	return XMPP_EINVOP;
+    for (i = 0; i < ctx->nloops; i++)
+	if (ctx->loops[i].load) return XMPP_EINVOP;
+
+    if (threads == ctx->nloops) return 0;
+
+    loops = event_loops_new(ctx, threads);
+    if (!loops) return XMPP_EMEM;
+
+    event_loops_free(ctx, ctx->loops, ctx->nloops);
+    ctx->loops = loops;
+    ctx->nloops = threads;
+
+    return 0;
+}
+
+/** Drive a context from an external event loop.
+ *  Instead of waiting on sockets in xmpp_run() or xmpp_run_once(), the
+ *  library reports the socket of each connection, and whether it is
+ *  waiting to read or write, to the handler.  The handler is called
+ *  whenever that interest changes, with events set to 0 once the socket
+ *  must no longer be watched.  The application then waits on the
+ *  sockets itself, calls xmpp_conn_handle_io() when one is ready, and
+ *  calls xmpp_run_timers() when the time it returned has passed.
+ *
+ *  The handler can only be changed while no connection of the context
+ *  is connected.  Passing NULL returns the context to its own event
+ *  loop.
+ *
+ *  @param ctx a Strophe context object
+ *  @param handler a watch handler or NULL
+ *  @param userdata an opaque data pointer passed to the handler
+ *
+ *  @return 0 on success or a number less than 0 on failure
+ *
+ *  @ingroup Context
+ */
+int xmpp_ctx_set_watch_handler(xmpp_ctx_t * const ctx,
+			       xmpp_watch_handler handler,
+			       void * const userdata)
+{
+    int i;
+
+    if (atomic_get_int(&ctx->loop_status) == XMPP_LOOP_RUNNING)
+	return XMPP_EINVOP;
+    for (i = 0; i < ctx->nloops; i++)
+	if (ctx->loops[i].load) return XMPP_EINVOP;
+
+    ctx->watch_handler = handler;
+    ctx->watch_userdata = userdata;
+
+    /* switch the backends over */
+    for (i = 0; i < ctx->nloops; i++) {
+	event_shutdown(&ctx->loops[i]);
+	event_init(&ctx->loops[i]);
+    }
+
+    return 0;
+}
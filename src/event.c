@@ -35,22 +35,138 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
 
 #ifndef _WIN32
 #include <sys/select.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <poll.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#endif
 #else
 #include <winsock2.h>
 #define ETIMEDOUT WSAETIMEDOUT
 #define ECONNRESET WSAECONNRESET
 #define ECONNABORTED WSAECONNABORTED
+#ifndef ENOBUFS
+#define ENOBUFS WSAENOBUFS
+#endif
 #endif
 
 #include <strophe.h>
 #include "common.h"
 #include "parser.h"
 
+static void _loop_drain_wake(xmpp_loop_t * const loop);
+
+/* states of a connection on its loop's list of connections with data
+ * posted by other threads */
+#define POST_IDLE 0
+#define POST_QUEUED 1
+#define POST_FROZEN 2 /* not linked to a loop, so never queued */
+
+/* connection lists */
+
+static void _connlist_init(xmpp_connlist_t * const head)
+{
+    head->conn = NULL;
+    head->next = head;
+    head->prev = head;
+}
+
+static int _connlist_empty(const xmpp_connlist_t * const head)
+{
+    return head->next == head;
+}
+
+/* add an entry to the end of a list, unless it is in a list already */
+static void _connlist_append(xmpp_connlist_t * const head,
+			     xmpp_connlist_t * const entry)
+{
+    if (entry->next) return;
+
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+/* remove an entry from whichever list it is in */
+static void _connlist_unlink(xmpp_connlist_t * const entry)
+{
+    if (!entry->next) return;
+
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+/* move all entries of a list to the empty list head.  the connections
+ * are then worked off by popping them from there, so that handlers may
+ * add them back or remove any connection meanwhile */
+static void _connlist_splice(xmpp_connlist_t * const head,
+			     xmpp_connlist_t * const from)
+{
+    _connlist_init(head);
+    if (_connlist_empty(from)) return;
+
+    head->next = from->next;
+    head->prev = from->prev;
+    head->next->prev = head;
+    head->prev->next = head;
+    _connlist_init(from);
+}
+
+/* remove the first entry of a list and return its connection, or NULL
+ * if the list is empty */
+static xmpp_conn_t *_connlist_pop(xmpp_connlist_t * const head)
+{
+    xmpp_connlist_t *entry = head->next;
+
+    if (entry == head) return NULL;
+
+    _connlist_unlink(entry);
+    return entry->conn;
+}
+
+/* drop what a write sent from the front of a connection's send queue */
+static void _conn_sent(xmpp_conn_t * const conn, size_t len)
+{
+    xmpp_send_queue_t *sq;
+    size_t left, bytes = len;
+    int stanzas = 0;
+
+    while ((sq = conn->send_queue_head)) {
+	left = sq->len - sq->written;
+	if (len < left) {
+	    sq->written += len;
+	    break;
+	}
+	len -= left;
+
+	conn->send_queue_head = sq->next;
+	if (!conn->send_queue_head) conn->send_queue_tail = NULL;
+	if (!sq->next || !(sq->next->flags & SEND_CONTINUED))
+	    stanzas++;
+	conn_free_queue_item(conn->ctx, sq);
+    }
+
+    conn_queue_sent(conn, bytes, stanzas);
+}
+
 #ifndef DEFAULT_TIMEOUT
 /** @def DEFAULT_TIMEOUT
  *  The default timeout in milliseconds for the event loop.
@@ -59,278 +175,2146 @@
 #define DEFAULT_TIMEOUT 1
 #endif
 
-/** Run the event loop once.
- *  This function will run send any data that has been queued by
- *  xmpp_send and related functions and run through the Strophe even
- *  loop a single time, and will not wait more than timeout
- *  milliseconds for events.  This is provided to support integration
- *  with event loops outside the library, and if used, should be
- *  called regularly to achieve low latency event handling.
+#ifndef SEND_IOV_MAX
+/** @def SEND_IOV_MAX
+ *  The maximum number of send queue items gathered into one socket
+ *  write.  This is the system's IOV_MAX where it is defined.
+ */
+#ifdef IOV_MAX
+#define SEND_IOV_MAX IOV_MAX
+#else
+#define SEND_IOV_MAX 64
+#endif
+#endif
+
+#ifndef TLS_BATCH_SIZE
+/** @def TLS_BATCH_SIZE
+ *  The most data from small send queue items that is packed into one
+ *  TLS write.  This is the largest payload of a TLS record.
+ */
+#define TLS_BATCH_SIZE 16384
+#endif
+
+#ifndef EPOLL_MAX_EVENTS
+/** @def EPOLL_MAX_EVENTS
+ *  The maximum number of ready sockets collected by one call to
+ *  epoll_wait().  Sockets which do not fit are reported on the next
+ *  iteration of the event loop.
+ */
+#define EPOLL_MAX_EVENTS 256
+#endif
+
+#ifdef HAVE_IO_URING
+#ifndef URING_ENTRIES
+/** @def URING_ENTRIES
+ *  The number of submission queue entries of the io_uring engine.
+ */
+#define URING_ENTRIES 1024
+#endif
+#ifndef URING_BUFFERS
+/** @def URING_BUFFERS
+ *  The number of receive buffers the io_uring engine registers with the
+ *  kernel.  The buffers are shared by all connections of a context and
+ *  a buffer is only held between a read completing and its data being
+ *  parsed, so this does not need to grow with the number of connections.
+ */
+#define URING_BUFFERS 256
+#endif
+#ifndef URING_BUFFER_SIZE
+/** @def URING_BUFFER_SIZE
+ *  The size of each io_uring receive buffer.
+ */
+#define URING_BUFFER_SIZE 4096
+#endif
+#ifndef URING_IOV_MAX
+/** @def URING_IOV_MAX
+ *  The maximum number of send queue items written by one io_uring
+ *  write operation.
+ */
+#define URING_IOV_MAX 64
+#endif
+
+/* buffer group id of the registered receive buffers */
+#define URING_BGID 1
+
+/* operation kinds kept in the low bits of an sqe's user_data */
+#define URING_OP_RECV 1
+#define URING_OP_POLLIN 2
+#define URING_OP_POLLOUT 3
+#define URING_OP_WRITE 4
+#define URING_OP_WAKE 5 /* the loop's wakeup channel, no connection */
+#define URING_OP_MASK 7
+
+/* per connection engine state.  this outlives the connection while the
+ * kernel still owns operations that refer to it. */
+struct _uring_conn_t {
+    xmpp_conn_t *conn; /* NULL once the connection is gone */
+    int inflight;
+    int read_op; /* URING_OP_RECV or URING_OP_POLLIN if a read is posted */
+    int polling_out; /* waiting for a connect or for TLS output space */
+    int writing;
+    size_t write_len; /* bytes of the send queue being written */
+    int cancelled; /* reads cancelled ahead of a migration */
+    int cancel_lost; /* on the loop's list of cancellations to retry */
+    uring_conn_t *cancel_next;
+    struct iovec iov[URING_IOV_MAX];
+};
+
+static void _conn_flush(xmpp_conn_t * const conn);
+static void _conn_handle_connect(xmpp_conn_t * const conn);
+static void _conn_handle_read(xmpp_conn_t * const conn);
+static void _conn_handle_data(xmpp_conn_t * const conn, char *buf,
+			      const int len);
+static int _conn_inflate_pending(const xmpp_conn_t * const conn);
+static void _conn_set_read_pending(xmpp_conn_t * const conn,
+				   const int pending);
+
+static uint64_t _uring_data(uring_conn_t * const st, const int op)
+{
+    return (uint64_t)(uintptr_t)st | op;
+}
+
+/* hand receive buffers (back) to the kernel.  returns FALSE if the
+ * submission queue is full */
+static int _uring_provide(xmpp_loop_t * const loop, const int bid,
+			  const int count)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(loop->ring);
+    if (!sqe) return 0;
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t)&loop->ring_bufs[bid * URING_BUFFER_SIZE];
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BGID;
+
+    return 1;
+}
+
+/* hand a receive buffer back to the kernel, or once there is room */
+static void _uring_return_buffer(xmpp_loop_t * const loop, const int bid)
+{
+    if (!_uring_provide(loop, bid, 1))
+	loop->ring_lost_bufs[loop->ring_nlost_bufs++] = bid;
+}
+
+/* note that a connection's operations could not all be submitted, so
+ * that they are once the ring has room again.  without this the
+ * connection would never hear from the kernel again */
+static void _uring_lost(xmpp_conn_t * const conn)
+{
+    xmpp_debug(conn->ctx, "event", "io_uring submission queue full");
+    _connlist_append(&conn->loop->ring_rearm, &conn->ev_rearm);
+}
+
+/* wait for the loop to be woken up by another thread */
+static void _uring_arm_wake(xmpp_loop_t * const loop)
+{
+    struct io_uring_sqe *sqe;
+
+    if (loop->wake_rd < 0) return;
+
+    sqe = uring_get_sqe(loop->ring);
+    loop->ring_wake_lost = !sqe;
+    if (!sqe) return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wake_rd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_WAKE;
+}
+
+static int _uring_init(xmpp_loop_t * const loop)
+{
+    static const int ops[] = { IORING_OP_RECV, IORING_OP_WRITEV,
+			       IORING_OP_POLL_ADD, IORING_OP_TIMEOUT,
+			       IORING_OP_ASYNC_CANCEL,
+			       IORING_OP_PROVIDE_BUFFERS };
+    unsigned int i;
+
+    loop->ring_bufs = NULL;
+    loop->ring_lost_bufs = NULL;
+    loop->ring_nlost_bufs = 0;
+    loop->ring_wake_lost = 0;
+    loop->ring_cancels = NULL;
+    loop->ring_timeout_queued = 0;
+    _connlist_init(&loop->ring_rearm);
+    loop->ring = uring_new(loop->ctx, URING_ENTRIES);
+    if (!loop->ring) return 0;
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+	if (!uring_op_supported(loop->ring, ops[i])) {
+	    xmpp_debug(loop->ctx, "event", "io_uring lacks opcode %d", ops[i]);
+	    uring_free(loop->ring);
+	    loop->ring = NULL;
+	    return 0;
+	}
+    }
+
+    loop->ring_bufs = xmpp_alloc(loop->ctx, URING_BUFFERS * URING_BUFFER_SIZE);
+    loop->ring_lost_bufs = xmpp_alloc(loop->ctx, URING_BUFFERS * sizeof(int));
+    if (!loop->ring_bufs || !loop->ring_lost_bufs ||
+	!_uring_provide(loop, 0, URING_BUFFERS)) {
+	if (loop->ring_bufs) xmpp_free(loop->ctx, loop->ring_bufs);
+	if (loop->ring_lost_bufs) xmpp_free(loop->ctx, loop->ring_lost_bufs);
+	loop->ring_bufs = NULL;
+	loop->ring_lost_bufs = NULL;
+	uring_free(loop->ring);
+	loop->ring = NULL;
+	return 0;
+    }
+    _uring_arm_wake(loop);
+
+    loop->ev_backend = XMPP_EVENT_URING;
+    return 1;
+}
+
+static uring_conn_t *_uring_conn_state(xmpp_conn_t * const conn)
+{
+    uring_conn_t *st;
+
+    if (conn->uring) return conn->uring;
+
+    st = xmpp_alloc(conn->ctx, sizeof(uring_conn_t));
+    if (!st) return NULL;
+    memset(st, 0, sizeof(uring_conn_t));
+    st->conn = conn;
+    conn->uring = st;
+
+    return st;
+}
+
+/* post a read for a connection.  plaintext connections read straight
+ * into a registered buffer, while TLS connections only wait for
+ * readability since the TLS library does its own socket reads */
+static void _uring_arm_read(xmpp_conn_t * const conn)
+{
+    struct io_uring_sqe *sqe;
+    uring_conn_t *st;
+
+    /* a migrating connection is re-armed by its new loop, and a paused
+     * parser takes no data until the loop resumes it or, after a stream
+     * restart, resets it */
+    if (conn->migrate_to || parser_paused(conn->parser) ||
+	conn->reset_parser)
+	return;
+
+    st = _uring_conn_state(conn);
+    if (!st || st->read_op) return;
+
+    sqe = uring_get_sqe(conn->loop->ring);
+    if (!sqe) {
+	_uring_lost(conn);
+	return;
+    }
+
+    sqe->fd = conn->sock;
+    if (conn->tls) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->poll32_events = POLLIN;
+	st->read_op = URING_OP_POLLIN;
+    } else {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->len = URING_BUFFER_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	st->read_op = URING_OP_RECV;
+    }
+    sqe->user_data = _uring_data(st, st->read_op);
+    st->inflight++;
+}
+
+/* wait for a socket to become writable, either to finish connecting or
+ * because a TLS write could not complete */
+static void _uring_arm_pollout(xmpp_conn_t * const conn)
+{
+    struct io_uring_sqe *sqe;
+    uring_conn_t *st;
+
+    if (conn->migrate_to) return;
+
+    st = _uring_conn_state(conn);
+    if (!st || st->polling_out) return;
+
+    sqe = uring_get_sqe(conn->loop->ring);
+    if (!sqe) {
+	_uring_lost(conn);
+	return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->sock;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = _uring_data(st, URING_OP_POLLOUT);
+    st->polling_out = 1;
+    st->inflight++;
+}
+
+/* submit the send queue as a single gathered write */
+static void _uring_flush(xmpp_conn_t * const conn)
+{
+    struct io_uring_sqe *sqe;
+    xmpp_send_queue_t *sq;
+    uring_conn_t *st;
+    size_t total;
+    int n;
+
+    /* TLS connections write synchronously through the TLS library */
+    if (conn->tls || conn->migrate_to) return;
+
+    conn_queue_pick(conn, conn->write_budget);
+    if (!conn->send_queue_head) return;
+
+    st = _uring_conn_state(conn);
+    if (!st || st->writing) return;
+
+    n = 0;
+    total = 0;
+    for (sq = conn->send_queue_head; sq && n < URING_IOV_MAX; sq = sq->next) {
+	/* the rest goes out with the next write */
+	if (n && total >= conn->write_budget) {
+	    conn->stats.write_budget_hits++;
+	    break;
+	}
+	st->iov[n].iov_base = &sq->data[sq->written];
+	st->iov[n].iov_len = sq->len - sq->written;
+	total += st->iov[n].iov_len;
+	n++;
+    }
+
+    sqe = uring_get_sqe(conn->loop->ring);
+    if (!sqe) {
+	_uring_lost(conn);
+	return;
+    }
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = conn->sock;
+    sqe->addr = (uintptr_t)st->iov;
+    sqe->len = n;
+    sqe->user_data = _uring_data(st, URING_OP_WRITE);
+    st->writing = 1;
+    st->write_len = total;
+    st->inflight++;
+}
+
+/* returns FALSE if the submission queue is full */
+static int _uring_cancel(xmpp_loop_t * const loop, const uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(loop->ring);
+    if (!sqe) return 0;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+
+    return 1;
+}
+
+/* cancel all operations of a connection.  returns FALSE if not all
+ * cancellations could be submitted */
+static int _uring_cancel_all(xmpp_loop_t * const loop, uring_conn_t *st)
+{
+    int ok = 1;
+
+    if (st->read_op)
+	ok &= _uring_cancel(loop, _uring_data(st, st->read_op));
+    if (st->polling_out)
+	ok &= _uring_cancel(loop, _uring_data(st, URING_OP_POLLOUT));
+    if (st->writing)
+	ok &= _uring_cancel(loop, _uring_data(st, URING_OP_WRITE));
+
+    return ok;
+}
+
+/* detach a connection from the engine and cancel its operations */
+static void _uring_remove(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+    uring_conn_t *st = conn->uring;
+
+    _connlist_unlink(&conn->ev_rearm);
+    if (!st) return;
+
+    /* the state is kept until the cancellations went out, as the
+     * operations could otherwise wait on the socket forever */
+    if (!_uring_cancel_all(loop, st) && !st->cancel_lost) {
+	st->cancel_lost = 1;
+	st->cancel_next = loop->ring_cancels;
+	loop->ring_cancels = st;
+    }
+
+    st->conn = NULL;
+    conn->uring = NULL;
+    if (st->inflight == 0 && !st->cancel_lost) xmpp_free(conn->ctx, st);
+}
+
+/* cancel the reads of a connection which is about to change loops.
+ * returns TRUE once the kernel no longer holds any of its operations.
+ * writes are left to complete so that no queued data is lost, and data
+ * from reads which complete before the cancellation is still parsed
+ * here. */
+static int _uring_quiesce(xmpp_conn_t * const conn)
+{
+    uring_conn_t *st = conn->uring;
+
+    if (!st || st->inflight == 0) return 1;
+
+    /* tried again on the next iteration if the ring is full */
+    if (!st->cancelled) {
+	st->cancelled = 1;
+	if (st->read_op)
+	    st->cancelled &= _uring_cancel(conn->loop,
+					   _uring_data(st, st->read_op));
+	if (st->polling_out)
+	    st->cancelled &= _uring_cancel(conn->loop,
+					   _uring_data(st, URING_OP_POLLOUT));
+    }
+
+    return 0;
+}
+
+/* a gathered write completed, drop everything it sent from the queue */
+static void _uring_handle_write(xmpp_conn_t * const conn, int res)
+{
+    if (res < 0) {
+	if (res == -EAGAIN || res == -EINTR) return;
+	xmpp_debug(conn->ctx, "xmpp", "Send error occured, disconnecting.");
+	conn->error = ECONNABORTED;
+	conn_disconnect(conn);
+	return;
+    }
+
+    _conn_sent(conn, res);
+}
+
+static void _uring_handle_cqe(xmpp_loop_t * const loop, uring_conn_t *st,
+			      const int op, const int res,
+			      const unsigned int flags)
+{
+    xmpp_conn_t *conn = st->conn;
+    int bid = -1;
+
+    switch (op) {
+    case URING_OP_RECV:
+	st->read_op = 0;
+	if (flags & IORING_CQE_F_BUFFER)
+	    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	if (!conn || conn->state != XMPP_STATE_CONNECTED) break;
+
+	if (res > 0) {
+	    conn->stanza_quota = conn->stanza_budget;
+	    _conn_handle_data(conn, &loop->ring_bufs[bid * URING_BUFFER_SIZE],
+			      res);
+	    /* the parser keeps what it didn't get to */
+	    if (conn->state == XMPP_STATE_CONNECTED &&
+		(parser_paused(conn->parser) || _conn_inflate_pending(conn)))
+		_conn_set_read_pending(conn, 1);
+	} else if (res == 0) {
+	    /* return of 0 means socket closed by server */
+	    xmpp_debug(loop->ctx, "xmpp", "Socket closed by remote host.");
+	    conn->error = ECONNRESET;
+	    conn_disconnect(conn);
+	} else if (res != -ENOBUFS && res != -EAGAIN && res != -EINTR &&
+		   res != -ECANCELED) {
+	    conn->error = -res;
+	    conn_disconnect(conn);
+	}
+	break;
+    case URING_OP_POLLIN:
+	st->read_op = 0;
+	if (conn && conn->state == XMPP_STATE_CONNECTED && res > 0)
+	    _conn_handle_read(conn);
+	break;
+    case URING_OP_POLLOUT:
+	st->polling_out = 0;
+	if (!conn || res <= 0) break;
+	if (conn->state == XMPP_STATE_CONNECTING)
+	    _conn_handle_connect(conn);
+	else if (conn->state == XMPP_STATE_CONNECTED)
+	    _conn_flush(conn);
+	break;
+    case URING_OP_WRITE:
+	st->writing = 0;
+	if (conn && conn->state == XMPP_STATE_CONNECTED)
+	    _uring_handle_write(conn, res);
+	break;
+    }
+
+    if (bid >= 0) _uring_return_buffer(loop, bid);
+
+    /* handlers may have released the connection */
+    conn = st->conn;
+    if (conn && conn->state == XMPP_STATE_CONNECTED) {
+	_uring_arm_read(conn);
+	if (conn->ev_mask & EVENT_WRITE) _uring_arm_pollout(conn);
+	_uring_flush(conn);
+    }
+}
+
+/* submit again what didn't fit into the submission queue before.  the
+ * ring has room once io_uring_enter took the queued entries */
+static void _uring_retry(xmpp_loop_t * const loop)
+{
+    xmpp_connlist_t pending;
+    xmpp_conn_t *conn;
+    uring_conn_t *st, **link;
+
+    if (loop->ring_wake_lost) _uring_arm_wake(loop);
+
+    while (loop->ring_nlost_bufs &&
+	   _uring_provide(loop,
+			  loop->ring_lost_bufs[loop->ring_nlost_bufs - 1], 1))
+	loop->ring_nlost_bufs--;
+
+    link = &loop->ring_cancels;
+    while ((st = *link)) {
+	if (st->inflight && !_uring_cancel_all(loop, st)) {
+	    link = &st->cancel_next;
+	    continue;
+	}
+	*link = st->cancel_next;
+	st->cancel_lost = 0;
+	if (st->inflight == 0) xmpp_free(loop->ctx, st);
+    }
+
+    /* connections which fail again put themselves back */
+    _connlist_splice(&pending, &loop->ring_rearm);
+    while ((conn = _connlist_pop(&pending))) {
+	if (conn->state == XMPP_STATE_CONNECTING) {
+	    _uring_arm_pollout(conn);
+	} else if (conn->state == XMPP_STATE_CONNECTED) {
+	    _uring_arm_read(conn);
+	    if (conn->ev_mask & EVENT_WRITE) _uring_arm_pollout(conn);
+	    _uring_flush(conn);
+	}
+    }
+}
+
+/* forget the loop's timeout once the kernel took it.  until an
+ * io_uring_enter call succeeds, it stays queued for a later iteration */
+static void _uring_timeout_check(xmpp_loop_t * const loop)
+{
+    if (loop->ring_timeout_queued &&
+	uring_sqe_taken(loop->ring, loop->ring_timeout_pos))
+	loop->ring_timeout_queued = 0;
+}
+
+/* submit queued operations, wait for and dispatch completions.  this is
+ * a single io_uring_enter call per iteration.  returns FALSE if nothing
+ * completed. */
+static int _run_uring(xmpp_loop_t * const loop, const unsigned long wait)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    uring_conn_t *st;
+    uint64_t data;
+    unsigned int flags, min = 0;
+    int res, processed = 0;
+
+    _uring_timeout_check(loop);
+
+    if (wait > 0 && !uring_peek_cqe(loop->ring)) {
+	/* wake up after the timeout or the first completion.  a timeout
+	 * still waiting to be submitted is used again, with this wait */
+	loop->ring_timeout.tv_sec = wait / 1000;
+	loop->ring_timeout.tv_nsec = (wait % 1000) * 1000000;
+	if (!loop->ring_timeout_queued) {
+	    sqe = uring_get_sqe(loop->ring);
+	    if (sqe) {
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&loop->ring_timeout;
+		sqe->len = 1;
+		sqe->off = 1;
+		loop->ring_timeout_queued = 1;
+		loop->ring_timeout_pos = uring_sqe_pos(loop->ring);
+	    }
+	}
+	if (loop->ring_timeout_queued) min = 1;
+    }
+
+    if (uring_enter(loop->ring, min) < 0 && !sock_is_recoverable(errno) &&
+	errno != ETIME && errno != EBUSY) {
+	xmpp_error(loop->ctx, "xmpp", "event watcher internal error %d", errno);
+	return 0;
+    }
+    _uring_timeout_check(loop);
+
+    while ((cqe = uring_peek_cqe(loop->ring))) {
+	data = cqe->user_data;
+	res = cqe->res;
+	flags = cqe->flags;
+	uring_cqe_seen(loop->ring);
+
+	/* timeouts, cancellations and buffer updates */
+	if (!data) continue;
+
+	if (data == URING_OP_WAKE) {
+	    _loop_drain_wake(loop);
+	    _uring_arm_wake(loop);
+	    processed = 1;
+	    continue;
+	}
+
+	st = (uring_conn_t *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	_uring_handle_cqe(loop, st, (int)(data & URING_OP_MASK), res, flags);
+	processed = 1;
+
+	st->inflight--;
+	if (!st->conn && st->inflight == 0 && !st->cancel_lost)
+	    xmpp_free(loop->ctx, st);
+    }
+
+    _uring_retry(loop);
+
+    return processed;
+}
+
+static void _uring_shutdown(xmpp_loop_t * const loop)
+{
+    struct io_uring_cqe *cqe;
+    uring_conn_t *st;
+    uint64_t data;
+
+    /* release the state of connections that went away with operations
+     * still in flight, as far as the kernel has finished with them */
+    uring_enter(loop->ring, 0);
+    while ((cqe = uring_peek_cqe(loop->ring))) {
+	data = cqe->user_data;
+	uring_cqe_seen(loop->ring);
+	if (!data || data == URING_OP_WAKE) continue;
+	st = (uring_conn_t *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	if (--st->inflight == 0 && !st->conn && !st->cancel_lost)
+	    xmpp_free(loop->ctx, st);
+    }
+    while ((st = loop->ring_cancels)) {
+	loop->ring_cancels = st->cancel_next;
+	if (st->inflight == 0) xmpp_free(loop->ctx, st);
+    }
+
+    uring_free(loop->ring);
+    xmpp_free(loop->ctx, loop->ring_bufs);
+    xmpp_free(loop->ctx, loop->ring_lost_bufs);
+    loop->ring = NULL;
+    loop->ring_bufs = NULL;
+    loop->ring_lost_bufs = NULL;
+}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_SYS_EPOLL_H
+static int _epoll_init(xmpp_loop_t * const loop)
+{
+    loop->ev_ready = xmpp_alloc(loop->ctx, EPOLL_MAX_EVENTS *
+			       sizeof(struct epoll_event));
+    if (!loop->ev_ready) return 0;
+
+    loop->epfd = epoll_create(EPOLL_MAX_EVENTS);
+    if (loop->epfd < 0) {
+	xmpp_debug(loop->ctx, "event", "epoll unavailable, using select");
+	xmpp_free(loop->ctx, loop->ev_ready);
+	loop->ev_ready = NULL;
+	return 0;
+    }
+
+    /* the wakeup channel is tagged with the loop itself */
+    if (loop->wake_rd >= 0) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = loop;
+	epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_rd, &ev);
+    }
+
+    loop->ev_backend = XMPP_EVENT_EPOLL;
+    return 1;
+}
+
+static void _epoll_watch(xmpp_conn_t * const conn, const unsigned int mask)
+{
+    xmpp_loop_t *loop = conn->loop;
+    struct epoll_event ev;
+    int op;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = conn;
+    if (mask & EVENT_READ) ev.events |= EPOLLIN;
+    if (mask & EVENT_WRITE) ev.events |= EPOLLOUT;
+
+    if (mask == 0)
+	op = EPOLL_CTL_DEL;
+    else if (conn->ev_mask)
+	op = EPOLL_CTL_MOD;
+    else
+	op = EPOLL_CTL_ADD;
+
+    /* older kernels require a non-NULL event for EPOLL_CTL_DEL */
+    if (epoll_ctl(loop->epfd, op, conn->sock, &ev) < 0 && mask)
+	xmpp_error(loop->ctx, "event", "failed to watch socket %d, error %d",
+		   conn->sock, sock_error());
+}
+
+static void _epoll_remove(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+    int i;
+
+    if (conn->ev_mask) _epoll_watch(conn, 0);
+
+    /* forget any events already collected for this connection so the
+     * dispatch loop doesn't touch it once it is gone */
+    for (i = 0; i < loop->ev_nready; i++)
+	if (loop->ev_ready[i].data.ptr == conn)
+	    loop->ev_ready[i].data.ptr = NULL;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/** Initialize the event backend of an event loop.
+ *  If built with io_uring support and the kernel provides it, socket
+ *  reads and writes are submitted through an io_uring instance.
+ *  Otherwise, on platforms which support it, an epoll instance is
+ *  created for the loop so that each socket is registered with the
+ *  kernel once instead of being rebuilt into fd_sets on every
+ *  iteration.  If neither is available, the portable select() backend
+ *  is used.  If the context has a watch handler, socket interest is
+ *  reported to it instead and the loop does not wait by itself.
  *
- *  @param ctx a Strophe context object
- *  @param timeout time to wait for events in milliseconds
+ *  @param loop an event loop of a Strophe context
+ */
+void event_init(xmpp_loop_t * const loop)
+{
+    loop->ev_backend = XMPP_EVENT_SELECT;
+#ifdef HAVE_SYS_EPOLL_H
+    loop->epfd = -1;
+    loop->ev_ready = NULL;
+    loop->ev_nready = 0;
+#endif
+#ifdef HAVE_IO_URING
+    loop->ring = NULL;
+    loop->ring_bufs = NULL;
+#endif
+
+    /* the application's own event loop does the waiting */
+    if (loop->ctx->watch_handler) {
+	loop->ev_backend = XMPP_EVENT_EXTERNAL;
+	return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (_uring_init(loop)) return;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (_epoll_init(loop)) return;
+#endif
+}
+
+/** Release the event backend of an event loop.
+ *
+ *  @param loop an event loop of a Strophe context
+ */
+void event_shutdown(xmpp_loop_t * const loop)
+{
+#ifdef HAVE_IO_URING
+    if (loop->ring) _uring_shutdown(loop);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (loop->epfd >= 0) close(loop->epfd);
+    if (loop->ev_ready) xmpp_free(loop->ctx, loop->ev_ready);
+    loop->epfd = -1;
+    loop->ev_ready = NULL;
+#endif
+}
+
+/* a connection's send queue overflowed with the disconnect policy */
+static void _conn_overflow_timeout(wheel_timer_t * const timer,
+				   const uint64_t now)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)timer->userdata;
+    int error = conn->send_overflow;
+
+    conn->send_overflow = 0;
+    if (conn->state != XMPP_STATE_CONNECTED) return;
+
+    conn->error = error;
+    xmpp_info(conn->ctx, "xmpp", "Send queue %s, disconnecting.",
+	      error == ENOBUFS ? "overflowed" : "failed");
+    conn_disconnect(conn);
+}
+
+/** Initialize the event state of a new connection.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_init(xmpp_conn_t * const conn)
+{
+    xmpp_connlist_t *entries[5];
+    int i, n = 0;
+
+    conn->ev_mask = 0;
+    conn->ev_want_write = 0;
+    conn->ev_linked = 0;
+    conn->post_state = POST_FROZEN;
+
+    entries[n++] = &conn->ev_link;
+    entries[n++] = &conn->ev_output;
+    entries[n++] = &conn->ev_reset;
+    entries[n++] = &conn->ev_readable;
+#ifdef HAVE_IO_URING
+    entries[n++] = &conn->ev_rearm;
+#endif
+    for (i = 0; i < n; i++) {
+	entries[i]->conn = conn;
+	entries[i]->next = NULL;
+	entries[i]->prev = NULL;
+    }
+
+    wheel_timer_init(&conn->overflow_timer, _conn_overflow_timeout, conn);
+}
+
+/* a connection attempt took too long */
+static void _conn_connect_timeout(wheel_timer_t * const timer,
+				  const uint64_t now)
+{
+    xmpp_conn_t *conn = (xmpp_conn_t *)timer->userdata;
+
+    if (conn->state != XMPP_STATE_CONNECTING) return;
+
+    conn->error = ETIMEDOUT;
+    xmpp_info(conn->ctx, "xmpp", "Connection attempt timed out.");
+    conn_disconnect(conn);
+}
+
+/** Update the events watched for a connection's socket.
+ *  This is called whenever a connection changes state.  Connecting
+ *  sockets are watched for writability, connected sockets for
+ *  readability and, while output is blocked, for writability, and
+ *  disconnected sockets are removed from the backend.
+ *  The select() backend computes this on every iteration, so it only
+ *  keeps track of the mask.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_update(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+    unsigned int mask;
+
+    /* not handed to a loop yet, it will register the connection */
+    if (!loop) return;
+
+    switch (conn->state) {
+    case XMPP_STATE_CONNECTING:
+	mask = EVENT_WRITE;
+	break;
+    case XMPP_STATE_CONNECTED:
+	mask = EVENT_READ;
+	if (conn->ev_want_write) mask |= EVENT_WRITE;
+	break;
+    default:
+	event_conn_remove(conn);
+	return;
+    }
+
+    /* bound the connection attempt */
+    if (conn->state == XMPP_STATE_CONNECTING) {
+	if (!wheel_pending(&conn->connect_timer)) {
+	    wheel_timer_init(&conn->connect_timer, _conn_connect_timeout,
+			     conn);
+	    wheel_add(loop->wheel, &conn->connect_timer,
+		      conn->timeout_stamp + conn->connect_timeout);
+	}
+    } else
+	wheel_del(&conn->connect_timer);
+
+    if (mask == conn->ev_mask) return;
+
+    switch (loop->ev_backend) {
+#ifdef HAVE_SYS_EPOLL_H
+    case XMPP_EVENT_EPOLL:
+	_epoll_watch(conn, mask);
+	break;
+#endif
+#ifdef HAVE_IO_URING
+    case XMPP_EVENT_URING:
+	if (mask & EVENT_WRITE) _uring_arm_pollout(conn);
+	if (mask & EVENT_READ) _uring_arm_read(conn);
+	break;
+#endif
+    case XMPP_EVENT_EXTERNAL:
+	loop->ctx->watch_handler(conn, conn->sock, mask,
+				 loop->ctx->watch_userdata);
+	break;
+    default:
+	break;
+    }
+    conn->ev_mask = mask;
+}
+
+/** Stop watching a connection's socket.
+ *  This must be called before the socket is closed or the connection
+ *  object is freed.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_remove(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+
+    if (!loop) return;
+
+    wheel_del(&conn->connect_timer);
+    wheel_del(&conn->overflow_timer);
+
+    switch (loop->ev_backend) {
+#ifdef HAVE_SYS_EPOLL_H
+    case XMPP_EVENT_EPOLL:
+	_epoll_remove(conn);
+	break;
+#endif
+#ifdef HAVE_IO_URING
+    case XMPP_EVENT_URING:
+	_uring_remove(conn);
+	break;
+#endif
+    case XMPP_EVENT_EXTERNAL:
+	if (conn->ev_mask)
+	    loop->ctx->watch_handler(conn, conn->sock, 0,
+				     loop->ctx->watch_userdata);
+	break;
+    default:
+	break;
+    }
+    conn->ev_mask = 0;
+    conn->ev_want_write = 0;
+    _connlist_unlink(&conn->ev_output);
+    _connlist_unlink(&conn->ev_reset);
+    _connlist_unlink(&conn->ev_readable);
+}
+
+/** Note that data was added to a connection's send queue.
+ *  The connection is flushed on the next iteration of its loop, unless
+ *  it is waiting for its socket to become writable anyway.  An
+ *  external event loop only hands over sockets which are ready, so it
+ *  is asked to watch for writability instead.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_queued(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+
+    /* connections are picked up once their loop links them */
+    if (!loop || !conn->ev_linked || conn->ev_want_write) return;
+
+    if (loop->ev_backend != XMPP_EVENT_EXTERNAL) {
+	_connlist_append(&loop->output, &conn->ev_output);
+	return;
+    }
+
+    conn->ev_want_write = 1;
+    event_conn_update(conn);
+}
+
+/** Note that a connection's parser must be reset.
+ *  The parser can't be reset from within its own callbacks, so this is
+ *  done by the connection's loop before more data is read.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_reset(xmpp_conn_t * const conn)
+{
+    if (conn->loop && conn->ev_linked)
+	_connlist_append(&conn->loop->resets, &conn->ev_reset);
+}
+
+/** Close a connection whose send queue overflowed.
+ *  Overflows are noticed while handlers are sending, so the connection
+ *  is closed by its loop on the next iteration.  Stanzas which could not
+ *  be compressed leave the stream broken and are dealt with the same.
+ *
+ *  @param conn a Strophe connection object
+ *  @param error the error to disconnect with, ENOBUFS for an overflow
+ */
+void event_conn_overflow(xmpp_conn_t * const conn, const int error)
+{
+    conn->send_overflow = error;
+
+    /* connections are picked up once their loop links them.  adding the
+     * timer again would postpone it */
+    if (conn->loop && conn->ev_linked &&
+	!wheel_pending(&conn->overflow_timer))
+	wheel_add(conn->loop->wheel, &conn->overflow_timer, 0);
+}
+
+/** Find how much of a connection's send queue a write still refers to.
+ *  These bytes at the front of the queue must not be dropped: a TLS
+ *  write has to be repeated with the same data, and an asynchronous
+ *  write may not have completed yet.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return the number of bytes
+ */
+size_t event_conn_pinned(const xmpp_conn_t * const conn)
+{
+#ifdef HAVE_IO_URING
+    if (conn->uring && conn->uring->writing)
+	return conn->uring->write_len;
+#endif
+    return conn->tls_retry;
+}
+
+/* write the front of a plaintext connection's send queue, gathering up
+ * to budget bytes of queued items into one system call.  returns the
+ * number of bytes written, or -1 if nothing could be written */
+static int _conn_write_plain(xmpp_conn_t * const conn, const size_t budget,
+			     size_t * const towrite)
+{
+    sock_iovec_t iov[SEND_IOV_MAX];
+    xmpp_send_queue_t *sq;
+    size_t len = 0;
+    int n = 0;
+    int ret;
+
+    for (sq = conn->send_queue_head; sq && n < SEND_IOV_MAX; sq = sq->next) {
+	if (n && len >= budget) break;
+	sock_iovec_set(&iov[n], &sq->data[sq->written], sq->len - sq->written);
+	len += sq->len - sq->written;
+	n++;
+    }
+    *towrite = len;
+
+    if (n == 1)
+	ret = sock_write(conn->sock, &conn->send_queue_head->data[
+			     conn->send_queue_head->written], len);
+    else
+	ret = sock_writev(conn->sock, iov, n);
+
+    if (ret < 0 && !sock_is_recoverable(sock_error()))
+	conn->error = sock_error();
+
+    return ret;
+}
+
+/* write the front of a TLS connection's send queue.  runs of small
+ * items are copied into the loop's batch buffer so that they go out as
+ * one record instead of one record each.  returns the number of bytes
+ * written, or -1 if nothing could be written */
+static int _conn_write_tls(xmpp_conn_t * const conn, size_t * const towrite)
+{
+    xmpp_loop_t *loop = conn->loop;
+    xmpp_send_queue_t *sq = conn->send_queue_head;
+    size_t len, n, max;
+    char *buf;
+    int ret;
+
+    len = sq->len - sq->written;
+    buf = &sq->data[sq->written];
+
+    /* a write the TLS library couldn't complete has to be repeated with
+     * the same data, which the queue still holds */
+    max = conn->tls_retry ? conn->tls_retry : TLS_BATCH_SIZE;
+    if (len > max) len = max;
+
+    if (len < max && sq->next) {
+	if (!loop->tls_batch)
+	    loop->tls_batch = xmpp_alloc(conn->ctx, TLS_BATCH_SIZE);
+	if (loop->tls_batch) {
+	    for (n = 0; sq && n < max; sq = sq->next) {
+		len = sq->len - sq->written;
+		if (n + len > max) {
+		    /* only a retry splits an item */
+		    if (!conn->tls_retry) break;
+		    len = max - n;
+		}
+		memcpy(&loop->tls_batch[n], &sq->data[sq->written], len);
+		n += len;
+	    }
+	    buf = loop->tls_batch;
+	    len = n;
+	}
+    }
+    *towrite = len;
+
+    ret = tls_write(conn->tls, buf, len);
+    if (ret <= 0) {
+	if (!tls_is_recoverable(tls_error(conn->tls)))
+	    conn->error = tls_error(conn->tls);
+	else
+	    conn->tls_retry = len;
+	return -1;
+    }
+    conn->tls_retry = 0;
+
+    return ret;
+}
+
+/** Write a connection's send queue right away.
+ *  Queued data is otherwise written on the next iteration of the
+ *  connection's loop.  This makes one write of up to the write budget
+ *  now, unless the socket is known to be full or the loop's backend
+ *  submits writes on its own.  A failed write is left for the loop to
+ *  close the connection, as it isn't closed from within a send call.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_flush(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop = conn->loop;
+    size_t towrite;
+    int ret;
+
+    if (!loop || !conn->ev_linked || conn->state != XMPP_STATE_CONNECTED ||
+	conn->ev_want_write || conn->send_overflow || conn->tls_retry)
+	return;
+#ifdef HAVE_IO_URING
+    if ((loop->ev_backend == XMPP_EVENT_URING && !conn->tls) ||
+	(conn->uring && conn->uring->writing))
+	return;
+#endif
+
+    conn_queue_pick(conn, conn->write_budget);
+    if (!conn->send_queue_head) return;
+
+    if (conn->tls)
+	ret = _conn_write_tls(conn, &towrite);
+    else
+	ret = _conn_write_plain(conn, conn->write_budget, &towrite);
+
+    if (ret > 0)
+	_conn_sent(conn, ret);
+    else if (conn->error)
+	event_conn_overflow(conn, conn->error);
+}
+
+/* write out as much of the send queue as the socket will take */
+static void _conn_flush(xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+    size_t total = 0;
+    size_t towrite;
+    int ret, spent = 0;
+
+    /* if we're running tls, there may be some remaining data waiting to
+     * be sent, so push that out */
+    if (conn->tls) {
+	ret = tls_clear_pending_write(conn->tls);
+
+	if (ret < 0 && !tls_is_recoverable(tls_error(conn->tls))) {
+	    /* an error occured */
+	    xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
+	    conn->error = ECONNABORTED;
+	    conn_disconnect(conn);
+	    return;
+	}
+    }
+
+    /* write the send queue to the socket, up to the write budget */
+    for (;;) {
+	conn_queue_pick(conn, conn->write_budget);
+	if (!conn->send_queue_head) break;
+
+	if (total >= conn->write_budget && total) {
+	    conn->stats.write_budget_hits++;
+	    spent = 1;
+	    break;
+	}
+
+	if (conn->tls)
+	    ret = _conn_write_tls(conn, &towrite);
+	else
+	    ret = _conn_write_plain(conn, conn->write_budget - total,
+				    &towrite);
+	if (ret < 0) break;
+
+	_conn_sent(conn, ret);
+	total += ret;
+
+	/* not all data could be sent now */
+	if ((size_t)ret < towrite) break;
+    }
+
+    /* tear down connection on error */
+    if (conn->error) {
+	/* FIXME: need to tear down send queues and random other things
+	 * maybe this should be abstracted */
+	xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
+	conn->error = ECONNABORTED;
+	conn_disconnect(conn);
+	return;
+    }
+
+    /* if the socket is full, leave the rest to when it becomes writable
+     * instead of retrying on every iteration.  what is left when the
+     * budget ran out is written on the next iteration */
+    _connlist_unlink(&conn->ev_output);
+    if ((conn->send_queue_head && !spent) != conn->ev_want_write) {
+	conn->ev_want_write = !conn->ev_want_write;
+	event_conn_update(conn);
+    }
+    if (spent) event_conn_queued(conn);
+}
+
+/* a connecting socket became writable, so the connect has completed */
+static void _conn_handle_connect(xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+
+    /* check for error */
+    if (sock_connect_error(conn->sock) != 0) {
+	/* connection failed */
+	xmpp_debug(ctx, "xmpp", "connection failed");
+	conn_disconnect(conn);
+	return;
+    }
+
+    conn->state = XMPP_STATE_CONNECTED;
+    event_conn_update(conn);
+
+    /* a connection object connecting again starts over */
+    handler_clear_system(conn);
+    handler_schedule_timed(conn);
+    xmpp_debug(ctx, "xmpp", "connection successful");
+
+    /* send stream init */
+    conn_open_stream(conn);
+}
+
+/* feed data received on a connection to its parser */
+static void _conn_handle_data(xmpp_conn_t * const conn, char *buf,
+			      const int len)
+{
+    char *out;
+    int ret;
+
+    if (!conn->compress) {
+	if (!parser_feed(conn->parser, buf, len)) {
+	    /* parse error, we need to shut down */
+	    /* FIXME */
+	    xmpp_debug(conn->ctx, "xmpp", "parse error, disconnecting");
+	    conn_disconnect(conn);
+	}
+	return;
+    }
+
+    /* a compressed stream is fed piece by piece, and what the parser
+     * can't take now is kept for later.  called with no data, this
+     * continues with what was kept */
+    if (len && compress_input(conn->compress, buf, len) != 0) {
+	conn->error = ENOMEM;
+	conn_disconnect(conn);
+	return;
+    }
+
+    while ((ret = compress_inflate(conn->compress, &out)) > 0) {
+	if (!parser_feed(conn->parser, out, ret)) {
+	    xmpp_debug(conn->ctx, "xmpp", "parse error, disconnecting");
+	    conn_disconnect(conn);
+	    return;
+	}
+	if (conn->state != XMPP_STATE_CONNECTED || conn->reset_parser ||
+	    parser_paused(conn->parser))
+	    break;
+    }
+
+    if (ret < 0) {
+	xmpp_debug(conn->ctx, "xmpp", "decompression error, disconnecting");
+	conn->error = ECONNABORTED;
+	conn_disconnect(conn);
+    } else if (conn->state == XMPP_STATE_CONNECTED &&
+	       compress_keep(conn->compress) != 0) {
+	conn->error = ENOMEM;
+	conn_disconnect(conn);
+    }
+}
+
+/* whether a connection has received data left to decompress */
+static int _conn_inflate_pending(const xmpp_conn_t * const conn)
+{
+    return conn->compress && compress_pending(conn->compress);
+}
+
+/* remember whether a connection has decrypted data left in its TLS
+ * layer, which won't wake up the event backend */
+static void _conn_set_read_pending(xmpp_conn_t * const conn,
+				   const int pending)
+{
+    if (pending)
+	_connlist_append(&conn->loop->readable, &conn->ev_readable);
+    else
+	_connlist_unlink(&conn->ev_readable);
+}
+
+/* a connected socket is readable or has buffered TLS data.  read until
+ * the socket runs dry or the connection's read budget is used up */
+static void _conn_handle_read(xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+    size_t total = 0;
+    int ret;
+
+    _conn_set_read_pending(conn, 0);
+    conn->stanza_quota = conn->stanza_budget;
+
+    /* first finish the data left when the stanza budget ran out */
+    if (parser_paused(conn->parser)) {
+	if (!parser_resume(conn->parser)) {
+	    xmpp_debug(ctx, "xmpp", "parse error, disconnecting");
+	    conn_disconnect(conn);
+	    return;
+	}
+	if (conn->state != XMPP_STATE_CONNECTED) return;
+	if (parser_paused(conn->parser) || (conn->reset_parser &&
+					    _conn_inflate_pending(conn))) {
+	    _conn_set_read_pending(conn, 1);
+	    return;
+	}
+	if (conn->reset_parser) return;
+    }
+
+    /* then the compressed data the parser didn't get to, which may
+     * continue after a stream restart */
+    if (_conn_inflate_pending(conn)) {
+	_conn_handle_data(conn, NULL, 0);
+	if (conn->state != XMPP_STATE_CONNECTED) return;
+	if (conn->reset_parser || parser_paused(conn->parser) ||
+	    _conn_inflate_pending(conn)) {
+	    _conn_set_read_pending(conn, 1);
+	    return;
+	}
+    }
+
+#ifdef HAVE_IO_URING
+    /* plaintext sockets are read by the io_uring engine */
+    if (conn->loop->ev_backend == XMPP_EVENT_URING && !conn->tls) {
+	_uring_arm_read(conn);
+	return;
+    }
+#endif
+
+    if (conn->recv_buf_len != conn->recv_buf_size) {
+	if (conn->recv_buf) xmpp_free(ctx, conn->recv_buf);
+	conn->recv_buf_len = 0;
+	conn->recv_buf = xmpp_alloc(ctx, conn->recv_buf_size);
+	if (!conn->recv_buf) {
+	    xmpp_error(ctx, "xmpp", "failed to allocate receive buffer");
+	    conn->error = ECONNABORTED;
+	    conn_disconnect(conn);
+	    return;
+	}
+	conn->recv_buf_len = conn->recv_buf_size;
+    }
+
+    do {
+	if (conn->tls) {
+	    ret = tls_read(conn->tls, conn->recv_buf, conn->recv_buf_len);
+	} else {
+	    ret = sock_read(conn->sock, conn->recv_buf, conn->recv_buf_len);
+	}
+
+	if (ret > 0) {
+	    total += ret;
+	    _conn_handle_data(conn, conn->recv_buf, ret);
+
+	    /* a short read means the socket is drained, so don't spend
+	     * a system call to find out.  TLS reads return at most one
+	     * record, so this doesn't hold for them */
+	    if (!conn->tls && (size_t)ret < conn->recv_buf_len) break;
+	} else {
+	    if (conn->tls) {
+		if (!tls_is_recoverable(tls_error(conn->tls)))
+		{
+		    xmpp_debug(ctx, "xmpp", "Unrecoverable TLS error, %d.", tls_error(conn->tls));
+		    conn->error = tls_error(conn->tls);
+		    conn_disconnect(conn);
+		}
+	    } else if (ret == 0) {
+		/* return of 0 means socket closed by server */
+		xmpp_debug(ctx, "xmpp", "Socket closed by remote host.");
+		conn->error = ECONNRESET;
+		conn_disconnect(conn);
+	    } else if (!sock_is_recoverable(sock_error())) {
+		xmpp_debug(ctx, "xmpp", "Socket read error, %d.", sock_error());
+		conn->error = sock_error();
+		conn_disconnect(conn);
+	    }
+	    break;
+	}
+
+	/* the parser must be reset before it is fed any more data */
+	if (conn->state != XMPP_STATE_CONNECTED || conn->reset_parser ||
+	    parser_paused(conn->parser))
+	    break;
+	if (total >= conn->read_budget) {
+	    conn->stats.read_budget_hits++;
+	    break;
+	}
+    } while (1);
+
+    /* decrypted data still sitting in the TLS layer and data the parser
+     * was paused on are picked up on the next iteration */
+    if (conn->state == XMPP_STATE_CONNECTED &&
+	(parser_paused(conn->parser) || _conn_inflate_pending(conn) ||
+	 (conn->tls && tls_pending(conn->tls))))
+	_conn_set_read_pending(conn, 1);
+
+#ifdef HAVE_IO_URING
+    /* wait for more once the parser takes data again */
+    if (conn->state == XMPP_STATE_CONNECTED &&
+	conn->loop->ev_backend == XMPP_EVENT_URING)
+	_uring_arm_read(conn);
+#endif
+}
+
+/* read from connections which were left with buffered TLS data or with
+ * data their parser was paused on.  the connections are taken from the
+ * list pending, which is emptied */
+static int _loop_read_pending(xmpp_loop_t * const loop,
+			      xmpp_connlist_t * const pending)
+{
+    xmpp_conn_t *conn;
+
+    while ((conn = _connlist_pop(pending))) {
+	if (conn->state != XMPP_STATE_CONNECTED) continue;
+
+	/* the parser must be reset before it is fed any more data */
+	if (conn->reset_parser)
+	    _conn_set_read_pending(conn, 1);
+	else
+	    _conn_handle_read(conn);
+    }
+
+    return 1;
+}
+
+/* reset the parsers of a loop's connections which asked for it */
+static void _loop_reset_parsers(xmpp_loop_t * const loop)
+{
+    xmpp_conn_t *conn;
+
+    while ((conn = _connlist_pop(&loop->resets))) {
+	conn_parser_reset(conn);
+#ifdef HAVE_IO_URING
+	if (loop->ev_backend == XMPP_EVENT_URING &&
+	    conn->state == XMPP_STATE_CONNECTED)
+	    _uring_arm_read(conn);
+#endif
+    }
+}
+
+/* wait for and dispatch events with select().  returns FALSE if no
+ * events were processed. */
+static int _run_select(xmpp_loop_t * const loop, const unsigned long wait)
+{
+    xmpp_connlist_t *connitem, *next;
+    xmpp_conn_t *conn;
+    fd_set rfds, wfds;
+    sock_t max = 0;
+    int ret;
+    struct timeval tv;
+    long usec;
+
+    usec = wait * 1000;
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+
+    FD_ZERO(&rfds); 
+    FD_ZERO(&wfds);
+
+    /* find events to watch */
+    connitem = loop->connlist.next;
+    while (connitem != &loop->connlist) {
+	conn = connitem->conn;
+	
+	switch (conn->state) {
+	case XMPP_STATE_CONNECTING:
+	    /* connect has been called and we're waiting for it to complete */
+	    /* connection will give us write or error events */
+	    FD_SET(conn->sock, &wfds);
+	    break;
+	case XMPP_STATE_CONNECTED:
+	    FD_SET(conn->sock, &rfds);
+	    if (conn->ev_want_write) FD_SET(conn->sock, &wfds);
+	    break;
+	case XMPP_STATE_DISCONNECTED:
+	    /* do nothing */
+	default:
+	    break;
+	}
+	
+	if (conn->sock > max) max = conn->sock;
+
+	connitem = connitem->next;
+    }
+
+    if (loop->wake_rd >= 0) {
+	FD_SET(loop->wake_rd, &rfds);
+	if (loop->wake_rd > max) max = loop->wake_rd;
+    }
+
+    /* check for events */
+    ret = select(max + 1, &rfds,  &wfds, NULL, &tv);
+
+    /* select errored */
+    if (ret < 0) {
+	if (!sock_is_recoverable(sock_error()))
+	    xmpp_error(loop->ctx, "xmpp", "event watcher internal error %d", 
+		       sock_error());
+	return 0;
+    }
+    
+    /* no events happened */
+    if (ret == 0) return 0;
+
+    if (loop->wake_rd >= 0 && FD_ISSET(loop->wake_rd, &rfds))
+	_loop_drain_wake(loop);
+
+    /* process events */
+    for (connitem = loop->connlist.next; connitem != &loop->connlist;
+	 connitem = next) {
+	conn = connitem->conn;
+	next = connitem->next;
+
+	switch (conn->state) {
+	case XMPP_STATE_CONNECTING:
+	    if (FD_ISSET(conn->sock, &wfds))
+		_conn_handle_connect(conn);
+	    break;
+	case XMPP_STATE_CONNECTED:
+	    if (FD_ISSET(conn->sock, &wfds))
+		_conn_flush(conn);
+	    if (conn->state == XMPP_STATE_CONNECTED &&
+		FD_ISSET(conn->sock, &rfds))
+		_conn_handle_read(conn);
+	    break;
+	case XMPP_STATE_DISCONNECTED:
+	    /* do nothing */
+	default:
+	    break;
+	}
+    }
+
+    return 1;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* wait for and dispatch events with epoll.  only connections whose
+ * sockets became ready are visited.  returns FALSE if no events were
+ * processed. */
+static int _run_epoll(xmpp_loop_t * const loop, const unsigned long wait)
+{
+    xmpp_conn_t *conn;
+    int i, ret;
+
+    ret = epoll_wait(loop->epfd, loop->ev_ready, EPOLL_MAX_EVENTS, (int)wait);
+    if (ret < 0) {
+	if (!sock_is_recoverable(sock_error()))
+	    xmpp_error(loop->ctx, "xmpp", "event watcher internal error %d",
+		       sock_error());
+	return 0;
+    }
+    if (ret == 0) return 0;
+
+    loop->ev_nready = ret;
+    for (i = 0; i < loop->ev_nready; i++) {
+	/* cleared if the connection went away during this iteration */
+	conn = (xmpp_conn_t *)loop->ev_ready[i].data.ptr;
+	if (!conn) continue;
+
+	if ((void *)conn == (void *)loop) {
+	    _loop_drain_wake(loop);
+	    continue;
+	}
+
+	switch (conn->state) {
+	case XMPP_STATE_CONNECTING:
+	    _conn_handle_connect(conn);
+	    break;
+	case XMPP_STATE_CONNECTED:
+	    if (loop->ev_ready[i].events & EPOLLOUT) {
+		_conn_flush(conn);
+		/* the flush may have failed and released the connection */
+		if (!loop->ev_ready[i].data.ptr ||
+		    conn->state != XMPP_STATE_CONNECTED)
+		    break;
+	    }
+	    if (loop->ev_ready[i].events & ~EPOLLOUT)
+		_conn_handle_read(conn);
+	    break;
+	default:
+	    break;
+	}
+    }
+    loop->ev_nready = 0;
+
+    return 1;
+}
+#endif
+
+/* event loops */
+
+/* set up the channel other threads use to wake a loop.  this is an
+ * eventfd where available and a pipe on other POSIX systems */
+static void _loop_wake_init(xmpp_loop_t * const loop)
+{
+#if !defined(_WIN32) && !defined(HAVE_SYS_EVENTFD_H)
+    int fds[2];
+#endif
+
+    loop->wake_rd = -1;
+    loop->wake_wr = -1;
+    loop->woken = 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+    loop->wake_rd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->wake_wr = loop->wake_rd;
+#elif !defined(_WIN32)
+    if (pipe(fds) == 0) {
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	loop->wake_rd = fds[0];
+	loop->wake_wr = fds[1];
+    }
+#endif
+}
+
+static void _loop_wake_free(xmpp_loop_t * const loop)
+{
+#ifndef _WIN32
+    if (loop->wake_wr >= 0 && loop->wake_wr != loop->wake_rd)
+	close(loop->wake_wr);
+    if (loop->wake_rd >= 0)
+	close(loop->wake_rd);
+#endif
+}
+
+/* consume wakeups.  posts made after this wake the loop again */
+static void _loop_drain_wake(xmpp_loop_t * const loop)
+{
+#ifndef _WIN32
+    char buf[64];
+
+    while (read(loop->wake_rd, buf, sizeof(buf)) > 0)
+	;
+#endif
+    atomic_swap_int(&loop->woken, 0);
+}
+
+/** Wake up an event loop waiting for events.
+ *  This may be called from any thread.  Wakeups are coalesced, so only
+ *  the first call after the loop last woke up touches the channel.
  *
- *  @ingroup EventLoop
+ *  @param loop an event loop of a Strophe context
  */
-void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
+void event_loop_wake(xmpp_loop_t * const loop)
 {
-    xmpp_connlist_t *connitem;
-    xmpp_conn_t *conn;
-    fd_set rfds, wfds;
-    sock_t max = 0;
-    int ret;
-    struct timeval tv;
-    xmpp_send_queue_t *sq, *tsq;
-    int towrite;
-    char buf[4096];
-    uint64_t next;
-    long usec;
-    int tls_read_bytes = 0;
+#ifndef _WIN32
+    uint64_t one = 1;
 
-    if (ctx->loop_status == XMPP_LOOP_QUIT) return;
-    ctx->loop_status = XMPP_LOOP_RUNNING;
+    if (loop->wake_wr < 0 || atomic_swap_int(&loop->woken, 1))
+	return;
 
-    /* send queued data */
-    connitem = ctx->connlist;
-    while (connitem) {
-	conn = connitem->conn;
+    if (write(loop->wake_wr, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	xmpp_error(loop->ctx, "event", "failed to wake event loop, error %d",
+		   errno);
+#endif
+}
+
+/* move data posted by other threads to a connection's send queue.  like
+ * xmpp_send(), this drops data for connections which aren't connected */
+static void _conn_take_posted(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *item;
+
+    while ((item = (xmpp_send_queue_t *)mpsc_pop(&conn->posted))) {
 	if (conn->state != XMPP_STATE_CONNECTED) {
-	    connitem = connitem->next;
+	    conn_free_queue_item(conn->ctx, item);
 	    continue;
 	}
 
-	/* if we're running tls, there may be some remaining data waiting to
-	 * be sent, so push that out */
-	if (conn->tls) {
-	    ret = tls_clear_pending_write(conn->tls);
+	item->next = NULL;
+	conn_queue(conn, item, XMPP_LANE_INTERACTIVE, 0);
+    }
+}
 
-	    if (ret < 0 && !tls_is_recoverable(tls_error(conn->tls))) {
-		/* an error occured */
-		xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
-		conn->error = ECONNABORTED;
-		conn_disconnect(conn);
-	    }
-	}
+/** Note that another thread posted data to a connection.
+ *  This may be called from any thread.  The first post since the loop
+ *  last took the connection's posts puts the connection on the loop's
+ *  list of connections with posts and wakes the loop up, so that the
+ *  loop only visits the connections which have any.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_posted(xmpp_conn_t * const conn)
+{
+    xmpp_loop_t *loop;
 
-	/* write all data from the send queue to the socket */
-	sq = conn->send_queue_head;
-	while (sq) {
-	    towrite = sq->len - sq->written;
+    /* queued already, or not linked and its loop takes the posts once
+     * it links it */
+    if (!atomic_cas_int(&conn->post_state, POST_IDLE, POST_QUEUED))
+	return;
 
-	    if (conn->tls) {
-		ret = tls_write(conn->tls, &sq->data[sq->written], towrite);
+    /* the connection stays with this loop while it is queued */
+    loop = conn->loop;
+    mpsc_push(&loop->posted, &conn->post_node);
+    event_loop_wake(loop);
+}
 
-		if (ret < 0 && !tls_is_recoverable(tls_error(conn->tls))) {
-		    /* an error occured */
-		    conn->error = tls_error(conn->tls);
-		    break;
-		} else if (ret < towrite) {
-		    /* not all data could be sent now */
-		    if (ret >= 0) sq->written += ret;
-		    break;
-		}
+/* move data posted to a loop's connections to their send queues */
+static void _loop_take_posted(xmpp_loop_t * const loop)
+{
+    mpsc_node_t *node;
+    xmpp_conn_t *conn;
 
-	    } else {
-		ret = sock_write(conn->sock, &sq->data[sq->written], towrite);
+    while ((node = mpsc_pop(&loop->posted))) {
+	conn = (xmpp_conn_t *)((char *)node -
+			       offsetof(xmpp_conn_t, post_node));
 
-		if (ret < 0 && !sock_is_recoverable(sock_error())) {
-		    /* an error occured */
-		    conn->error = sock_error();
-		    break;
-		} else if (ret < towrite) {
-		    /* not all data could be sent now */
-		    if (ret >= 0) sq->written += ret;
-		    break;
-		}
-	    }
+	/* posts from here on queue the connection again */
+	atomic_swap_int(&conn->post_state, POST_IDLE);
+	_conn_take_posted(conn);
+    }
+}
 
-	    /* all data for this queue item written, delete and move on */
-	    xmpp_free(ctx, sq->data);
-	    tsq = sq;
-	    sq = sq->next;
-	    xmpp_free(ctx, tsq);
+/* stop queueing a connection on its loop's list of connections with
+ * posts, before it leaves the loop.  the loop's thread waits until it
+ * has taken the connection off the list if it is on it */
+static void _conn_freeze_posts(xmpp_conn_t * const conn)
+{
+    while (!atomic_cas_int(&conn->post_state, POST_IDLE, POST_FROZEN))
+	_loop_take_posted(conn->loop);
+}
 
-	    /* pop the top item */
-	    conn->send_queue_head = sq;
-	    /* if we've sent everything update the tail */
-	    if (!sq) conn->send_queue_tail = NULL;
-	}
+/* append a connection to a loop and register it with the loop's
+ * backend.  must be called from the thread driving the loop */
+static void _loop_link(xmpp_loop_t * const loop, xmpp_conn_t * const conn)
+{
+    _connlist_append(&loop->connlist, &conn->ev_link);
+    conn->ev_linked = 1;
+    atomic_swap_int(&conn->post_state, POST_IDLE);
 
-	/* tear down connection on error */
-	if (conn->error) {
-	    /* FIXME: need to tear down send queues and random other things
-	     * maybe this should be abstracted */
-	    xmpp_debug(ctx, "xmpp", "Send error occured, disconnecting.");
-	    conn->error = ECONNABORTED;
-	    conn_disconnect(conn);
-	}
-	
-	connitem = connitem->next;
-    }
+    event_conn_update(conn);
+    handler_schedule_timed(conn);
+
+    /* pick up work left from before the connection came here */
+    if (conn->reset_parser) event_conn_reset(conn);
+    if (conn->send_overflow)
+	event_conn_overflow(conn, conn->send_overflow);
+    _conn_take_posted(conn);
+    if (conn->send_queue_len) event_conn_queued(conn);
 
-    /* reset parsers if needed */
-    for (connitem = ctx->connlist; connitem; connitem = connitem->next) {
-	if (connitem->conn->reset_parser)
-	    conn_parser_reset(connitem->conn);
+    /* a migrated connection may have left buffered TLS data, input not
+     * yet decompressed or a paused parser behind.  compressed output is
+     * flushed into the send queue stanza by stanza, so it is picked up
+     * with the queue */
+    if (conn->state == XMPP_STATE_CONNECTED &&
+	(parser_paused(conn->parser) || _conn_inflate_pending(conn) ||
+	 (conn->tls && tls_pending(conn->tls))))
+	_conn_set_read_pending(conn, 1);
+}
+
+/* give a connection to a loop.  while loop threads are running, only
+ * the thread driving a loop may touch its connection list and backend,
+ * so the connection is queued for the loop to pick up on its next
+ * iteration instead */
+static void _loop_hand_over(xmpp_loop_t * const loop,
+			    xmpp_conn_t * const conn)
+{
+    conn->loop = loop;
+
+    if (!atomic_get_int(&loop->ctx->threaded)) {
+	_loop_link(loop, conn);
+	return;
     }
 
+    mutex_lock(loop->lock);
+    _connlist_append(&loop->adopt, &conn->ev_link);
+    mutex_unlock(loop->lock);
+}
+
+/* link connections handed over by other threads */
+static void _loop_adopt(xmpp_loop_t * const loop)
+{
+    xmpp_connlist_t adopted;
+    xmpp_conn_t *conn;
+
+    mutex_lock(loop->lock);
+    _connlist_splice(&adopted, &loop->adopt);
+    mutex_unlock(loop->lock);
 
-    /* fire any ready timed handlers, then
-       make sure we don't wait past the time when timed handlers need 
-       to be called */
-    next = handler_fire_timed(ctx);
+    while ((conn = _connlist_pop(&adopted)))
+	_loop_link(loop, conn);
+}
 
-    usec = ((next < timeout) ? next : timeout) * 1000;
-    tv.tv_sec = usec / 1000000;
-    tv.tv_usec = usec % 1000000;
+/* returns TRUE if the backend holds no references to a connection that
+ * would prevent it from moving to another loop */
+static int _conn_quiesce(xmpp_conn_t * const conn)
+{
+#ifdef HAVE_IO_URING
+    if (conn->loop->ev_backend == XMPP_EVENT_URING)
+	return _uring_quiesce(conn);
+#endif
+    return 1;
+}
 
-    FD_ZERO(&rfds); 
-    FD_ZERO(&wfds);
+/* move connections with a pending migration to their new loops */
+static void _loop_migrate(xmpp_loop_t * const loop)
+{
+    xmpp_ctx_t *ctx = loop->ctx;
+    xmpp_connlist_t *item, *next;
+    xmpp_loop_t *target;
+    xmpp_conn_t *conn;
 
-    /* find events to watch */
-    connitem = ctx->connlist;
-    while (connitem) {
-	conn = connitem->conn;
-	
-	switch (conn->state) {
-	case XMPP_STATE_CONNECTING:
-	    /* connect has been called and we're waiting for it to complete */
-	    /* connection will give us write or error events */
-	    
-	    /* make sure the timeout hasn't expired */
-	    if (time_elapsed(conn->timeout_stamp, time_stamp()) <= 
-		conn->connect_timeout)
-		FD_SET(conn->sock, &wfds);
-	    else {
-		conn->error = ETIMEDOUT;
-		xmpp_info(ctx, "xmpp", "Connection attempt timed out.");
-		conn_disconnect(conn);
-	    }
-	    break;
-	case XMPP_STATE_CONNECTED:
-	    FD_SET(conn->sock, &rfds);
-	    break;
-	case XMPP_STATE_DISCONNECTED:
-	    /* do nothing */
-	default:
-	    break;
+    for (item = loop->connlist.next; item != &loop->connlist; item = next) {
+	next = item->next;
+	conn = item->conn;
+
+	if (!conn->migrate_to || !_conn_quiesce(conn)) continue;
+
+	_conn_freeze_posts(conn);
+	event_conn_remove(conn);
+	handler_cancel_timed(conn);
+	_connlist_unlink(&conn->ev_link);
+	conn->ev_linked = 0;
+
+	target = conn->migrate_to;
+	conn->migrate_to = NULL;
+	loop->migrating--;
+
+	mutex_lock(ctx->lock);
+	loop->load--;
+	target->load++;
+	mutex_unlock(ctx->lock);
+
+	xmpp_debug(ctx, "event", "moving connection to loop %d",
+		   (int)(target - ctx->loops));
+	_loop_hand_over(target, conn);
+    }
+}
+
+/** Create the event loops of a context.
+ *
+ *  @param ctx a Strophe context object
+ *  @param count the number of loops
+ *
+ *  @return an array of count initialized loops or NULL on an error
+ */
+xmpp_loop_t *event_loops_new(xmpp_ctx_t * const ctx, const int count)
+{
+    xmpp_loop_t *loops;
+    int i;
+
+    loops = xmpp_alloc(ctx, count * sizeof(xmpp_loop_t));
+    if (!loops) return NULL;
+
+    for (i = 0; i < count; i++) {
+	loops[i].ctx = ctx;
+	_connlist_init(&loops[i].connlist);
+	loops[i].load = 0;
+	loops[i].migrating = 0;
+	_connlist_init(&loops[i].output);
+	_connlist_init(&loops[i].resets);
+	_connlist_init(&loops[i].readable);
+	mpsc_init(&loops[i].posted);
+	loops[i].tls_batch = NULL;
+	_connlist_init(&loops[i].adopt);
+	loops[i].thread = NULL;
+	loops[i].lock = mutex_create(ctx);
+	if (!loops[i].lock) {
+	    event_loops_free(ctx, loops, i);
+	    return NULL;
 	}
-	
-	/* Check if there is something in the SSL buffer. */
-	if (conn->tls) {
-	    tls_read_bytes += tls_pending(conn->tls);
+	loops[i].wheel = wheel_new(ctx, time_stamp());
+	if (!loops[i].wheel) {
+	    mutex_destroy(loops[i].lock);
+	    event_loops_free(ctx, loops, i);
+	    return NULL;
 	}
-	
-	if (conn->sock > max) max = conn->sock;
 
-	connitem = connitem->next;
+	_loop_wake_init(&loops[i]);
+	event_init(&loops[i]);
     }
 
-    /* check for events */
-    ret = select(max + 1, &rfds,  &wfds, NULL, &tv);
+    return loops;
+}
 
-    /* select errored */
-    if (ret < 0) {
-	if (!sock_is_recoverable(sock_error()))
-	    xmpp_error(ctx, "xmpp", "event watcher internal error %d", 
-		       sock_error());
-	return;
+/** Release the event loops of a context.
+ *  The loops must not have any connections left.
+ *
+ *  @param ctx a Strophe context object
+ *  @param loops an array of loops created by event_loops_new
+ *  @param count the number of loops
+ */
+void event_loops_free(xmpp_ctx_t * const ctx, xmpp_loop_t * const loops,
+		      const int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	event_shutdown(&loops[i]);
+	_loop_wake_free(&loops[i]);
+	if (loops[i].tls_batch) xmpp_free(ctx, loops[i].tls_batch);
+	mutex_destroy(loops[i].lock);
+	wheel_free(loops[i].wheel);
     }
-    
-    /* no events happened */
-    if (ret == 0 && tls_read_bytes == 0) return;
+    xmpp_free(ctx, loops);
+}
 
-    /* process events */
-    connitem = ctx->connlist;
-    while (connitem) {
-	conn = connitem->conn;
+/** Hand a connection to an event loop.
+ *  A connection which has no loop yet is given to the requested loop
+ *  if xmpp_conn_migrate() was called for it, and otherwise to the loop
+ *  with the fewest connections.  A connection which already belongs to
+ *  a loop only has its backend registration refreshed.
+ *
+ *  @param conn a Strophe connection object
+ *
+ *  @return 0 on success and -1 on an error
+ */
+int event_conn_attach(xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+    xmpp_loop_t *loop;
+    int i;
 
-	switch (conn->state) {
-	case XMPP_STATE_CONNECTING:
-	    if (FD_ISSET(conn->sock, &wfds)) {
-		/* connection complete */
+    if (conn->loop) {
+	event_conn_update(conn);
+	return 0;
+    }
 
-		/* check for error */
-		if (sock_connect_error(conn->sock) != 0) {
-		    /* connection failed */
-		    xmpp_debug(ctx, "xmpp", "connection failed");
-		    conn_disconnect(conn);
-		    break;
-		}
+    mutex_lock(ctx->lock);
+    loop = conn->migrate_to;
+    if (!loop) {
+	loop = &ctx->loops[0];
+	for (i = 1; i < ctx->nloops; i++)
+	    if (ctx->loops[i].load < loop->load)
+		loop = &ctx->loops[i];
+    }
+    loop->load++;
+    mutex_unlock(ctx->lock);
+    conn->migrate_to = NULL;
 
-		conn->state = XMPP_STATE_CONNECTED;
-		xmpp_debug(ctx, "xmpp", "connection successful");
+    _loop_hand_over(loop, conn);
 
-		
-		/* send stream init */
-		conn_open_stream(conn);
-	    }
+    return 0;
+}
 
-	    break;
-	case XMPP_STATE_CONNECTED:
-	    if (FD_ISSET(conn->sock, &rfds) || (conn->tls && tls_pending(conn->tls))) {
-		if (conn->tls) {
-		    ret = tls_read(conn->tls, buf, 4096);
-		} else {
-		    ret = sock_read(conn->sock, buf, 4096);
-		}
+/** Take a connection away from its event loop.
+ *  This is called when a connection object is freed.
+ *
+ *  @param conn a Strophe connection object
+ */
+void event_conn_detach(xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = conn->ctx;
+    xmpp_loop_t *loop = conn->loop;
 
-		if (ret > 0) {
-		    ret = parser_feed(conn->parser, buf, ret);
-		    if (!ret) {
-			/* parse error, we need to shut down */
-			/* FIXME */
-			xmpp_debug(ctx, "xmpp", "parse error, disconnecting");
-			conn_disconnect(conn);
-		    }
-		} else {
-		    if (conn->tls) {
-			if (!tls_is_recoverable(tls_error(conn->tls)))
-			{
-			    xmpp_debug(ctx, "xmpp", "Unrecoverable TLS error, %d.", tls_error(conn->tls));
-			    conn->error = tls_error(conn->tls);
-			    conn_disconnect(conn);
-			}
-		    } else {
-			/* return of 0 means socket closed by server */
-			xmpp_debug(ctx, "xmpp", "Socket closed by remote host.");
-			conn->error = ECONNRESET;
-			conn_disconnect(conn);
-		    }
-		}
-	    }
+    if (!loop) return;
 
-	    break;
-	case XMPP_STATE_DISCONNECTED:
-	    /* do nothing */
-	default:
-	    break;
+    /* make sure neither the loop nor its backend refer to us anymore */
+    if (conn->ev_linked) _conn_freeze_posts(conn);
+    event_conn_remove(conn);
+    handler_cancel_timed(conn);
+    if (conn->migrate_to) {
+	conn->migrate_to = NULL;
+	loop->migrating--;
+    }
+
+    /* connections not linked yet are waiting in the adopt list */
+    if (conn->ev_linked) {
+	_connlist_unlink(&conn->ev_link);
+	conn->ev_linked = 0;
+    } else {
+	mutex_lock(loop->lock);
+	_connlist_unlink(&conn->ev_link);
+	mutex_unlock(loop->lock);
+    }
+
+    mutex_lock(ctx->lock);
+    loop->load--;
+    mutex_unlock(ctx->lock);
+    conn->loop = NULL;
+}
+
+/* fire the timed handlers and connection timeouts of a loop which are
+ * due.  returns the time in milliseconds until the next one may be */
+static uint64_t _loop_fire_timers(xmpp_loop_t * const loop)
+{
+    uint64_t now = time_stamp();
+
+    wheel_run(loop->wheel, now);
+
+    return wheel_next(loop->wheel, now);
+}
+
+/* run one iteration of an event loop */
+static void _loop_run_once(xmpp_loop_t * const loop,
+			   const unsigned long timeout)
+{
+    xmpp_connlist_t pending, leftover;
+    xmpp_conn_t *conn;
+    uint64_t next;
+    unsigned long wait;
+    int ret;
+
+    /* pick up connections from other threads and send off leaving ones */
+    _loop_adopt(loop);
+    if (loop->migrating) _loop_migrate(loop);
+
+    /* send queued data */
+    _loop_take_posted(loop);
+    _connlist_splice(&pending, &loop->output);
+    while ((conn = _connlist_pop(&pending))) {
+	if (conn->state != XMPP_STATE_CONNECTED) continue;
+#ifdef HAVE_IO_URING
+	if (loop->ev_backend == XMPP_EVENT_URING && !conn->tls) {
+	    _uring_flush(conn);
+	    /* retry if no write could be submitted */
+	    if (conn->send_queue_head && !(conn->uring &&
+					   conn->uring->writing))
+		_connlist_append(&loop->output, &conn->ev_output);
+	    continue;
 	}
+	/* don't interleave with a write submitted before TLS started */
+	if (conn->uring && conn->uring->writing) {
+	    _connlist_append(&loop->output, &conn->ev_output);
+	    continue;
+	}
+#endif
+	/* blocked sockets are flushed once they become writable */
+	if (conn->send_queue_len && !conn->ev_want_write)
+	    _conn_flush(conn);
+    }
 
-	connitem = connitem->next;
+    _loop_reset_parsers(loop);
+
+    /* fire any expired timers, then
+       make sure we don't wait past the time when the next one is due */
+    next = _loop_fire_timers(loop);
+    wait = (next < timeout) ? (unsigned long)next : timeout;
+
+    /* don't sleep on data we already have.  it is processed after this
+     * iteration's events, so that each connection gets one share of
+     * the iteration */
+    _connlist_splice(&leftover, &loop->readable);
+    if (!_connlist_empty(&leftover)) wait = 0;
+
+    switch (loop->ev_backend) {
+#ifdef HAVE_IO_URING
+    case XMPP_EVENT_URING:
+	ret = _run_uring(loop, wait);
+	break;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    case XMPP_EVENT_EPOLL:
+	ret = _run_epoll(loop, wait);
+	break;
+#endif
+    case XMPP_EVENT_EXTERNAL:
+	/* waiting is up to the application */
+	ret = 0;
+	break;
+    default:
+	ret = _run_select(loop, wait);
+	break;
     }
 
+    if (!_connlist_empty(&leftover)) ret |= _loop_read_pending(loop, &leftover);
+
+    /* no events happened */
+    if (!ret) return;
+
     /* fire any ready handlers */
-    handler_fire_timed(ctx);
+    _loop_fire_timers(loop);
+}
+
+/* drive an event loop from its own thread until the context stops */
+static void _loop_thread(void *arg)
+{
+    xmpp_loop_t *loop = (xmpp_loop_t *)arg;
+
+    while (atomic_get_int(&loop->ctx->loop_status) == XMPP_LOOP_RUNNING)
+	_loop_run_once(loop, DEFAULT_TIMEOUT);
+}
+
+/** Run the event loop once.
+ *  This function will run send any data that has been queued by
+ *  xmpp_send and related functions and run through the Strophe even
+ *  loop a single time, and will not wait more than timeout
+ *  milliseconds for events.  This is provided to support integration
+ *  with event loops outside the library, and if used, should be
+ *  called regularly to achieve low latency event handling.
+ *
+ *  If the context has several event loops (see xmpp_ctx_set_threads),
+ *  they are all run in turn from the calling thread, and only the last
+ *  one waits for events.
+ *
+ *  @param ctx a Strophe context object
+ *  @param timeout time to wait for events in milliseconds
+ *
+ *  @ingroup EventLoop
+ */
+void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long timeout)
+{
+    int i;
+
+    atomic_cas_int(&ctx->loop_status, XMPP_LOOP_NOTSTARTED,
+		   XMPP_LOOP_RUNNING);
+    if (atomic_get_int(&ctx->loop_status) == XMPP_LOOP_QUIT) return;
+
+    for (i = 0; i < ctx->nloops; i++)
+	_loop_run_once(&ctx->loops[i], i == ctx->nloops - 1 ? timeout : 0);
 }
 
 /** Start the event loop.
  *  This function continuously calls xmpp_run_once and does not return
  *  until xmpp_stop has been called.
  *
+ *  If the context has several event loops (see xmpp_ctx_set_threads),
+ *  each of them after the first is driven by a thread of its own, while
+ *  the calling thread drives the first.  This function returns once
+ *  all loop threads have finished.
+ *
  *  @param ctx a Strophe context object
  *
  *  @ingroup EventLoop
  */
 void xmpp_run(xmpp_ctx_t *ctx)
 {
-    if (ctx->loop_status != XMPP_LOOP_NOTSTARTED) return;
+    int i;
+
+    if (!atomic_cas_int(&ctx->loop_status, XMPP_LOOP_NOTSTARTED,
+			XMPP_LOOP_RUNNING))
+	return;
 
-    ctx->loop_status = XMPP_LOOP_RUNNING;
-    while (ctx->loop_status == XMPP_LOOP_RUNNING) {
-	xmpp_run_once(ctx, DEFAULT_TIMEOUT);
+    atomic_swap_int(&ctx->threaded, ctx->nloops > 1);
+    for (i = 1; i < ctx->nloops; i++) {
+	ctx->loops[i].thread = thread_create(ctx, _loop_thread,
+					     &ctx->loops[i]);
+	if (!ctx->loops[i].thread) {
+	    xmpp_error(ctx, "event", "failed to start event loop thread");
+	    xmpp_stop(ctx);
+	    break;
+	}
+    }
+
+    while (atomic_get_int(&ctx->loop_status) == XMPP_LOOP_RUNNING) {
+	_loop_run_once(&ctx->loops[0], DEFAULT_TIMEOUT);
     }
 
+    for (i = 1; i < ctx->nloops; i++) {
+	if (ctx->loops[i].thread) thread_join(ctx->loops[i].thread);
+	ctx->loops[i].thread = NULL;
+    }
+    atomic_swap_int(&ctx->threaded, 0);
+
+    /* link connections handed over while the threads were stopping */
+    for (i = 0; i < ctx->nloops; i++)
+	_loop_adopt(&ctx->loops[i]);
+
     xmpp_debug(ctx, "event", "Event loop completed.");
 }
 
@@ -346,6 +2330,95 @@ void xmpp_stop(xmpp_ctx_t *ctx)
 {
     xmpp_debug(ctx, "event", "Stopping event loop.");
 
-    if (ctx->loop_status == XMPP_LOOP_RUNNING)
-	ctx->loop_status = XMPP_LOOP_QUIT;
+    /* the loop threads see it on their next iteration */
+    if (atomic_get_int(&ctx->loop_status) == XMPP_LOOP_RUNNING)
+	atomic_swap_int(&ctx->loop_status, XMPP_LOOP_QUIT);
+}
+
+/** Handle socket events reported by an external event loop.
+ *  Applications which run their own event loop instead of xmpp_run()
+ *  register a watch handler with xmpp_ctx_set_watch_handler(), wait on
+ *  the sockets it reports, and call this function when a connection's
+ *  socket becomes readable or writable.
+ *
+ *  @param conn a Strophe connection object
+ *  @param events the ready events, a combination of XMPP_IO_READ and
+ *      XMPP_IO_WRITE
+ *
+ *  @ingroup EventLoop
+ */
+void xmpp_conn_handle_io(xmpp_conn_t * const conn, const int events)
+{
+    if (!conn->loop) return;
+
+    switch (conn->state) {
+    case XMPP_STATE_CONNECTING:
+	if (events & XMPP_IO_WRITE)
+	    _conn_handle_connect(conn);
+	break;
+    case XMPP_STATE_CONNECTED:
+	if (events & XMPP_IO_WRITE) _conn_flush(conn);
+	if (conn->state == XMPP_STATE_CONNECTED && (events & XMPP_IO_READ))
+	    _conn_handle_read(conn);
+
+	/* the parser can't be reset from within its own callbacks */
+	if (conn->reset_parser) {
+	    _connlist_unlink(&conn->ev_reset);
+	    conn_parser_reset(conn);
+	}
+	break;
+    default:
+	break;
+    }
+}
+
+/* run everything of a loop that isn't triggered by a socket.  returns
+ * the time in milliseconds until this is needed again */
+static uint64_t _loop_run_timers(xmpp_loop_t * const loop)
+{
+    xmpp_connlist_t leftover;
+    uint64_t next;
+
+    if (loop->migrating) _loop_migrate(loop);
+
+    /* nobody waits on the wakeup channel of an external loop */
+    if (loop->woken) _loop_drain_wake(loop);
+
+    _loop_take_posted(loop);
+    _loop_reset_parsers(loop);
+
+    _connlist_splice(&leftover, &loop->readable);
+    _loop_read_pending(loop, &leftover);
+
+    next = _loop_fire_timers(loop);
+
+    return _connlist_empty(&loop->readable) ? next : 0;
+}
+
+/** Run timers for an external event loop.
+ *  This fires all timed handlers that are due, checks for connection
+ *  attempts which took too long, and processes data left buffered by
+ *  previous reads.  Applications driving the library from their own
+ *  event loop should call this when the returned time has passed and
+ *  after each batch of calls to xmpp_conn_handle_io(), since handlers
+ *  run by those may change the deadline.
+ *
+ *  @param ctx a Strophe context object
+ *
+ *  @return the time in milliseconds until this should be called again
+ *
+ *  @ingroup EventLoop
+ */
+unsigned long xmpp_run_timers(xmpp_ctx_t * const ctx)
+{
+    uint64_t next, min;
+    int i;
+
+    min = (uint64_t)(-1);
+    for (i = 0; i < ctx->nloops; i++) {
+	next = _loop_run_timers(&ctx->loops[i]);
+	if (next < min) min = next;
+    }
+
+    return (min > ULONG_MAX) ? ULONG_MAX : (unsigned long)min;
 }
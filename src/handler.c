@@ -32,6 +32,56 @@
 #include "strophe.h"
 #include "common.h"
 
+/* free what a stanza handler matches stanzas on */
+static void _handler_free_match(xmpp_ctx_t * const ctx,
+				xmpp_handlist_t * const item)
+{
+    if (!item->interned) {
+	if (item->ns) xmpp_free(ctx, item->ns);
+	if (item->name) xmpp_free(ctx, item->name);
+    }
+    if (item->type) xmpp_free(ctx, item->type);
+}
+
+/* match the namespace or name of a stanza against a handler's.  the
+ * handler's are interned if they can be, and so are the stanza's, so
+ * equal strings are the same pointer */
+static int _handler_match(const xmpp_handlist_t * const item,
+			  const char * const s, const char * const want)
+{
+    if (!s) return 0;
+    return item->interned ? s == want : strcmp(s, want) == 0;
+}
+
+/** Determine whether any handler could match a stanza.
+ *  This is called with the start tag of a stanza, before the stanza is
+ *  built.  The namespaces of its children aren't known yet, so
+ *  handlers for a namespace are taken to match.
+ *
+ *  @param conn a Strophe connection object
+ *  @param name the name of the stanza
+ *  @param id the id of the stanza or NULL
+ *  @param type the type of the stanza or NULL
+ *
+ *  @return TRUE if a handler could match the stanza, FALSE otherwise
+ */
+int handler_wants(xmpp_conn_t * const conn, const char * const name,
+		  const char * const id, const char * const type)
+{
+    xmpp_handlist_t *item;
+
+    if (id && hash_get(conn->id_handlers, id)) return 1;
+
+    for (item = conn->handlers; item; item = item->next) {
+	if (item->user_handler && !conn->authenticated) continue;
+	if (item->name && strcmp(name, item->name) != 0) continue;
+	if (item->type && (!type || strcmp(type, item->type) != 0)) continue;
+	return 1;
+    }
+
+    return 0;
+}
+
 /** Fire off all stanza handlers that match.
  *  This function is called internally by the event loop whenever stanzas
  *  are received from the XMPP server.
@@ -102,9 +152,11 @@ void handler_fire_stanza(xmpp_conn_t * const conn,
 	    continue;
 	}
 
-	if ((!item->ns || (ns && strcmp(ns, item->ns) == 0) ||
-	     xmpp_stanza_get_child_by_ns(stanza, item->ns)) &&
-	    (!item->name || (name && strcmp(name, item->name) == 0)) &&
+	if ((!item->ns || _handler_match(item, ns, item->ns) ||
+	     (item->interned ?
+	      stanza_get_child_by_interned_ns(stanza, item->ns) :
+	      xmpp_stanza_get_child_by_ns(stanza, item->ns))) &&
+	    (!item->name || _handler_match(item, name, item->name)) &&
 	    (!item->type || (type && strcmp(type, item->type) == 0)))
 	    if (!((xmpp_handler)(item->handler))(conn, stanza, item->userdata)) {
 		/* handler is one-shot, so delete it */
@@ -112,9 +164,7 @@ void handler_fire_stanza(xmpp_conn_t * const conn,
 		    prev->next = item->next;
 		else
 		    conn->handlers = item->next;
-                if (item->ns) xmpp_free(conn->ctx, item->ns);
-                if (item->name) xmpp_free(conn->ctx, item->name);
-                if (item->type) xmpp_free(conn->ctx, item->type);
+		_handler_free_match(conn->ctx, item);
 		xmpp_free(conn->ctx, item);
 		item = NULL;
 	    }
@@ -129,70 +179,29 @@ void handler_fire_stanza(xmpp_conn_t * const conn,
     }
 }
 
-/** Fire off all timed handlers that are ready.
- *  This function is called internally by the event loop.
- *
- *  @param ctx a Strophe context object
- *
- *  @return the time in milliseconds until the next handler will be ready
- */
-uint64_t handler_fire_timed(xmpp_ctx_t * const ctx)
+/* a timed handler's timer expired.  handlers which may not run yet
+ * are left unscheduled until the connection is ready for them */
+static void _timed_handler_fire(wheel_timer_t * const timer,
+				const uint64_t now)
 {
-    xmpp_connlist_t *connitem;
-    xmpp_handlist_t *handitem, *temp;
-    int ret, fired;
-    uint64_t elapsed, min;
-
-    min = (uint64_t)(-1);
-
-    connitem = ctx->connlist;
-    while (connitem) {
-	if (connitem->conn->state != XMPP_STATE_CONNECTED) {
-	    connitem = connitem->next;
-	    continue;
-	}
-	
-	/* enable all handlers that were added */
-	for (handitem = connitem->conn->timed_handlers; handitem;
-	     handitem = handitem->next)
-	    handitem->enabled = 1;
-
-	handitem = connitem->conn->timed_handlers;
-	while (handitem) {
-	    /* skip newly added handlers */
-	    if (!handitem->enabled) {
-		handitem = handitem->next;
-		continue;
-	    }
+    xmpp_handlist_t *item = (xmpp_handlist_t *)timer->userdata;
+    xmpp_conn_t *conn = item->conn;
+    xmpp_timed_handler handler;
 
-	    /* only fire user handlers after authentication */
-	    if (handitem->user_handler && !connitem->conn->authenticated) {
-		handitem = handitem->next;
-		continue;
-	    }
+    if (conn->state != XMPP_STATE_CONNECTED)
+	return;
 
-	    fired = 0;
-	    elapsed = time_elapsed(handitem->last_stamp, time_stamp());
-	    if (elapsed >= handitem->period) {
-		/* fire! */
-		fired = 1;
-		handitem->last_stamp = time_stamp();
-		ret = ((xmpp_timed_handler)handitem->handler)(connitem->conn, handitem->userdata);
-	    } else if (min > (handitem->period - elapsed))
-		min = handitem->period - elapsed;
-		
-	    temp = handitem;
-	    handitem = handitem->next;
-
-	    /* delete handler if it returned false */
-	    if (fired && !ret)
-		xmpp_timed_handler_delete(connitem->conn, temp->handler);
-	}
+    /* only fire user handlers after authentication */
+    if (item->user_handler && !conn->authenticated)
+	return;
 
-	connitem = connitem->next;
-    }
+    /* rearm before calling, the handler may delete itself */
+    item->last_stamp = now;
+    wheel_add(conn->loop->wheel, timer, now + item->period);
 
-    return min;
+    handler = (xmpp_timed_handler)item->handler;
+    if (!handler(conn, item->userdata))
+	xmpp_timed_handler_delete(conn, handler);
 }
 
 /** Reset all timed handlers.
@@ -207,13 +216,120 @@ void handler_reset_timed(xmpp_conn_t *conn, int user_only)
 
     handitem = conn->timed_handlers;
     while (handitem) {
-	if ((user_only && handitem->user_handler) || !user_only)
+	if ((user_only && handitem->user_handler) || !user_only) {
 	    handitem->last_stamp = time_stamp();
+	    if (conn->loop)
+		wheel_add(conn->loop->wheel, &handitem->timer,
+			  handitem->last_stamp + handitem->period);
+	}
 	
 	handitem = handitem->next;
     }
 }
 
+/** Schedule timed handlers which are not pending.
+ *  Handlers are left unscheduled while their connection is not in an
+ *  event loop or not ready for them.  This function is called
+ *  internally when that changes, and schedules them to fire once their
+ *  period since they last fired has elapsed.
+ *
+ *  @param conn a Strophe connection object
+ */
+void handler_schedule_timed(xmpp_conn_t * const conn)
+{
+    xmpp_handlist_t *handitem;
+
+    if (!conn->loop) return;
+
+    for (handitem = conn->timed_handlers; handitem;
+	 handitem = handitem->next)
+	if (!wheel_pending(&handitem->timer))
+	    wheel_add(conn->loop->wheel, &handitem->timer,
+		      handitem->last_stamp + handitem->period);
+}
+
+/** Unschedule all timed handlers.
+ *  This function is called internally when a connection leaves its
+ *  event loop.
+ *
+ *  @param conn a Strophe connection object
+ */
+void handler_cancel_timed(xmpp_conn_t * const conn)
+{
+    xmpp_handlist_t *handitem;
+
+    for (handitem = conn->timed_handlers; handitem;
+	 handitem = handitem->next)
+	wheel_del(&handitem->timer);
+}
+
+/* drop the system handlers of a list of timed (kind 0), id (kind 1) or
+ * normal (kind 2) handlers, returns what is left */
+static xmpp_handlist_t *_handlist_clear_system(xmpp_conn_t * const conn,
+					       xmpp_handlist_t *list,
+					       const int kind)
+{
+    xmpp_handlist_t *item, **link;
+
+    link = &list;
+    while ((item = *link)) {
+	if (item->user_handler) {
+	    link = &item->next;
+	    continue;
+	}
+
+	*link = item->next;
+	if (kind == 0) {
+	    wheel_del(&item->timer);
+	} else if (kind == 1) {
+	    xmpp_free(conn->ctx, item->id);
+	} else {
+	    _handler_free_match(conn->ctx, item);
+	}
+	xmpp_free(conn->ctx, item);
+    }
+
+    return list;
+}
+
+/** Delete all system handlers.
+ *  The library's handlers only make sense for the stream they were
+ *  added on.  This function is called internally when a connection
+ *  object connects again, so that none are left over from before.
+ *
+ *  @param conn a Strophe connection object
+ */
+void handler_clear_system(xmpp_conn_t * const conn)
+{
+    xmpp_handlist_t *list;
+    hash_iterator_t *iter;
+    const char *key;
+    char **keys;
+    int i, count = 0;
+
+    conn->timed_handlers = _handlist_clear_system(conn,
+						  conn->timed_handlers, 0);
+    conn->handlers = _handlist_clear_system(conn, conn->handlers, 2);
+
+    /* the id handler lists can't be changed while walking the table */
+    keys = xmpp_alloc(conn->ctx,
+		      (hash_num_keys(conn->id_handlers) + 1) * sizeof(char *));
+    if (!keys) return;
+    iter = hash_iter_new(conn->id_handlers);
+    while (iter && (key = hash_iter_next(iter)))
+	if ((keys[count] = xmpp_strdup(conn->ctx, key))) count++;
+    if (iter) hash_iter_release(iter);
+
+    for (i = 0; i < count; i++) {
+	list = (xmpp_handlist_t *)hash_get(conn->id_handlers, keys[i]);
+	list = _handlist_clear_system(conn, list, 1);
+	hash_drop(conn->id_handlers, keys[i]);
+	if (list) hash_add(conn->id_handlers, keys[i], list);
+	xmpp_free(conn->ctx, keys[i]);
+    }
+    xmpp_free(conn->ctx, keys);
+}
+
 static void _timed_handler_add(xmpp_conn_t * const conn,
 			       xmpp_timed_handler handler,
 			       const unsigned long period,
@@ -241,6 +357,10 @@ static void _timed_handler_add(xmpp_conn_t * const conn,
 
     item->period = period;
     item->last_stamp = time_stamp();
+    item->conn = conn;
+    wheel_timer_init(&item->timer, _timed_handler_fire, item);
+    if (conn->loop)
+	wheel_add(conn->loop->wheel, &item->timer, item->last_stamp + period);
 
     /* append item to list */
     if (!conn->timed_handlers)
@@ -282,6 +402,7 @@ void xmpp_timed_handler_delete(xmpp_conn_t * const conn,
 	else
 	    conn->timed_handlers = item->next;
 	
+	wheel_del(&item->timer);
 	xmpp_free(conn->ctx, item);
     }
 }
@@ -394,32 +515,21 @@ static void _handler_add(xmpp_conn_t * const conn,
     item->enabled = 0;
     item->next = NULL;
     
-    if (ns) {
-	item->ns = xmpp_strdup(conn->ctx, ns);
-	if (!item->ns) {
-	    xmpp_free(conn->ctx, item);
-	    return;
-	}
-    } else
-	item->ns = NULL;
-    if (name) {
-	item->name = xmpp_strdup(conn->ctx, name);
-	if (!item->name) {
-	    if (item->ns) xmpp_free(conn->ctx, item->ns);
-	    xmpp_free(conn->ctx, item);
-	    return;
-	}
-    } else
-	item->name = NULL;
-    if (type) {
-	item->type = xmpp_strdup(conn->ctx, type);
-	if (!item->type) {
-	    if (item->ns) xmpp_free(conn->ctx, item->ns);
-	    if (item->name) xmpp_free(conn->ctx, item->name);
-	    xmpp_free(conn->ctx, item);
-	}
-    } else
-	item->type = NULL;
+    /* the namespace and name are interned, so that matching them is a
+     * pointer compare, or else both copied */
+    item->ns = ns ? intern_add(conn->ctx->intern, ns) : NULL;
+    item->name = name ? intern_add(conn->ctx->intern, name) : NULL;
+    item->interned = (!ns || item->ns) && (!name || item->name);
+    if (!item->interned) {
+	item->ns = ns ? xmpp_strdup(conn->ctx, ns) : NULL;
+	item->name = name ? xmpp_strdup(conn->ctx, name) : NULL;
+    }
+    item->type = type ? xmpp_strdup(conn->ctx, type) : NULL;
+    if ((ns && !item->ns) || (name && !item->name) || (type && !item->type)) {
+	_handler_free_match(conn->ctx, item);
+	xmpp_free(conn->ctx, item);
+	return;
+    }
 
     /* append to list */
     if (!conn->handlers)
@@ -462,9 +572,7 @@ void xmpp_handler_delete(xmpp_conn_t * const conn,
 	else
 	    conn->handlers = item->next;
 
-	if (item->ns) xmpp_free(conn->ctx, item->ns);
-	if (item->name) xmpp_free(conn->ctx, item->name);
-	if (item->type) xmpp_free(conn->ctx, item->type);
+	_handler_free_match(conn->ctx, item);
 	xmpp_free(conn->ctx, item);
     }
 }
@@ -519,6 +627,9 @@ void handler_add_timed(xmpp_conn_t * const conn,
  *  If the handler function returns true, it will be kept, and if it
  *  returns false, it will be deleted from the list of handlers.
  *
+ *  As with xmpp_handler_add(), a handler added while a stanza is being
+ *  received does not see that stanza.
+ *
  *  @param conn a Strophe connection object
  *  @param handler a function pointer to a stanza handler
  *  @param id a string with the id
@@ -564,6 +675,13 @@ void handler_add_id(xmpp_conn_t * const conn,
  *  If the handler function returns true, it will be kept, and if it
  *  returns false, it will be deleted from the list of handlers.
  *
+ *  Stanzas no handler could match are skipped without being built, and
+ *  this is decided when their start tag is parsed.  A handler added
+ *  once a stanza's start tag has arrived, from a timed handler for
+ *  instance, only sees the stanzas which start after it.  Handlers
+ *  added by a stanza handler see the stanzas after the one being
+ *  handled.
+ *
  *  @param conn a Strophe connection object
  *  @param handler a function pointer to a stanza handler
  *  @param ns a string with the namespace to match
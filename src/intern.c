@@ -0,0 +1,232 @@
+/* intern.c
+** strophe XMPP client library -- string interning
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  String interning.
+ *
+ *  Each context keeps one copy of the element names, attribute names
+ *  and namespaces its stanzas use, and stanzas and handlers point at
+ *  it.  An interned string is equal to another interned string only if
+ *  they are the same pointer.
+ *
+ *  The table is seeded with common XMPP names and grows as new ones
+ *  turn up, up to INTERN_MAX strings.  Names come from the network, so
+ *  once the table is full, or an allocation for it fails, it is closed
+ *  for good.  As nothing is added after that, a string which isn't
+ *  interned can never equal one which is.
+ *
+ *  Lookups take no lock, since entries are never changed or removed
+ *  once they are published.  Additions are serialized by a mutex.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "intern.h"
+
+/* number of hash chains, a power of two */
+#define INTERN_BUCKETS 512
+/* most strings a table holds */
+#define INTERN_MAX 1024
+/* longer strings aren't worth sharing */
+#define INTERN_MAX_LEN 128
+
+typedef struct _intern_entry_t intern_entry_t;
+struct _intern_entry_t {
+    intern_entry_t *next;
+    char str[1];
+};
+
+struct _intern_t {
+    xmpp_ctx_t *ctx;
+    mutex_t *lock; /* held while adding */
+    arena_t *arena; /* the entries are carved from it */
+    int count;
+    volatile int closed; /* nothing more is added */
+    void * volatile buckets[INTERN_BUCKETS];
+};
+
+static const char * const _intern_seeds[] = {
+    /* elements */
+    "message", "presence", "iq", "body", "subject", "thread", "error",
+    "text", "show", "status", "priority", "query", "item", "group",
+    "x", "c", "delay", "stream:features", "stream:error", "starttls",
+    "proceed", "mechanisms", "mechanism", "auth", "challenge",
+    "response", "success", "failure", "compression", "method",
+    "compress", "compressed", "bind", "session", "jid", "resource",
+    "sm", "enable", "enabled", "resume", "resumed", "failed", "r", "a",
+    /* attributes */
+    "xmlns", "xmlns:stream", "xml:lang", "id", "to", "from", "type",
+    "version", "h", "previd", "max", "location", "node", "ver", "hash",
+    "code", "name", "subscription", "ask", "var", "category", "stamp",
+    /* namespaces */
+    XMPP_NS_CLIENT, XMPP_NS_COMPONENT, XMPP_NS_STREAMS,
+    XMPP_NS_STREAMS_IETF, XMPP_NS_TLS, XMPP_NS_SASL, XMPP_NS_BIND,
+    XMPP_NS_SESSION, XMPP_NS_COMPRESSION, XMPP_NS_FEATURE_COMPRESSION,
+    XMPP_NS_SM, XMPP_NS_AUTH, XMPP_NS_DISCO_INFO, XMPP_NS_DISCO_ITEMS,
+    XMPP_NS_ROSTER, "urn:ietf:params:xml:ns:xmpp-stanzas",
+    "http://jabber.org/protocol/caps", "urn:xmpp:delay", "jabber:x:data",
+    "jabber:iq:version", "jabber:iq:last", "urn:xmpp:ping",
+    "http://jabber.org/protocol/chatstates",
+    "http://jabber.org/protocol/muc", "http://jabber.org/protocol/muc#user",
+    NULL
+};
+
+/* FNV-1a */
+static unsigned int _intern_hash(const char *s)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*s != '\0') {
+	hash ^= (unsigned char)*s++;
+	hash *= 16777619u;
+    }
+
+    return hash & (INTERN_BUCKETS - 1);
+}
+
+static char *_intern_find(intern_t * const table, const char * const s,
+			  const unsigned int bucket)
+{
+    intern_entry_t *entry;
+
+    entry = atomic_get_ptr(&table->buckets[bucket]);
+    for (; entry; entry = entry->next)
+	if (strcmp(entry->str, s) == 0) return entry->str;
+
+    return NULL;
+}
+
+/** Allocate a new intern table.
+ *  The table is seeded with the names most stanzas use.
+ *
+ *  @param ctx the Strophe context object to allocate the table with
+ *
+ *  @return a new intern table or NULL on memory allocation failure
+ */
+intern_t *intern_new(xmpp_ctx_t * const ctx)
+{
+    intern_t *table;
+    int i;
+
+    table = xmpp_alloc(ctx, sizeof(intern_t));
+    if (!table) return NULL;
+
+    memset(table, 0, sizeof(intern_t));
+    table->ctx = ctx;
+    table->lock = mutex_create(ctx);
+    table->arena = arena_new(ctx);
+    if (!table->lock || !table->arena) {
+	intern_free(table);
+	return NULL;
+    }
+
+    for (i = 0; _intern_seeds[i]; i++) {
+	if (!intern_add(table, _intern_seeds[i])) {
+	    intern_free(table);
+	    return NULL;
+	}
+    }
+
+    return table;
+}
+
+/** Free an intern table.
+ *  The strings in it are freed along with it.
+ *
+ *  @param table an intern table
+ */
+void intern_free(intern_t * const table)
+{
+    if (table->arena) arena_release(table->arena);
+    if (table->lock) mutex_destroy(table->lock);
+    xmpp_free(table->ctx, table);
+}
+
+/** Look up the interned copy of a string.
+ *
+ *  @param table an intern table
+ *  @param s a string
+ *
+ *  @return the interned copy of the string or NULL if it has none
+ */
+char *intern_get(intern_t * const table, const char * const s)
+{
+    return _intern_find(table, s, _intern_hash(s));
+}
+
+/** Look up the interned copy of a string, adding one if needed.
+ *  Strings longer than INTERN_MAX_LEN are not interned, and neither is
+ *  anything new once the table is closed.
+ *
+ *  @param table an intern table
+ *  @param s a string
+ *
+ *  @return the interned copy of the string or NULL if it can't be
+ *      interned
+ */
+char *intern_add(intern_t * const table, const char * const s)
+{
+    intern_entry_t *entry;
+    unsigned int bucket;
+    size_t len;
+    char *str;
+
+    bucket = _intern_hash(s);
+    str = _intern_find(table, s, bucket);
+    if (str || atomic_get_int(&table->closed)) return str;
+
+    len = strlen(s);
+    if (len > INTERN_MAX_LEN) return NULL;
+
+    mutex_lock(table->lock);
+
+    /* someone else may have added it meanwhile */
+    str = _intern_find(table, s, bucket);
+    if (!str && !table->closed) {
+	entry = table->count < INTERN_MAX ?
+	    arena_alloc(table->arena,
+			offsetof(intern_entry_t, str) + len + 1) : NULL;
+	if (entry) {
+	    memcpy(entry->str, s, len + 1);
+	    entry->next = table->buckets[bucket];
+	    atomic_swap_ptr(&table->buckets[bucket], entry);
+	    table->count++;
+	    str = entry->str;
+	} else {
+	    xmpp_debug(table->ctx, "intern", "Table closed at %d strings.",
+		       table->count);
+	    atomic_swap_int(&table->closed, 1);
+	}
+    }
+
+    mutex_unlock(table->lock);
+
+    return str;
+}
+
+/** Determine whether a pointer is an interned string.
+ *
+ *  @param table an intern table
+ *  @param s a string
+ *
+ *  @return TRUE if the pointer is the interned copy of the string,
+ *      FALSE otherwise
+ */
+int intern_owns(intern_t * const table, const char * const s)
+{
+    return intern_get(table, s) == s;
+}
@@ -0,0 +1,41 @@
+/* intern.h
+** strophe XMPP client library -- string interning interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  String interning API.
+ */
+
+#ifndef __LIBSTROPHE_INTERN_H__
+#define __LIBSTROPHE_INTERN_H__
+
+typedef struct _intern_t intern_t;
+
+/** allocate a new intern table, seeded with common XMPP names */
+intern_t *intern_new(xmpp_ctx_t * const ctx);
+
+/** free an intern table along with all the strings in it */
+void intern_free(intern_t * const table);
+
+/** look up the interned copy of a string, or NULL if it has none.
+ *  interned strings are shared, and must never be changed or freed */
+char *intern_get(intern_t * const table, const char * const s);
+
+/** look up the interned copy of a string, adding one if there is none.
+ *  returns NULL if the string can't be interned */
+char *intern_add(intern_t * const table, const char * const s);
+
+/** return true if a pointer is the interned copy of a string */
+int intern_owns(intern_t * const table, const char * const s);
+
+#endif /* __LIBSTROPHE_INTERN_H__ */
@@ -0,0 +1,236 @@
+/* logring.c
+** strophe XMPP client library -- asynchronous logging
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Asynchronous logging.
+ *
+ *  Messages are formatted into the slots of a fixed ring and handed to
+ *  the logger by a thread of their own, so a logger that blocks holds
+ *  up nothing but that thread.  The ring is a bounded queue in which
+ *  every slot carries a sequence number: a producer claims the slot at
+ *  the head by advancing the head with a compare and swap once the
+ *  slot's sequence shows it free, and publishes the message by bumping
+ *  the sequence again.  The logging thread is the only consumer, so it
+ *  follows the tail without any atomic updates of its own.  Logging
+ *  never waits for room; when the ring is full the message is dropped
+ *  and counted.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "logring.h"
+
+/* longest area and message kept, including the terminating NUL; longer
+ * ones are truncated */
+#define LOG_AREA_SIZE 32
+#define LOG_MSG_SIZE 1024
+
+/* milliseconds the logging thread sleeps while the ring stays empty,
+ * which bounds the delay of a missed wakeup */
+#define LOG_RING_IDLE 50
+
+typedef struct _log_slot_t log_slot_t;
+struct _log_slot_t {
+    volatile int seq; /* position it may be written at, plus one once full */
+    xmpp_log_level_t level;
+    char area[LOG_AREA_SIZE];
+    char msg[LOG_MSG_SIZE];
+};
+
+struct _log_ring_t {
+    const xmpp_ctx_t *ctx;
+    const xmpp_log_t *log;
+    log_slot_t *slots;
+    int mask;
+    volatile int head; /* next position to write */
+    int tail; /* next position to read, only used by the thread */
+    volatile int dropped;
+    volatile int sleeping;
+    volatile int stop;
+    signal_t *signal;
+    thread_t *thread;
+};
+
+/* positions wrap around, so they are compared by their difference */
+static int _distance(const int from, const int to)
+{
+    return (int)((unsigned int)to - (unsigned int)from);
+}
+
+/* pass on the messages in the ring, returns how many there were */
+static int _log_ring_drain(log_ring_t * const ring)
+{
+    log_slot_t *slot;
+    int count = 0;
+
+    for (;;) {
+	slot = &ring->slots[ring->tail & ring->mask];
+	if (_distance(ring->tail + 1, atomic_get_int(&slot->seq)) < 0)
+	    break;
+
+	ring->log->handler(ring->log->userdata, slot->level, slot->area,
+			   slot->msg);
+
+	/* free the slot for the round after this one */
+	atomic_swap_int(&slot->seq,
+			(int)((unsigned int)ring->tail + ring->mask + 1));
+	ring->tail = (int)((unsigned int)ring->tail + 1);
+	count++;
+    }
+
+    return count;
+}
+
+static void _log_ring_main(void *arg)
+{
+    log_ring_t *ring = (log_ring_t *)arg;
+
+    for (;;) {
+	if (_log_ring_drain(ring)) continue;
+	if (atomic_get_int(&ring->stop)) break;
+
+	/* producers only post the signal while we are asleep.  check the
+	 * ring again after saying so, as a message may have come in
+	 * before */
+	atomic_swap_int(&ring->sleeping, 1);
+	if (!_log_ring_drain(ring) && !atomic_get_int(&ring->stop))
+	    signal_wait(ring->signal, LOG_RING_IDLE);
+	atomic_swap_int(&ring->sleeping, 0);
+    }
+
+    /* messages put while stopping */
+    _log_ring_drain(ring);
+}
+
+/** Allocate a log ring and start its thread.
+ *
+ *  @param ctx a Strophe context object
+ *  @param log the logger to pass messages on to
+ *  @param size the least number of messages the ring holds; rounded up
+ *      to a power of two
+ *
+ *  @return a new ring or NULL on failure
+ */
+log_ring_t *log_ring_new(const xmpp_ctx_t * const ctx,
+			 const xmpp_log_t * const log, const int size)
+{
+    log_ring_t *ring;
+    int i, count;
+
+    for (count = 2; count < size; count <<= 1)
+	;
+
+    ring = xmpp_alloc(ctx, sizeof(log_ring_t));
+    if (!ring) return NULL;
+
+    memset(ring, 0, sizeof(log_ring_t));
+    ring->ctx = ctx;
+    ring->log = log;
+    ring->mask = count - 1;
+    ring->slots = xmpp_alloc(ctx, count * sizeof(log_slot_t));
+    ring->signal = signal_create(ctx);
+    if (!ring->slots || !ring->signal) goto fail;
+
+    for (i = 0; i < count; i++)
+	ring->slots[i].seq = i;
+
+    ring->thread = thread_create(ctx, _log_ring_main, ring);
+    if (!ring->thread) goto fail;
+
+    return ring;
+
+fail:
+    if (ring->signal) signal_destroy(ring->signal);
+    if (ring->slots) xmpp_free(ctx, ring->slots);
+    xmpp_free(ctx, ring);
+    return NULL;
+}
+
+/** Release a log ring.
+ *  The messages still in the ring are passed on to the logger before
+ *  its thread exits.
+ *
+ *  @param ring a log ring
+ */
+void log_ring_free(log_ring_t * const ring)
+{
+    atomic_swap_int(&ring->stop, 1);
+    signal_post(ring->signal);
+    thread_join(ring->thread);
+
+    signal_destroy(ring->signal);
+    xmpp_free(ring->ctx, ring->slots);
+    xmpp_free(ring->ctx, ring);
+}
+
+/** Put a log message into a ring.
+ *  This may be called from any thread.  It never waits: if the ring is
+ *  full, the message is dropped.
+ *
+ *  @param ring a log ring
+ *  @param level the level at which to log
+ *  @param area the area to log for
+ *  @param fmt a printf-style format string for the message
+ *  @param ap variable argument list supplied for the format string
+ */
+void log_ring_put(log_ring_t * const ring, const xmpp_log_level_t level,
+		  const char * const area, const char * const fmt,
+		  va_list ap)
+{
+    log_slot_t *slot;
+    int pos, diff;
+
+    pos = atomic_get_int(&ring->head);
+    for (;;) {
+	slot = &ring->slots[pos & ring->mask];
+	diff = _distance(pos, atomic_get_int(&slot->seq));
+	if (diff == 0) {
+	    /* the slot is free, claim it */
+	    if (atomic_cas_int(&ring->head, pos,
+			       (int)((unsigned int)pos + 1)))
+		break;
+	} else if (diff < 0) {
+	    /* the slot still holds the message of the previous round */
+	    atomic_add_int(&ring->dropped, 1);
+	    return;
+	}
+	pos = atomic_get_int(&ring->head);
+    }
+
+    slot->level = level;
+    strncpy(slot->area, area, LOG_AREA_SIZE - 1);
+    slot->area[LOG_AREA_SIZE - 1] = '\0';
+    xmpp_vsnprintf(slot->msg, LOG_MSG_SIZE, fmt, ap);
+    slot->msg[LOG_MSG_SIZE - 1] = '\0';
+
+    /* publish the message */
+    atomic_swap_int(&slot->seq, (int)((unsigned int)pos + 1));
+
+    if (atomic_get_int(&ring->sleeping))
+	signal_post(ring->signal);
+}
+
+/** Get the number of messages a ring dropped.
+ *
+ *  @param ring a log ring
+ *
+ *  @return the number of messages dropped because the ring was full
+ */
+unsigned long log_ring_dropped(const log_ring_t * const ring)
+{
+    return (unsigned long)(unsigned int)ring->dropped;
+}
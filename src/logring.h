@@ -0,0 +1,44 @@
+/* logring.h
+** strophe XMPP client library -- asynchronous logging interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Asynchronous logging API.
+ */
+
+#ifndef __LIBSTROPHE_LOGRING_H__
+#define __LIBSTROPHE_LOGRING_H__
+
+#include <stdarg.h>
+
+typedef struct _log_ring_t log_ring_t;
+
+/** allocate a ring of at least size messages and start the thread
+ *  passing them on to a logger */
+log_ring_t *log_ring_new(const xmpp_ctx_t * const ctx,
+			 const xmpp_log_t * const log, const int size);
+
+/** pass on the messages left in a ring, then stop its thread and
+ *  release it */
+void log_ring_free(log_ring_t * const ring);
+
+/** format a message into a ring; never blocks, and drops the message if
+ *  the ring is full */
+void log_ring_put(log_ring_t * const ring, const xmpp_log_level_t level,
+		  const char * const area, const char * const fmt,
+		  va_list ap);
+
+/** return the number of messages dropped because the ring was full */
+unsigned long log_ring_dropped(const log_ring_t * const ring);
+
+#endif /* __LIBSTROPHE_LOGRING_H__ */
@@ -0,0 +1,101 @@
+/* mpsc.c
+** strophe XMPP client library -- lock-free queue
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Multiple producer, single consumer queue.
+ *
+ *  This is an intrusive linked list with a stub node.  Producers only
+ *  swap the head pointer and then link the previous head to the new
+ *  node, so a push never blocks and never fails.  Between those two
+ *  steps the list is briefly broken; the consumer then sees the queue
+ *  as empty and finds the node on a later pop.
+ */
+
+#include <stdlib.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "mpsc.h"
+
+/* read a link which producers may be writing */
+static mpsc_node_t *_load(mpsc_node_t * volatile * const link)
+{
+    return (mpsc_node_t *)atomic_get_ptr((void * volatile *)link);
+}
+
+/** Initialize an empty queue.
+ *
+ *  @param queue the queue to initialize
+ */
+void mpsc_init(mpsc_queue_t * const queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/** Add a node to the end of a queue.
+ *  This may be called from any thread.
+ *
+ *  @param queue a queue
+ *  @param node the node to add, which must not be on any queue
+ */
+void mpsc_push(mpsc_queue_t * const queue, mpsc_node_t * const node)
+{
+    mpsc_node_t *prev;
+
+    node->next = NULL;
+    prev = atomic_swap_ptr((void * volatile *)&queue->head, node);
+    atomic_swap_ptr((void * volatile *)&prev->next, node);
+}
+
+/** Remove the node at the front of a queue.
+ *  Only the thread consuming the queue may call this.
+ *
+ *  @param queue a queue
+ *
+ *  @return the oldest node, or NULL if the queue is empty or its next
+ *      node has not been completely pushed yet
+ */
+mpsc_node_t *mpsc_pop(mpsc_queue_t * const queue)
+{
+    mpsc_node_t *tail = queue->tail;
+    mpsc_node_t *next = _load(&tail->next);
+
+    /* skip the stub */
+    if (tail == &queue->stub) {
+	if (!next) return NULL;
+	queue->tail = next;
+	tail = next;
+	next = _load(&tail->next);
+    }
+
+    if (next) {
+	queue->tail = next;
+	return tail;
+    }
+
+    /* tail is the last node, unless a push is in progress */
+    if (tail != _load(&queue->head)) return NULL;
+
+    /* put the stub back behind it so that it can be taken */
+    mpsc_push(queue, &queue->stub);
+    next = _load(&tail->next);
+    if (next) {
+	queue->tail = next;
+	return tail;
+    }
+
+    return NULL;
+}
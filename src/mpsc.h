@@ -0,0 +1,47 @@
+/* mpsc.h
+** strophe XMPP client library -- lock-free queue interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Multiple producer, single consumer queue API.
+ */
+
+#ifndef __LIBSTROPHE_MPSC_H__
+#define __LIBSTROPHE_MPSC_H__
+
+typedef struct _mpsc_node_t mpsc_node_t;
+typedef struct _mpsc_queue_t mpsc_queue_t;
+
+/* embedded in the items put on a queue */
+struct _mpsc_node_t {
+    mpsc_node_t * volatile next;
+};
+
+struct _mpsc_queue_t {
+    mpsc_node_t * volatile head; /* last pushed, swapped by producers */
+    mpsc_node_t *tail; /* next to pop, only used by the consumer */
+    mpsc_node_t stub;
+};
+
+/** initialize an empty queue */
+void mpsc_init(mpsc_queue_t * const queue);
+
+/** add a node to a queue; may be called from any thread */
+void mpsc_push(mpsc_queue_t * const queue, mpsc_node_t * const node);
+
+/** remove the oldest node from a queue; only one thread may pop.
+ *  returns NULL if the queue is empty or the next node is still being
+ *  pushed */
+mpsc_node_t *mpsc_pop(mpsc_queue_t * const queue);
+
+#endif /* __LIBSTROPHE_MPSC_H__ */
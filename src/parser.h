@@ -23,12 +23,21 @@
 
 typedef struct _parser_t parser_t;
 
+/* character data is collected in a buffer which is kept for the next
+ * stanza unless it grew larger than this */
+#define PARSER_TEXT_KEEP 4096
+
 typedef void (*parser_start_callback)(char *name,
                                       char **attrs,
                                       void * const userdata);
 typedef void (*parser_end_callback)(char *name, void * const userdata);
 typedef void (*parser_stanza_callback)(xmpp_stanza_t *stanza,
                                        void * const userdata);
+/* sees the start tag of each stanza before it is built.  returns false
+ * to have the stanza skipped, in which case only its end is reported */
+typedef int (*parser_filter_callback)(char *name, char **attrs,
+                                      void * const userdata);
+typedef void (*parser_skipped_callback)(char *name, void * const userdata);
 
 
 parser_t *parser_new(xmpp_ctx_t *ctx, 
@@ -39,5 +48,14 @@ parser_t *parser_new(xmpp_ctx_t *ctx,
 void parser_free(parser_t * const parser);
 int parser_reset(parser_t *parser);
 int parser_feed(parser_t *parser, char *chunk, int len);
+void parser_set_filter(parser_t *parser, parser_filter_callback filtercb,
+		       parser_skipped_callback skippedcb);
+
+/* stop delivering stanzas after the current one, keeping the rest of the
+ * data fed so far.  this is called from the parser's callbacks.  no data
+ * must be fed to a paused parser until parser_resume() unpaused it */
+void parser_pause(parser_t *parser);
+int parser_paused(parser_t *parser);
+int parser_resume(parser_t *parser);
 
 #endif /* __LIBSTROPHE_PARSER_H__ */
@@ -32,20 +32,43 @@ struct _parser_t {
     parser_start_callback startcb;
     parser_end_callback endcb;
     parser_stanza_callback stanzacb;
+    parser_filter_callback filtercb;
+    parser_skipped_callback skippedcb;
     void *userdata;
     int depth;
     xmpp_stanza_t *stanza;
+    int paused;
+    int skipping; /* the current stanza is not built */
+
+    /* character data of the current stanza not yet added to it */
+    char *text;
+    size_t text_len;
+    size_t text_size;
 };
 
-static void _set_attributes(xmpp_stanza_t *stanza, const XML_Char **attrs)
+/* add the character data collected since the last tag to the current
+ * stanza, as one text node however many pieces it came in */
+static void _flush_text(parser_t *parser)
 {
-    int i;
+    xmpp_stanza_t *stanza;
 
-    if (!attrs) return;
+    if (!parser->text_len) return;
 
-    for (i = 0; attrs[i]; i += 2) {
-        xmpp_stanza_set_attribute(stanza, attrs[i], attrs[i+1]);
+    stanza = stanza_arena_text(parser->ctx, parser->stanza->arena,
+			       parser->text, parser->text_len);
+    parser->text_len = 0;
+    if (parser->text_size > PARSER_TEXT_KEEP) {
+	xmpp_free(parser->ctx, parser->text);
+	parser->text = NULL;
+	parser->text_size = 0;
+    }
+    if (!stanza) {
+	/* FIXME: allocation error, disconnect */
+	return;
     }
+
+    xmpp_stanza_add_child(parser->stanza, stanza);
+    xmpp_stanza_release(stanza);
 }
 
 static void _start_element(void *userdata,
@@ -54,6 +77,12 @@ static void _start_element(void *userdata,
 {
     parser_t *parser = (parser_t *)userdata;
     xmpp_stanza_t *child;
+    arena_t *arena;
+
+    if (parser->skipping) {
+	parser->depth++;
+	return;
+    }
 
     if (parser->depth == 0) {
         /* notify the owner */
@@ -66,22 +95,32 @@ static void _start_element(void *userdata,
 	    /* something terrible happened */
 	    /* FIXME: shutdown disconnect */
 	    xmpp_error(parser->ctx, "parser", "oops, where did our stanza go?");
+	} else if (!parser->stanza && parser->filtercb &&
+		   !parser->filtercb((char *)name, (char **)attrs,
+				     parser->userdata)) {
+	    /* nobody wants this stanza, so only its depth is tracked */
+	    parser->skipping = 1;
 	} else if (!parser->stanza) {
-	    /* starting a new toplevel stanza */
-	    parser->stanza = xmpp_stanza_new(parser->ctx);
+	    /* starting a new toplevel stanza.  it is built in an arena
+	     * of its own, which its nodes hold references to */
+	    arena = arena_new(parser->ctx);
+	    if (arena) {
+		parser->stanza = stanza_arena_tag(parser->ctx, arena,
+						  name, attrs);
+		arena_release(arena);
+	    }
 	    if (!parser->stanza) {
 		/* FIXME: can't allocate, disconnect */
 	    }
-	    xmpp_stanza_set_name(parser->stanza, name);
-	    _set_attributes(parser->stanza, attrs);
 	} else {
+	    _flush_text(parser);
+
 	    /* starting a child of parser->stanza */
-	    child = xmpp_stanza_new(parser->ctx);
+	    child = stanza_arena_tag(parser->ctx, parser->stanza->arena,
+				     name, attrs);
 	    if (!child) {
 		/* FIXME: can't allocate, disconnect */
 	    }
-	    xmpp_stanza_set_name(child, name);
-	    _set_attributes(child, attrs);
 
 	    /* add child to parent */
 	    xmpp_stanza_add_child(parser->stanza, child);
@@ -103,11 +142,21 @@ static void _end_element(void *userdata, const XML_Char *name)
 
     parser->depth--;
 
+    if (parser->skipping) {
+	if (parser->depth == 1) {
+	    parser->skipping = 0;
+	    if (parser->skippedcb)
+		parser->skippedcb((char *)name, parser->userdata);
+	}
+	return;
+    }
+
     if (parser->depth == 0) {
         /* notify the owner */
         if (parser->endcb)
             parser->endcb((char *)name, parser->userdata);
     } else {
+	_flush_text(parser);
 	if (parser->stanza->parent) {
 	    /* we're finishing a child stanza, so set current to the parent */
 	    parser->stanza = parser->stanza->parent;
@@ -124,20 +173,25 @@ static void _end_element(void *userdata, const XML_Char *name)
 static void _characters(void *userdata, const XML_Char *s, int len)
 {
     parser_t *parser = (parser_t *)userdata;
-    xmpp_stanza_t *stanza;
-
-    if (parser->depth < 2) return;
-
-    /* create and populate stanza */
-    stanza = xmpp_stanza_new(parser->ctx);
-    if (!stanza) {
-	/* FIXME: allocation error, disconnect */
-	return;
+    size_t size;
+    char *text;
+
+    if (parser->depth < 2 || parser->skipping) return;
+
+    /* collect the pieces the text comes in, until the next tag */
+    if (parser->text_len + len > parser->text_size) {
+	size = parser->text_size ? parser->text_size : 256;
+	while (size < parser->text_len + len) size *= 2;
+	text = xmpp_realloc(parser->ctx, parser->text, size);
+	if (!text) {
+	    /* FIXME: allocation error, disconnect */
+	    return;
+	}
+	parser->text = text;
+	parser->text_size = size;
     }
-    xmpp_stanza_set_text_with_size(stanza, s, len);
-
-    xmpp_stanza_add_child(parser->stanza, stanza);
-    xmpp_stanza_release(stanza);
+    memcpy(&parser->text[parser->text_len], s, len);
+    parser->text_len += len;
 }
 
 parser_t *parser_new(xmpp_ctx_t *ctx,
@@ -155,9 +209,15 @@ parser_t *parser_new(xmpp_ctx_t *ctx,
         parser->startcb = startcb;
         parser->endcb = endcb;
         parser->stanzacb = stanzacb;
+        parser->filtercb = NULL;
+        parser->skippedcb = NULL;
         parser->userdata = userdata;
         parser->depth = 0;
         parser->stanza = NULL;
+        parser->paused = 0;
+        parser->text = NULL;
+        parser->text_len = 0;
+        parser->text_size = 0;
 
         parser_reset(parser);
     }
@@ -170,6 +230,7 @@ void parser_free(parser_t *parser)
 {
     if (parser->expat)
         XML_ParserFree(parser->expat);
+    if (parser->text) xmpp_free(parser->ctx, parser->text);
 
     xmpp_free(parser->ctx, parser);
 }
@@ -188,15 +249,55 @@ int parser_reset(parser_t *parser)
 
     parser->depth = 0;
     parser->stanza = NULL;
+    parser->paused = 0;
+    parser->skipping = 0;
+    parser->text_len = 0;
 
     XML_SetUserData(parser->expat, parser);
     XML_SetElementHandler(parser->expat, _start_element, _end_element);
     XML_SetCharacterDataHandler(parser->expat, _characters);
+#ifdef HAVE_XML_SETREPARSEDEFERRALENABLED
+    /* newer expat waits for a tag cut off at the end of a chunk until
+     * much more data arrived, while the peer may be waiting for an
+     * answer to it */
+    XML_SetReparseDeferralEnabled(parser->expat, XML_FALSE);
+#endif
 
     return 1;
 }
 
+/* have each stanza's start tag checked before the stanza is built */
+void parser_set_filter(parser_t *parser, parser_filter_callback filtercb,
+		       parser_skipped_callback skippedcb)
+{
+    parser->filtercb = filtercb;
+    parser->skippedcb = skippedcb;
+}
+
 int parser_feed(parser_t *parser, char *chunk, int len)
 {
-    return XML_Parse(parser->expat, chunk, len, 0);
+    return XML_Parse(parser->expat, chunk, len, 0) != XML_STATUS_ERROR;
+}
+
+/* suspend parsing.  expat keeps the unparsed data of the current chunk */
+void parser_pause(parser_t *parser)
+{
+    if (!parser->paused &&
+	XML_StopParser(parser->expat, XML_TRUE) == XML_STATUS_OK)
+	parser->paused = 1;
+}
+
+int parser_paused(parser_t *parser)
+{
+    return parser->paused;
+}
+
+/* continue parsing the data left by a pause.  the parser may be paused
+ * again before it is done.  true on success */
+int parser_resume(parser_t *parser)
+{
+    if (!parser->paused) return 1;
+
+    parser->paused = 0;
+    return XML_ResumeParser(parser->expat) != XML_STATUS_ERROR;
 }
@@ -27,6 +27,12 @@
 #include "common.h"
 #include "parser.h"
 
+typedef struct _parser_queue_t parser_queue_t;
+struct _parser_queue_t {
+    xmpp_stanza_t *stanza;
+    parser_queue_t *next;
+};
+
 struct _parser_t {
     xmpp_ctx_t *ctx;
     xmlParserCtxtPtr xmlctx;
@@ -34,20 +40,49 @@ struct _parser_t {
     parser_start_callback startcb;
     parser_end_callback endcb;
     parser_stanza_callback stanzacb;
+    parser_filter_callback filtercb;
+    parser_skipped_callback skippedcb;
     void *userdata;
     int depth;
     xmpp_stanza_t *stanza;
+    int skipping; /* the current stanza is not built */
+
+    /* character data of the current stanza not yet added to it */
+    char *text;
+    size_t text_len;
+    size_t text_size;
+
+    /* libxml2 can't suspend a push parser, so stanzas completed while
+     * paused are queued until the parser is resumed */
+    int paused;
+    parser_queue_t *queue_head;
+    parser_queue_t *queue_tail;
+    char *end_name; /* the stream ended while paused */
 };
 
-static void _set_attributes(xmpp_stanza_t *stanza, const xmlChar **attrs)
+/* add the character data collected since the last tag to the current
+ * stanza, as one text node however many pieces it came in */
+static void _flush_text(parser_t *parser)
 {
-    int i;
+    xmpp_stanza_t *stanza;
 
-    if (!attrs) return;
+    if (!parser->text_len) return;
 
-    for (i = 0; attrs[i]; i += 2) {
-        xmpp_stanza_set_attribute(stanza, attrs[i], attrs[i+1]);
+    stanza = stanza_arena_text(parser->ctx, parser->stanza->arena,
+			       parser->text, parser->text_len);
+    parser->text_len = 0;
+    if (parser->text_size > PARSER_TEXT_KEEP) {
+	xmpp_free(parser->ctx, parser->text);
+	parser->text = NULL;
+	parser->text_size = 0;
     }
+    if (!stanza) {
+	/* FIXME: allocation error, disconnect */
+	return;
+    }
+
+    xmpp_stanza_add_child(parser->stanza, stanza);
+    xmpp_stanza_release(stanza);
 }
 
 static void _start_element(void *userdata, 
@@ -55,6 +90,12 @@ static void _start_element(void *userdata,
 {
     parser_t *parser = (parser_t *)userdata;
     xmpp_stanza_t *child;
+    arena_t *arena;
+
+    if (parser->skipping) {
+	parser->depth++;
+	return;
+    }
 
     if (parser->depth == 0) {
         /* notify the owner */
@@ -67,22 +108,36 @@ static void _start_element(void *userdata,
 	    /* something terrible happened */
 	    /* FIXME: we should probably trigger a disconnect */
 	    xmpp_error(parser->ctx, "parser", "oops, where did our stanza go?");
+	} else if (!parser->stanza && parser->filtercb && !parser->paused &&
+		   !parser->filtercb((char *)name, (char **)attrs,
+				     parser->userdata)) {
+	    /* nobody wants this stanza, so only its depth is tracked.
+	     * while paused, the handlers may still change before the
+	     * stanza is delivered, so it is built */
+	    parser->skipping = 1;
 	} else if (!parser->stanza) {
-	    /* starting a new toplevel stanza */
-	    parser->stanza = xmpp_stanza_new(parser->ctx);
+	    /* starting a new toplevel stanza.  it is built in an arena
+	     * of its own, which its nodes hold references to */
+	    arena = arena_new(parser->ctx);
+	    if (arena) {
+		parser->stanza = stanza_arena_tag(parser->ctx, arena,
+						  (char *)name,
+						  (const char * const *)attrs);
+		arena_release(arena);
+	    }
 	    if (!parser->stanza) {
 		/* FIXME: can't allocate, disconnect */
 	    }
-	    xmpp_stanza_set_name(parser->stanza, (char *)name);
-	    _set_attributes(parser->stanza, attrs);
 	} else {
+	    _flush_text(parser);
+
 	    /* starting a child of conn->stanza */
-	    child = xmpp_stanza_new(parser->ctx);
+	    child = stanza_arena_tag(parser->ctx, parser->stanza->arena,
+				     (char *)name,
+				     (const char * const *)attrs);
 	    if (!child) {
 		/* FIXME: can't allocate, disconnect */
 	    }
-	    xmpp_stanza_set_name(child, (char *)name);
-	    _set_attributes(child, attrs);
 
 	    /* add child to parent */
 	    xmpp_stanza_add_child(parser->stanza, child);
@@ -98,20 +153,78 @@ static void _start_element(void *userdata,
     parser->depth++;
 }
 
+/* keep a stanza completed while paused, taking over its reference */
+static void _queue_stanza(parser_t *parser, xmpp_stanza_t *stanza)
+{
+    parser_queue_t *item;
+
+    item = xmpp_alloc(parser->ctx, sizeof(parser_queue_t));
+    if (!item) {
+	/* FIXME: allocation error, disconnect */
+	xmpp_stanza_release(stanza);
+	return;
+    }
+    item->stanza = stanza;
+    item->next = NULL;
+
+    if (parser->queue_tail)
+	parser->queue_tail->next = item;
+    else
+	parser->queue_head = item;
+    parser->queue_tail = item;
+}
+
+/* drop the stanzas queued while paused */
+static void _clear_queue(parser_t *parser)
+{
+    parser_queue_t *item;
+
+    while ((item = parser->queue_head)) {
+	parser->queue_head = item->next;
+	xmpp_stanza_release(item->stanza);
+	xmpp_free(parser->ctx, item);
+    }
+    parser->queue_tail = NULL;
+
+    if (parser->end_name) {
+	xmpp_free(parser->ctx, parser->end_name);
+	parser->end_name = NULL;
+    }
+}
+
 static void _end_element(void *userdata, const xmlChar *name)
 {
     parser_t *parser = (parser_t *)userdata;
 
     parser->depth--;
 
+    if (parser->skipping) {
+	if (parser->depth == 1) {
+	    parser->skipping = 0;
+	    if (parser->skippedcb)
+		parser->skippedcb((char *)name, parser->userdata);
+	}
+	return;
+    }
+
     if (parser->depth == 0) {
+        if (parser->paused) {
+            /* deliver it after the queued stanzas */
+            parser->end_name = xmpp_strdup(parser->ctx, (char *)name);
+            return;
+        }
+
         /* notify owner */
         if (parser->endcb)
             parser->endcb((char *)name, parser->userdata);
     } else {
+	_flush_text(parser);
 	if (parser->stanza->parent) {
 	    /* we're finishing a child stanza, so set current to the parent */
 	    parser->stanza = parser->stanza->parent;
+	} else if (parser->paused) {
+	    _queue_stanza(parser, parser->stanza);
+	    parser->stanza = NULL;
 	} else {
             if (parser->stanzacb)
                 parser->stanzacb(parser->stanza,
@@ -125,21 +238,25 @@ static void _end_element(void *userdata, const xmlChar *name)
 static void _characters(void *userdata, const xmlChar *chr, int len)
 {
     parser_t *parser = (parser_t *)userdata;
-    xmpp_stanza_t *stanza;
+    size_t size;
+    char *text;
 
-    /* skip unimportant whitespace, etc */
-    if (parser->depth < 2) return;
+    if (parser->depth < 2 || parser->skipping) return;
 
-    /* create and populate stanza */
-    stanza = xmpp_stanza_new(parser->ctx);
-    if (!stanza) {
-	/* FIXME: allocation error, disconnect */
-	return;
+    /* collect the pieces the text comes in, until the next tag */
+    if (parser->text_len + len > parser->text_size) {
+	size = parser->text_size ? parser->text_size : 256;
+	while (size < parser->text_len + len) size *= 2;
+	text = xmpp_realloc(parser->ctx, parser->text, size);
+	if (!text) {
+	    /* FIXME: allocation error, disconnect */
+	    return;
+	}
+	parser->text = text;
+	parser->text_size = size;
     }
-    xmpp_stanza_set_text_with_size(stanza, (char *)chr, len);
-
-    xmpp_stanza_add_child(parser->stanza, stanza);
-    xmpp_stanza_release(stanza);
+    memcpy(&parser->text[parser->text_len], (char *)chr, len);
+    parser->text_len += len;
 }
 
 /* create a new parser */
@@ -162,9 +279,18 @@ parser_t *parser_new(xmpp_ctx_t *ctx,
         parser->startcb = startcb;
         parser->endcb = endcb;
         parser->stanzacb = stanzacb;
+        parser->filtercb = NULL;
+        parser->skippedcb = NULL;
         parser->userdata = userdata;
         parser->depth = 0;
         parser->stanza = NULL;
+        parser->paused = 0;
+        parser->text = NULL;
+        parser->text_len = 0;
+        parser->text_size = 0;
+        parser->queue_head = NULL;
+        parser->queue_tail = NULL;
+        parser->end_name = NULL;
 
         parser_reset(parser);
     }
@@ -177,6 +303,8 @@ void parser_free(parser_t *parser)
 {
     if (parser->xmlctx)
         xmlFreeParserCtxt(parser->xmlctx);
+    _clear_queue(parser);
+    if (parser->text) xmpp_free(parser->ctx, parser->text);
     xmpp_free(parser->ctx, parser);
 }
 
@@ -195,10 +323,22 @@ int parser_reset(parser_t *parser)
 
     parser->depth = 0;
     parser->stanza = NULL;
+    parser->paused = 0;
+    parser->skipping = 0;
+    parser->text_len = 0;
+    _clear_queue(parser);
 
     return 1;
 }
 
+/* have each stanza's start tag checked before the stanza is built */
+void parser_set_filter(parser_t *parser, parser_filter_callback filtercb,
+		       parser_skipped_callback skippedcb)
+{
+    parser->filtercb = filtercb;
+    parser->skippedcb = skippedcb;
+}
+
 /* feed a chunk of data to the parser */
 int parser_feed(parser_t *parser, char *chunk, int len)
 {
@@ -210,3 +350,45 @@ int parser_feed(parser_t *parser, char *chunk, int len)
         return 0;
     }
 }
+
+/* stop delivering stanzas.  the rest of the current chunk is still
+ * parsed, and the stanzas in it are queued */
+void parser_pause(parser_t *parser)
+{
+    parser->paused = 1;
+}
+
+int parser_paused(parser_t *parser)
+{
+    return parser->paused;
+}
+
+/* deliver the stanzas queued while paused, until the parser is paused
+ * again.  true on success */
+int parser_resume(parser_t *parser)
+{
+    parser_queue_t *item;
+    char *name;
+
+    parser->paused = 0;
+
+    while (!parser->paused && (item = parser->queue_head)) {
+	parser->queue_head = item->next;
+	if (!parser->queue_head) parser->queue_tail = NULL;
+
+	if (parser->stanzacb)
+	    parser->stanzacb(item->stanza, parser->userdata);
+	xmpp_stanza_release(item->stanza);
+	xmpp_free(parser->ctx, item);
+    }
+
+    if (!parser->paused && parser->end_name) {
+	name = parser->end_name;
+	parser->end_name = NULL;
+	if (parser->endcb)
+	    parser->endcb(name, parser->userdata);
+	xmpp_free(parser->ctx, name);
+    }
+
+    return 1;
+}
@@ -0,0 +1,393 @@
+/* sm.c
+** strophe XMPP client library -- stream management
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Stream management.
+ *
+ *  With stream management (XEP-0198) on, both ends count the stanzas
+ *  they receive and tell each other the count from time to time.  Each
+ *  stanza picked for writing is kept until the server's count covers
+ *  it.  Kept stanzas share their data with the send queue through
+ *  buffer references, so keeping them costs no copy.  When a broken
+ *  connection resumes its session, the stanzas the server missed are
+ *  sent again ahead of the ones which were still waiting in the send
+ *  lanes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+
+/** Whether the server counts stanzas of a name.
+ *
+ *  @param name the name of a stanza or NULL
+ *
+ *  @return 1 if it does, 0 if not
+ */
+int sm_counts(const char * const name)
+{
+    return name && (strcmp(name, "message") == 0 ||
+		    strcmp(name, "presence") == 0 ||
+		    strcmp(name, "iq") == 0);
+}
+
+/** Whether raw data sent is a stanza the server counts.
+ *  This looks at how the data starts, so it must hold the whole start
+ *  tag's name.
+ *
+ *  @param data the data
+ *  @param len the length of the data
+ *
+ *  @return 1 if it is, 0 if not
+ */
+int sm_is_stanza(const char * const data, const size_t len)
+{
+    static const char * const names[] = { "<message", "<presence", "<iq" };
+    size_t name_len;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	name_len = strlen(names[i]);
+	if (len > name_len && memcmp(data, names[i], name_len) == 0 &&
+	    data[name_len] != '\0' && strchr(" \t\r\n/>", data[name_len]))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* move the data an item owns into a shared buffer, so that it can be
+ * kept after the item is written */
+static int _sm_share(xmpp_conn_t * const conn, xmpp_send_queue_t * const item)
+{
+    xmpp_buffer_t *buffer;
+
+    buffer = xmpp_alloc(conn->ctx, sizeof(xmpp_buffer_t));
+    if (!buffer) return XMPP_EMEM;
+
+    buffer->ref = 1;
+    buffer->ctx = conn->ctx;
+    buffer->data = item->data;
+    buffer->len = item->len;
+    buffer->free_cb = item->free_cb;
+    buffer->userdata = item->userdata;
+
+    item->buffer = buffer;
+    item->free_cb = NULL;
+    item->userdata = NULL;
+
+    return 0;
+}
+
+/* free the items of a list */
+static void _sm_free_list(xmpp_conn_t * const conn,
+			  xmpp_send_queue_t *item)
+{
+    xmpp_send_queue_t *next;
+
+    for (; item; item = next) {
+	next = item->next;
+	conn_free_queue_item(conn->ctx, item);
+    }
+}
+
+/* cut the first unit off a list, returns it */
+static xmpp_send_queue_t *_sm_cut_unit(xmpp_send_queue_t ** const head)
+{
+    xmpp_send_queue_t *first, *last;
+
+    first = *head;
+    last = first;
+    while (last->next && (last->next->flags & SEND_CONTINUED))
+	last = last->next;
+
+    *head = last->next;
+    last->next = NULL;
+
+    return first;
+}
+
+/* forget the stanzas sent on a session */
+static void _sm_forget(xmpp_conn_t * const conn)
+{
+    _sm_free_list(conn, conn->sm_unacked_head);
+    conn->sm_unacked_head = NULL;
+    conn->sm_unacked_tail = NULL;
+    conn->sm_sent = 0;
+    conn->sm_acked = 0;
+}
+
+/** Keep a stanza picked for writing until the server acknowledges it.
+ *  Units of data which weren't marked SEND_STANZA when they were queued
+ *  are not counted by the server and not kept.
+ *
+ *  @param conn a Strophe connection object
+ *  @param first the first item of the stanza
+ *
+ *  @return 0 on success or XMPP_EMEM
+ */
+int sm_keep(xmpp_conn_t * const conn, xmpp_send_queue_t * const first)
+{
+    xmpp_send_queue_t *item, *copy, *head = NULL, *tail = NULL;
+
+    if (!(first->flags & SEND_STANZA)) return 0;
+
+    for (item = first; item; item = item->next) {
+	if (!item->buffer && _sm_share(conn, item) != 0) break;
+	copy = conn_new_buffer_item(conn, item->buffer);
+	if (!copy) break;
+	copy->data = item->data;
+	copy->len = item->len;
+	copy->flags = item->flags & (SEND_CONTINUED | SEND_STANZA);
+	if (!tail) head = copy;
+	else tail->next = copy;
+	tail = copy;
+    }
+
+    /* the server counts the stanza even if we can't keep it */
+    conn->sm_sent++;
+    if (item) {
+	_sm_free_list(conn, head);
+	return XMPP_EMEM;
+    }
+
+    if (!conn->sm_unacked_tail) conn->sm_unacked_head = head;
+    else conn->sm_unacked_tail->next = head;
+    conn->sm_unacked_tail = tail;
+
+    return 0;
+}
+
+/** Drop the stanzas the server acknowledged.
+ *
+ *  @param conn a Strophe connection object
+ *  @param h the number of stanzas the server has received
+ *
+ *  @return 0 on success or -1 if the server acknowledged more stanzas
+ *      than it was sent
+ */
+int sm_ack(xmpp_conn_t * const conn, const unsigned int h)
+{
+    unsigned int count;
+
+    count = h - conn->sm_acked;
+    if (count > conn->sm_sent - conn->sm_acked) return -1;
+
+    while (count-- && conn->sm_unacked_head)
+	_sm_free_list(conn, _sm_cut_unit(&conn->sm_unacked_head));
+    if (!conn->sm_unacked_head) conn->sm_unacked_tail = NULL;
+    conn->sm_acked = h;
+
+    return 0;
+}
+
+/** Count a stanza received.
+ *  Stanzas the parser skipped are counted too.
+ *
+ *  @param conn a Strophe connection object
+ *  @param name the name of the stanza received
+ */
+void sm_handled(xmpp_conn_t * const conn, const char * const name)
+{
+    if (sm_counts(name)) conn->sm_handled++;
+}
+
+static int _sm_handle_enabled(xmpp_conn_t * const conn,
+			      xmpp_stanza_t * const stanza,
+			      void * const userdata)
+{
+    char *name, *id, *resume;
+
+    name = xmpp_stanza_get_name(stanza);
+    if (strcmp(name, "enabled") == 0) {
+	xmpp_debug(conn->ctx, "xmpp", "Stream management enabled.");
+	conn->sm_state = SM_ON;
+	conn->sm_handled = 0;
+
+	id = xmpp_stanza_get_attribute(stanza, "id");
+	resume = xmpp_stanza_get_attribute(stanza, "resume");
+	if (id && resume &&
+	    (strcmp(resume, "true") == 0 || strcmp(resume, "1") == 0))
+	    conn->sm_id = xmpp_strdup(conn->ctx, id);
+
+	sm_start(conn);
+    } else if (strcmp(name, "failed") == 0) {
+	xmpp_debug(conn->ctx, "xmpp", "Stream management refused, "\
+		   "continuing without it.");
+	conn->sm_state = SM_OFF;
+	_sm_forget(conn);
+    } else {
+	return 1;
+    }
+
+    return 0;
+}
+
+/** Ask the server to enable stream management.
+ *  Stanzas sent from here on are counted.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_enable(xmpp_conn_t * const conn)
+{
+    _sm_forget(conn);
+    conn->sm_handled = 0;
+
+    handler_add(conn, _sm_handle_enabled, XMPP_NS_SM, NULL, NULL, NULL);
+    conn_send_string(conn, XMPP_LANE_CONTROL, SEND_BARRIER,
+		     "<enable xmlns='%s' resume='true'/>", XMPP_NS_SM);
+    conn->sm_state = SM_REQUESTED;
+}
+
+static int _sm_handle_ack(xmpp_conn_t * const conn,
+			  xmpp_stanza_t * const stanza,
+			  void * const userdata)
+{
+    char *h;
+
+    h = xmpp_stanza_get_attribute(stanza, "h");
+    if (!h || sm_ack(conn, (unsigned int)strtoul(h, NULL, 10)) != 0) {
+	xmpp_error(conn->ctx, "xmpp", "Server acknowledged stanzas it "\
+		   "was never sent.");
+	xmpp_disconnect(conn);
+	return 0;
+    }
+    conn->sm_requested = 0;
+
+    return 1;
+}
+
+static int _sm_handle_request(xmpp_conn_t * const conn,
+			      xmpp_stanza_t * const stanza,
+			      void * const userdata)
+{
+    conn_send_string(conn, XMPP_LANE_CONTROL, 0,
+		     "<a xmlns='%s' h='%u'/>", XMPP_NS_SM, conn->sm_handled);
+
+    return 1;
+}
+
+/* ask the server which stanzas it received, unless it's all known */
+static int _sm_request_ack(xmpp_conn_t * const conn, void * const userdata)
+{
+    if (conn->sm_state == SM_ON && !conn->sm_requested &&
+	conn->sm_sent != conn->sm_acked) {
+	conn_send_string(conn, XMPP_LANE_CONTROL, 0,
+			 "<r xmlns='%s'/>", XMPP_NS_SM);
+	conn->sm_requested = 1;
+    }
+
+    return 1;
+}
+
+/** Start answering and sending acknowledgement requests.
+ *  This is called once a session is enabled or resumed.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_start(xmpp_conn_t * const conn)
+{
+    handler_add(conn, _sm_handle_ack, XMPP_NS_SM, "a", NULL, NULL);
+    handler_add(conn, _sm_handle_request, XMPP_NS_SM, "r", NULL, NULL);
+    handler_add_timed(conn, _sm_request_ack, conn->sm_ack_interval, NULL);
+}
+
+/** Send the stanzas the server didn't acknowledge again.
+ *  This is called once a session is resumed and the stanzas the server
+ *  received are dropped.  They go out before anything else.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_resend(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *list;
+
+    list = conn->sm_unacked_head;
+    conn->sm_unacked_head = NULL;
+    conn->sm_unacked_tail = NULL;
+    conn->sm_sent = conn->sm_acked;
+
+    /* each is counted and kept again as it is picked for writing */
+    while (list) {
+	conn->stats.sm_resent++;
+	conn_queue(conn, _sm_cut_unit(&list), XMPP_LANE_CONTROL,
+		   SEND_BARRIER | SEND_STANZA);
+    }
+}
+
+/** Set aside the stanzas left in the send lanes of a broken connection.
+ *  They are queued again once the connection has a session.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_park(xmpp_conn_t * const conn)
+{
+    xmpp_send_lane_t *lane, *parked;
+    int i;
+
+    for (i = 0; i < SEND_LANES; i++) {
+	lane = &conn->send_lanes[i];
+	parked = &conn->sm_parked[i];
+	if (!lane->head) continue;
+
+	if (!parked->tail) parked->head = lane->head;
+	else parked->tail->next = lane->head;
+	parked->tail = lane->tail;
+	lane->head = NULL;
+	lane->tail = NULL;
+    }
+}
+
+/** Queue the stanzas set aside by sm_park() again.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_requeue(xmpp_conn_t * const conn)
+{
+    xmpp_send_queue_t *list, *unit;
+    int i;
+
+    for (i = 0; i < SEND_LANES; i++) {
+	list = conn->sm_parked[i].head;
+	conn->sm_parked[i].head = NULL;
+	conn->sm_parked[i].tail = NULL;
+
+	while (list) {
+	    unit = _sm_cut_unit(&list);
+	    conn_queue(conn, unit, (xmpp_lane_t)i,
+		       unit->flags & (SEND_DROPPABLE | SEND_STANZA));
+	}
+    }
+}
+
+/** Give up on a session.
+ *  The stanzas the server didn't acknowledge are dropped and counted as
+ *  lost.  Stanzas set aside by sm_park() are kept for a new session.
+ *
+ *  @param conn a Strophe connection object
+ */
+void sm_reset(xmpp_conn_t * const conn)
+{
+    conn->stats.sm_lost += conn->sm_sent - conn->sm_acked;
+    _sm_forget(conn);
+    conn->sm_handled = 0;
+    conn->sm_state = SM_OFF;
+    conn->sm_requested = 0;
+    if (conn->sm_id) {
+	xmpp_free(conn->ctx, conn->sm_id);
+	conn->sm_id = NULL;
+    }
+}
@@ -419,9 +419,9 @@ static int fmtstr (char *buffer, size_t *currlen, size_t maxlen,
     value = "<NULL>";
   }
 
-  for (strln = 0; value[strln]; ++strln); /* strlen */
-  if (max >= 0 && max < strln)
-    strln = max;
+  /* strlen, without reading past the precision; the string needn't be
+   * null-terminated within it */
+  for (strln = 0; (max < 0 || strln < max) && value[strln]; ++strln);
   padlen = min - strln;
   if (padlen < 0) 
     padlen = 0;
@@ -433,7 +433,7 @@ static int fmtstr (char *buffer, size_t *currlen, size_t maxlen,
     total += dopr_outch (buffer, currlen, maxlen, ' ');
     --padlen;
   }
-  while (*value && ((max < 0) || (cnt < max)))
+  while (((max < 0) || (cnt < max)) && *value)
   {
     total += dopr_outch (buffer, currlen, maxlen, *value++);
     ++cnt;
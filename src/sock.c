@@ -154,6 +154,34 @@ int sock_write(const sock_t sock, const void * const buff, const size_t len)
     return send(sock, buff, len, 0);
 }
 
+void sock_iovec_set(sock_iovec_t * const iov, const void * const buff,
+		    const size_t len)
+{
+#ifdef _WIN32
+    iov->buf = (char *)buff;
+    iov->len = (ULONG)len;
+#else
+    iov->iov_base = (void *)buff;
+    iov->iov_len = len;
+#endif
+}
+
+/* write several buffers with one system call.  returns the number of
+ * bytes written like sock_write */
+int sock_writev(const sock_t sock, const sock_iovec_t * const iov,
+		const int count)
+{
+#ifdef _WIN32
+    DWORD sent;
+
+    if (WSASend(sock, (LPWSABUF)iov, count, &sent, 0, NULL, NULL) != 0)
+	return -1;
+    return (int)sent;
+#else
+    return writev(sock, iov, count);
+#endif
+}
+
 int sock_is_recoverable(const int error)
 {
 #ifdef _WIN32
@@ -22,10 +22,13 @@
 #include <stdio.h>
 
 #ifndef _WIN32
+#include <sys/uio.h>
 typedef int sock_t;
+typedef struct iovec sock_iovec_t;
 #else
 #include <winsock2.h>
 typedef SOCKET sock_t;
+typedef WSABUF sock_iovec_t;
 #endif
 
 void sock_initialize(void);
@@ -40,6 +43,11 @@ int sock_set_blocking(const sock_t sock);
 int sock_set_nonblocking(const sock_t sock);
 int sock_read(const sock_t sock, void * const buff, const size_t len);
 int sock_write(const sock_t sock, const void * const buff, const size_t len);
+/* gathered writes, the buffers are set up with sock_iovec_set */
+void sock_iovec_set(sock_iovec_t * const iov, const void * const buff,
+		    const size_t len);
+int sock_writev(const sock_t sock, const sock_iovec_t * const iov,
+		const int count);
 int sock_is_recoverable(const int error);
 /* checks for an error after connect, return 0 if connect successful */
 int sock_connect_error(const sock_t sock);
@@ -30,6 +30,12 @@
 #define inline __inline
 #endif
 
+/* attributes are found by scanning them, unless a stanza has more than
+ * this many and they are indexed by a hash table */
+#define STANZA_ATTR_SCAN 8
+/* attributes there is room for once a stanza has any */
+#define STANZA_ATTR_MIN 4
+
 /** Create a stanza object.
  *  This function allocates and initializes and blank stanza object.
  *  The stanza will have a reference count of one, so the caller does not
@@ -55,12 +61,310 @@ xmpp_stanza_t *xmpp_stanza_new(xmpp_ctx_t *ctx)
 	stanza->children = NULL;
 	stanza->parent = NULL;
 	stanza->data = NULL;
-	stanza->attributes = NULL;
+	stanza->attrs = NULL;
+	stanza->nattrs = 0;
+	stanza->attrs_size = 0;
+	stanza->attr_index = NULL;
+	stanza->arena = NULL;
+	stanza->arena_data = 0;
+	stanza->arena_attrs = 0;
     }
 
     return stanza; 
 }
 
+/* carve a blank stanza object from an arena */
+static xmpp_stanza_t *_stanza_arena_new(xmpp_ctx_t * const ctx,
+					arena_t * const arena)
+{
+    xmpp_stanza_t *stanza;
+
+    stanza = arena_alloc(arena, sizeof(xmpp_stanza_t));
+    if (stanza != NULL) {
+	stanza->ref = 1;
+	stanza->ctx = ctx;
+	stanza->type = XMPP_STANZA_UNKNOWN;
+	stanza->prev = NULL;
+	stanza->next = NULL;
+	stanza->children = NULL;
+	stanza->parent = NULL;
+	stanza->data = NULL;
+	stanza->attrs = NULL;
+	stanza->nattrs = 0;
+	stanza->attrs_size = 0;
+	stanza->attr_index = NULL;
+	stanza->arena = arena_clone(arena);
+	stanza->arena_data = 1;
+	stanza->arena_attrs = 1;
+    }
+
+    return stanza;
+}
+
+/* the interned copy of a name, or a copy of it in an arena if it
+ * can't be interned */
+static char *_stanza_arena_intern(xmpp_ctx_t * const ctx,
+				  arena_t * const arena, const char * const s)
+{
+    char *copy;
+
+    copy = intern_add(ctx->intern, s);
+    return copy ? copy : arena_strdup(arena, s);
+}
+
+/* namespaces are the only attribute values which are interned */
+static int _stanza_is_xmlns(const char * const key)
+{
+    return strcmp(key, "xmlns") == 0;
+}
+
+/** Create a tag stanza object in an arena.
+ *  The object, its name and its attributes are all carved from the
+ *  arena, and the object holds a reference to the arena until it is
+ *  freed.  Names, attribute names and namespaces are interned instead
+ *  where they can be.  It behaves like any other stanza object;
+ *  changing its name or attributes moves them out of the arena.
+ *
+ *  @param ctx a Strophe context object
+ *  @param arena the arena
+ *  @param name a string with the name of the stanza
+ *  @param attrs a NULL terminated array of attribute names and values,
+ *      as the XML parsers provide them, or NULL
+ *
+ *  @return a stanza object or NULL on memory allocation failure
+ */
+xmpp_stanza_t *stanza_arena_tag(xmpp_ctx_t * const ctx,
+				arena_t * const arena,
+				const char * const name,
+				const char * const * const attrs)
+{
+    xmpp_stanza_t *stanza;
+    int i, n;
+
+    stanza = _stanza_arena_new(ctx, arena);
+    if (!stanza) return NULL;
+
+    stanza->type = XMPP_STANZA_TAG;
+    stanza->data = _stanza_arena_intern(ctx, arena, name);
+    if (!stanza->data) goto arena_error;
+
+    for (n = 0; attrs && attrs[n]; n += 2)
+	;
+    if (n > 0) {
+	stanza->attrs = arena_alloc(arena, n * sizeof(char *));
+	if (!stanza->attrs) goto arena_error;
+	for (i = 0; i < n; i += 2) {
+	    stanza->attrs[i] = _stanza_arena_intern(ctx, arena, attrs[i]);
+	    stanza->attrs[i + 1] = _stanza_is_xmlns(attrs[i]) ?
+		_stanza_arena_intern(ctx, arena, attrs[i + 1]) :
+		arena_strdup(arena, attrs[i + 1]);
+	    if (!stanza->attrs[i] || !stanza->attrs[i + 1]) goto arena_error;
+	}
+	stanza->nattrs = n / 2;
+	stanza->attrs_size = n / 2;
+    }
+
+    return stanza;
+
+arena_error:
+    xmpp_stanza_release(stanza);
+    return NULL;
+}
+
+/** Create a text stanza object in an arena.
+ *  This is stanza_arena_tag() for text nodes.
+ *
+ *  @param ctx a Strophe context object
+ *  @param arena the arena
+ *  @param text a buffer with the text
+ *  @param len the length of the text
+ *
+ *  @return a stanza object or NULL on memory allocation failure
+ */
+xmpp_stanza_t *stanza_arena_text(xmpp_ctx_t * const ctx,
+				 arena_t * const arena,
+				 const char * const text, const size_t len)
+{
+    xmpp_stanza_t *stanza;
+
+    stanza = _stanza_arena_new(ctx, arena);
+    if (!stanza) return NULL;
+
+    stanza->type = XMPP_STANZA_TEXT;
+    stanza->data = arena_strndup(arena, text, len);
+    if (!stanza->data) {
+	xmpp_stanza_release(stanza);
+	return NULL;
+    }
+
+    return stanza;
+}
+
+/* the interned copy of a name, or a copy of its own if it can't be
+ * interned */
+static char *_stanza_intern(xmpp_ctx_t * const ctx, const char * const s)
+{
+    char *copy;
+
+    copy = intern_add(ctx->intern, s);
+    return copy ? copy : xmpp_strdup(ctx, s);
+}
+
+/* free a name unless it is interned */
+static void _stanza_free_name(xmpp_ctx_t * const ctx, char * const s)
+{
+    if (!intern_owns(ctx->intern, s)) xmpp_free(ctx, s);
+}
+
+/* free the data of a stanza unless it lives in the stanza's arena or
+ * is an interned name */
+static void _stanza_free_data(xmpp_stanza_t * const stanza)
+{
+    if (stanza->data && !stanza->arena_data) {
+	if (stanza->type == XMPP_STANZA_TAG)
+	    _stanza_free_name(stanza->ctx, stanza->data);
+	else
+	    xmpp_free(stanza->ctx, stanza->data);
+    }
+    stanza->data = NULL;
+    stanza->arena_data = 0;
+}
+
+/* copy the value of an attribute */
+static char *_stanza_copy_value(xmpp_ctx_t * const ctx,
+				const char * const key,
+				const char * const value)
+{
+    return _stanza_is_xmlns(key) ? _stanza_intern(ctx, value) :
+	xmpp_strdup(ctx, value);
+}
+
+/* free the value of an attribute */
+static void _stanza_free_value(xmpp_ctx_t * const ctx,
+			       const char * const key, char * const value)
+{
+    if (_stanza_is_xmlns(key)) _stanza_free_name(ctx, value);
+    else xmpp_free(ctx, value);
+}
+
+/* free attribute pairs which have memory of their own.  a pair may
+ * lack its value, or both its key and value */
+static void _stanza_free_pairs(xmpp_ctx_t * const ctx,
+			       char ** const attrs, const int nattrs)
+{
+    int i;
+
+    for (i = 0; i < nattrs && attrs[2 * i]; i++) {
+	if (attrs[2 * i + 1])
+	    _stanza_free_value(ctx, attrs[2 * i], attrs[2 * i + 1]);
+	_stanza_free_name(ctx, attrs[2 * i]);
+    }
+    xmpp_free(ctx, attrs);
+}
+
+/* copy attribute pairs to memory of their own */
+static char **_stanza_copy_attrs(xmpp_ctx_t * const ctx,
+				 char * const * const attrs, const int nattrs)
+{
+    char **copy;
+    int i;
+
+    copy = xmpp_alloc(ctx, 2 * nattrs * sizeof(char *));
+    if (!copy) return NULL;
+
+    for (i = 0; i < nattrs; i++) {
+	copy[2 * i] = _stanza_intern(ctx, attrs[2 * i]);
+	copy[2 * i + 1] = copy[2 * i] ?
+	    _stanza_copy_value(ctx, attrs[2 * i], attrs[2 * i + 1]) : NULL;
+	if (!copy[2 * i + 1]) {
+	    _stanza_free_pairs(ctx, copy, i + 1);
+	    return NULL;
+	}
+    }
+
+    return copy;
+}
+
+/* move the attributes of a stanza out of its arena, before they are
+ * changed */
+static int _stanza_own_attributes(xmpp_stanza_t * const stanza)
+{
+    char **attrs = NULL;
+
+    if (!stanza->arena_attrs) return XMPP_EOK;
+
+    if (stanza->nattrs) {
+	attrs = _stanza_copy_attrs(stanza->ctx, stanza->attrs,
+				   stanza->nattrs);
+	if (!attrs) return XMPP_EMEM;
+    }
+    stanza->attrs = attrs;
+    stanza->attrs_size = stanza->nattrs;
+    stanza->arena_attrs = 0;
+
+    return XMPP_EOK;
+}
+
+/* free the attributes of a stanza */
+static void _stanza_free_attrs(xmpp_stanza_t * const stanza)
+{
+    if (stanza->attr_index) hash_release(stanza->attr_index);
+    if (!stanza->arena_attrs && stanza->attrs)
+	_stanza_free_pairs(stanza->ctx, stanza->attrs, stanza->nattrs);
+}
+
+/* index the attributes of a stanza by their keys.  positions are
+ * stored plus one, so that they aren't NULL */
+static void _stanza_index_attrs(xmpp_stanza_t * const stanza)
+{
+    int i;
+
+    stanza->attr_index = hash_new(stanza->ctx, 4 * STANZA_ATTR_SCAN, NULL);
+    if (!stanza->attr_index) return;
+
+    for (i = 0; i < stanza->nattrs; i++) {
+	if (hash_add(stanza->attr_index, stanza->attrs[2 * i],
+		     (void *)(size_t)(i + 1))) {
+	    hash_release(stanza->attr_index);
+	    stanza->attr_index = NULL;
+	    return;
+	}
+    }
+}
+
+/* find the position of an attribute of a stanza, or -1 */
+static int _stanza_find_attr(xmpp_stanza_t * const stanza,
+			     const char * const name)
+{
+    void *pos;
+    int i;
+
+    if (stanza->nattrs > STANZA_ATTR_SCAN) {
+	if (!stanza->attr_index) _stanza_index_attrs(stanza);
+	/* without an index, scan */
+	if (stanza->attr_index) {
+	    pos = hash_get(stanza->attr_index, name);
+	    return pos ? (int)(size_t)pos - 1 : -1;
+	}
+    }
+
+    for (i = 0; i < stanza->nattrs; i++)
+	if (strcmp(stanza->attrs[2 * i], name) == 0) return i;
+
+    return -1;
+}
+
+/* look up an attribute of a tag stanza */
+static char *_stanza_attribute(xmpp_stanza_t * const stanza,
+			       const char * const name)
+{
+    int i;
+
+    i = _stanza_find_attr(stanza, name);
+
+    return i < 0 ? NULL : stanza->attrs[2 * i + 1];
+}
+
 /** Clone a stanza object.
  *  This function increments the reference count of the stanza object.
  *  
@@ -92,9 +396,6 @@ xmpp_stanza_t *xmpp_stanza_clone(xmpp_stanza_t * const stanza)
 xmpp_stanza_t *xmpp_stanza_copy(const xmpp_stanza_t * const stanza)
 {
     xmpp_stanza_t *copy, *child, *copychild, *tail;
-    hash_iterator_t *iter;
-    const char *key;
-    void *val;
 
     copy = xmpp_stanza_new(stanza->ctx);
     if (!copy) goto copy_error;
@@ -102,24 +403,18 @@ xmpp_stanza_t *xmpp_stanza_copy(const xmpp_stanza_t * const stanza)
     copy->type = stanza->type;
 
     if (stanza->data) {
-	copy->data = xmpp_strdup(stanza->ctx, stanza->data);
+	copy->data = stanza->type == XMPP_STANZA_TAG ?
+	    _stanza_intern(stanza->ctx, stanza->data) :
+	    xmpp_strdup(stanza->ctx, stanza->data);
 	if (!copy->data) goto copy_error;
     }
 
-    if (stanza->attributes) {
-	copy->attributes = hash_new(stanza->ctx, 8, xmpp_free);
-	if (!copy->attributes) goto copy_error;
-	iter = hash_iter_new(stanza->attributes);
-	if (!iter) { printf("DEBUG HERE\n"); goto copy_error; }
-	while ((key = hash_iter_next(iter))) {
-	    val = xmpp_strdup(stanza->ctx,
-			      (char *)hash_get(stanza->attributes, key));
-	    if (!val) goto copy_error;
-	    
-	    if (hash_add(copy->attributes, key, val))
-		goto copy_error;
-	}
-	hash_iter_release(iter);
+    if (stanza->nattrs) {
+	copy->attrs = _stanza_copy_attrs(stanza->ctx, stanza->attrs,
+					 stanza->nattrs);
+	if (!copy->attrs) goto copy_error;
+	copy->nattrs = stanza->nattrs;
+	copy->attrs_size = stanza->nattrs;
     }
 
     tail = copy->children;
@@ -171,9 +466,11 @@ int xmpp_stanza_release(xmpp_stanza_t * const stanza)
 	    xmpp_stanza_release(tchild);
 	}
 
-	if (stanza->attributes) hash_release(stanza->attributes);
-	if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
-	xmpp_free(stanza->ctx, stanza);
+	_stanza_free_attrs(stanza);
+	_stanza_free_data(stanza);
+	/* a node carved from an arena goes with the arena */
+	if (stanza->arena) arena_release(stanza->arena);
+	else xmpp_free(stanza->ctx, stanza);
 	released = 1;
     }
 
@@ -206,171 +503,155 @@ int xmpp_stanza_is_tag(xmpp_stanza_t * const stanza)
     return (stanza && stanza->type == XMPP_STANZA_TAG);
 }
 
-/* Escape a string with for use in a XML text node or attribute. Assumes that
- * the input string is encoded in UTF-8. On sucess, returns a pointer to a
- * buffer with the resulting data which must be xmpp_free()'d by the caller.
- * On failure, returns NULL.
- */
-
-static char *_escape_xml(xmpp_ctx_t * const ctx, char *text)
-{
-    size_t len = 0;
-    char *src;
-    char *dst;
-    char *buf;
-    for (src = text; *src != '\0'; src++) {
-        switch (*src) {
-            case '<':   /* "&lt;" */
-            case '>':   /* "&gt;" */
-                len += 4;
-                break;
-            case '&':   /* "&amp;" */
-                len += 5;
-                break;
-            case '"':
-                len += 6; /*"&quot;" */
-                break;
-            default:
-                len++;
-        }
-    }
-    if ((buf = xmpp_alloc(ctx, (len+1) * sizeof(char))) == NULL)
-        return NULL;    /* Error */
-    dst = buf;
-    for (src = text; *src != '\0'; src++) {
-        switch (*src) {
-            case '<':
-                strcpy(dst, "&lt;");
-                dst += 4;
-                break;
-            case '>':
-                strcpy(dst, "&gt;");
-                dst += 4;
-                break;
-            case '&':
-                strcpy(dst, "&amp;");
-                dst += 5;
-                break;
-            case '"':
-                strcpy(dst, "&quot;");
-                dst += 6;
-                break;
-            default:
-                *dst = *src;
-                dst++;
-        }
-    }
-    *dst = '\0';
-    return buf;
-}
-
-/* small helper function */
-static inline void _render_update(int *written, const int length,
-			   const int lastwrite,
-			   size_t *left, char **ptr)
-{
-    *written += lastwrite;
-
-    if (*written > length) {
-	*left = 0;
-	*ptr = NULL;
-    } else {
-	*left -= lastwrite;
-	*ptr = &(*ptr)[lastwrite];
-    }
-}
-
-/* always returns number of bytes written or that would have been
- * written if the buffer was large enough
- * return values < 0 indicate some error occured,
- * and return values > buflen indicate buffer was not large enough
- */
+/* append bytes to the render output, asking for more room as needed */
+static int _render_put(render_t * const render, const char *data,
+		       size_t len)
+{
+    size_t n;
+
+    while (len) {
+	if (render->len == render->size && render->next(render))
+	    return XMPP_EMEM;
+
+	n = render->size - render->len;
+	if (n > len) n = len;
+	memcpy(&render->buf[render->len], data, n);
+	render->len += n;
+	data += n;
+	len -= n;
+    }
+
+    return XMPP_EOK;
+}
+
+static int _render_str(render_t * const render, const char * const str)
+{
+    return _render_put(render, str, strlen(str));
+}
+
+/* append a string escaped for use in a XML text node or attribute.
+ * assumes that the string is encoded in UTF-8 */
+static int _render_escaped(render_t * const render, const char *text)
+{
+    const char *run, *entity;
+
+    for (run = text; *text != '\0'; text++) {
+	switch (*text) {
+	case '<':
+	    entity = "&lt;";
+	    break;
+	case '>':
+	    entity = "&gt;";
+	    break;
+	case '&':
+	    entity = "&amp;";
+	    break;
+	case '"':
+	    entity = "&quot;";
+	    break;
+	default:
+	    continue;
+	}
+	if (_render_put(render, run, text - run) ||
+	    _render_str(render, entity))
+	    return XMPP_EMEM;
+	run = text + 1;
+    }
+
+    return _render_put(render, run, text - run);
+}
+
+/* render a stanza and its children in a single pass.
+ * returns XMPP_EOK, or XMPP_EMEM or XMPP_EINVOP on failure */
 static int _render_stanza_recursive(xmpp_stanza_t *stanza,
-			     char * const buf, size_t const buflen)
+				    render_t * const render)
 {
-    char *ptr = buf;
-    size_t left = buflen;
-    int ret, written;
+    int ret;
     xmpp_stanza_t *child;
-    hash_iterator_t *iter;
-    const char *key;
-    char *tmp;
-
-    written = 0;
+    int i;
 
     if (stanza->type == XMPP_STANZA_UNKNOWN) return XMPP_EINVOP;
+    if (!stanza->data) return XMPP_EINVOP;
 
-    if (stanza->type == XMPP_STANZA_TEXT) {
-	if (!stanza->data) return XMPP_EINVOP;
-
-	tmp = _escape_xml(stanza->ctx, stanza->data);
-	if (tmp == NULL) return XMPP_EMEM;
-	ret = xmpp_snprintf(ptr, left, "%s", tmp);
-	xmpp_free(stanza->ctx, tmp);
-	if (ret < 0) return XMPP_EMEM;
-	_render_update(&written, buflen, ret, &left, &ptr);
-    } else { /* stanza->type == XMPP_STANZA_TAG */
-	if (!stanza->data) return XMPP_EINVOP;
-
-	/* write begining of tag and attributes */
-	ret = xmpp_snprintf(ptr, left, "<%s", stanza->data);
-	if (ret < 0) return XMPP_EMEM;
-	_render_update(&written, buflen, ret, &left, &ptr);
-
-	if (stanza->attributes && hash_num_keys(stanza->attributes) > 0) {
-	    iter = hash_iter_new(stanza->attributes);
-	    while ((key = hash_iter_next(iter))) {
-		tmp = _escape_xml(stanza->ctx,
-		    (char *)hash_get(stanza->attributes, key));
-		if (tmp == NULL) return XMPP_EMEM;
-		ret = xmpp_snprintf(ptr, left, " %s=\"%s\"", key, tmp);
-		xmpp_free(stanza->ctx, tmp);
-		if (ret < 0) return XMPP_EMEM;
-		_render_update(&written, buflen, ret, &left, &ptr);
-	    }
-	    hash_iter_release(iter);
-	}
+    if (stanza->type == XMPP_STANZA_TEXT)
+	return _render_escaped(render, stanza->data);
 
-	if (!stanza->children) {
-	    /* write end if singleton tag */
-	    ret = xmpp_snprintf(ptr, left, "/>");
-	    if (ret < 0) return XMPP_EMEM;
-	    _render_update(&written, buflen, ret, &left, &ptr);
-	} else {
-	    /* this stanza has child stanzas */
-
-	    /* write end of start tag */
-	    ret = xmpp_snprintf(ptr, left, ">");
-	    if (ret < 0) return XMPP_EMEM;
-	    _render_update(&written, buflen, ret, &left, &ptr);
-	    
-	    /* iterate and recurse over child stanzas */
-	    child = stanza->children;
-	    while (child) {
-		ret = _render_stanza_recursive(child, ptr, left);
-		if (ret < 0) return ret;
-
-		_render_update(&written, buflen, ret, &left, &ptr);
-
-		child = child->next;
-	    }
-
-	    /* write end tag */
-	    ret = xmpp_snprintf(ptr, left, "</%s>", stanza->data);
-	    if (ret < 0) return XMPP_EMEM;
-	    
-	    _render_update(&written, buflen, ret, &left, &ptr);
-	}
+    /* stanza->type == XMPP_STANZA_TAG */
+
+    /* write begining of tag and attributes */
+    if (_render_str(render, "<") || _render_str(render, stanza->data))
+	return XMPP_EMEM;
+
+    for (i = 0; i < stanza->nattrs; i++) {
+	if (_render_str(render, " ") ||
+	    _render_str(render, stanza->attrs[2 * i]) ||
+	    _render_str(render, "=\"") ||
+	    _render_escaped(render, stanza->attrs[2 * i + 1]) ||
+	    _render_str(render, "\""))
+	    return XMPP_EMEM;
     }
 
-    return written;
+    if (!stanza->children) {
+	/* write end if singleton tag */
+	return _render_str(render, "/>");
+    }
+
+    /* this stanza has child stanzas */
+
+    /* write end of start tag */
+    if (_render_str(render, ">")) return XMPP_EMEM;
+
+    /* iterate and recurse over child stanzas */
+    for (child = stanza->children; child; child = child->next) {
+	ret = _render_stanza_recursive(child, render);
+	if (ret != XMPP_EOK) return ret;
+    }
+
+    /* write end tag */
+    if (_render_str(render, "</") || _render_str(render, stanza->data) ||
+	_render_str(render, ">"))
+	return XMPP_EMEM;
+
+    return XMPP_EOK;
+}
+
+/** Render a stanza object into caller-provided buffers.
+ *  The stanza and its children are rendered in a single pass.  Whenever
+ *  the current buffer fills up, the render object's next function is
+ *  called for more room, so the text may end up in one buffer that
+ *  grows or spread over a chain of buffers.  The text is not
+ *  null-terminated.
+ *
+ *  @param stanza a Strophe stanza object
+ *  @param render the output buffer state
+ *
+ *  @return 0 on success (XMPP_EOK), and a number less than 0 on failure
+ *      (XMPP_EMEM, XMPP_EINVOP)
+ */
+int stanza_render(xmpp_stanza_t * const stanza, render_t * const render)
+{
+    return _render_stanza_recursive(stanza, render);
+}
+
+/* make room in a flat render buffer by doubling its size */
+static int _render_grow(render_t * const render)
+{
+    xmpp_ctx_t *ctx = (xmpp_ctx_t *)render->userdata;
+    char *tmp;
+
+    tmp = xmpp_realloc(ctx, render->buf, render->size * 2);
+    if (!tmp) return XMPP_EMEM;
+    render->buf = tmp;
+    render->size *= 2;
+
+    return XMPP_EOK;
 }
 
 /** Render a stanza object to text.
  *  This function renders a given stanza object, along with its
  *  children, to text.  The text is returned in an allocated,
  *  null-terminated buffer.  It starts by allocating a 1024 byte buffer
- *  and reallocates more memory if that is not large enough.
+ *  and grows it as the stanza is rendered if that is not large enough.
  *
  *  @param stanza a Strophe stanza object
  *  @param buf a reference to a string pointer
@@ -385,41 +666,76 @@ int  xmpp_stanza_to_text(xmpp_stanza_t *stanza,
 			 char ** const buf,
 			 size_t * const buflen)
 {
-    char *buffer, *tmp;
-    size_t length;
+    render_t render;
     int ret;
 
-    /* allocate a default sized buffer and attempt to render */
-    length = 1024;
-    buffer = xmpp_alloc(stanza->ctx, length);
-    if (!buffer) {
-	*buf = NULL;
-	*buflen = 0;
-	return XMPP_EMEM;
+    *buf = NULL;
+    *buflen = 0;
+
+    /* allocate a default sized buffer and render */
+    render.size = 1024;
+    render.buf = xmpp_alloc(stanza->ctx, render.size);
+    if (!render.buf) return XMPP_EMEM;
+    render.len = 0;
+    render.next = _render_grow;
+    render.userdata = stanza->ctx;
+
+    ret = _render_stanza_recursive(stanza, &render);
+    if (ret == XMPP_EOK)
+	ret = _render_put(&render, "", 1);
+    if (ret != XMPP_EOK) {
+	xmpp_free(stanza->ctx, render.buf);
+	return ret;
     }
 
-    ret = _render_stanza_recursive(stanza, buffer, length);
-    if (ret < 0) return ret;
+    *buf = render.buf;
+    *buflen = render.len - 1;
 
-    if (ret > length - 1) {
-	tmp = xmpp_realloc(stanza->ctx, buffer, ret + 1);
-	if (!tmp) {
-	    xmpp_free(stanza->ctx, buffer);
-	    *buf = NULL;
-	    *buflen = 0;
-	    return XMPP_EMEM;
-	}
-	length = ret + 1;
-	buffer = tmp;
+    return XMPP_EOK;
+}
 
-	ret = _render_stanza_recursive(stanza, buffer, length);
-	if (ret > length - 1) return XMPP_EMEM;
+/** Render stanzas back to back into one buffer.
+ *  The buffer grows as needed, so the stanzas end up in one piece of
+ *  memory however many there are.
+ *
+ *  @param ctx the Strophe context object to allocate the buffer with
+ *  @param stanzas an array of stanza objects
+ *  @param count the number of stanzas in the array
+ *  @param buf a reference to a string pointer
+ *  @param ends an array of count sizes, set to where each stanza ends
+ *      in the buffer
+ *
+ *  @return 0 on success (XMPP_EOK), and a number less than 0 on failure
+ *      (XMPP_EMEM, XMPP_EINVOP)
+ */
+int stanza_render_all(xmpp_ctx_t * const ctx,
+		      xmpp_stanza_t * const * const stanzas,
+		      const size_t count, char ** const buf,
+		      size_t * const ends)
+{
+    render_t render;
+    size_t i;
+    int ret = XMPP_EOK;
+
+    *buf = NULL;
+
+    render.size = 1024;
+    render.buf = xmpp_alloc(ctx, render.size);
+    if (!render.buf) return XMPP_EMEM;
+    render.len = 0;
+    render.next = _render_grow;
+    render.userdata = ctx;
+
+    for (i = 0; i < count && ret == XMPP_EOK; i++) {
+	ret = _render_stanza_recursive(stanzas[i], &render);
+	ends[i] = render.len;
+    }
+    if (ret != XMPP_EOK) {
+	xmpp_free(ctx, render.buf);
+	return ret;
     }
-    
-    buffer[length - 1] = 0;
 
-    *buf = buffer;
-    *buflen = ret;
+    *buf = render.buf;
 
     return XMPP_EOK;
 }
@@ -439,10 +755,11 @@ int xmpp_stanza_set_name(xmpp_stanza_t *stanza,
 {
     if (stanza->type == XMPP_STANZA_TEXT) return XMPP_EINVOP;
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
+    _stanza_free_data(stanza);
 
     stanza->type = XMPP_STANZA_TAG;
-    stanza->data = xmpp_strdup(stanza->ctx, name);
+    stanza->data = _stanza_intern(stanza->ctx, name);
+    if (!stanza->data) return XMPP_EMEM;
 
     return XMPP_EOK;
 }
@@ -473,17 +790,14 @@ char *xmpp_stanza_get_name(xmpp_stanza_t * const stanza)
  */
 int xmpp_stanza_get_attribute_count(xmpp_stanza_t * const stanza)
 {
-    if (stanza->attributes == NULL) {
-	return 0;
-    }
-
-    return hash_num_keys(stanza->attributes);
+    return stanza->nattrs;
 }
 
 /** Get all attributes for a stanza object.
  *  This function populates the array with attributes from the stanza.  The
  *  attr array will be in the format:  attr[i] = attribute name, 
- *  attr[i+1] = attribute value.
+ *  attr[i+1] = attribute value.  Attributes are in the order they were
+ *  first set, which for parsed stanzas is the order of the XML.
  *
  *  @param stanza a Strophe stanza object
  *  @param attr the string array to populate
@@ -497,31 +811,11 @@ int xmpp_stanza_get_attribute_count(xmpp_stanza_t * const stanza)
 int xmpp_stanza_get_attributes(xmpp_stanza_t * const stanza,
 			       const char **attr, int attrlen)
 {
-    hash_iterator_t *iter;
-    const char *key;
-    int num = 0;
+    int num;
 
-    if (stanza->attributes == NULL) {
-	return 0;
-    }
+    for (num = 0; num < 2 * stanza->nattrs && num < attrlen; num++)
+	attr[num] = stanza->attrs[num];
 
-    iter = hash_iter_new(stanza->attributes);
-    while ((key = hash_iter_next(iter)) != NULL && attrlen) {
-	attr[num++] = key;
-	attrlen--;
-	if (attrlen == 0) {
-	    hash_iter_release(iter);
-	    return num;
-	}
-	attr[num++] = hash_get(stanza->attributes, key);
-	attrlen--;
-	if (attrlen == 0) {
-	    hash_iter_release(iter);
-	    return num;
-	}
-    }
-
-    hash_iter_release(iter);
     return num;
 }
 
@@ -539,19 +833,90 @@ int xmpp_stanza_set_attribute(xmpp_stanza_t * const stanza,
 			      const char * const key,
 			      const char * const value)
 {
-    char *val;
+    char **attrs, *name, *val;
+    int i, size;
 
     if (stanza->type != XMPP_STANZA_TAG) return XMPP_EINVOP;
 
-    if (!stanza->attributes) {
-	stanza->attributes = hash_new(stanza->ctx, 8, xmpp_free);
-	if (!stanza->attributes) return XMPP_EMEM;
-    }
+    if (_stanza_own_attributes(stanza) != XMPP_EOK) return XMPP_EMEM;
 
-    val = xmpp_strdup(stanza->ctx, value);
+    val = _stanza_copy_value(stanza->ctx, key, value);
     if (!val) return XMPP_EMEM;
 
-    hash_add(stanza->attributes, key, val);
+    /* replace the value of an attribute which is already set */
+    i = _stanza_find_attr(stanza, key);
+    if (i >= 0) {
+	_stanza_free_value(stanza->ctx, key, stanza->attrs[2 * i + 1]);
+	stanza->attrs[2 * i + 1] = val;
+	return XMPP_EOK;
+    }
+
+    if (stanza->nattrs == stanza->attrs_size) {
+	size = stanza->attrs_size ? 2 * stanza->attrs_size : STANZA_ATTR_MIN;
+	attrs = xmpp_realloc(stanza->ctx, stanza->attrs,
+			     2 * size * sizeof(char *));
+	if (!attrs) {
+	    _stanza_free_value(stanza->ctx, key, val);
+	    return XMPP_EMEM;
+	}
+	stanza->attrs = attrs;
+	stanza->attrs_size = size;
+    }
+
+    name = _stanza_intern(stanza->ctx, key);
+    if (!name) {
+	_stanza_free_value(stanza->ctx, key, val);
+	return XMPP_EMEM;
+    }
+
+    i = stanza->nattrs++;
+    stanza->attrs[2 * i] = name;
+    stanza->attrs[2 * i + 1] = val;
+
+    /* keep the index up to date, or have it rebuilt */
+    if (stanza->attr_index &&
+	hash_add(stanza->attr_index, name, (void *)(size_t)(i + 1))) {
+	hash_release(stanza->attr_index);
+	stanza->attr_index = NULL;
+    }
+
+    return XMPP_EOK;
+}
+
+/** Delete an attribute from a stanza object.
+ *  The attributes set after it keep their order.
+ *
+ *  @param stanza a Strophe stanza object
+ *  @param key a string with the attribute name
+ *
+ *  @return XMPP_EOK (0) on success or a number less than 0 on failure
+ *
+ *  @ingroup Stanza
+ */
+int xmpp_stanza_del_attribute(xmpp_stanza_t * const stanza,
+			      const char * const key)
+{
+    int i;
+
+    if (stanza->type != XMPP_STANZA_TAG) return XMPP_EINVOP;
+
+    i = _stanza_find_attr(stanza, key);
+    if (i < 0) return XMPP_EOK;
+
+    if (_stanza_own_attributes(stanza) != XMPP_EOK) return XMPP_EMEM;
+
+    _stanza_free_value(stanza->ctx, stanza->attrs[2 * i],
+		       stanza->attrs[2 * i + 1]);
+    _stanza_free_name(stanza->ctx, stanza->attrs[2 * i]);
+    memmove(&stanza->attrs[2 * i], &stanza->attrs[2 * i + 2],
+	    2 * (stanza->nattrs - i - 1) * sizeof(char *));
+    stanza->nattrs--;
+
+    /* the positions of the later attributes moved */
+    if (stanza->attr_index) {
+	hash_release(stanza->attr_index);
+	stanza->attr_index = NULL;
+    }
 
     return XMPP_EOK;
 }
@@ -625,7 +990,7 @@ int xmpp_stanza_set_text(xmpp_stanza_t *stanza,
     
     stanza->type = XMPP_STANZA_TEXT;
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
+    _stanza_free_data(stanza);
     stanza->data = xmpp_strdup(stanza->ctx, text);
 
     return XMPP_EOK;
@@ -653,7 +1018,7 @@ int xmpp_stanza_set_text_with_size(xmpp_stanza_t *stanza,
 
     stanza->type = XMPP_STANZA_TEXT;
 
-    if (stanza->data) xmpp_free(stanza->ctx, stanza->data);
+    _stanza_free_data(stanza);
     stanza->data = xmpp_alloc(stanza->ctx, size + 1);
     if (!stanza->data) return XMPP_EMEM;
 
@@ -678,10 +1043,7 @@ char *xmpp_stanza_get_id(xmpp_stanza_t * const stanza)
     if (stanza->type != XMPP_STANZA_TAG)
 	return NULL;
 
-    if (!stanza->attributes)
-	return NULL;
-
-    return (char *)hash_get(stanza->attributes, "id");
+    return _stanza_attribute(stanza, "id");
 }
 
 /** Get the namespace attribute of the stanza object.
@@ -699,10 +1061,7 @@ char *xmpp_stanza_get_ns(xmpp_stanza_t * const stanza)
     if (stanza->type != XMPP_STANZA_TAG)
 	return NULL;
 
-    if (!stanza->attributes)
-	return NULL;
-
-    return (char *)hash_get(stanza->attributes, "xmlns");
+    return _stanza_attribute(stanza, "xmlns");
 }
 
 /** Get the 'type' attribute of the stanza object.
@@ -720,10 +1079,7 @@ char *xmpp_stanza_get_type(xmpp_stanza_t * const stanza)
     if (stanza->type != XMPP_STANZA_TAG)
 	return NULL;
     
-    if (!stanza->attributes)
-	return NULL;
-
-    return (char *)hash_get(stanza->attributes, "type");
+    return _stanza_attribute(stanza, "type");
 }
 
 /** Get the first child of stanza with name.
@@ -741,10 +1097,15 @@ xmpp_stanza_t *xmpp_stanza_get_child_by_name(xmpp_stanza_t * const stanza,
 					     const char * const name)
 {
     xmpp_stanza_t *child;
-    
+    char *interned;
+
+    /* names equal to an interned one are the same pointer */
+    interned = intern_get(stanza->ctx->intern, name);
+
     for (child = stanza->children; child; child = child->next) {
 	if (child->type == XMPP_STANZA_TAG &&
-	    (strcmp(name, xmpp_stanza_get_name(child)) == 0))
+	    (interned ? child->data == interned :
+	     strcmp(name, child->data) == 0))
 	    break;
     }
 
@@ -767,16 +1128,42 @@ xmpp_stanza_t *xmpp_stanza_get_child_by_ns(xmpp_stanza_t * const stanza,
 					   const char * const ns)
 {
     xmpp_stanza_t *child;
+    char *interned, *child_ns;
+
+    interned = intern_get(stanza->ctx->intern, ns);
+    if (interned) return stanza_get_child_by_interned_ns(stanza, interned);
 
     for (child = stanza->children; child; child = child->next) {
-	if (xmpp_stanza_get_ns(child) &&
-	    strcmp(ns, xmpp_stanza_get_ns(child)) == 0)
+	child_ns = xmpp_stanza_get_ns(child);
+	if (child_ns && strcmp(ns, child_ns) == 0)
 	    break;
     }
     
     return child;
 }
 
+/** Get the first child of a stanza with a given interned namespace.
+ *  This is xmpp_stanza_get_child_by_ns() for a namespace known to be
+ *  interned, which is matched by comparing pointers.
+ *
+ *  @param stanza a Strophe stanza object
+ *  @param ns the interned copy of the namespace to match
+ *
+ *  @return the matching child stanza object or NULL if no match was found
+ */
+xmpp_stanza_t *stanza_get_child_by_interned_ns(xmpp_stanza_t * const stanza,
+					       const char * const ns)
+{
+    xmpp_stanza_t *child;
+
+    for (child = stanza->children; child; child = child->next) {
+	if (xmpp_stanza_get_ns(child) == ns)
+	    break;
+    }
+
+    return child;
+}
+
 /** Get the list of children.
  *  This function returns the first child of the stanza object.  The rest
  *  of the children can be obtained by calling xmpp_stanza_get_next() to
@@ -925,8 +1312,5 @@ char *xmpp_stanza_get_attribute(xmpp_stanza_t * const stanza,
     if (stanza->type != XMPP_STANZA_TAG)
 	return NULL;
     
-    if (!stanza->attributes)
-	return NULL;
-
-    return hash_get(stanza->attributes, name);
+    return _stanza_attribute(stanza, name);
 }
@@ -24,6 +24,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <sys/time.h>
 #endif
 
 #include "strophe.h"
@@ -40,6 +41,30 @@ struct _mutex_t {
 #endif
 };
 
+struct _thread_t {
+    const xmpp_ctx_t *ctx;
+    thread_func_t func;
+    void *arg;
+
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+struct _signal_t {
+    const xmpp_ctx_t *ctx;
+
+#ifdef _WIN32
+    HANDLE event;
+#else
+    volatile int pending;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
 /* mutex functions */
 
 mutex_t *mutex_create(const xmpp_ctx_t * ctx)
@@ -77,8 +102,10 @@ int mutex_destroy(mutex_t *mutex)
     if (mutex->mutex)
 	ret = CloseHandle(mutex->mutex);
 #else
-    if (mutex->mutex)
+    if (mutex->mutex) {
 	ret = pthread_mutex_destroy(mutex->mutex) == 0;
+	xmpp_free(mutex->ctx, mutex->mutex);
+    }
 #endif
     ctx = mutex->ctx;
     xmpp_free(ctx, mutex);
@@ -117,3 +144,206 @@ int mutex_unlock(mutex_t *mutex)
 
     return ret;
 }
+
+/* thread functions */
+
+#ifdef _WIN32
+static DWORD WINAPI _thread_main(LPVOID arg)
+#else
+static void *_thread_main(void *arg)
+#endif
+{
+    thread_t *thread = (thread_t *)arg;
+
+    thread->func(thread->arg);
+
+    return 0;
+}
+
+thread_t *thread_create(const xmpp_ctx_t *ctx, thread_func_t func,
+			void *arg)
+{
+    thread_t *thread;
+
+    thread = xmpp_alloc(ctx, sizeof(thread_t));
+    if (thread) {
+	thread->ctx = ctx;
+	thread->func = func;
+	thread->arg = arg;
+#ifdef _WIN32
+	thread->thread = CreateThread(NULL, 0, _thread_main, thread, 0, NULL);
+	if (!thread->thread) {
+#else
+	if (pthread_create(&thread->thread, NULL, _thread_main, thread) != 0) {
+#endif
+	    xmpp_free(ctx, thread);
+	    thread = NULL;
+	}
+    }
+
+    return thread;
+}
+
+/* wait for a thread to finish and release it */
+int thread_join(thread_t *thread)
+{
+    int ret;
+    const xmpp_ctx_t *ctx;
+
+#ifdef _WIN32
+    ret = WaitForSingleObject(thread->thread, INFINITE) == 0;
+    CloseHandle(thread->thread);
+#else
+    ret = pthread_join(thread->thread, NULL) == 0;
+#endif
+    ctx = thread->ctx;
+    xmpp_free(ctx, thread);
+
+    return ret;
+}
+
+/* signal functions */
+
+signal_t *signal_create(const xmpp_ctx_t *ctx)
+{
+    signal_t *signal;
+
+    signal = xmpp_alloc(ctx, sizeof(signal_t));
+    if (!signal) return NULL;
+
+    signal->ctx = ctx;
+#ifdef _WIN32
+    signal->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!signal->event) {
+	xmpp_free(ctx, signal);
+	return NULL;
+    }
+#else
+    signal->pending = 0;
+    if (pthread_mutex_init(&signal->mutex, NULL) != 0) {
+	xmpp_free(ctx, signal);
+	return NULL;
+    }
+    if (pthread_cond_init(&signal->cond, NULL) != 0) {
+	pthread_mutex_destroy(&signal->mutex);
+	xmpp_free(ctx, signal);
+	return NULL;
+    }
+#endif
+
+    return signal;
+}
+
+void signal_destroy(signal_t *signal)
+{
+#ifdef _WIN32
+    CloseHandle(signal->event);
+#else
+    pthread_cond_destroy(&signal->cond);
+    pthread_mutex_destroy(&signal->mutex);
+#endif
+    xmpp_free(signal->ctx, signal);
+}
+
+/* wake up the thread waiting on a signal, or make its next wait return
+ * at once */
+void signal_post(signal_t *signal)
+{
+#ifdef _WIN32
+    SetEvent(signal->event);
+#else
+    atomic_swap_int(&signal->pending, 1);
+    /* the waiter holds the mutex only while checking for a pending post,
+     * so skipping the wakeup then costs at most a timeout */
+    if (pthread_mutex_trylock(&signal->mutex) == 0) {
+	pthread_cond_signal(&signal->cond);
+	pthread_mutex_unlock(&signal->mutex);
+    }
+#endif
+}
+
+/* wait for a post or until timeout milliseconds have passed */
+void signal_wait(signal_t *signal, unsigned long timeout)
+{
+#ifdef _WIN32
+    WaitForSingleObject(signal->event, timeout);
+#else
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + timeout / 1000;
+    until.tv_nsec = (now.tv_usec + (timeout % 1000) * 1000) * 1000;
+    if (until.tv_nsec >= 1000000000) {
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&signal->mutex);
+    if (!atomic_get_int(&signal->pending))
+	pthread_cond_timedwait(&signal->cond, &signal->mutex, &until);
+    atomic_swap_int(&signal->pending, 0);
+    pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+/* atomic operations */
+
+void *atomic_swap_ptr(void * volatile *ptr, void *value)
+{
+#ifdef _WIN32
+    return InterlockedExchangePointer(ptr, value);
+#else
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void *atomic_get_ptr(void * volatile *ptr)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchangePointer(ptr, NULL, NULL);
+#else
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int atomic_swap_int(volatile int *ptr, int value)
+{
+#ifdef _WIN32
+    return (int)InterlockedExchange((volatile LONG *)ptr, value);
+#else
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* add to an integer, returns the new value */
+int atomic_add_int(volatile int *ptr, int value)
+{
+#ifdef _WIN32
+    return (int)InterlockedExchangeAdd((volatile LONG *)ptr, value) + value;
+#else
+    return __atomic_add_fetch(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int atomic_get_int(volatile int *ptr)
+{
+#ifdef _WIN32
+    return (int)InterlockedCompareExchange((volatile LONG *)ptr, 0, 0);
+#else
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* replace an integer if it holds the expected value, returns true if it
+ * did */
+int atomic_cas_int(volatile int *ptr, int expected, int value)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange((volatile LONG *)ptr, value,
+				      expected) == expected;
+#else
+    return __atomic_compare_exchange_n(ptr, &expected, value, 0,
+				       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
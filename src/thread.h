@@ -31,6 +31,9 @@
 #include "strophe.h"
 
 typedef struct _mutex_t mutex_t;
+typedef struct _thread_t thread_t;
+typedef struct _signal_t signal_t;
+typedef void (*thread_func_t)(void *arg);
 
 /* mutex functions */
 
@@ -40,4 +43,27 @@ int mutex_lock(mutex_t *mutex);
 int mutex_trylock(mutex_t *mutex);
 int mutex_unlock(mutex_t *mutex);
 
+/* thread functions */
+
+thread_t *thread_create(const xmpp_ctx_t *ctx, thread_func_t func,
+			void *arg);
+int thread_join(thread_t *thread);
+
+/* wakeup signals.  posting never blocks, and a wait may occasionally
+ * miss a post and sleep until its timeout */
+
+signal_t *signal_create(const xmpp_ctx_t *ctx);
+void signal_destroy(signal_t *signal);
+void signal_post(signal_t *signal);
+void signal_wait(signal_t *signal, unsigned long timeout);
+
+/* atomic operations, all with full memory barriers */
+
+void *atomic_swap_ptr(void * volatile *ptr, void *value);
+void *atomic_get_ptr(void * volatile *ptr);
+int atomic_swap_int(volatile int *ptr, int value);
+int atomic_add_int(volatile int *ptr, int value);
+int atomic_get_int(volatile int *ptr);
+int atomic_cas_int(volatile int *ptr, int expected, int value);
+
 #endif /* __LIBSTROPHE_THREAD_H__ */
@@ -68,7 +68,8 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
 	tls->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
 
 	SSL_CTX_set_client_cert_cb(tls->ssl_ctx, NULL);
-	SSL_CTX_set_mode (tls->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+	SSL_CTX_set_mode (tls->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	SSL_CTX_set_verify (tls->ssl_ctx, SSL_VERIFY_NONE, NULL);
 
 	tls->ssl = SSL_new(tls->ssl_ctx);
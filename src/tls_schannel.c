@@ -75,11 +75,11 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
     SecPkgCred_CipherStrengths spc_cs;
     SecPkgCred_SupportedProtocols spc_sp;
 
-    OSVERSIONINFO osvi;
-
-    memset(&osvi, 0, sizeof(osvi));
-    osvi.dwOSVersionInfoSize = sizeof(osvi);
-
+    OSVERSIONINFO osvi;
+
+    memset(&osvi, 0, sizeof(osvi));
+    osvi.dwOSVersionInfoSize = sizeof(osvi);
+
     GetVersionEx(&osvi);
 
     /* no TLS support on win9x/me, despite what anyone says */
@@ -157,26 +157,26 @@ tls_t *tls_new(xmpp_ctx_t *ctx, sock_t sock)
 
     /* This bunch of queries should trip up wine until someone fixes
      * schannel support there */
-    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_SUPPORTED_ALGS, &spc_sa);
-    if (ret != SEC_E_OK)
-    {
-	tls_free(tls);
-	return NULL;
-    }
-
-    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_CIPHER_STRENGTHS, &spc_cs);
-    if (ret != SEC_E_OK)
-    {
-	tls_free(tls);
-	return NULL;
-    }
-
-    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_SUPPORTED_PROTOCOLS, &spc_sp);
-    if (ret != SEC_E_OK)
-    {
-	tls_free(tls);
-	return NULL;
-    }
+    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_SUPPORTED_ALGS, &spc_sa);
+    if (ret != SEC_E_OK)
+    {
+	tls_free(tls);
+	return NULL;
+    }
+
+    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_CIPHER_STRENGTHS, &spc_cs);
+    if (ret != SEC_E_OK)
+    {
+	tls_free(tls);
+	return NULL;
+    }
+
+    ret = tls->sft->QueryCredentialsAttributes(&(tls->hcred), SECPKG_ATTR_SUPPORTED_PROTOCOLS, &spc_sp);
+    if (ret != SEC_E_OK)
+    {
+	tls_free(tls);
+	return NULL;
+    }
 
     return tls;
 }
@@ -227,16 +227,23 @@ int tls_start(tls_t *tls)
     /* search the ctx's conns for our sock, and use the domain there as our
      * name */
     {
-	xmpp_connlist_t *listentry = tls->ctx->connlist;
+	xmpp_connlist_t *listentry;
+	int i;
 
-	while (listentry) {
-	    xmpp_conn_t *conn = listentry->conn;
+	for (i = 0; i < tls->ctx->nloops && !name; i++) {
+	    xmpp_connlist_t *head = &tls->ctx->loops[i].connlist;
 
-	    if (conn->sock == tls->sock) {
-		name = strdup(conn->domain);
-		listentry = NULL;
-	    } else {
-		listentry = listentry->next;
+	    listentry = head->next;
+
+	    while (listentry != head) {
+		xmpp_conn_t *conn = listentry->conn;
+
+		if (conn->sock == tls->sock) {
+		    name = strdup(conn->domain);
+		    listentry = head;
+		} else {
+		    listentry = listentry->next;
+		}
 	    }
 	}
     }
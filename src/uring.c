@@ -0,0 +1,332 @@
+/* uring.c
+** strophe XMPP client library -- io_uring abstraction
+**
+** Copyright (C) 2005-2009 Collecta, Inc. 
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  io_uring abstraction.
+ *
+ *  A minimal wrapper around the io_uring system calls, so that the
+ *  event loop can batch socket reads and writes without depending on
+ *  an external library.  Only the pieces the event loop needs are
+ *  implemented.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "uring.h"
+
+struct _uring_t {
+    xmpp_ctx_t *ctx;
+    int fd;
+
+    /* mapped rings */
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    /* submission ring */
+    unsigned int *sq_khead;
+    unsigned int *sq_ktail;
+    unsigned int *sq_mask;
+    unsigned int *sq_entries;
+    unsigned int *sq_array;
+    unsigned int sqe_head; /* first sqe not yet published */
+    unsigned int sqe_tail; /* next free sqe */
+
+    /* completion ring */
+    unsigned int *cq_khead;
+    unsigned int *cq_ktail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* supported opcodes */
+    unsigned char ops[IORING_OP_LAST];
+};
+
+static int _setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		  unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static int _register(int fd, unsigned int opcode, void *arg,
+		     unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void _probe(uring_t *ring)
+{
+    struct io_uring_probe *probe;
+    size_t len;
+    int i;
+
+    len = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    probe = xmpp_alloc(ring->ctx, len);
+    if (!probe) return;
+    memset(probe, 0, len);
+
+    if (_register(ring->fd, IORING_REGISTER_PROBE, probe,
+		  IORING_OP_LAST) == 0) {
+	for (i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+	    if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+		ring->ops[probe->ops[i].op] = 1;
+    }
+
+    xmpp_free(ring->ctx, probe);
+}
+
+/** Create a new io_uring instance.
+ *
+ *  @param ctx a Strophe context object
+ *  @param entries the number of submission queue entries
+ *
+ *  @return a new ring or NULL if io_uring is unavailable
+ */
+uring_t *uring_new(xmpp_ctx_t * const ctx, const unsigned int entries)
+{
+    uring_t *ring;
+    struct io_uring_params p;
+
+    ring = xmpp_alloc(ctx, sizeof(uring_t));
+    if (!ring) return NULL;
+    memset(ring, 0, sizeof(uring_t));
+    ring->ctx = ctx;
+    ring->sq_ptr = MAP_FAILED;
+    ring->cq_ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = _setup(entries, &p);
+    if (ring->fd < 0) {
+	xmpp_free(ctx, ring);
+	return NULL;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+	ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) goto error;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ptr = ring->sq_ptr;
+    else {
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED) goto error;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto error;
+
+    ring->sq_khead = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_ktail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned int *)((char *)ring->sq_ptr +
+					p.sq_off.ring_entries);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+
+    ring->cq_khead = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_ktail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    _probe(ring);
+
+    return ring;
+
+error:
+    uring_free(ring);
+    return NULL;
+}
+
+/** Destroy an io_uring instance.
+ *  Any operations still in flight are cancelled by the kernel.
+ *
+ *  @param ring a ring created with uring_new()
+ */
+void uring_free(uring_t *ring)
+{
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+	munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    xmpp_free(ring->ctx, ring);
+}
+
+/** Check whether the running kernel supports an io_uring operation.
+ *
+ *  @param ring an io_uring instance
+ *  @param op an IORING_OP_* opcode
+ *
+ *  @return TRUE if the operation is supported
+ */
+int uring_op_supported(uring_t *ring, const int op)
+{
+    return op >= 0 && op < IORING_OP_LAST && ring->ops[op];
+}
+
+/** Get a submission queue entry.
+ *  The entry is cleared and will be submitted by the next call to
+ *  uring_enter().  If the submission queue is full, the queued entries
+ *  are submitted first.
+ *
+ *  @param ring an io_uring instance
+ *
+ *  @return a submission queue entry or NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head;
+
+    head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= *ring->sq_entries) {
+	if (uring_enter(ring, 0) < 0) return NULL;
+	head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= *ring->sq_entries) return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/** Get the number of submission queue entries waiting to be submitted.
+ *
+ *  @param ring an io_uring instance
+ *
+ *  @return the number of queued entries
+ */
+unsigned int uring_sq_ready(uring_t *ring)
+{
+    return ring->sqe_tail - ring->sqe_head;
+}
+
+/** Get the position of the last submission queue entry obtained.
+ *
+ *  @param ring an io_uring instance
+ *
+ *  @return a position to pass to uring_sqe_taken()
+ */
+unsigned int uring_sqe_pos(uring_t *ring)
+{
+    return ring->sqe_tail - 1;
+}
+
+/** Check whether the kernel took an entry off the submission queue.
+ *  Entries are kept until an io_uring_enter call succeeds, which may
+ *  happen in a later call to uring_enter() or uring_get_sqe().
+ *
+ *  @param ring an io_uring instance
+ *  @param pos the entry's position from uring_sqe_pos()
+ *
+ *  @return TRUE if the entry was submitted, FALSE otherwise
+ */
+int uring_sqe_taken(uring_t *ring, const unsigned int pos)
+{
+    return (int)(__atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) - pos) > 0;
+}
+
+/** Submit queued entries and wait for completions.
+ *  This publishes every entry obtained from uring_get_sqe() and makes a
+ *  single io_uring_enter system call.
+ *
+ *  @param ring an io_uring instance
+ *  @param min_complete the number of completions to wait for
+ *
+ *  @return the number of entries submitted or -1 on error
+ */
+int uring_enter(uring_t *ring, const unsigned int min_complete)
+{
+    unsigned int tail, to_submit;
+    int ret;
+
+    tail = *ring->sq_ktail;
+    while (ring->sqe_head != ring->sqe_tail) {
+	ring->sq_array[tail & *ring->sq_mask] =
+	    ring->sqe_head & *ring->sq_mask;
+	tail++;
+	ring->sqe_head++;
+    }
+    __atomic_store_n(ring->sq_ktail, tail, __ATOMIC_RELEASE);
+
+    /* include entries published earlier but not yet consumed, in case a
+     * previous call failed */
+    to_submit = tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (to_submit == 0 && min_complete == 0) return 0;
+
+    do {
+	ret = _enter(ring->fd, to_submit, min_complete,
+		     min_complete ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR && min_complete == 0);
+
+    return ret;
+}
+
+/** Get the next completion queue entry.
+ *  The entry remains valid until uring_cqe_seen() is called.
+ *
+ *  @param ring an io_uring instance
+ *
+ *  @return a completion queue entry or NULL if none are available
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+    unsigned int head;
+
+    head = *ring->cq_khead;
+    if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE))
+	return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/** Mark the current completion queue entry as consumed.
+ *
+ *  @param ring an io_uring instance
+ */
+void uring_cqe_seen(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,48 @@
+/* uring.h
+** strophe XMPP client library -- io_uring abstraction header
+**
+** Copyright (C) 2005-2009 Collecta, Inc. 
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  io_uring submission and completion ring API.
+ */
+
+#ifndef __LIBSTROPHE_URING_H__
+#define __LIBSTROPHE_URING_H__
+
+#include <linux/io_uring.h>
+
+#include "strophe.h"
+
+typedef struct _uring_t uring_t;
+
+uring_t *uring_new(xmpp_ctx_t * const ctx, const unsigned int entries);
+void uring_free(uring_t *ring);
+
+/* check that the kernel implements an opcode */
+int uring_op_supported(uring_t *ring, const int op);
+
+/* get a cleared sqe, submitting queued ones if the ring is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+/* submit all queued sqes and wait for min_complete completions */
+int uring_enter(uring_t *ring, const unsigned int min_complete);
+/* number of sqes queued since the last uring_enter */
+unsigned int uring_sq_ready(uring_t *ring);
+/* position of the last sqe obtained, and whether the kernel took it */
+unsigned int uring_sqe_pos(uring_t *ring);
+int uring_sqe_taken(uring_t *ring, const unsigned int pos);
+
+/* get the next completion or NULL, and mark it consumed */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif /* __LIBSTROPHE_URING_H__ */
@@ -0,0 +1,344 @@
+/* wheel.c
+** strophe XMPP client library -- hierarchical timer wheel
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Hierarchical timer wheel.
+ *
+ *  Timers are hashed into one of four levels of 64 slots by how far in
+ *  the future they expire, with a resolution of one millisecond at the
+ *  lowest level.  Adding and cancelling a timer is O(1), and advancing
+ *  the wheel only visits slots holding timers: each time the lowest
+ *  level wraps around, the next slot of the level above is cascaded
+ *  down.  Timers further out than the wheel's range (about 4.6 hours)
+ *  are parked in the top level and rehashed as they come closer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "wheel.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE ((((uint64_t)1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* slot numbers of the lists of timers waiting for their callback, and
+ * of timers which were added after their expiry time had already been
+ * processed */
+#define WHEEL_EXPIRED (WHEEL_LEVELS * WHEEL_SIZE)
+#define WHEEL_DUE (WHEEL_EXPIRED + 1)
+
+struct _wheel_t {
+    const xmpp_ctx_t *ctx;
+    uint64_t now; /* next tick to process */
+    int count; /* timers hashed into slots */
+    uint64_t occupied[WHEEL_LEVELS]; /* bitmaps of non-empty slots */
+    wheel_timer_t *slots[WHEEL_LEVELS * WHEEL_SIZE];
+    wheel_timer_t *expired;
+    wheel_timer_t *due;
+};
+
+/* index of the lowest set bit of a non-zero word */
+static int _lowest_bit(uint64_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int n = 0;
+
+    while (!(bits & 1)) {
+	bits >>= 1;
+	n++;
+    }
+    return n;
+#endif
+}
+
+static void _wheel_link(wheel_t * const wheel, wheel_timer_t * const timer,
+			const int slot)
+{
+    wheel_timer_t **head;
+
+    if (slot == WHEEL_EXPIRED)
+	head = &wheel->expired;
+    else if (slot == WHEEL_DUE)
+	head = &wheel->due;
+    else {
+	head = &wheel->slots[slot];
+	wheel->occupied[slot / WHEEL_SIZE] |=
+	    ((uint64_t)1) << (slot & WHEEL_MASK);
+	wheel->count++;
+    }
+
+    timer->next = *head;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    timer->wheel = wheel;
+    timer->slot = slot;
+}
+
+static void _wheel_unlink(wheel_timer_t * const timer)
+{
+    wheel_t *wheel = timer->wheel;
+    int slot = timer->slot;
+
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->wheel = NULL;
+
+    if (slot < WHEEL_EXPIRED) {
+	wheel->count--;
+	if (!wheel->slots[slot])
+	    wheel->occupied[slot / WHEEL_SIZE] &=
+		~(((uint64_t)1) << (slot & WHEEL_MASK));
+    }
+}
+
+/* hash a timer into the slot matching its distance from the wheel's
+ * current tick */
+static void _wheel_place(wheel_t * const wheel, wheel_timer_t * const timer)
+{
+    uint64_t key, delta;
+    int level;
+
+    key = timer->expires;
+    if (key < wheel->now) {
+	_wheel_link(wheel, timer, WHEEL_DUE);
+	return;
+    }
+    if (key - wheel->now > WHEEL_RANGE)
+	key = wheel->now + WHEEL_RANGE;
+    delta = key - wheel->now;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+	if (delta < (((uint64_t)1) << (WHEEL_BITS * (level + 1))))
+	    break;
+
+    _wheel_link(wheel, timer, level * WHEEL_SIZE +
+		(int)((key >> (WHEEL_BITS * level)) & WHEEL_MASK));
+}
+
+/* move the timers of the next slot of each upper level down the wheel
+ * as the level below wraps around at tick */
+static void _wheel_cascade(wheel_t * const wheel, const uint64_t tick)
+{
+    wheel_timer_t *timer;
+    int level, idx;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+	idx = (int)((tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+	while ((timer = wheel->slots[level * WHEEL_SIZE + idx])) {
+	    _wheel_unlink(timer);
+	    _wheel_place(wheel, timer);
+	}
+	if (idx) break;
+    }
+}
+
+/** Allocate a new timer wheel.
+ *
+ *  @param ctx a Strophe context object
+ *  @param now the current time in milliseconds
+ *
+ *  @return a new wheel or NULL on memory allocation failure
+ */
+wheel_t *wheel_new(const xmpp_ctx_t * const ctx, const uint64_t now)
+{
+    wheel_t *wheel;
+
+    wheel = xmpp_alloc(ctx, sizeof(wheel_t));
+    if (!wheel) return NULL;
+
+    memset(wheel, 0, sizeof(wheel_t));
+    wheel->ctx = ctx;
+    wheel->now = now;
+
+    return wheel;
+}
+
+/** Release a timer wheel.
+ *  Timers still pending on the wheel are left unscheduled; they are owned
+ *  by their users and not freed.
+ *
+ *  @param wheel a timer wheel
+ */
+void wheel_free(wheel_t * const wheel)
+{
+    int slot;
+
+    for (slot = 0; slot < WHEEL_LEVELS * WHEEL_SIZE; slot++)
+	while (wheel->slots[slot])
+	    _wheel_unlink(wheel->slots[slot]);
+    while (wheel->expired)
+	_wheel_unlink(wheel->expired);
+    while (wheel->due)
+	_wheel_unlink(wheel->due);
+
+    xmpp_free(wheel->ctx, wheel);
+}
+
+/** Initialize a timer.
+ *
+ *  @param timer the timer to initialize
+ *  @param callback function called when the timer expires
+ *  @param userdata an opaque data pointer kept with the timer
+ */
+void wheel_timer_init(wheel_timer_t * const timer,
+		      wheel_callback callback, void * const userdata)
+{
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->callback = callback;
+    timer->userdata = userdata;
+}
+
+/** Schedule a timer.
+ *  A timer that is already pending is rescheduled, possibly on a
+ *  different wheel.  Timers that expire at or before the current time
+ *  fire on the next call to wheel_run().
+ *
+ *  @param wheel a timer wheel
+ *  @param timer an initialized timer
+ *  @param expires the time in milliseconds at which the timer expires
+ */
+void wheel_add(wheel_t * const wheel, wheel_timer_t * const timer,
+	       const uint64_t expires)
+{
+    if (timer->wheel)
+	_wheel_unlink(timer);
+
+    timer->expires = expires;
+    _wheel_place(wheel, timer);
+}
+
+/** Cancel a timer.
+ *
+ *  @param timer a timer
+ */
+void wheel_del(wheel_timer_t * const timer)
+{
+    if (timer->wheel)
+	_wheel_unlink(timer);
+}
+
+/** Check whether a timer is scheduled.
+ *
+ *  @param timer a timer
+ *
+ *  @return true if the timer is pending on a wheel
+ */
+int wheel_pending(const wheel_timer_t * const timer)
+{
+    return timer->wheel != NULL;
+}
+
+/** Advance a timer wheel.
+ *  Every timer that expired by time now is removed from the wheel and
+ *  its callback is called.  Callbacks may add and cancel any timer,
+ *  including their own; timers they add are not fired until the next
+ *  call.
+ *
+ *  @param wheel a timer wheel
+ *  @param now the current time in milliseconds
+ */
+void wheel_run(wheel_t * const wheel, const uint64_t now)
+{
+    wheel_timer_t *timer;
+    uint64_t tick, rest;
+    int idx;
+
+    while ((timer = wheel->due)) {
+	_wheel_unlink(timer);
+	_wheel_link(wheel, timer, WHEEL_EXPIRED);
+    }
+
+    while (wheel->now <= now) {
+	if (!wheel->count) {
+	    wheel->now = now + 1;
+	    break;
+	}
+
+	tick = wheel->now;
+	idx = (int)(tick & WHEEL_MASK);
+	if (!idx)
+	    _wheel_cascade(wheel, tick);
+
+	while ((timer = wheel->slots[idx])) {
+	    _wheel_unlink(timer);
+	    if (timer->expires <= tick)
+		_wheel_link(wheel, timer, WHEEL_EXPIRED);
+	    else
+		_wheel_place(wheel, timer);
+	}
+
+	/* skip ahead to the next occupied slot or the next cascade */
+	rest = 0;
+	if (idx < WHEEL_MASK)
+	    rest = wheel->occupied[0] & (~((uint64_t)0) << (idx + 1));
+	if (rest)
+	    tick = tick - idx + _lowest_bit(rest);
+	else
+	    tick = tick - idx + WHEEL_SIZE;
+	wheel->now = tick <= now ? tick : now + 1;
+    }
+
+    while ((timer = wheel->expired)) {
+	_wheel_unlink(timer);
+	timer->callback(timer, now);
+    }
+}
+
+/** Find when the next timer may expire.
+ *  The result is exact for timers due within the next 64 milliseconds
+ *  and otherwise the time at which the timer is cascaded closer, so the
+ *  caller may wake up early but never late.
+ *
+ *  @param wheel a timer wheel
+ *  @param now the current time in milliseconds
+ *
+ *  @return the time in milliseconds until the next timer may expire, or
+ *      (uint64_t)-1 if no timers are pending
+ */
+uint64_t wheel_next(const wheel_t * const wheel, const uint64_t now)
+{
+    uint64_t bits, best, base, tick;
+    int level, shift, pos;
+
+    if (wheel->due) return 0;
+
+    best = (uint64_t)-1;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+	bits = wheel->occupied[level];
+	if (!bits) continue;
+
+	/* distance from the next slot to be processed or cascaded */
+	shift = WHEEL_BITS * level;
+	base = (wheel->now + (((uint64_t)1) << shift) - 1) >> shift;
+	pos = (int)(base & WHEEL_MASK);
+	if (pos)
+	    bits = (bits >> pos) | (bits << (WHEEL_SIZE - pos));
+	tick = (base + _lowest_bit(bits)) << shift;
+	if (tick < best)
+	    best = tick;
+    }
+
+    if (best == (uint64_t)-1) return best;
+    return best > now ? best - now : 0;
+}
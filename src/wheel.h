@@ -0,0 +1,76 @@
+/* wheel.h
+** strophe XMPP client library -- timer wheel interface
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+/** @file
+ *  Hierarchical timer wheel API.
+ */
+
+#ifndef __LIBSTROPHE_WHEEL_H__
+#define __LIBSTROPHE_WHEEL_H__
+
+#ifndef _WIN32
+#include <stdint.h>
+#else
+#include "ostypes.h"
+#endif
+
+typedef struct _wheel_t wheel_t;
+typedef struct _wheel_timer_t wheel_timer_t;
+
+/* called when a timer expires.  the timer is no longer pending and may
+ * be added again or freed by the callback */
+typedef void (*wheel_callback)(wheel_timer_t * const timer,
+			       const uint64_t now);
+
+struct _wheel_timer_t {
+    /* timers are kept in lists, one per wheel slot */
+    wheel_timer_t *next;
+    wheel_timer_t **pprev;
+    uint64_t expires;
+    wheel_t *wheel; /* wheel the timer is pending on, or NULL */
+    int slot;
+
+    wheel_callback callback;
+    void *userdata;
+};
+
+/** allocate a new timer wheel starting at time now */
+wheel_t *wheel_new(const xmpp_ctx_t * const ctx, const uint64_t now);
+
+/** release a timer wheel; pending timers are forgotten, not freed */
+void wheel_free(wheel_t * const wheel);
+
+/** initialize a timer before first use */
+void wheel_timer_init(wheel_timer_t * const timer,
+		      wheel_callback callback, void * const userdata);
+
+/** schedule a timer to expire at a given time, rescheduling it if it is
+ *  already pending */
+void wheel_add(wheel_t * const wheel, wheel_timer_t * const timer,
+	       const uint64_t expires);
+
+/** cancel a timer; does nothing if the timer is not pending */
+void wheel_del(wheel_timer_t * const timer);
+
+/** return true if the timer is scheduled on a wheel */
+int wheel_pending(const wheel_timer_t * const timer);
+
+/** advance the wheel to time now, calling back every expired timer */
+void wheel_run(wheel_t * const wheel, const uint64_t now);
+
+/** return a lower bound on the milliseconds until the next timer may
+ *  expire, or (uint64_t)-1 if no timers are pending */
+uint64_t wheel_next(const wheel_t * const wheel, const uint64_t now);
+
+#endif /* __LIBSTROPHE_WHEEL_H__ */
@@ -58,6 +58,18 @@ extern "C" {
  *  Namespace definition for 'urn:ietf:params:xml:ns:xmpp-session'.
  */
 #define XMPP_NS_SESSION "urn:ietf:params:xml:ns:xmpp-session"
+/** @def XMPP_NS_COMPRESSION
+ *  Namespace definition for 'http://jabber.org/protocol/compress'.
+ */
+#define XMPP_NS_COMPRESSION "http://jabber.org/protocol/compress"
+/** @def XMPP_NS_FEATURE_COMPRESSION
+ *  Namespace definition for 'http://jabber.org/features/compress'.
+ */
+#define XMPP_NS_FEATURE_COMPRESSION "http://jabber.org/features/compress"
+/** @def XMPP_NS_SM
+ *  Namespace definition for 'urn:xmpp:sm:3'.
+ */
+#define XMPP_NS_SM "urn:xmpp:sm:3"
 /** @def XMPP_NS_AUTH
  *  Namespace definition for 'jabber:iq:auth'.
  */
@@ -120,6 +132,7 @@ typedef struct _xmpp_ctx_t xmpp_ctx_t;
 xmpp_ctx_t *xmpp_ctx_new(const xmpp_mem_t * const mem, 
 			     const xmpp_log_t * const log);
 void xmpp_ctx_free(xmpp_ctx_t * const ctx);
+int xmpp_ctx_set_threads(xmpp_ctx_t * const ctx, const int threads);
 
 struct _xmpp_mem_t {
     void *(*alloc)(const size_t size, void * const userdata);
@@ -154,6 +167,12 @@ struct _xmpp_log_t {
 
 /* return a default logger filtering at a given level */
 xmpp_log_t *xmpp_get_default_logger(xmpp_log_level_t level);
+/* drop log messages below a level before they are formatted */
+void xmpp_ctx_set_log_level(xmpp_ctx_t * const ctx,
+			    const xmpp_log_level_t level);
+/* hand log messages to the logger from a thread of its own */
+int xmpp_ctx_set_log_async(xmpp_ctx_t * const ctx, const int size);
+unsigned long xmpp_ctx_get_log_dropped(const xmpp_ctx_t * const ctx);
 
 /* connection */
 
@@ -161,6 +180,12 @@ xmpp_log_t *xmpp_get_default_logger(xmpp_log_level_t level);
 typedef struct _xmpp_conn_t xmpp_conn_t;
 typedef struct _xmpp_stanza_t xmpp_stanza_t;
 
+/* opaque shared send buffer */
+typedef struct _xmpp_buffer_t xmpp_buffer_t;
+
+/* frees data handed over to the library */
+typedef void (*xmpp_free_callback)(char * const data, void * const userdata);
+
 /* connect callback */
 typedef enum {
     XMPP_CONN_CONNECT,
@@ -217,7 +242,91 @@ void xmpp_conn_set_jid(xmpp_conn_t * const conn, const char * const jid);
 const char *xmpp_conn_get_pass(const xmpp_conn_t * const conn);
 void xmpp_conn_set_pass(xmpp_conn_t * const conn, const char * const pass);
 xmpp_ctx_t* xmpp_conn_get_context(xmpp_conn_t * const conn);
+
+/* how often a connection used up its share of an event loop iteration,
+ * what its send queue limits turned away, how well its stream
+ * compressed, what became of stanzas when its session broke and how
+ * many received stanzas were never built */
+typedef struct {
+    unsigned long read_budget_hits;
+    unsigned long stanza_budget_hits;
+    unsigned long write_budget_hits;
+    unsigned long send_queue_rejected;
+    unsigned long send_queue_dropped;
+    unsigned long compress_bytes_in; /* sent data before compression */
+    unsigned long compress_bytes_out; /* and after */
+    unsigned long sm_resent; /* stanzas sent again on a resumed session */
+    unsigned long sm_lost; /* unacknowledged stanzas of a lost session */
+    unsigned long stanzas_skipped; /* no handler or the filter wanted them */
+} xmpp_conn_stats_t;
+
+/* what happens to data sent while the send queue is full */
+typedef enum {
+    XMPP_QUEUE_REJECT, /* the new data is dropped */
+    XMPP_QUEUE_DROP_OLDEST, /* the oldest droppable stanzas make room */
+    XMPP_QUEUE_DISCONNECT /* the connection is closed */
+} xmpp_queue_policy_t;
+
+/* send queue watermark crossings */
+typedef enum {
+    XMPP_QUEUE_HIGH,
+    XMPP_QUEUE_LOW
+} xmpp_queue_event_t;
+
+typedef void (*xmpp_queue_handler)(xmpp_conn_t * const conn,
+				   const xmpp_queue_event_t event,
+				   void * const userdata);
+
+/* send lanes, from the most to the least urgent */
+typedef enum {
+    XMPP_LANE_CONTROL, /* stream negotiation, acks and other protocol */
+    XMPP_LANE_INTERACTIVE, /* the default */
+    XMPP_LANE_BULK /* archive replays, file transfers and the like */
+} xmpp_lane_t;
+
+void xmpp_conn_get_stats(const xmpp_conn_t * const conn,
+			 xmpp_conn_stats_t * const stats);
 void xmpp_conn_disable_tls(xmpp_conn_t * const conn);
+void xmpp_conn_set_compression(xmpp_conn_t * const conn, const int level);
+int xmpp_conn_is_compressed(const xmpp_conn_t * const conn);
+void xmpp_conn_set_stream_management(xmpp_conn_t * const conn,
+				     const int enable);
+void xmpp_conn_set_ack_interval(xmpp_conn_t * const conn,
+				const unsigned long period);
+int xmpp_conn_is_resumed(const xmpp_conn_t * const conn);
+int xmpp_conn_get_unacked(const xmpp_conn_t * const conn);
+void xmpp_conn_set_recv_buffer_size(xmpp_conn_t * const conn,
+				    const size_t size);
+void xmpp_conn_set_read_budget(xmpp_conn_t * const conn,
+			       const size_t budget);
+void xmpp_conn_set_stanza_budget(xmpp_conn_t * const conn,
+				 const unsigned int budget);
+void xmpp_conn_set_write_budget(xmpp_conn_t * const conn,
+				const size_t budget);
+void xmpp_conn_set_send_queue_max(xmpp_conn_t * const conn,
+				  const size_t max_bytes, const int max_items,
+				  const xmpp_queue_policy_t policy);
+void xmpp_conn_set_send_queue_watermarks(xmpp_conn_t * const conn,
+					 const size_t high, const size_t low,
+					 xmpp_queue_handler handler,
+					 void * const userdata);
+
+/* if the filter returns false the stanza is skipped */
+typedef int (*xmpp_stanza_filter)(xmpp_conn_t * const conn,
+				  const char * const name,
+				  const char * const * const attrs,
+				  void * const userdata);
+
+void xmpp_conn_set_stanza_filter(xmpp_conn_t * const conn,
+				 xmpp_stanza_filter filter,
+				 void * const userdata);
+size_t xmpp_conn_get_send_queue_bytes(const xmpp_conn_t * const conn);
+int xmpp_conn_get_send_queue_len(const xmpp_conn_t * const conn);
+void xmpp_conn_set_lane_weight(xmpp_conn_t * const conn,
+			       const xmpp_lane_t lane,
+			       const unsigned int weight);
+int xmpp_conn_migrate(xmpp_conn_t * const conn, const int thread);
+int xmpp_conn_get_thread(const xmpp_conn_t * const conn);
 
 int xmpp_connect_client(xmpp_conn_t * const conn, 
 			  const char * const altdomain,
@@ -232,11 +341,58 @@ void xmpp_disconnect(xmpp_conn_t * const conn);
 
 void xmpp_send(xmpp_conn_t * const conn,
 	       xmpp_stanza_t * const stanza);
+void xmpp_send_droppable(xmpp_conn_t * const conn,
+			 xmpp_stanza_t * const stanza);
+void xmpp_send_lane(xmpp_conn_t * const conn,
+		    xmpp_stanza_t * const stanza,
+		    const xmpp_lane_t lane);
+void xmpp_send_batch(xmpp_conn_t * const conn,
+		     xmpp_stanza_t * const * const stanzas,
+		     const size_t count, const int flush);
+void xmpp_send_batch_multi(xmpp_conn_t * const * const conns,
+			   const size_t nconns,
+			   xmpp_stanza_t * const * const stanzas,
+			   const size_t count, const int flush);
 
 void xmpp_send_raw_string(xmpp_conn_t * const conn, 
 			  const char * const fmt, ...);
 void xmpp_send_raw(xmpp_conn_t * const conn, 
 		   const char * const data, const size_t len);
+void xmpp_send_raw_lane(xmpp_conn_t * const conn,
+			const char * const data, const size_t len,
+			const xmpp_lane_t lane);
+
+/* sending from other threads */
+void xmpp_post(xmpp_conn_t * const conn,
+	       xmpp_stanza_t * const stanza);
+void xmpp_post_raw(xmpp_conn_t * const conn,
+		   const char * const data, const size_t len);
+
+/* sending without copying */
+void xmpp_send_adopt(xmpp_conn_t * const conn,
+		     char * const data, const size_t len,
+		     xmpp_free_callback free_cb, void * const userdata);
+void xmpp_send_buffer(xmpp_conn_t * const conn,
+		      xmpp_buffer_t * const buffer);
+void xmpp_post_adopt(xmpp_conn_t * const conn,
+		     char * const data, const size_t len,
+		     xmpp_free_callback free_cb, void * const userdata);
+void xmpp_post_buffer(xmpp_conn_t * const conn,
+		      xmpp_buffer_t * const buffer);
+
+/* shared send buffers */
+xmpp_buffer_t *xmpp_buffer_new(xmpp_ctx_t * const ctx,
+			       const char * const data, const size_t len);
+xmpp_buffer_t *xmpp_buffer_adopt(xmpp_ctx_t * const ctx, char * const data,
+				 const size_t len,
+				 xmpp_free_callback free_cb,
+				 void * const userdata);
+xmpp_buffer_t *xmpp_buffer_from_stanza(xmpp_ctx_t * const ctx,
+				       xmpp_stanza_t * const stanza);
+xmpp_buffer_t *xmpp_buffer_clone(xmpp_buffer_t * const buffer);
+void xmpp_buffer_release(xmpp_buffer_t * const buffer);
+const char *xmpp_buffer_get_data(const xmpp_buffer_t * const buffer);
+size_t xmpp_buffer_get_len(const xmpp_buffer_t * const buffer);
 
 
 /* handlers */
@@ -312,6 +468,9 @@ xmpp_stanza_t *xmpp_stanza_get_child_by_ns(xmpp_stanza_t * const stanza,
 xmpp_stanza_t *xmpp_stanza_get_next(xmpp_stanza_t * const stanza);
 char *xmpp_stanza_get_attribute(xmpp_stanza_t * const stanza,
 				const char * const name);
+int xmpp_stanza_get_attribute_count(xmpp_stanza_t * const stanza);
+int xmpp_stanza_get_attributes(xmpp_stanza_t * const stanza,
+			       const char **attr, int attrlen);
 char * xmpp_stanza_get_ns(xmpp_stanza_t * const stanza);
 /* concatenate all child text nodes.  this function
  * returns a string that must be freed by the caller */
@@ -326,6 +485,8 @@ int xmpp_stanza_set_ns(xmpp_stanza_t * const stanza, const char * const ns);
 int xmpp_stanza_set_attribute(xmpp_stanza_t * const stanza, 
 			      const char * const key,
 			      const char * const value);
+int xmpp_stanza_del_attribute(xmpp_stanza_t * const stanza,
+			      const char * const key);
 int xmpp_stanza_set_name(xmpp_stanza_t *stanza,
 			 const char * const name);
 int xmpp_stanza_set_text(xmpp_stanza_t *stanza,
@@ -367,6 +528,23 @@ void xmpp_run_once(xmpp_ctx_t *ctx, const unsigned long  timeout);
 void xmpp_run(xmpp_ctx_t *ctx);
 void xmpp_stop(xmpp_ctx_t *ctx);
 
+/* integration with external event loops */
+#define XMPP_IO_READ 0x01
+#define XMPP_IO_WRITE 0x02
+
+typedef void (*xmpp_watch_handler)(xmpp_conn_t * const conn,
+				   const int fd,
+				   const int events,
+				   void * const userdata);
+
+int xmpp_ctx_set_watch_handler(xmpp_ctx_t * const ctx,
+			       xmpp_watch_handler handler,
+			       void * const userdata);
+int xmpp_conn_get_fd(const xmpp_conn_t * const conn);
+int xmpp_conn_get_events(const xmpp_conn_t * const conn);
+void xmpp_conn_handle_io(xmpp_conn_t * const conn, const int events);
+unsigned long xmpp_run_timers(xmpp_ctx_t * const ctx);
+
 #ifdef __cplusplus
 }
 #endif
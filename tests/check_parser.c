@@ -13,6 +13,7 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <check.h>
 
@@ -80,12 +81,61 @@ START_TEST(callbacks)
 }
 END_TEST
 
+xmpp_stanza_t *tree_stanza = NULL;
+void tree_handle_stanza(xmpp_stanza_t *stanza, void *userdata)
+{
+    tree_stanza = xmpp_stanza_clone(stanza);
+}
+
+START_TEST(stanza_tree)
+{
+    xmpp_ctx_t *ctx;
+    parser_t *parser;
+    xmpp_stanza_t *body;
+    char *text;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    parser = parser_new(ctx, NULL, NULL, tree_handle_stanza, NULL);
+
+    parser_feed(parser, "<stream:stream>", 15);
+    parser_feed(parser, "<message id='m1' type='chat'>"
+                "<body>a &amp; b</body></message>", 61);
+    parser_free(parser);
+
+    fail_unless(tree_stanza != NULL);
+    fail_unless(strcmp(xmpp_stanza_get_name(tree_stanza), "message") == 0);
+    fail_unless(strcmp(xmpp_stanza_get_id(tree_stanza), "m1") == 0);
+    fail_unless(strcmp(xmpp_stanza_get_type(tree_stanza), "chat") == 0);
+    fail_unless(xmpp_stanza_get_attribute(tree_stanza, "to") == NULL);
+
+    body = xmpp_stanza_get_child_by_name(tree_stanza, "body");
+    fail_unless(body != NULL);
+    /* text split by entities is one node */
+    fail_unless(xmpp_stanza_get_children(body) != NULL);
+    fail_unless(xmpp_stanza_get_next(xmpp_stanza_get_children(body)) == NULL);
+    text = xmpp_stanza_get_text(body);
+    fail_unless(text != NULL && strcmp(text, "a & b") == 0);
+    xmpp_free(ctx, text);
+
+    /* parsed stanzas can be changed like any other */
+    xmpp_stanza_set_type(tree_stanza, "normal");
+    xmpp_stanza_set_name(body, "subject");
+    fail_unless(strcmp(xmpp_stanza_get_type(tree_stanza), "normal") == 0);
+    fail_unless(strcmp(xmpp_stanza_get_id(tree_stanza), "m1") == 0);
+    fail_unless(xmpp_stanza_get_child_by_name(tree_stanza, "subject") != NULL);
+
+    xmpp_stanza_release(tree_stanza);
+    xmpp_ctx_free(ctx);
+}
+END_TEST
+
 Suite *parser_suite(void)
 {
     Suite *s = suite_create("Parser");
     TCase *tc_core = tcase_create("Core");
     tcase_add_test(tc_core, create_destroy);
     tcase_add_test(tc_core, callbacks);
+    tcase_add_test(tc_core, stanza_tree);
     suite_add_tcase(s, tc_core);
     return s;
 }
@@ -0,0 +1,458 @@
+/* fakeserver.c
+** libstrophe XMPP client library -- scripted XMPP server for tests
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "strophe.h"
+#include "thread.h"
+#include "fakeserver.h"
+
+/* iterations of the client's loop, at 1 ms each, to wait for it */
+#define FAKESERVER_PATIENCE 5000
+/* more than the sockets take while the server waits */
+#define FAKESERVER_FILLER_LEN (1024 * 1024)
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' id='fake' " \
+    "from='localhost' version='1.0'>"
+
+struct _fakeserver_t {
+    xmpp_ctx_t *ctx;
+    int listener;
+    int client;
+    unsigned short port;
+    int paused;
+    int detached;
+    fakeserver_driver driver;
+    void *driver_data;
+    volatile int connected; /* set by the client's thread */
+    xmpp_conn_handler handler;
+    void *userdata;
+    char *in;
+    size_t in_len;
+    size_t in_size;
+    int compressed;
+    z_stream inflate;
+    z_stream deflate;
+};
+
+static void _nonblock(const int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+fakeserver_t *fakeserver_new(xmpp_ctx_t * const ctx)
+{
+    fakeserver_t *srv;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int on = 1;
+
+    srv = calloc(1, sizeof(fakeserver_t));
+    if (!srv) return NULL;
+    srv->ctx = ctx;
+    srv->client = -1;
+
+    /* like any application, tests must not be killed by SIGPIPE when
+     * the client writes to a dropped connection */
+    signal(SIGPIPE, SIG_IGN);
+
+    srv->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv->listener < 0) {
+	free(srv);
+	return NULL;
+    }
+    setsockopt(srv->listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(srv->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(srv->listener, 4) < 0 ||
+	getsockname(srv->listener, (struct sockaddr *)&addr, &len) < 0) {
+	close(srv->listener);
+	free(srv);
+	return NULL;
+    }
+    _nonblock(srv->listener);
+    srv->port = ntohs(addr.sin_port);
+
+    return srv;
+}
+
+void fakeserver_free(fakeserver_t * const srv)
+{
+    fakeserver_drop(srv);
+    close(srv->listener);
+    free(srv->in);
+    free(srv);
+}
+
+unsigned short fakeserver_port(const fakeserver_t * const srv)
+{
+    return srv->port;
+}
+
+static void _append(fakeserver_t * const srv, const char * const data,
+		    const size_t len)
+{
+    if (srv->in_len + len + 1 > srv->in_size) {
+	srv->in_size = (srv->in_len + len + 1) * 2;
+	srv->in = realloc(srv->in, srv->in_size);
+    }
+    memcpy(&srv->in[srv->in_len], data, len);
+    srv->in_len += len;
+    srv->in[srv->in_len] = '\0';
+}
+
+/* take what the client sent, if the server is reading */
+static void _receive(fakeserver_t * const srv)
+{
+    char buf[4096], out[16384];
+    ssize_t ret;
+
+    if (srv->client < 0 || srv->paused) return;
+
+    while ((ret = read(srv->client, buf, sizeof(buf))) > 0) {
+	if (!srv->compressed) {
+	    _append(srv, buf, ret);
+	    continue;
+	}
+
+	srv->inflate.next_in = (Bytef *)buf;
+	srv->inflate.avail_in = ret;
+	do {
+	    srv->inflate.next_out = (Bytef *)out;
+	    srv->inflate.avail_out = sizeof(out);
+	    if (inflate(&srv->inflate, Z_SYNC_FLUSH) == Z_DATA_ERROR) {
+		printf("fakeserver: corrupt compressed data\n");
+		return;
+	    }
+	    _append(srv, out, sizeof(out) - srv->inflate.avail_out);
+	} while (srv->inflate.avail_in || !srv->inflate.avail_out);
+    }
+}
+
+void fakeserver_run(fakeserver_t * const srv, const int iterations)
+{
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+	if (srv->detached)
+	    usleep(1000);
+	else if (srv->driver)
+	    srv->driver(srv->driver_data);
+	else
+	    xmpp_run_once(srv->ctx, 1);
+	_receive(srv);
+    }
+}
+
+int fakeserver_connect(fakeserver_t * const srv, xmpp_conn_t * const conn,
+		       xmpp_conn_handler handler, void * const userdata)
+{
+    int i;
+
+    if (xmpp_connect_client(conn, "127.0.0.1", srv->port, handler,
+			    userdata) != 0)
+	return -1;
+
+    for (i = 0; i < FAKESERVER_PATIENCE && srv->client < 0; i++) {
+	fakeserver_run(srv, 1);
+	srv->client = accept(srv->listener, NULL, NULL);
+    }
+    if (srv->client < 0) return -1;
+
+    _nonblock(srv->client);
+    srv->in_len = 0;
+
+    return 0;
+}
+
+void fakeserver_drop(fakeserver_t * const srv)
+{
+    if (srv->client >= 0) close(srv->client);
+    srv->client = -1;
+    fakeserver_compress(srv, 0);
+    srv->paused = 0;
+    srv->in_len = 0;
+}
+
+int fakeserver_expect(fakeserver_t * const srv, const char * const text)
+{
+    char *found;
+    int i;
+
+    for (i = 0; i < FAKESERVER_PATIENCE; i++) {
+	found = srv->in_len ? strstr(srv->in, text) : NULL;
+	if (found) {
+	    fakeserver_consume(srv, found - srv->in + strlen(text));
+	    return 0;
+	}
+	fakeserver_run(srv, 1);
+    }
+
+    printf("fakeserver: no %s in %.*s\n", text, (int)srv->in_len,
+	   srv->in_len ? srv->in : "");
+    return -1;
+}
+
+int fakeserver_wait(fakeserver_t * const srv, const char * const text)
+{
+    int i;
+
+    for (i = 0; i < FAKESERVER_PATIENCE &&
+	     !strstr(fakeserver_input(srv), text); i++)
+	fakeserver_run(srv, 1);
+
+    return strstr(fakeserver_input(srv), text) ? 0 : -1;
+}
+
+int fakeserver_received(const fakeserver_t * const srv,
+			const char * const id)
+{
+    char attr[64];
+
+    snprintf(attr, sizeof(attr), "id=\"%s\"", id);
+    return strstr(fakeserver_input(srv), attr) != NULL;
+}
+
+static void _write(fakeserver_t * const srv, const char * const data,
+		   const size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+	ret = write(srv->client, &data[done], len - done);
+	if (ret > 0)
+	    done += ret;
+	else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+	    return;
+	else
+	    fakeserver_run(srv, 1);
+    }
+}
+
+void fakeserver_send(fakeserver_t * const srv, const char * const data)
+{
+    char out[16384];
+
+    if (!srv->compressed) {
+	_write(srv, data, strlen(data));
+	return;
+    }
+
+    srv->deflate.next_in = (Bytef *)data;
+    srv->deflate.avail_in = strlen(data);
+    do {
+	srv->deflate.next_out = (Bytef *)out;
+	srv->deflate.avail_out = sizeof(out);
+	deflate(&srv->deflate, Z_SYNC_FLUSH);
+	_write(srv, out, sizeof(out) - srv->deflate.avail_out);
+    } while (!srv->deflate.avail_out);
+}
+
+void fakeserver_compress(fakeserver_t * const srv, const int compressed)
+{
+    if (srv->compressed) {
+	inflateEnd(&srv->inflate);
+	deflateEnd(&srv->deflate);
+	srv->compressed = 0;
+    }
+    if (!compressed) return;
+
+    memset(&srv->inflate, 0, sizeof(srv->inflate));
+    memset(&srv->deflate, 0, sizeof(srv->deflate));
+    inflateInit(&srv->inflate);
+    deflateInit(&srv->deflate, Z_DEFAULT_COMPRESSION);
+    srv->compressed = 1;
+}
+
+int fakeserver_auth(fakeserver_t * const srv, const char * const features)
+{
+    char *buf;
+
+    if (fakeserver_expect(srv, "streams\">") != 0) return -1;
+    fakeserver_send(srv, STREAM_HEADER "<stream:features>"
+		    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+		    "<mechanism>PLAIN</mechanism></mechanisms>"
+		    "</stream:features>");
+    if (fakeserver_expect(srv, "</auth>") != 0) return -1;
+    fakeserver_send(srv, "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+
+    if (fakeserver_expect(srv, "streams\">") != 0) return -1;
+    buf = malloc(strlen(STREAM_HEADER) + strlen(features) + 256);
+    sprintf(buf, STREAM_HEADER "<stream:features>"
+	    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+	    "<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+	    "%s</stream:features>", features);
+    fakeserver_send(srv, buf);
+    free(buf);
+
+    /* the stream restarts compressed, and isn't offered compression
+     * again */
+    if (strstr(features, "<compression")) {
+	if (fakeserver_expect(srv, "</compress>") != 0) return -1;
+	fakeserver_send(srv, "<compressed "
+			"xmlns='http://jabber.org/protocol/compress'/>");
+	fakeserver_compress(srv, 1);
+	if (fakeserver_expect(srv, "streams\">") != 0) return -1;
+	fakeserver_send(srv, STREAM_HEADER "<stream:features>"
+			"<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+			"<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+			"</stream:features>");
+    }
+
+    return 0;
+}
+
+int fakeserver_bind(fakeserver_t * const srv)
+{
+    if (fakeserver_expect(srv, "_xmpp_bind1") != 0 ||
+	fakeserver_expect(srv, "</iq>") != 0)
+	return -1;
+    fakeserver_send(srv, "<iq type='result' id='_xmpp_bind1'>"
+		    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>"
+		    "<jid>u@localhost/r</jid></bind></iq>");
+    if (fakeserver_expect(srv, "_xmpp_session1") != 0 ||
+	fakeserver_expect(srv, "</iq>") != 0)
+	return -1;
+    fakeserver_send(srv, "<iq type='result' id='_xmpp_session1'/>");
+
+    return 0;
+}
+
+int fakeserver_login(fakeserver_t * const srv, const char * const features)
+{
+    if (fakeserver_auth(srv, features) != 0 || fakeserver_bind(srv) != 0)
+	return -1;
+
+    return 0;
+}
+
+/* note the session coming up and pass events on */
+static void _conn_handler(xmpp_conn_t * const conn,
+			  const xmpp_conn_event_t status, const int error,
+			  xmpp_stream_error_t * const stream_error,
+			  void * const userdata)
+{
+    fakeserver_t *srv = (fakeserver_t *)userdata;
+
+    atomic_swap_int(&srv->connected, status == XMPP_CONN_CONNECT);
+    if (srv->handler)
+	srv->handler(conn, status, error, stream_error, srv->userdata);
+}
+
+int fakeserver_start(fakeserver_t * const srv, xmpp_conn_t * const conn,
+		     const char * const features,
+		     xmpp_conn_handler handler, void * const userdata)
+{
+    int i;
+
+    srv->handler = handler;
+    srv->userdata = userdata;
+    atomic_swap_int(&srv->connected, 0);
+    if (fakeserver_connect(srv, conn, _conn_handler, srv) != 0 ||
+	fakeserver_login(srv, features) != 0)
+	return -1;
+
+    for (i = 0; i < FAKESERVER_PATIENCE &&
+	     !atomic_get_int(&srv->connected); i++)
+	fakeserver_run(srv, 1);
+
+    return atomic_get_int(&srv->connected) ? 0 : -1;
+}
+
+void fakeserver_pause(fakeserver_t * const srv, const int paused)
+{
+    srv->paused = paused;
+}
+
+void fakeserver_detach(fakeserver_t * const srv, const int detached)
+{
+    srv->detached = detached;
+}
+
+void fakeserver_set_driver(fakeserver_t * const srv,
+			   fakeserver_driver driver, void * const userdata)
+{
+    srv->driver = driver;
+    srv->driver_data = userdata;
+}
+
+void fakeserver_fill(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    char *filler;
+
+    filler = malloc(FAKESERVER_FILLER_LEN);
+    memset(filler, ' ', FAKESERVER_FILLER_LEN);
+    fakeserver_pause(srv, 1);
+    xmpp_send_raw(conn, filler, FAKESERVER_FILLER_LEN);
+    free(filler);
+    fakeserver_run(srv, 20);
+}
+
+void fakeserver_drain(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    int i;
+
+    fakeserver_pause(srv, 0);
+    for (i = 0; i < FAKESERVER_PATIENCE &&
+	     xmpp_conn_get_send_queue_bytes(conn); i++)
+	fakeserver_run(srv, 1);
+    fakeserver_run(srv, 10);
+}
+
+void fakeserver_message(xmpp_conn_t * const conn, const char * const id,
+			const int droppable)
+{
+    xmpp_stanza_t *msg;
+
+    msg = xmpp_stanza_new(xmpp_conn_get_context(conn));
+    xmpp_stanza_set_name(msg, "message");
+    xmpp_stanza_set_id(msg, id);
+    if (droppable) xmpp_send_droppable(conn, msg);
+    else xmpp_send(conn, msg);
+    xmpp_stanza_release(msg);
+}
+
+const char *fakeserver_input(const fakeserver_t * const srv)
+{
+    return srv->in_len ? srv->in : "";
+}
+
+size_t fakeserver_input_len(const fakeserver_t * const srv)
+{
+    return srv->in_len;
+}
+
+void fakeserver_consume(fakeserver_t * const srv, const size_t len)
+{
+    if (!len) return;
+    memmove(srv->in, &srv->in[len], srv->in_len - len + 1);
+    srv->in_len -= len;
+}
@@ -0,0 +1,92 @@
+/* fakeserver.h
+** libstrophe XMPP client library -- scripted XMPP server for tests
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#ifndef __LIBSTROPHE_FAKESERVER_H__
+#define __LIBSTROPHE_FAKESERVER_H__
+
+#include <stddef.h>
+
+#include "strophe.h"
+
+/* a server listening on the loopback interface.  it runs in the same
+ * thread as the client: each call waiting for the client runs the
+ * client's context meanwhile */
+typedef struct _fakeserver_t fakeserver_t;
+
+/* runs an iteration of a client's event loop, waiting about 1 ms */
+typedef void (*fakeserver_driver)(void * const userdata);
+
+fakeserver_t *fakeserver_new(xmpp_ctx_t * const ctx);
+void fakeserver_free(fakeserver_t * const srv);
+unsigned short fakeserver_port(const fakeserver_t * const srv);
+
+/* connect a client connection to the server and accept it */
+int fakeserver_connect(fakeserver_t * const srv, xmpp_conn_t * const conn,
+		       xmpp_conn_handler handler, void * const userdata);
+/* negotiate a session, offering features after authentication.  if
+ * they include compression, it is negotiated before binding */
+int fakeserver_login(fakeserver_t * const srv, const char * const features);
+/* the steps of fakeserver_login(): authenticate and offer features,
+ * then answer the client's bind and session requests */
+int fakeserver_auth(fakeserver_t * const srv, const char * const features);
+int fakeserver_bind(fakeserver_t * const srv);
+/* connect and log in, waiting for the client to report the session.
+ * the client's jid must be u@localhost/r, and it must have a password */
+int fakeserver_start(fakeserver_t * const srv, xmpp_conn_t * const conn,
+		     const char * const features,
+		     xmpp_conn_handler handler, void * const userdata);
+/* close the client's socket, the next connect is accepted again */
+void fakeserver_drop(fakeserver_t * const srv);
+
+/* wait until the client sent text.  everything received up to and
+ * including it is consumed.  returns 0 on success, -1 on a timeout */
+int fakeserver_expect(fakeserver_t * const srv, const char * const text);
+/* wait until the client sent text, without consuming anything.
+ * returns 0 on success, -1 on a timeout */
+int fakeserver_wait(fakeserver_t * const srv, const char * const text);
+/* whether the data not consumed yet holds a stanza with an id */
+int fakeserver_received(const fakeserver_t * const srv,
+			const char * const id);
+/* send data to the client */
+void fakeserver_send(fakeserver_t * const srv, const char * const data);
+/* run the client for a number of event loop iterations */
+void fakeserver_run(fakeserver_t * const srv, const int iterations);
+/* start or stop compressing the stream with zlib */
+void fakeserver_compress(fakeserver_t * const srv, const int compressed);
+/* stop or go on reading from the client, to let its socket fill up */
+void fakeserver_pause(fakeserver_t * const srv, const int paused);
+/* stop or go on running the client while waiting for it, for when
+ * other threads run its context.  this must be set before connecting
+ * if the context is to be run by xmpp_run() */
+void fakeserver_detach(fakeserver_t * const srv, const int detached);
+/* run the client with driver instead of xmpp_run_once(), for clients
+ * driven by an external event loop.  NULL goes back to the default */
+void fakeserver_set_driver(fakeserver_t * const srv,
+			   fakeserver_driver driver, void * const userdata);
+/* stop reading and have the client send filler until its socket is
+ * full, so that what it sends next stays queued */
+void fakeserver_fill(fakeserver_t * const srv, xmpp_conn_t * const conn);
+/* go on reading until the client's send queue is empty */
+void fakeserver_drain(fakeserver_t * const srv, xmpp_conn_t * const conn);
+
+/* have the client send a message with an id */
+void fakeserver_message(xmpp_conn_t * const conn, const char * const id,
+			const int droppable);
+
+/* data received and not consumed yet */
+const char *fakeserver_input(const fakeserver_t * const srv);
+size_t fakeserver_input_len(const fakeserver_t * const srv);
+void fakeserver_consume(fakeserver_t * const srv, const size_t len);
+
+#endif /* __LIBSTROPHE_FAKESERVER_H__ */
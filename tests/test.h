@@ -12,5 +12,13 @@
     return (num_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;\
     }\
       
+/* for tests without check: fail main() or a helper returning int,
+ * reporting where a condition didn't hold */
+#define TEST_CHECK(cond) do { \
+	if (!(cond)) { \
+	    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+	    return 1; \
+	} \
+    } while (0)
 
 #endif /* __LIBSTROPHE_TEST_H__ */
@@ -0,0 +1,221 @@
+/* test_attrs.c
+** libstrophe XMPP client library -- test routines for stanza attributes
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "parser.h"
+#include "test.h"
+
+/* more than are found by scanning */
+#define MANY 20
+
+/* the attribute names of a stanza in order, separated by spaces */
+static char *names(xmpp_stanza_t * const stanza)
+{
+    static char order[512];
+    const char *attrs[2 * MANY + 8];
+    int i, n;
+
+    n = xmpp_stanza_get_attributes(stanza, attrs, 2 * MANY + 8);
+    order[0] = '\0';
+    for (i = 0; i < n; i += 2) {
+	if (order[0]) strcat(order, " ");
+	strcat(order, attrs[i]);
+    }
+
+    return order;
+}
+
+/* the stanza rendered, which must be freed */
+static char *render(xmpp_stanza_t * const stanza)
+{
+    char *buf;
+    size_t len;
+
+    if (xmpp_stanza_to_text(stanza, &buf, &len) != 0) return NULL;
+
+    return buf;
+}
+
+/* attributes keep the order they were first set in, replacing one
+ * keeps its place and deleting one closes the gap */
+static int test_set(xmpp_ctx_t * const ctx)
+{
+    xmpp_stanza_t *stanza;
+    char *text;
+
+    stanza = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(stanza, "message");
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == 0);
+    TEST_CHECK(xmpp_stanza_get_attribute(stanza, "to") == NULL);
+
+    xmpp_stanza_set_attribute(stanza, "to", "a@b");
+    xmpp_stanza_set_id(stanza, "i1");
+    xmpp_stanza_set_type(stanza, "chat");
+    xmpp_stanza_set_ns(stanza, "jabber:client");
+    xmpp_stanza_set_attribute(stanza, "from", "c@d");
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == 5);
+    TEST_CHECK(strcmp(names(stanza), "to id type xmlns from") == 0);
+
+    xmpp_stanza_set_id(stanza, "i2");
+    xmpp_stanza_set_ns(stanza, "jabber:server");
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == 5);
+    TEST_CHECK(strcmp(names(stanza), "to id type xmlns from") == 0);
+    TEST_CHECK(strcmp(xmpp_stanza_get_id(stanza), "i2") == 0);
+    TEST_CHECK(strcmp(xmpp_stanza_get_ns(stanza), "jabber:server") == 0);
+
+    TEST_CHECK(xmpp_stanza_del_attribute(stanza, "id") == 0);
+    TEST_CHECK(xmpp_stanza_del_attribute(stanza, "xmlns") == 0);
+    TEST_CHECK(xmpp_stanza_del_attribute(stanza, "nope") == 0);
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == 3);
+    TEST_CHECK(strcmp(names(stanza), "to type from") == 0);
+    TEST_CHECK(xmpp_stanza_get_id(stanza) == NULL);
+    TEST_CHECK(xmpp_stanza_get_ns(stanza) == NULL);
+    TEST_CHECK(strcmp(xmpp_stanza_get_attribute(stanza, "from"), "c@d") == 0);
+
+    /* set again, it goes last */
+    xmpp_stanza_set_id(stanza, "i3");
+    TEST_CHECK(strcmp(names(stanza), "to type from id") == 0);
+
+    text = render(stanza);
+    TEST_CHECK(text && strcmp(text, "<message to=\"a@b\" type=\"chat\" "
+			      "from=\"c@d\" id=\"i3\"/>") == 0);
+    xmpp_free(ctx, text);
+
+    xmpp_stanza_release(stanza);
+
+    return 0;
+}
+
+/* stanzas with many attributes index them, and the index follows
+ * replacements and deletions */
+static int test_many(xmpp_ctx_t * const ctx)
+{
+    xmpp_stanza_t *stanza, *copy;
+    char name[16], value[16], expected[512];
+    int i;
+
+    stanza = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(stanza, "x");
+    for (i = 0; i < MANY; i++) {
+	sprintf(name, "a%d", i);
+	sprintf(value, "v%d", i);
+	xmpp_stanza_set_attribute(stanza, name, value);
+    }
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == MANY);
+    TEST_CHECK(strcmp(xmpp_stanza_get_attribute(stanza, "a17"), "v17") == 0);
+
+    /* delete the even ones and replace the odd ones */
+    for (i = 0; i < MANY; i += 2) {
+	sprintf(name, "a%d", i);
+	TEST_CHECK(xmpp_stanza_del_attribute(stanza, name) == 0);
+    }
+    for (i = 1; i < MANY; i += 2) {
+	sprintf(name, "a%d", i);
+	sprintf(value, "w%d", i);
+	xmpp_stanza_set_attribute(stanza, name, value);
+    }
+    TEST_CHECK(xmpp_stanza_get_attribute_count(stanza) == MANY / 2);
+
+    expected[0] = '\0';
+    for (i = 1; i < MANY; i += 2) {
+	sprintf(name, "a%d", i);
+	sprintf(value, "w%d", i);
+	if (expected[0]) strcat(expected, " ");
+	strcat(expected, name);
+	TEST_CHECK(strcmp(xmpp_stanza_get_attribute(stanza, name),
+			  value) == 0);
+	sprintf(name, "a%d", i - 1);
+	TEST_CHECK(xmpp_stanza_get_attribute(stanza, name) == NULL);
+    }
+    TEST_CHECK(strcmp(names(stanza), expected) == 0);
+
+    /* a copy has the same attributes in the same order */
+    copy = xmpp_stanza_copy(stanza);
+    TEST_CHECK(strcmp(names(copy), expected) == 0);
+    TEST_CHECK(strcmp(xmpp_stanza_get_attribute(copy, "a19"), "w19") == 0);
+    xmpp_stanza_release(copy);
+
+    xmpp_stanza_release(stanza);
+
+    return 0;
+}
+
+static xmpp_stanza_t *parsed = NULL;
+
+static void stanza_cb(xmpp_stanza_t *stanza, void * const userdata)
+{
+    if (!parsed) parsed = xmpp_stanza_clone(stanza);
+}
+
+/* parsed stanzas have their attributes in document order, and keep
+ * them when they are changed */
+static int test_parsed(xmpp_ctx_t * const ctx)
+{
+    static char doc[] = "<stream:stream xmlns='jabber:client' "
+	"xmlns:stream='http://etherx.jabber.org/streams'>"
+	"<iq type='get' id='p1' to='a@b' from='c@d'><query/></iq>";
+    parser_t *parser;
+    char *text;
+
+    parser = parser_new(ctx, NULL, NULL, stanza_cb, NULL);
+    TEST_CHECK(parser_feed(parser, doc, strlen(doc)));
+    parser_free(parser);
+    TEST_CHECK(parsed != NULL);
+
+    TEST_CHECK(strcmp(names(parsed), "type id to from") == 0);
+    xmpp_stanza_set_id(parsed, "p2");
+    TEST_CHECK(xmpp_stanza_del_attribute(parsed, "to") == 0);
+    xmpp_stanza_set_attribute(parsed, "to", "e@f");
+    TEST_CHECK(strcmp(names(parsed), "type id from to") == 0);
+
+    text = render(parsed);
+    TEST_CHECK(text && strcmp(text, "<iq type=\"get\" id=\"p2\" "
+			      "from=\"c@d\" to=\"e@f\"><query/></iq>") == 0);
+    xmpp_free(ctx, text);
+
+    /* deleting first moves the attributes out of the parser's memory */
+    xmpp_stanza_release(parsed);
+    parsed = NULL;
+    parser = parser_new(ctx, NULL, NULL, stanza_cb, NULL);
+    TEST_CHECK(parser_feed(parser, doc, strlen(doc)));
+    parser_free(parser);
+    TEST_CHECK(parsed != NULL);
+    TEST_CHECK(xmpp_stanza_del_attribute(parsed, "type") == 0);
+    TEST_CHECK(strcmp(names(parsed), "id to from") == 0);
+    TEST_CHECK(strcmp(xmpp_stanza_get_attribute(parsed, "from"), "c@d") == 0);
+    xmpp_stanza_release(parsed);
+    parsed = NULL;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(ctx != NULL);
+
+    if (test_set(ctx) || test_many(ctx) || test_parsed(ctx))
+	return 1;
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/* test_batch.c
+** libstrophe XMPP client library -- test routines for batch sends
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* messages with ids prefix0, prefix1, ... */
+static void make_batch(xmpp_ctx_t * const ctx, xmpp_stanza_t ** const batch,
+		       const int count, const char * const prefix)
+{
+    char id[16];
+    int i;
+
+    for (i = 0; i < count; i++) {
+	batch[i] = xmpp_stanza_new(ctx);
+	xmpp_stanza_set_name(batch[i], "message");
+	sprintf(id, "%s%d", prefix, i);
+	xmpp_stanza_set_id(batch[i], id);
+    }
+}
+
+static void free_batch(xmpp_stanza_t ** const batch, const int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	xmpp_stanza_release(batch[i]);
+}
+
+/* a stanza which can't be rendered fails the whole batch, and the
+ * connection goes on as before */
+static int test_invalid(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = xmpp_conn_get_context(conn);
+    xmpp_stanza_t *batch[3];
+
+    make_batch(ctx, batch, 3, "v");
+    xmpp_stanza_release(batch[1]);
+    batch[1] = xmpp_stanza_new(ctx);
+    xmpp_send_batch(conn, batch, 3, 1);
+    free_batch(batch, 3);
+    TEST_CHECK(xmpp_conn_get_send_queue_len(conn) == 0);
+
+    make_batch(ctx, batch, 3, "w");
+    xmpp_send_batch(conn, batch, 3, 1);
+    free_batch(batch, 3);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"w0\"") == 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"w1\"") == 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"w2\"") == 0);
+    TEST_CHECK(!fakeserver_received(srv, "v0"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    return 0;
+}
+
+/* a connection without room for the whole batch queues none of it,
+ * while the others queue all of it, and connections which are not
+ * connected are skipped */
+static int test_partial(fakeserver_t * const srv1, xmpp_conn_t * const conn1,
+			fakeserver_t * const srv2, xmpp_conn_t * const conn2)
+{
+    xmpp_ctx_t *ctx = xmpp_conn_get_context(conn1);
+    xmpp_conn_t *conns[3], *idle;
+    xmpp_stanza_t *batch[3];
+    xmpp_conn_stats_t stats;
+
+    idle = xmpp_conn_new(ctx);
+    conns[0] = conn1;
+    conns[1] = idle;
+    conns[2] = conn2;
+
+    fakeserver_fill(srv1, conn1);
+    xmpp_conn_set_send_queue_max(conn1, 0,
+				 xmpp_conn_get_send_queue_len(conn1) + 2,
+				 XMPP_QUEUE_REJECT);
+
+    make_batch(ctx, batch, 3, "x");
+    xmpp_send_batch_multi(conns, 3, batch, 3, 1);
+    free_batch(batch, 3);
+
+    xmpp_conn_get_stats(conn1, &stats);
+    TEST_CHECK(stats.send_queue_rejected == 3);
+    xmpp_conn_get_stats(idle, &stats);
+    TEST_CHECK(stats.send_queue_rejected == 0);
+    TEST_CHECK(xmpp_conn_get_send_queue_len(idle) == 0);
+    TEST_CHECK(fakeserver_expect(srv2, "id=\"x0\"") == 0);
+    TEST_CHECK(fakeserver_expect(srv2, "id=\"x1\"") == 0);
+    TEST_CHECK(fakeserver_expect(srv2, "id=\"x2\"") == 0);
+
+    /* once there is room again, the next batch goes out whole */
+    fakeserver_drain(srv1, conn1);
+    TEST_CHECK(!fakeserver_received(srv1, "x0") &&
+	       !fakeserver_received(srv1, "x1") &&
+	       !fakeserver_received(srv1, "x2"));
+    fakeserver_consume(srv1, fakeserver_input_len(srv1));
+    make_batch(ctx, batch, 3, "y");
+    xmpp_send_batch_multi(conns, 3, batch, 3, 1);
+    free_batch(batch, 3);
+    TEST_CHECK(fakeserver_expect(srv1, "id=\"y2\"") == 0);
+    TEST_CHECK(fakeserver_expect(srv2, "id=\"y2\"") == 0);
+    xmpp_conn_get_stats(conn1, &stats);
+    TEST_CHECK(stats.send_queue_rejected == 3);
+    xmpp_conn_set_send_queue_max(conn1, 0, 0, XMPP_QUEUE_REJECT);
+
+    xmpp_conn_release(idle);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn1, *conn2;
+    fakeserver_t *srv1, *srv2;
+    int sndbuf = 8192;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv1 = fakeserver_new(ctx);
+    srv2 = fakeserver_new(ctx);
+    TEST_CHECK(srv1 != NULL && srv2 != NULL);
+
+    conn1 = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn1, "u@localhost/r");
+    xmpp_conn_set_pass(conn1, "p");
+    TEST_CHECK(fakeserver_start(srv1, conn1, "", NULL, NULL) == 0);
+    setsockopt(xmpp_conn_get_fd(conn1), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+    conn2 = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn2, "u@localhost/r");
+    xmpp_conn_set_pass(conn2, "p");
+    TEST_CHECK(fakeserver_start(srv2, conn2, "", NULL, NULL) == 0);
+
+    if (test_invalid(srv1, conn1) ||
+	test_partial(srv1, conn1, srv2, conn2))
+	return 1;
+
+    xmpp_conn_release(conn1);
+    xmpp_conn_release(conn2);
+    fakeserver_free(srv1);
+    fakeserver_free(srv2);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,162 @@
+/* test_budget.c
+** libstrophe XMPP client library -- test routines for connection budgets
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+static int received = 0;
+static int out_of_order = 0;
+
+/* messages are numbered m0, m1, ... and must arrive in that order */
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    char id[16];
+
+    sprintf(id, "m%d", received++);
+    if (!xmpp_stanza_get_id(stanza) ||
+	strcmp(xmpp_stanza_get_id(stanza), id) != 0)
+	out_of_order++;
+
+    return 1;
+}
+
+/* send count numbered messages from the server in one write */
+static void send_messages(fakeserver_t * const srv, const int first,
+			  const int count)
+{
+    char *buf, *p;
+    int i;
+
+    buf = malloc(count * 128);
+    p = buf;
+    for (i = first; i < first + count; i++)
+	p += sprintf(p, "<message id='m%d' type='chat'><body>%d is a "
+		     "number</body></message>", i, i);
+    fakeserver_send(srv, buf);
+    free(buf);
+}
+
+/* the stanza budget pauses the parser after one stanza per iteration,
+ * and the rest is parsed on later iterations without new reads */
+static int test_stanza_budget(fakeserver_t * const srv,
+			      xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    int i, before;
+
+    xmpp_conn_set_stanza_budget(conn, 1);
+    received = 0;
+    send_messages(srv, 0, 5);
+
+    for (i = 0; i < 1000 && received < 5; i++) {
+	before = received;
+	fakeserver_run(srv, 1);
+	TEST_CHECK(received - before <= 1);
+    }
+    TEST_CHECK(received == 5);
+    TEST_CHECK(out_of_order == 0);
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.stanza_budget_hits >= 4);
+
+    return 0;
+}
+
+/* the read budget stops reading a connection for this iteration once
+ * it was used up, without losing or reordering anything */
+static int test_read_budget(fakeserver_t * const srv,
+			    xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    int i;
+
+    xmpp_conn_set_stanza_budget(conn, 1000);
+    xmpp_conn_set_recv_buffer_size(conn, 16);
+    xmpp_conn_set_read_budget(conn, 64);
+    received = 0;
+    send_messages(srv, 0, 20);
+
+    for (i = 0; i < 1000 && received < 20; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(received == 20);
+    TEST_CHECK(out_of_order == 0);
+
+    xmpp_conn_get_stats(conn, &stats);
+#ifndef HAVE_IO_URING
+    /* the io_uring engine hands over one completed read at a time, so
+     * it has nothing to stop early */
+    TEST_CHECK(stats.read_budget_hits > 0);
+#endif
+
+    return 0;
+}
+
+/* the write budget spreads a long send queue over several iterations */
+static int test_write_budget(fakeserver_t * const srv,
+			     xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    char buf[64];
+    int i;
+
+    xmpp_conn_set_write_budget(conn, 16);
+    for (i = 0; i < 10; i++) {
+	sprintf(buf, "<message id='w%d'/>", i);
+	xmpp_send_raw(conn, buf, strlen(buf));
+    }
+
+    for (i = 0; i < 10; i++) {
+	sprintf(buf, "<message id='w%d'/>", i);
+	TEST_CHECK(fakeserver_expect(srv, buf) == 0);
+    }
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.write_budget_hits > 0);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+
+    if (test_stanza_budget(srv, conn) || test_read_budget(srv, conn) ||
+	test_write_budget(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,236 @@
+/* test_buffer.c
+** libstrophe XMPP client library -- test routines for zero-copy sends
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* large enough not to fit into the sockets while the server waits */
+#define BIG_LEN (1024 * 1024)
+
+static int freed = 0;
+
+static void count_free(char * const data, void * const userdata)
+{
+    freed++;
+    free(data);
+}
+
+/* a buffer of len bytes of a repeating pattern */
+static char *pattern(const size_t len)
+{
+    char *data;
+    size_t i;
+
+    data = malloc(len);
+    for (i = 0; i < len; i++)
+	data[i] = 'a' + i % 26;
+
+    return data;
+}
+
+static xmpp_conn_t *start(xmpp_ctx_t * const ctx, fakeserver_t * const srv)
+{
+    xmpp_conn_t *conn;
+    int sndbuf = 8192;
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    if (fakeserver_start(srv, conn, "", NULL, NULL) != 0) {
+	xmpp_conn_release(conn);
+	return NULL;
+    }
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    return conn;
+}
+
+/* run until the server has len bytes, and check they are the pattern */
+static int receive_pattern(fakeserver_t * const srv, const size_t len)
+{
+    char *expected;
+    int i, ret;
+
+    for (i = 0; i < 5000 && fakeserver_input_len(srv) < len; i++)
+	fakeserver_run(srv, 1);
+    if (fakeserver_input_len(srv) != len) return 1;
+
+    expected = pattern(len);
+    ret = memcmp(fakeserver_input(srv), expected, len) != 0;
+    free(expected);
+    fakeserver_consume(srv, len);
+
+    return ret;
+}
+
+/* data adopted by a connection that can't send is freed right away */
+static int test_adopt_disconnected(xmpp_ctx_t * const ctx)
+{
+    xmpp_conn_t *conn;
+
+    conn = xmpp_conn_new(ctx);
+    freed = 0;
+    xmpp_send_adopt(conn, pattern(16), 16, count_free, NULL);
+    TEST_CHECK(freed == 1);
+    xmpp_conn_release(conn);
+
+    return 0;
+}
+
+/* a buffer's data lives until the last reference is released */
+static int test_buffer_refs(xmpp_ctx_t * const ctx)
+{
+    xmpp_buffer_t *buffer, *clone;
+    char *data;
+
+    freed = 0;
+    data = pattern(16);
+    buffer = xmpp_buffer_adopt(ctx, data, 16, count_free, NULL);
+    TEST_CHECK(buffer != NULL);
+    TEST_CHECK(xmpp_buffer_get_data(buffer) == data);
+    TEST_CHECK(xmpp_buffer_get_len(buffer) == 16);
+
+    clone = xmpp_buffer_clone(buffer);
+    TEST_CHECK(clone == buffer);
+    xmpp_buffer_release(buffer);
+    TEST_CHECK(freed == 0);
+    xmpp_buffer_release(clone);
+    TEST_CHECK(freed == 1);
+
+    /* without a callback the data comes from the context's allocator */
+    data = xmpp_alloc(ctx, 16);
+    memset(data, 'x', 16);
+    buffer = xmpp_buffer_adopt(ctx, data, 16, NULL, NULL);
+    TEST_CHECK(buffer != NULL);
+    xmpp_buffer_release(buffer);
+
+    /* a copied buffer doesn't point at the caller's data */
+    data = pattern(16);
+    buffer = xmpp_buffer_new(ctx, data, 16);
+    TEST_CHECK(buffer != NULL);
+    TEST_CHECK(xmpp_buffer_get_data(buffer) != data);
+    TEST_CHECK(memcmp(xmpp_buffer_get_data(buffer), data, 16) == 0);
+    free(data);
+    xmpp_buffer_release(buffer);
+
+    return 0;
+}
+
+/* adopted data stays with the send queue until it was written */
+static int test_adopt_sent(fakeserver_t * const srv,
+			   xmpp_conn_t * const conn)
+{
+    freed = 0;
+    fakeserver_pause(srv, 1);
+    xmpp_send_adopt(conn, pattern(BIG_LEN), BIG_LEN, count_free, NULL);
+    fakeserver_run(srv, 50);
+    TEST_CHECK(freed == 0);
+    TEST_CHECK(xmpp_conn_get_send_queue_bytes(conn) > 0);
+
+    fakeserver_pause(srv, 0);
+    TEST_CHECK(receive_pattern(srv, BIG_LEN) == 0);
+    fakeserver_run(srv, 1);
+    TEST_CHECK(freed == 1);
+
+    return 0;
+}
+
+/* one buffer sent to two connections is freed after both wrote it,
+ * even though the caller let go of it first */
+static int test_buffer_shared(xmpp_ctx_t * const ctx,
+			      fakeserver_t * const srv1,
+			      xmpp_conn_t * const conn1,
+			      fakeserver_t * const srv2,
+			      xmpp_conn_t * const conn2)
+{
+    xmpp_buffer_t *buffer;
+
+    freed = 0;
+    fakeserver_pause(srv1, 1);
+    fakeserver_pause(srv2, 1);
+    buffer = xmpp_buffer_adopt(ctx, pattern(BIG_LEN), BIG_LEN, count_free,
+			       NULL);
+    TEST_CHECK(buffer != NULL);
+    xmpp_send_buffer(conn1, buffer);
+    xmpp_send_buffer(conn2, buffer);
+    xmpp_buffer_release(buffer);
+    fakeserver_run(srv1, 50);
+    TEST_CHECK(freed == 0);
+
+    fakeserver_pause(srv1, 0);
+    TEST_CHECK(receive_pattern(srv1, BIG_LEN) == 0);
+    fakeserver_run(srv1, 1);
+    TEST_CHECK(freed == 0);
+
+    fakeserver_pause(srv2, 0);
+    TEST_CHECK(receive_pattern(srv2, BIG_LEN) == 0);
+    fakeserver_run(srv2, 1);
+    TEST_CHECK(freed == 1);
+
+    return 0;
+}
+
+/* data still queued when the connection goes away is freed with it */
+static int test_adopt_released(fakeserver_t * const srv,
+			       xmpp_conn_t * const conn)
+{
+    freed = 0;
+    fakeserver_pause(srv, 1);
+    xmpp_send_adopt(conn, pattern(BIG_LEN), BIG_LEN, count_free, NULL);
+    fakeserver_run(srv, 10);
+    TEST_CHECK(freed == 0);
+
+    xmpp_conn_release(conn);
+    TEST_CHECK(freed == 1);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn1, *conn2;
+    fakeserver_t *srv1, *srv2;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(test_adopt_disconnected(ctx) == 0);
+    TEST_CHECK(test_buffer_refs(ctx) == 0);
+
+    srv1 = fakeserver_new(ctx);
+    srv2 = fakeserver_new(ctx);
+    TEST_CHECK(srv1 != NULL && srv2 != NULL);
+    conn1 = start(ctx, srv1);
+    conn2 = start(ctx, srv2);
+    TEST_CHECK(conn1 != NULL && conn2 != NULL);
+
+    if (test_adopt_sent(srv1, conn1) ||
+	test_buffer_shared(ctx, srv1, conn1, srv2, conn2) ||
+	test_adopt_released(srv1, conn1))
+	return 1;
+
+    xmpp_conn_release(conn2);
+    fakeserver_free(srv1);
+    fakeserver_free(srv2);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
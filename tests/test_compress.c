@@ -0,0 +1,173 @@
+/* test_compress.c
+** libstrophe XMPP client library -- test routines for stream compression
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+#define COMPRESSION_FEATURE \
+    "<compression xmlns='http://jabber.org/features/compress'>" \
+    "<method>zlib</method></compression>"
+
+#define BODY_LEN 2000
+
+static int received = 0;
+static int bad = 0;
+static int disconnected = 0;
+
+static void conn_handler(xmpp_conn_t * const conn,
+			 const xmpp_conn_event_t status, const int error,
+			 xmpp_stream_error_t * const stream_error,
+			 void * const userdata)
+{
+    if (status == XMPP_CONN_DISCONNECT) disconnected++;
+}
+
+/* a body of BODY_LEN bytes, different for each message */
+static void make_body(char * const body, const int i)
+{
+    int j;
+
+    for (j = 0; j < BODY_LEN; j++)
+	body[j] = 'a' + (i + j / 7) % 26;
+    body[BODY_LEN] = '\0';
+}
+
+/* messages are numbered m0, m1, ... and must arrive in order, whole */
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    char id[16], body[BODY_LEN + 1], *text;
+
+    sprintf(id, "m%d", received);
+    make_body(body, received);
+    received++;
+
+    text = xmpp_stanza_get_text(xmpp_stanza_get_child_by_name(stanza,
+							       "body"));
+    if (!xmpp_stanza_get_id(stanza) ||
+	strcmp(xmpp_stanza_get_id(stanza), id) != 0 ||
+	!text || strcmp(text, body) != 0)
+	bad++;
+    if (text) xmpp_free(xmpp_conn_get_context(conn), text);
+
+    return 1;
+}
+
+/* exchange stanzas both ways over a compressed session */
+static int exchange(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = xmpp_conn_get_context(conn);
+    xmpp_stanza_t *msg, *body, *text;
+    char *buf, *p, expected[64];
+    char data[BODY_LEN + 1];
+    int i;
+
+    TEST_CHECK(xmpp_conn_is_compressed(conn));
+
+    /* many stanzas in one compressed write, read a little at a time
+     * and handled one per iteration, so that decompressed data is left
+     * over between iterations */
+    received = 0;
+    bad = 0;
+    buf = malloc(20 * (BODY_LEN + 64));
+    for (i = 0, p = buf; i < 20; i++) {
+	make_body(data, i);
+	p += sprintf(p, "<message id='m%d'><body>%s</body></message>",
+		     i, data);
+    }
+    fakeserver_send(srv, buf);
+    free(buf);
+    for (i = 0; i < 5000 && received < 20; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(received == 20);
+    TEST_CHECK(bad == 0);
+
+    /* and the other way */
+    for (i = 0; i < 10; i++) {
+	msg = xmpp_stanza_new(ctx);
+	xmpp_stanza_set_name(msg, "message");
+	sprintf(expected, "c%d", i);
+	xmpp_stanza_set_id(msg, expected);
+	body = xmpp_stanza_new(ctx);
+	xmpp_stanza_set_name(body, "body");
+	text = xmpp_stanza_new(ctx);
+	make_body(data, i);
+	xmpp_stanza_set_text(text, data);
+	xmpp_stanza_add_child(body, text);
+	xmpp_stanza_release(text);
+	xmpp_stanza_add_child(msg, body);
+	xmpp_stanza_release(body);
+	xmpp_send(conn, msg);
+	xmpp_stanza_release(msg);
+    }
+    for (i = 0; i < 10; i++) {
+	make_body(data, i);
+	sprintf(expected, "<message id=\"c%d\"><body>", i);
+	TEST_CHECK(fakeserver_expect(srv, expected) == 0);
+	TEST_CHECK(fakeserver_expect(srv, data) == 0);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    xmpp_conn_stats_t stats;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    xmpp_conn_set_compression(conn, 6);
+    xmpp_conn_set_recv_buffer_size(conn, 64);
+    xmpp_conn_set_stanza_budget(conn, 1);
+
+    /* compression is negotiated, and the stream restarts compressed */
+    TEST_CHECK(fakeserver_start(srv, conn, COMPRESSION_FEATURE,
+				conn_handler, NULL) == 0);
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    if (exchange(srv, conn)) return 1;
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.compress_bytes_in > stats.compress_bytes_out);
+
+    /* a new connection starts over with fresh compression state */
+    fakeserver_drop(srv);
+    for (i = 0; i < 1000 && !disconnected; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(disconnected == 1);
+    TEST_CHECK(!xmpp_conn_is_compressed(conn));
+    TEST_CHECK(fakeserver_start(srv, conn, COMPRESSION_FEATURE,
+				conn_handler, NULL) == 0);
+    if (exchange(srv, conn)) return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
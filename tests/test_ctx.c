@@ -18,8 +18,14 @@
 
 #include "strophe.h"
 #include "common.h"
+#include "test.h"
+
+/* call the library's function even when debug logging is compiled out
+ * of it */
+#undef xmpp_debug
 
 static int log_called = 0;
+static size_t long_len = 0;
 static int mem_alloc_called = 0;
 static int mem_free_called = 0;
 static int mem_realloc_called = 0;
@@ -48,6 +54,62 @@ void my_logger(void * const userdata, const xmpp_log_level_t level,
     if (strcmp((char *)userdata, "asdf") == 0 && level == XMPP_LEVEL_DEBUG
 	&& strcmp(area, "test") == 0 && strcmp(msg, "hello") == 0)
 	log_called++;
+    if (strcmp(area, "long") == 0) long_len = strlen(msg);
+}
+
+/* a context starts at the level of its logger */
+static int test_default_levels(xmpp_log_t * const custom)
+{
+    xmpp_ctx_t *ctx;
+
+    /* without a logger nothing is logged, whatever the level is set to */
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(ctx->log_level == XMPP_LEVEL_NONE);
+    TEST_CHECK(!xmpp_log_enabled(ctx, XMPP_LEVEL_ERROR));
+    xmpp_ctx_set_log_level(ctx, XMPP_LEVEL_DEBUG);
+    TEST_CHECK(ctx->log_level == XMPP_LEVEL_NONE);
+    xmpp_ctx_free(ctx);
+
+    ctx = xmpp_ctx_new(NULL, xmpp_get_default_logger(XMPP_LEVEL_WARN));
+    TEST_CHECK(ctx->log_level == XMPP_LEVEL_WARN);
+    TEST_CHECK(!xmpp_log_enabled(ctx, XMPP_LEVEL_INFO));
+    TEST_CHECK(xmpp_log_enabled(ctx, XMPP_LEVEL_WARN));
+    xmpp_ctx_free(ctx);
+
+    /* custom loggers see everything until told otherwise */
+    ctx = xmpp_ctx_new(NULL, custom);
+    TEST_CHECK(ctx->log_level == XMPP_LEVEL_DEBUG);
+    TEST_CHECK(xmpp_log_enabled(ctx, XMPP_LEVEL_DEBUG));
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
+
+/* messages too long for the buffer on the stack are formatted into
+ * one from the allocator, which is given back */
+static int test_long_message(xmpp_ctx_t * const ctx)
+{
+    char text[2001];
+    int allocs, frees;
+
+    memset(text, 'l', 2000);
+    text[2000] = '\0';
+    allocs = mem_alloc_called;
+    frees = mem_free_called;
+    xmpp_info(ctx, "long", "%s", text);
+    TEST_CHECK(long_len == 2000);
+    TEST_CHECK(mem_alloc_called > allocs);
+    TEST_CHECK(mem_alloc_called - allocs == mem_free_called - frees);
+
+    /* dropped below the level, before anything is allocated */
+    long_len = 0;
+    xmpp_ctx_set_log_level(ctx, XMPP_LEVEL_WARN);
+    allocs = mem_alloc_called;
+    xmpp_info(ctx, "long", "%s", text);
+    TEST_CHECK(long_len == 0);
+    TEST_CHECK(mem_alloc_called == allocs);
+
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -73,9 +135,20 @@ int main(int argc, char **argv)
     mylog.handler = my_logger;
     mylog.userdata = my_str;
 
+    if (test_default_levels(&mylog)) return 1;
+
     ctx = xmpp_ctx_new(&mymem, &mylog);
     xmpp_debug(ctx, "test", "hello");
 
+    /* messages below the log level are dropped */
+    xmpp_ctx_set_log_level(ctx, XMPP_LEVEL_INFO);
+    xmpp_debug(ctx, "test", "hello");
+    if (log_called != 1) {
+	xmpp_ctx_free(ctx);
+	return 1;
+    }
+    if (test_long_message(ctx)) return 1;
+
     testptr1 = xmpp_alloc(ctx, 1024);
     if (testptr1 == NULL) {
 	xmpp_ctx_free(ctx);
@@ -0,0 +1,222 @@
+/* test_intern.c
+** libstrophe XMPP client library -- test routines for string interning
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "intern.h"
+#include "test.h"
+
+/* more strings than a table holds */
+#define FILL 5000
+
+/* add strings until the table closes, returns how many were added */
+static int fill(intern_t * const table)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < FILL; i++) {
+	sprintf(name, "n%d", i);
+	if (!intern_add(table, name)) break;
+    }
+
+    return i;
+}
+
+/* equal strings are interned as one pointer, until the table closes,
+ * and from then on only the strings already in it are found */
+static int test_table(xmpp_ctx_t * const ctx)
+{
+    intern_t *table;
+    char buf[256], *foo, *n5;
+    int added;
+
+    table = intern_new(ctx);
+    TEST_CHECK(table != NULL);
+
+    /* seeded names are there from the start */
+    TEST_CHECK(intern_get(table, "message") != NULL);
+    TEST_CHECK(intern_get(table, XMPP_NS_CLIENT) != NULL);
+    TEST_CHECK(intern_get(table, "foo") == NULL);
+
+    strcpy(buf, "foo");
+    foo = intern_add(table, buf);
+    TEST_CHECK(foo != NULL && foo != buf);
+    TEST_CHECK(intern_add(table, "foo") == foo);
+    TEST_CHECK(intern_get(table, "foo") == foo);
+    TEST_CHECK(intern_owns(table, foo));
+    TEST_CHECK(!intern_owns(table, buf));
+
+    /* long strings aren't interned, and don't close the table */
+    memset(buf, 'l', 200);
+    buf[200] = '\0';
+    TEST_CHECK(intern_add(table, buf) == NULL);
+    TEST_CHECK(intern_add(table, "bar") != NULL);
+
+    added = fill(table);
+    TEST_CHECK(added > 0 && added < FILL);
+    TEST_CHECK(intern_add(table, "baz") == NULL);
+    TEST_CHECK(intern_get(table, "baz") == NULL);
+    n5 = intern_get(table, "n5");
+    TEST_CHECK(n5 != NULL && intern_add(table, "n5") == n5);
+    TEST_CHECK(intern_add(table, "foo") == foo);
+    TEST_CHECK(intern_add(table, "message") ==
+	       intern_get(table, "message"));
+
+    intern_free(table);
+
+    return 0;
+}
+
+static int hits[4];
+
+/* a connection takes each handler function once, so each match needs
+ * one of its own */
+static int handler0(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+		    void * const userdata)
+{
+    hits[0]++;
+    return 1;
+}
+
+static int handler1(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+		    void * const userdata)
+{
+    hits[1]++;
+    return 1;
+}
+
+static int handler2(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+		    void * const userdata)
+{
+    hits[2]++;
+    return 1;
+}
+
+static int handler3(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
+		    void * const userdata)
+{
+    hits[3]++;
+    return 1;
+}
+
+static xmpp_stanza_t *make_stanza(xmpp_ctx_t * const ctx,
+				  const char * const name,
+				  const char * const ns)
+{
+    xmpp_stanza_t *stanza;
+
+    stanza = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(stanza, name);
+    if (ns) xmpp_stanza_set_ns(stanza, ns);
+
+    return stanza;
+}
+
+/* fire the handlers for a stanza, returns which one matched, or -1 if
+ * none or several did */
+static int fire(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza)
+{
+    int i, found = -1;
+
+    memset(hits, 0, sizeof(hits));
+    handler_fire_stanza(conn, stanza);
+    xmpp_stanza_release(stanza);
+
+    for (i = 0; i < 4; i++) {
+	if (!hits[i]) continue;
+	if (found >= 0 || hits[i] > 1) return -1;
+	found = i;
+    }
+
+    return found;
+}
+
+/* once the context's table closes, names which didn't make it in are
+ * copied, and stanzas and handlers are still matched on them */
+static int test_closed(xmpp_ctx_t * const ctx)
+{
+    xmpp_conn_t *conn;
+    xmpp_stanza_t *stanza, *child;
+
+    conn = xmpp_conn_new(ctx);
+    conn->authenticated = 1;
+
+    /* these are interned, and matched by pointer */
+    xmpp_handler_add(conn, handler0, NULL, "early", NULL, NULL);
+    xmpp_handler_add(conn, handler1, "urn:early", NULL, NULL, NULL);
+    TEST_CHECK(intern_get(ctx->intern, "early") != NULL);
+    TEST_CHECK(fire(conn, make_stanza(ctx, "early", NULL)) == 0);
+
+    TEST_CHECK(fill(ctx->intern) < FILL);
+
+    /* these aren't, and are matched with strcmp() */
+    xmpp_handler_add(conn, handler2, NULL, "late", NULL, NULL);
+    xmpp_handler_add(conn, handler3, "urn:late", "message", NULL, NULL);
+    TEST_CHECK(intern_get(ctx->intern, "late") == NULL);
+    TEST_CHECK(intern_get(ctx->intern, "urn:late") == NULL);
+
+    TEST_CHECK(fire(conn, make_stanza(ctx, "early", NULL)) == 0);
+    TEST_CHECK(fire(conn, make_stanza(ctx, "late", NULL)) == 2);
+    TEST_CHECK(fire(conn, make_stanza(ctx, "message", "urn:late")) == 3);
+    TEST_CHECK(fire(conn, make_stanza(ctx, "message", "urn:other")) == -1);
+    TEST_CHECK(fire(conn, make_stanza(ctx, "lately", NULL)) == -1);
+
+    /* a child in a namespace interned before the table closed */
+    stanza = make_stanza(ctx, "iq", NULL);
+    child = make_stanza(ctx, "query", "urn:early");
+    xmpp_stanza_add_child(stanza, child);
+    xmpp_stanza_release(child);
+    TEST_CHECK(fire(conn, stanza) == 1);
+
+    /* looking up children works either way */
+    stanza = make_stanza(ctx, "iq", NULL);
+    child = make_stanza(ctx, "later", "urn:later");
+    xmpp_stanza_add_child(stanza, child);
+    xmpp_stanza_release(child);
+    child = make_stanza(ctx, "early", "urn:early");
+    xmpp_stanza_add_child(stanza, child);
+    xmpp_stanza_release(child);
+    child = xmpp_stanza_get_child_by_name(stanza, "later");
+    TEST_CHECK(child && strcmp(xmpp_stanza_get_ns(child), "urn:later") == 0);
+    TEST_CHECK(xmpp_stanza_get_child_by_ns(stanza, "urn:later") == child);
+    child = xmpp_stanza_get_child_by_name(stanza, "early");
+    TEST_CHECK(child && xmpp_stanza_get_child_by_ns(stanza,
+						   "urn:early") == child);
+    TEST_CHECK(xmpp_stanza_get_child_by_name(stanza, "lately") == NULL);
+    xmpp_stanza_release(stanza);
+
+    xmpp_conn_release(conn);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(ctx != NULL);
+
+    if (test_table(ctx) || test_closed(ctx))
+	return 1;
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+/* test_lanes.c
+** libstrophe XMPP client library -- test routines for send lanes
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* a little less than one quantum of a lane's weight */
+#define UNIT_LEN 4000
+
+/* send a unit of data tagged with a name, padded to len bytes */
+static void send_unit(xmpp_conn_t * const conn, const char * const name,
+		      const size_t len, const xmpp_lane_t lane)
+{
+    char *data;
+
+    data = malloc(len);
+    memset(data, ' ', len);
+    memcpy(data, "<x n='", 6);
+    memcpy(data + 6, name, strlen(name));
+    memcpy(data + 6 + strlen(name), "'/>", 3);
+    xmpp_send_raw_lane(conn, data, len, lane);
+    free(data);
+}
+
+/* let the server read everything, and return the names of the units
+ * in the order they arrived, separated by spaces */
+static char *drain(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    static char order[256];
+    const char *p, *end;
+
+    fakeserver_drain(srv, conn);
+
+    order[0] = '\0';
+    for (p = fakeserver_input(srv); (p = strstr(p, "<x n='")); p = end) {
+	p += 6;
+	end = strchr(p, '\'');
+	if (order[0]) strcat(order, " ");
+	strncat(order, p, end - p);
+    }
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    return order;
+}
+
+/* by default, control goes first, and interactive units get four
+ * turns for each turn of bulk units */
+static int test_default_weights(fakeserver_t * const srv,
+				xmpp_conn_t * const conn)
+{
+    char name[8];
+    int i;
+
+    fakeserver_fill(srv, conn);
+    for (i = 0; i < 4; i++) {
+	sprintf(name, "b%d", i);
+	send_unit(conn, name, UNIT_LEN, XMPP_LANE_BULK);
+    }
+    for (i = 0; i < 8; i++) {
+	sprintf(name, "i%d", i);
+	send_unit(conn, name, UNIT_LEN, XMPP_LANE_INTERACTIVE);
+    }
+    send_unit(conn, "c0", 16, XMPP_LANE_CONTROL);
+    send_unit(conn, "c1", 16, XMPP_LANE_CONTROL);
+
+    TEST_CHECK(strcmp(drain(srv, conn), "c0 c1 i0 i1 i2 i3 b0 i4 i5 i6 i7 "
+		      "b1 b2 b3") == 0);
+
+    return 0;
+}
+
+/* weights set the share of each lane, and what a lane doesn't use of
+ * its turn is carried over */
+static int test_set_weights(fakeserver_t * const srv,
+			    xmpp_conn_t * const conn)
+{
+    char name[8];
+    int i;
+
+    xmpp_conn_set_lane_weight(conn, XMPP_LANE_INTERACTIVE, 1);
+    xmpp_conn_set_lane_weight(conn, XMPP_LANE_BULK, 2);
+
+    fakeserver_fill(srv, conn);
+    for (i = 0; i < 4; i++) {
+	sprintf(name, "i%d", i);
+	send_unit(conn, name, UNIT_LEN, XMPP_LANE_INTERACTIVE);
+    }
+    for (i = 0; i < 6; i++) {
+	sprintf(name, "b%d", i);
+	send_unit(conn, name, UNIT_LEN, XMPP_LANE_BULK);
+    }
+
+    TEST_CHECK(strcmp(drain(srv, conn),
+		      "i0 b0 b1 i1 b2 b3 i2 b4 b5 i3") == 0);
+
+    /* a unit larger than a turn waits until the lane saved up for it */
+    fakeserver_fill(srv, conn);
+    send_unit(conn, "I0", 3 * UNIT_LEN, XMPP_LANE_INTERACTIVE);
+    send_unit(conn, "I1", UNIT_LEN, XMPP_LANE_INTERACTIVE);
+    for (i = 0; i < 8; i++) {
+	sprintf(name, "b%d", i);
+	send_unit(conn, name, UNIT_LEN, XMPP_LANE_BULK);
+    }
+
+    TEST_CHECK(strcmp(drain(srv, conn),
+		      "b0 b1 b2 b3 I0 b4 b5 I1 b6 b7") == 0);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    int sndbuf = 8192;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    if (test_default_weights(srv, conn) || test_set_weights(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
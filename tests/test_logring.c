@@ -0,0 +1,158 @@
+/* test_logring.c
+** libstrophe XMPP client library -- test routines for asynchronous logging
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "test.h"
+
+#define MESSAGES 100
+
+static pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t main_thread;
+static int logged = 0;
+static int last = -1;
+static int out_of_order = 0;
+static int in_main_thread = 0;
+static size_t longest = 0;
+
+/* messages are numbered, and must come in order.  the logger waits
+ * while the gate is held */
+static void logger(void * const userdata, const xmpp_log_level_t level,
+		   const char * const area, const char * const msg)
+{
+    int n;
+
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+
+    if (pthread_equal(pthread_self(), main_thread)) in_main_thread++;
+    if (strlen(msg) > longest) longest = strlen(msg);
+    if (sscanf(msg, "m%d", &n) == 1) {
+	if (n <= last) out_of_order++;
+	last = n;
+    }
+    logged++;
+}
+
+static void reset(void)
+{
+    logged = 0;
+    last = -1;
+    out_of_order = 0;
+    in_main_thread = 0;
+    longest = 0;
+}
+
+/* messages are passed on in order from the logging thread, and the
+ * ones left are passed on when the logger is made synchronous again */
+static int test_order(xmpp_ctx_t * const ctx)
+{
+    int i;
+
+    reset();
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 2 * MESSAGES) == 0);
+    for (i = 0; i < MESSAGES; i++)
+	xmpp_info(ctx, "test", "m%d", i);
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 0) == 0);
+
+    TEST_CHECK(logged == MESSAGES);
+    TEST_CHECK(out_of_order == 0);
+    TEST_CHECK(in_main_thread == 0);
+    TEST_CHECK(xmpp_ctx_get_log_dropped(ctx) == 0);
+
+    /* and synchronous logging is back */
+    reset();
+    xmpp_info(ctx, "test", "m0");
+    TEST_CHECK(logged == 1 && in_main_thread == 1);
+
+    return 0;
+}
+
+/* a stuck logger doesn't hold up logging: what doesn't fit into the
+ * ring is dropped and counted, and what does still comes in order */
+static int test_overflow(xmpp_ctx_t * const ctx)
+{
+    unsigned long dropped;
+    int i;
+
+    reset();
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 8) == 0);
+    pthread_mutex_lock(&gate);
+    for (i = 0; i < MESSAGES; i++)
+	xmpp_info(ctx, "test", "m%d", i);
+    pthread_mutex_unlock(&gate);
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 0) == 0);
+
+    dropped = xmpp_ctx_get_log_dropped(ctx);
+    TEST_CHECK(dropped > 0);
+    TEST_CHECK(logged + dropped == MESSAGES);
+    TEST_CHECK(out_of_order == 0);
+
+    return 0;
+}
+
+/* long messages are truncated rather than dropped */
+static int test_truncate(xmpp_ctx_t * const ctx)
+{
+    char big[2000];
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    reset();
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 4) == 0);
+    xmpp_info(ctx, "test", "%s", big);
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 0) == 0);
+    TEST_CHECK(logged == 1);
+    TEST_CHECK(longest == 1023);
+
+    return 0;
+}
+
+/* without a logger there is nothing to make asynchronous */
+static int test_no_logger(void)
+{
+    xmpp_ctx_t *ctx;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(xmpp_ctx_set_log_async(ctx, 8) != 0);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_log_t log;
+
+    main_thread = pthread_self();
+    log.handler = logger;
+    log.userdata = NULL;
+    ctx = xmpp_ctx_new(NULL, &log);
+    TEST_CHECK(ctx != NULL);
+
+    if (test_no_logger() || test_order(ctx) || test_overflow(ctx) ||
+	test_truncate(ctx))
+	return 1;
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
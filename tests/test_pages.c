@@ -0,0 +1,118 @@
+/* test_pages.c
+** libstrophe XMPP client library -- test routines for send pages
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "fakeserver.h"
+#include "test.h"
+
+#define STANZAS 2000
+
+/* a message with a body of len bytes.  every hundredth one spans
+ * several pages, the others share them */
+static xmpp_stanza_t *make_message(xmpp_ctx_t * const ctx, const int i)
+{
+    xmpp_stanza_t *msg, *body, *text;
+    size_t len = i % 100 ? 10 + i % 300 : 3 * SEND_PAGE_SIZE + i;
+    char id[16], *data;
+
+    msg = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(msg, "message");
+    sprintf(id, "p%d", i);
+    xmpp_stanza_set_id(msg, id);
+
+    data = malloc(len + 1);
+    memset(data, 'a' + i % 26, len);
+    data[len] = '\0';
+    text = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_text(text, data);
+    free(data);
+
+    body = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(body, "body");
+    xmpp_stanza_add_child(body, text);
+    xmpp_stanza_release(text);
+    xmpp_stanza_add_child(msg, body);
+    xmpp_stanza_release(body);
+
+    return msg;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    xmpp_stanza_t *msg;
+    char *expected, *buf;
+    size_t total = 0, size = 0, len;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+
+    /* queue everything before anything is written, so that small
+     * stanzas pile up in shared pages */
+    expected = NULL;
+    fakeserver_pause(srv, 1);
+    for (i = 0; i < STANZAS; i++) {
+	msg = make_message(ctx, i);
+	TEST_CHECK(xmpp_stanza_to_text(msg, &buf, &len) == XMPP_EOK);
+	if (total + len > size) {
+	    size = (total + len) * 2;
+	    expected = realloc(expected, size);
+	}
+	memcpy(&expected[total], buf, len);
+	total += len;
+	xmpp_free(ctx, buf);
+
+	xmpp_send(conn, msg);
+	xmpp_stanza_release(msg);
+    }
+
+    /* every stanza arrives whole, in order */
+    fakeserver_pause(srv, 0);
+    for (i = 0; i < 5000 && fakeserver_input_len(srv) < total; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(fakeserver_input_len(srv) == total);
+    TEST_CHECK(memcmp(fakeserver_input(srv), expected, total) == 0);
+    fakeserver_consume(srv, total);
+
+    /* and so do stanzas sent one at a time once the queue drained */
+    for (i = 0; i < 10; i++) {
+	msg = make_message(ctx, i + 1);
+	TEST_CHECK(xmpp_stanza_to_text(msg, &buf, &len) == XMPP_EOK);
+	xmpp_send(conn, msg);
+	xmpp_stanza_release(msg);
+	TEST_CHECK(fakeserver_expect(srv, buf) == 0);
+	xmpp_free(ctx, buf);
+    }
+
+    free(expected);
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+/* test_post.c
+** libstrophe XMPP client library -- test routines for posting from threads
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "util.h"
+#include "fakeserver.h"
+#include "test.h"
+
+#define PRODUCERS 4
+#define POSTS 200
+
+typedef struct {
+    xmpp_conn_t *conn;
+    int id;
+    int delay; /* ms to wait before posting */
+    int count;
+} producer_t;
+
+/* adopted data freed by the library, from the loop's thread */
+static volatile int freed = 0;
+static int disconnected = 0;
+
+static void conn_handler(xmpp_conn_t * const conn,
+			 const xmpp_conn_event_t status, const int error,
+			 xmpp_stream_error_t * const stream_error,
+			 void * const userdata)
+{
+    if (status == XMPP_CONN_DISCONNECT) disconnected++;
+}
+
+static void free_data(char * const data, void * const userdata)
+{
+    free(data);
+    atomic_add_int(&freed, 1);
+}
+
+static char *message_text(const int producer, const int i)
+{
+    char *text = malloc(64);
+
+    snprintf(text, 64, "<message id=\"t%d-%d\"/>", producer, i);
+    return text;
+}
+
+/* post messages, going through each way of posting in turn */
+static void post_message(xmpp_conn_t * const conn, const int producer,
+			 const int i)
+{
+    xmpp_ctx_t *ctx = xmpp_conn_get_context(conn);
+    xmpp_stanza_t *stanza;
+    xmpp_buffer_t *buffer;
+    char id[32], *text;
+
+    switch (i % 4) {
+    case 0:
+	snprintf(id, sizeof(id), "t%d-%d", producer, i);
+	stanza = xmpp_stanza_new(ctx);
+	xmpp_stanza_set_name(stanza, "message");
+	xmpp_stanza_set_id(stanza, id);
+	xmpp_post(conn, stanza);
+	xmpp_stanza_release(stanza);
+	break;
+    case 1:
+	text = message_text(producer, i);
+	xmpp_post_raw(conn, text, strlen(text));
+	free(text);
+	break;
+    case 2:
+	text = message_text(producer, i);
+	xmpp_post_adopt(conn, text, strlen(text), free_data, NULL);
+	break;
+    case 3:
+	text = message_text(producer, i);
+	buffer = xmpp_buffer_adopt(ctx, text, strlen(text), free_data, NULL);
+	xmpp_post_buffer(conn, buffer);
+	xmpp_buffer_release(buffer);
+	break;
+    }
+}
+
+static void *producer_thread(void *arg)
+{
+    producer_t *producer = (producer_t *)arg;
+    int i;
+
+    if (producer->delay) usleep(producer->delay * 1000);
+    for (i = 0; i < producer->count; i++)
+	post_message(producer->conn, producer->id, i);
+
+    return NULL;
+}
+
+/* whether a producer's messages arrived, in the order it posted them */
+static int in_order(fakeserver_t * const srv, const int producer,
+		    const int count)
+{
+    const char *input = fakeserver_input(srv), *found, *last = input;
+    char attr[32];
+    int i;
+
+    for (i = 0; i < count; i++) {
+	snprintf(attr, sizeof(attr), "id=\"t%d-%d\"", producer, i);
+	found = strstr(input, attr);
+	if (!found || found < last) {
+	    printf("t%d-%d is missing or out of order\n", producer, i);
+	    return 0;
+	}
+	last = found;
+    }
+
+    return 1;
+}
+
+/* several threads post at once while the loop runs.  each thread's
+ * messages are sent in the order it posted them, and adopted data is
+ * freed once written */
+static int test_producers(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    pthread_t threads[PRODUCERS];
+    producer_t producers[PRODUCERS];
+    char last[32];
+    int i, j;
+
+    for (i = 0; i < PRODUCERS; i++) {
+	producers[i].conn = conn;
+	producers[i].id = i;
+	producers[i].delay = 0;
+	producers[i].count = POSTS;
+	TEST_CHECK(pthread_create(&threads[i], NULL, producer_thread,
+				  &producers[i]) == 0);
+    }
+
+    /* run the loop meanwhile, it takes the posts as they come */
+    for (i = 0; i < PRODUCERS; i++) {
+	snprintf(last, sizeof(last), "id=\"t%d-%d\"", i, POSTS - 1);
+	for (j = 0; j < 5000 && !strstr(fakeserver_input(srv), last); j++)
+	    fakeserver_run(srv, 1);
+    }
+    for (i = 0; i < PRODUCERS; i++)
+	TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+
+    for (i = 0; i < PRODUCERS; i++)
+	TEST_CHECK(in_order(srv, i, POSTS));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    /* one in four posts was adopted and one in four a buffer */
+    TEST_CHECK(atomic_get_int(&freed) == PRODUCERS * POSTS / 2);
+
+    return 0;
+}
+
+/* a post wakes the loop up while it waits for the socket */
+static int test_wakeup(fakeserver_t * const srv, xmpp_ctx_t * const ctx,
+		       xmpp_conn_t * const conn)
+{
+    pthread_t thread;
+    producer_t producer;
+    uint64_t start, elapsed;
+
+    /* settle, so that nothing else wakes the loop */
+    fakeserver_run(srv, 20);
+
+    producer.conn = conn;
+    producer.id = PRODUCERS;
+    producer.delay = 50;
+    producer.count = 1;
+    TEST_CHECK(pthread_create(&thread, NULL, producer_thread,
+			      &producer) == 0);
+
+    start = time_stamp();
+    xmpp_run_once(ctx, 5000);
+    elapsed = time_elapsed(start, time_stamp());
+    TEST_CHECK(pthread_join(thread, NULL) == 0);
+    TEST_CHECK(elapsed >= 40 && elapsed < 2500);
+
+    TEST_CHECK(fakeserver_wait(srv, "t4-0") == 0);
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    return 0;
+}
+
+/* posts to a connection which is no longer connected are freed by the
+ * loop without being sent */
+static int test_disconnected(fakeserver_t * const srv,
+			     xmpp_conn_t * const conn)
+{
+    int i, before;
+
+    fakeserver_drop(srv);
+    for (i = 0; i < 5000 && !disconnected; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(disconnected == 1);
+
+    before = atomic_get_int(&freed);
+    post_message(conn, 0, 2);
+    post_message(conn, 0, 3);
+    post_message(conn, 0, 4);
+    fakeserver_run(srv, 10);
+    TEST_CHECK(atomic_get_int(&freed) == before + 2);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", conn_handler, NULL) == 0);
+
+    if (test_producers(srv, conn) || test_wakeup(srv, ctx, conn) ||
+	test_disconnected(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+/* test_queue.c
+** libstrophe XMPP client library -- test routines for send queue limits
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+static int disconnected = 0;
+static xmpp_queue_event_t events[8];
+static int nevents = 0;
+
+static void conn_handler(xmpp_conn_t * const conn,
+			 const xmpp_conn_event_t status, const int error,
+			 xmpp_stream_error_t * const stream_error,
+			 void * const userdata)
+{
+    if (status == XMPP_CONN_DISCONNECT) disconnected++;
+}
+
+static void queue_handler(xmpp_conn_t * const conn,
+			  const xmpp_queue_event_t event,
+			  void * const userdata)
+{
+    if (nevents < 8) events[nevents] = event;
+    nevents++;
+}
+
+/* stanzas past the limit are dropped and counted */
+static int test_reject(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+
+    fakeserver_fill(srv, conn);
+    xmpp_conn_set_send_queue_max(conn, 0,
+				 xmpp_conn_get_send_queue_len(conn) + 2,
+				 XMPP_QUEUE_REJECT);
+    fakeserver_message(conn, "r0", 0);
+    fakeserver_message(conn, "r1", 0);
+    fakeserver_message(conn, "r2", 0);
+    fakeserver_message(conn, "r3", 1);
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.send_queue_rejected == 2);
+
+    fakeserver_drain(srv, conn);
+    TEST_CHECK(fakeserver_received(srv, "r0") &&
+	       fakeserver_received(srv, "r1"));
+    TEST_CHECK(!fakeserver_received(srv, "r2") &&
+	       !fakeserver_received(srv, "r3"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    xmpp_conn_set_send_queue_max(conn, 0, 0, XMPP_QUEUE_REJECT);
+
+    return 0;
+}
+
+/* the oldest droppable stanzas make room, others are kept */
+static int test_drop_oldest(fakeserver_t * const srv,
+			    xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+
+    fakeserver_fill(srv, conn);
+    xmpp_conn_set_send_queue_max(conn, 0,
+				 xmpp_conn_get_send_queue_len(conn) + 3,
+				 XMPP_QUEUE_DROP_OLDEST);
+    fakeserver_message(conn, "d0", 1);
+    fakeserver_message(conn, "k0", 0);
+    fakeserver_message(conn, "d1", 1);
+    fakeserver_message(conn, "k1", 0);
+    fakeserver_message(conn, "k2", 0);
+
+    /* nothing was rejected since the last test */
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.send_queue_dropped == 2);
+    TEST_CHECK(stats.send_queue_rejected == 2);
+
+    fakeserver_drain(srv, conn);
+    TEST_CHECK(!fakeserver_received(srv, "d0") &&
+	       !fakeserver_received(srv, "d1"));
+    TEST_CHECK(fakeserver_received(srv, "k0") &&
+	       fakeserver_received(srv, "k1") &&
+	       fakeserver_received(srv, "k2"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    xmpp_conn_set_send_queue_max(conn, 0, 0, XMPP_QUEUE_REJECT);
+
+    return 0;
+}
+
+/* the handler hears of the high watermark once, and of the low one
+ * once the queue drained */
+static int test_watermarks(fakeserver_t * const srv,
+			   xmpp_conn_t * const conn)
+{
+    size_t queued;
+
+    fakeserver_fill(srv, conn);
+    queued = xmpp_conn_get_send_queue_bytes(conn);
+    xmpp_conn_set_send_queue_watermarks(conn, queued + 40, 100,
+					queue_handler, NULL);
+    fakeserver_message(conn, "w0", 0);
+    TEST_CHECK(nevents == 0);
+    fakeserver_message(conn, "w1", 0);
+    fakeserver_message(conn, "w2", 0);
+    TEST_CHECK(nevents == 1 && events[0] == XMPP_QUEUE_HIGH);
+
+    fakeserver_drain(srv, conn);
+    TEST_CHECK(nevents == 2 && events[1] == XMPP_QUEUE_LOW);
+    TEST_CHECK(fakeserver_received(srv, "w2"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    xmpp_conn_set_send_queue_watermarks(conn, 0, 0, NULL, NULL);
+
+    return 0;
+}
+
+/* the connection is closed on the next iteration */
+static int test_disconnect(fakeserver_t * const srv,
+			   xmpp_conn_t * const conn)
+{
+    fakeserver_fill(srv, conn);
+    xmpp_conn_set_send_queue_max(conn, xmpp_conn_get_send_queue_bytes(conn)
+				 + 10, 0, XMPP_QUEUE_DISCONNECT);
+    fakeserver_message(conn, "x0", 0);
+    TEST_CHECK(disconnected == 0);
+    fakeserver_run(srv, 2);
+    TEST_CHECK(disconnected == 1);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    int sndbuf = 8192;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", conn_handler, NULL) == 0);
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    if (test_reject(srv, conn) || test_drop_oldest(srv, conn) ||
+	test_watermarks(srv, conn) || test_disconnect(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/* test_skip.c
+** libstrophe XMPP client library -- test routines for skipping stanzas
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+#define SM_FEATURE "<sm xmlns='urn:xmpp:sm:3'/>"
+
+static int presences = 0;
+static int bad = 0;
+static int results = 0;
+static int messages = 0;
+
+/* presences are wanted, and must arrive whole */
+static int presence_handler(xmpp_conn_t * const conn,
+			    xmpp_stanza_t * const stanza,
+			    void * const userdata)
+{
+    xmpp_stanza_t *status;
+    char *text;
+
+    presences++;
+    status = xmpp_stanza_get_child_by_name(stanza, "status");
+    text = status ? xmpp_stanza_get_text(status) : NULL;
+    if (!text || strcmp(text, "here") != 0) bad++;
+    if (text) xmpp_free(xmpp_conn_get_context(conn), text);
+
+    return 1;
+}
+
+static int result_handler(xmpp_conn_t * const conn,
+			  xmpp_stanza_t * const stanza,
+			  void * const userdata)
+{
+    results++;
+    return 1;
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    messages++;
+    if (strcmp(xmpp_stanza_get_id(stanza), "m2") != 0) bad++;
+    return 1;
+}
+
+static unsigned long skipped(xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+
+    xmpp_conn_get_stats(conn, &stats);
+    return stats.stanzas_skipped;
+}
+
+/* run the client until it handled a number of presences */
+static int wait_presences(fakeserver_t * const srv, const int count)
+{
+    int i;
+
+    for (i = 0; i < 5000 && presences < count; i++)
+	fakeserver_run(srv, 1);
+
+    return presences == count ? 0 : -1;
+}
+
+/* stanzas no handler wants are skipped, and still counted for stream
+ * management */
+static int test_sm_count(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    unsigned long before = skipped(conn);
+
+    fakeserver_send(srv, "<message id='s0'><body>hi</body></message>");
+    fakeserver_send(srv, "<iq type='set' id='s1'><query xmlns='q'/></iq>");
+    fakeserver_send(srv, "<message id='s2'/>");
+    fakeserver_send(srv, "<presence><status>here</status></presence>");
+    TEST_CHECK(wait_presences(srv, 1) == 0);
+    TEST_CHECK(skipped(conn) == before + 3);
+
+    fakeserver_send(srv, "<r xmlns='urn:xmpp:sm:3'/>");
+    TEST_CHECK(fakeserver_expect(srv, "<a xmlns='urn:xmpp:sm:3' "
+				 "h='4'/>") == 0);
+
+    return 0;
+}
+
+/* a stanza with the id an id handler waits for is built */
+static int test_id_handler(fakeserver_t * const srv,
+			   xmpp_conn_t * const conn)
+{
+    unsigned long before = skipped(conn);
+
+    xmpp_id_handler_add(conn, result_handler, "q1", NULL);
+    fakeserver_send(srv, "<iq type='result' id='q0'/>");
+    fakeserver_send(srv, "<iq type='result' id='q1'><query/></iq>");
+    fakeserver_send(srv, "<presence><status>here</status></presence>");
+    TEST_CHECK(wait_presences(srv, 2) == 0);
+    TEST_CHECK(results == 1);
+    TEST_CHECK(skipped(conn) == before + 1);
+    xmpp_id_handler_delete(conn, result_handler, "q1");
+
+    return 0;
+}
+
+/* a skipped stanza may arrive a few bytes at a time, with children
+ * named like stanzas, and what follows it is parsed as usual */
+static int test_nested(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    static const char * const chunks[] = {
+	"<mess", "age id='n0'><x xmlns='a'><message><bo", "dy>one</body>",
+	"<iq/><presence><status>not</stat", "us></presence></message>",
+	"<x><x><x/></x></x></x><body>t", "wo</body></mes", "sage><pres",
+	"ence><status>he", "re</status></presence>", NULL
+    };
+    unsigned long before = skipped(conn);
+    int i;
+
+    for (i = 0; chunks[i]; i++) {
+	fakeserver_send(srv, chunks[i]);
+	fakeserver_run(srv, 3);
+    }
+    TEST_CHECK(wait_presences(srv, 3) == 0);
+    TEST_CHECK(bad == 0);
+    TEST_CHECK(skipped(conn) == before + 1);
+
+    fakeserver_send(srv, "<r xmlns='urn:xmpp:sm:3'/>");
+    TEST_CHECK(fakeserver_expect(srv, "<a xmlns='urn:xmpp:sm:3' "
+				 "h='9'/>") == 0);
+
+    return 0;
+}
+
+/* whether to skip a stanza is decided at its start tag, so a handler
+ * added while it arrives sees only the stanzas after it */
+static int test_added_late(fakeserver_t * const srv,
+			   xmpp_conn_t * const conn)
+{
+    unsigned long before = skipped(conn);
+
+    fakeserver_send(srv, "<message id='m1'><body>o");
+    fakeserver_run(srv, 10);
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    fakeserver_send(srv, "ne</body></message><message id='m2'/>");
+    fakeserver_send(srv, "<presence><status>here</status></presence>");
+    TEST_CHECK(wait_presences(srv, 4) == 0);
+    TEST_CHECK(messages == 1);
+    TEST_CHECK(bad == 0);
+    TEST_CHECK(skipped(conn) == before + 1);
+    xmpp_handler_delete(conn, message_handler);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    xmpp_conn_set_recv_buffer_size(conn, 16);
+    xmpp_conn_set_stream_management(conn, 1);
+    TEST_CHECK(fakeserver_start(srv, conn, SM_FEATURE, NULL, NULL) == 0);
+    TEST_CHECK(fakeserver_expect(srv, "<enable ") == 0);
+    fakeserver_send(srv, "<enabled xmlns='urn:xmpp:sm:3'/>");
+    fakeserver_run(srv, 10);
+    xmpp_handler_add(conn, presence_handler, NULL, "presence", NULL, NULL);
+
+    if (test_sm_count(srv, conn) || test_id_handler(srv, conn) ||
+	test_nested(srv, conn) || test_added_late(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
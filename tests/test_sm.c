@@ -0,0 +1,336 @@
+/* test_sm.c
+** libstrophe XMPP client library -- test routines for stream management
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "fakeserver.h"
+#include "test.h"
+
+#define SM_FEATURE "<sm xmlns='urn:xmpp:sm:3'/>"
+
+/* more than the sockets take while the server waits */
+#define FILLER_LEN (1024 * 1024)
+
+static int connects = 0;
+static int disconnected = 0;
+
+static void conn_handler(xmpp_conn_t * const conn,
+			 const xmpp_conn_event_t status, const int error,
+			 xmpp_stream_error_t * const stream_error,
+			 void * const userdata)
+{
+    if (status == XMPP_CONN_CONNECT) connects++;
+    else if (status == XMPP_CONN_DISCONNECT) disconnected++;
+}
+
+/* acknowledge the first h stanzas the client sent */
+static void ack(fakeserver_t * const srv, const unsigned int h)
+{
+    char buf[64];
+
+    sprintf(buf, "<a xmlns='urn:xmpp:sm:3' h='%u'/>", h);
+    fakeserver_send(srv, buf);
+    fakeserver_run(srv, 10);
+}
+
+/* wait for the client to report a broken connection */
+static int wait_disconnect(fakeserver_t * const srv)
+{
+    int i, before = disconnected;
+
+    for (i = 0; i < 5000 && disconnected == before; i++)
+	fakeserver_run(srv, 1);
+
+    return disconnected > before ? 0 : -1;
+}
+
+/* the client asks to enable stream management once it has a session,
+ * and the server offers to resume it */
+static int test_enable(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    TEST_CHECK(fakeserver_start(srv, conn, SM_FEATURE, conn_handler,
+				NULL) == 0);
+    TEST_CHECK(fakeserver_expect(srv, "<enable xmlns='urn:xmpp:sm:3' "
+				 "resume='true'/>") == 0);
+    fakeserver_send(srv, "<enabled xmlns='urn:xmpp:sm:3' id='s1' "
+		    "resume='true'/>");
+    fakeserver_run(srv, 10);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+    TEST_CHECK(!xmpp_conn_is_resumed(conn));
+
+    return 0;
+}
+
+/* both ends count the stanzas they receive, and ask for the other's
+ * count */
+static int test_ack(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    fakeserver_send(srv, "<message id='s0'/>");
+    fakeserver_send(srv, "<r xmlns='urn:xmpp:sm:3'/>");
+    TEST_CHECK(fakeserver_expect(srv, "<a xmlns='urn:xmpp:sm:3' "
+				 "h='1'/>") == 0);
+
+    fakeserver_message(conn, "a0", 0);
+    fakeserver_message(conn, "a1", 0);
+    fakeserver_message(conn, "a2", 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"a2\"") == 0);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 3);
+    TEST_CHECK(fakeserver_expect(srv, "<r xmlns='urn:xmpp:sm:3'/>") == 0);
+
+    /* the client asks once at a time, and with one stanza left
+     * unacknowledged it asks again */
+    ack(srv, 2);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 1);
+    TEST_CHECK(fakeserver_expect(srv, "<r xmlns='urn:xmpp:sm:3'/>") == 0);
+    ack(srv, 3);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+
+    return 0;
+}
+
+/* a stanza which starts in the last bytes of a page is counted and
+ * kept like any other, though its first slice is cut off mid-name */
+static int test_page_end(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_ctx_t *ctx = xmpp_conn_get_context(conn);
+    xmpp_stanza_t *msg, *body, *text;
+    char *buf, *pad;
+    size_t len;
+
+    /* the page is let go of once the queue is empty, so m0 starts a
+     * fresh one, and leaves 5 bytes of it for m1 */
+    fakeserver_drain(srv, conn);
+    msg = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(msg, "message");
+    xmpp_stanza_set_id(msg, "m0");
+    body = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_name(body, "body");
+    text = xmpp_stanza_new(ctx);
+    xmpp_stanza_set_text(text, "x");
+    xmpp_stanza_add_child(body, text);
+    xmpp_stanza_add_child(msg, body);
+    TEST_CHECK(xmpp_stanza_to_text(msg, &buf, &len) == 0);
+    xmpp_free(ctx, buf);
+    pad = malloc(SEND_PAGE_SIZE);
+    memset(pad, 'x', SEND_PAGE_SIZE - 5 - len + 1);
+    pad[SEND_PAGE_SIZE - 5 - len + 1] = '\0';
+    xmpp_stanza_set_text(text, pad);
+    free(pad);
+    xmpp_stanza_release(text);
+    xmpp_stanza_release(body);
+
+    xmpp_send(conn, msg);
+    xmpp_stanza_release(msg);
+    fakeserver_message(conn, "m1", 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"m1\"") == 0);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 2);
+
+    ack(srv, 5);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+    TEST_CHECK(disconnected == 0);
+
+    return 0;
+}
+
+/* stanzas picked for writing were counted and kept, so dropping the
+ * oldest spares them even when they are droppable */
+static int test_drop_oldest(fakeserver_t * const srv,
+			    xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    char *filler;
+
+    /* the filler and d0 are picked together, and the filler keeps d0
+     * from being written */
+    xmpp_conn_set_write_budget(conn, 4 * FILLER_LEN);
+    filler = malloc(FILLER_LEN);
+    memset(filler, ' ', FILLER_LEN);
+    fakeserver_pause(srv, 1);
+    xmpp_send_raw(conn, filler, FILLER_LEN);
+    free(filler);
+    fakeserver_message(conn, "d0", 1);
+    fakeserver_run(srv, 20);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 1);
+
+    xmpp_conn_set_send_queue_max(conn, 0, xmpp_conn_get_send_queue_len(conn),
+				 XMPP_QUEUE_DROP_OLDEST);
+    fakeserver_message(conn, "k0", 0);
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.send_queue_dropped == 0);
+    TEST_CHECK(stats.send_queue_rejected == 1);
+    xmpp_conn_set_send_queue_max(conn, 0, 0, XMPP_QUEUE_REJECT);
+    xmpp_conn_set_write_budget(conn, 65536);
+
+    fakeserver_pause(srv, 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"d0\"") == 0);
+    ack(srv, 6);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+    TEST_CHECK(disconnected == 0);
+
+    return 0;
+}
+
+/* a broken connection resumes its session: the stanzas the server
+ * missed go out again, before those which were waiting in the lanes */
+static int test_resume(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    const char *in, *f, *p0, *p1;
+    char *big;
+    int i;
+
+    /* u0 arrives, f is cut off, p0 and p1 are still in the lanes */
+    fakeserver_message(conn, "u0", 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"u0\"") == 0);
+    big = malloc(FILLER_LEN + 64);
+    strcpy(big, "<message id='f'><body>");
+    memset(big + strlen(big), 'f', FILLER_LEN);
+    strcpy(big + 22 + FILLER_LEN, "</body></message>");
+    fakeserver_pause(srv, 1);
+    xmpp_send_raw(conn, big, strlen(big));
+    free(big);
+    fakeserver_run(srv, 20);
+    fakeserver_message(conn, "p0", 0);
+    fakeserver_message(conn, "p1", 0);
+    fakeserver_run(srv, 5);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 2);
+
+    fakeserver_drop(srv);
+    TEST_CHECK(wait_disconnect(srv) == 0);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 2);
+
+    /* the server got u0, and the client says it got s0 */
+    fakeserver_pause(srv, 0);
+    TEST_CHECK(fakeserver_connect(srv, conn, conn_handler, NULL) == 0);
+    TEST_CHECK(fakeserver_auth(srv, SM_FEATURE) == 0);
+    TEST_CHECK(fakeserver_wait(srv, "<resume") == 0);
+    TEST_CHECK(fakeserver_wait(srv, "/>") == 0);
+    in = strstr(fakeserver_input(srv), "<resume");
+    TEST_CHECK(strstr(in, "previd=\"s1\"") && strstr(in, "h=\"1\""));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    fakeserver_send(srv, "<resumed xmlns='urn:xmpp:sm:3' h='7' "
+		    "previd='s1'/>");
+
+    for (i = 0; i < 5000 && connects < 2; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(connects == 2);
+    TEST_CHECK(xmpp_conn_is_resumed(conn));
+
+    TEST_CHECK(fakeserver_wait(srv, "id=\"p1\"") == 0);
+    in = fakeserver_input(srv);
+    f = strstr(in, "<message id='f'>");
+    p0 = strstr(in, "id=\"p0\"");
+    p1 = strstr(in, "id=\"p1\"");
+    TEST_CHECK(f && p0 && f < p0 && p0 < p1);
+    TEST_CHECK(!strstr(in, "id=\"u0\""));
+    TEST_CHECK(strstr(f, "</body></message>") < p0);
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.sm_resent == 1);
+    TEST_CHECK(stats.sm_lost == 0);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 3);
+    ack(srv, 10);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+
+    return 0;
+}
+
+/* a session the server forgot is lost, and a new one is started */
+static int test_failed(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    xmpp_conn_stats_t stats;
+    int i;
+
+    fakeserver_message(conn, "u1", 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"u1\"") == 0);
+    fakeserver_drop(srv);
+    TEST_CHECK(wait_disconnect(srv) == 0);
+
+    TEST_CHECK(fakeserver_connect(srv, conn, conn_handler, NULL) == 0);
+    TEST_CHECK(fakeserver_auth(srv, SM_FEATURE) == 0);
+    TEST_CHECK(fakeserver_expect(srv, "<resume") == 0);
+    fakeserver_send(srv, "<failed xmlns='urn:xmpp:sm:3'/>");
+    TEST_CHECK(fakeserver_bind(srv) == 0);
+    TEST_CHECK(fakeserver_expect(srv, "<enable xmlns='urn:xmpp:sm:3' "
+				 "resume='true'/>") == 0);
+    fakeserver_send(srv, "<enabled xmlns='urn:xmpp:sm:3' id='s2' "
+		    "resume='true'/>");
+
+    for (i = 0; i < 5000 && connects < 3; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(connects == 3);
+    TEST_CHECK(!xmpp_conn_is_resumed(conn));
+
+    xmpp_conn_get_stats(conn, &stats);
+    TEST_CHECK(stats.sm_lost == 1);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+
+    /* the new session counts from zero */
+    fakeserver_message(conn, "n0", 0);
+    TEST_CHECK(fakeserver_expect(srv, "id=\"n0\"") == 0);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 1);
+    ack(srv, 1);
+    TEST_CHECK(xmpp_conn_get_unacked(conn) == 0);
+
+    return 0;
+}
+
+/* a server acknowledging stanzas it was never sent is not trusted */
+static int test_bad_ack(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    ack(srv, 100);
+    TEST_CHECK(fakeserver_expect(srv, "</stream:stream>") == 0);
+    fakeserver_drop(srv);
+    TEST_CHECK(wait_disconnect(srv) == 0);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    int sndbuf = 8192;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    xmpp_conn_set_stream_management(conn, 1);
+    xmpp_conn_set_ack_interval(conn, 10);
+
+    if (test_enable(srv, conn)) return 1;
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+    if (test_ack(srv, conn) || test_page_end(srv, conn) ||
+	test_drop_oldest(srv, conn) || test_resume(srv, conn) ||
+	test_failed(srv, conn) || test_bad_ack(srv, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/* test_threads.c
+** libstrophe XMPP client library -- test routines for event loop threads
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* the thread which ran the message handler last */
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t seen_thread;
+
+/* replies to each message with its id and the loop handling it, and
+ * moves the connection to the other loop when asked to */
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    const char *id = xmpp_stanza_get_id(stanza);
+    char reply[64];
+    int loop = xmpp_conn_get_thread(conn);
+
+    if (!id) return 1;
+
+    pthread_mutex_lock(&seen_lock);
+    seen_thread = pthread_self();
+    pthread_mutex_unlock(&seen_lock);
+
+    if (strcmp(id, "move") == 0)
+	TEST_CHECK(xmpp_conn_migrate(conn, 1 - loop) == 0);
+
+    snprintf(reply, sizeof(reply), "re-%s-%d", id, loop);
+    fakeserver_message(conn, reply, 0);
+
+    return 1;
+}
+
+/* send a message and return the loop which answered it, -1 if none */
+static int exchange(fakeserver_t * const srv, const char * const id)
+{
+    char text[64];
+    const char *found;
+    int loop;
+
+    snprintf(text, sizeof(text), "<message id='%s'/>", id);
+    fakeserver_send(srv, text);
+    snprintf(text, sizeof(text), "re-%s-", id);
+    if (fakeserver_wait(srv, text) < 0) return -1;
+
+    found = strstr(fakeserver_input(srv), text);
+    loop = found[strlen(text)] - '0';
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+
+    return loop;
+}
+
+/* ask the connection to move away from a loop, and wait until the
+ * other loop answers.  the connection leaves once no socket operation
+ * is outstanding for it, so the old loop may still answer a few */
+static int move(fakeserver_t * const srv, const int from)
+{
+    char id[16];
+    int i;
+
+    TEST_CHECK(exchange(srv, "move") == from);
+    for (i = 0; i < 100; i++) {
+	snprintf(id, sizeof(id), "p%d", i);
+	if (exchange(srv, id) == 1 - from) return 0;
+    }
+
+    return -1;
+}
+
+/* connect and log in, with messages answered by message_handler */
+static xmpp_conn_t *start(xmpp_ctx_t * const ctx, fakeserver_t * const srv)
+{
+    xmpp_conn_t *conn;
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    if (fakeserver_start(srv, conn, "", NULL, NULL) < 0) {
+	xmpp_conn_release(conn);
+	return NULL;
+    }
+
+    return conn;
+}
+
+/* a connection moved while the context is run from one thread keeps
+ * exchanging stanzas */
+static int test_run_once(void)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(xmpp_ctx_set_threads(ctx, 2) == 0);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+    conn = start(ctx, srv);
+    TEST_CHECK(conn != NULL);
+
+    TEST_CHECK(xmpp_conn_get_thread(conn) == 0);
+    TEST_CHECK(exchange(srv, "a0") == 0);
+
+    TEST_CHECK(move(srv, 0) == 0);
+    TEST_CHECK(xmpp_conn_get_thread(conn) == 1);
+    TEST_CHECK(exchange(srv, "a1") == 1);
+    TEST_CHECK(exchange(srv, "a2") == 1);
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
+
+static void *run_thread(void *arg)
+{
+    xmpp_run((xmpp_ctx_t *)arg);
+    return NULL;
+}
+
+static pthread_t last_thread(void)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&seen_lock);
+    thread = seen_thread;
+    pthread_mutex_unlock(&seen_lock);
+
+    return thread;
+}
+
+/* with a thread per loop, the connection's handlers run in the thread
+ * of its new loop after the move, and xmpp_stop() from another thread
+ * ends them all */
+static int test_threads(void)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    pthread_t runner;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(xmpp_ctx_set_threads(ctx, 2) == 0);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+    fakeserver_detach(srv, 1);
+
+    /* loop 0 is driven by the thread calling xmpp_run() */
+    TEST_CHECK(pthread_create(&runner, NULL, run_thread, ctx) == 0);
+    /* connect once the loop threads run, the connection is then
+     * handed over to them */
+    while (!atomic_get_int(&ctx->threaded))
+	usleep(1000);
+    conn = start(ctx, srv);
+    TEST_CHECK(conn != NULL);
+
+    TEST_CHECK(exchange(srv, "b0") == 0);
+    TEST_CHECK(pthread_equal(last_thread(), runner));
+
+    TEST_CHECK(move(srv, 0) == 0);
+    TEST_CHECK(exchange(srv, "b1") == 1);
+    TEST_CHECK(!pthread_equal(last_thread(), runner));
+
+    xmpp_stop(ctx);
+    TEST_CHECK(pthread_join(runner, NULL) == 0);
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (test_run_once() || test_threads())
+	return 1;
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* test_uring.c
+** libstrophe XMPP client library -- test routines for the io_uring engine
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "util.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* the exit status which tells make check a test was skipped */
+#define SKIPPED 77
+
+#ifdef HAVE_IO_URING
+
+static int messages = 0;
+static int ticks = 0;
+static uint64_t fired;
+
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    messages++;
+    return 1;
+}
+
+static int timed_handler(xmpp_conn_t * const conn, void * const userdata)
+{
+    ticks++;
+    fired = time_stamp();
+    return 0;
+}
+
+/* an idle loop waits as long as it was asked to, each time, and has
+ * no timeout left over afterwards */
+static int test_wait(xmpp_ctx_t * const ctx)
+{
+    uint64_t start, elapsed;
+    int i;
+
+    /* setting up the ring completes right away */
+    xmpp_run_once(ctx, 30);
+
+    for (i = 0; i < 3; i++) {
+	start = time_stamp();
+	xmpp_run_once(ctx, 30);
+	elapsed = time_elapsed(start, time_stamp());
+	TEST_CHECK(elapsed >= 25 && elapsed < 1000);
+	TEST_CHECK(!ctx->loops[0].ring_timeout_queued);
+    }
+
+    return 0;
+}
+
+/* stanzas are read, and a write which fills the socket is finished once
+ * the server reads again */
+static int test_exchange(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    int i;
+
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    fakeserver_send(srv, "<message id='s0'/><message id='s1'/>");
+    for (i = 0; i < 5000 && messages < 2; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(messages == 2);
+
+    fakeserver_fill(srv, conn);
+    TEST_CHECK(xmpp_conn_get_send_queue_bytes(conn) > 0);
+    fakeserver_message(conn, "c0", 0);
+    fakeserver_drain(srv, conn);
+    TEST_CHECK(fakeserver_received(srv, "c0"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    xmpp_handler_delete(conn, message_handler);
+
+    return 0;
+}
+
+/* a wait ends in time for the next timed handler */
+static int test_timed(xmpp_ctx_t * const ctx, xmpp_conn_t * const conn)
+{
+    uint64_t start, elapsed;
+
+    xmpp_timed_handler_add(conn, timed_handler, 40, NULL);
+    start = time_stamp();
+    while (!ticks && time_elapsed(start, time_stamp()) < 1000)
+	xmpp_run_once(ctx, 200);
+    elapsed = time_elapsed(start, fired);
+    TEST_CHECK(ticks == 1);
+    TEST_CHECK(elapsed >= 35 && elapsed < 150);
+    TEST_CHECK(!ctx->loops[0].ring_timeout_queued);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    int sndbuf = 8192;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    TEST_CHECK(ctx != NULL);
+    if (ctx->loops[0].ev_backend != XMPP_EVENT_URING) {
+	printf("io_uring isn't available, skipping\n");
+	xmpp_ctx_free(ctx);
+	return SKIPPED;
+    }
+
+    if (test_wait(ctx)) return 1;
+
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    if (test_exchange(srv, conn) || test_timed(ctx, conn))
+	return 1;
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    printf("built without io_uring, skipping\n");
+    return SKIPPED;
+}
+
+#endif /* HAVE_IO_URING */
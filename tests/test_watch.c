@@ -0,0 +1,208 @@
+/* test_watch.c
+** libstrophe XMPP client library -- test routines for external event loops
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "util.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* the application's view of the client's socket, kept up to date by
+ * the watch handler only */
+typedef struct {
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    int fd;
+    int events;
+    int calls;
+    int writes; /* times write interest was reported */
+} watch_t;
+
+static int messages = 0;
+static int ticks = 0;
+static uint64_t fired;
+
+static void watch_handler(xmpp_conn_t * const conn, const int fd,
+			  const int events, void * const userdata)
+{
+    watch_t *watch = (watch_t *)userdata;
+
+    watch->conn = conn;
+    watch->fd = fd;
+    if ((events & XMPP_IO_WRITE) && !(watch->events & XMPP_IO_WRITE))
+	watch->writes++;
+    watch->events = events;
+    watch->calls++;
+}
+
+/* one iteration of the application's loop: poll the watched socket for
+ * up to 1 ms or until timers are due, then hand over what is ready */
+static void drive(void * const userdata)
+{
+    watch_t *watch = (watch_t *)userdata;
+    struct pollfd pfd;
+    unsigned long next;
+    int events = 0;
+
+    next = xmpp_run_timers(watch->ctx);
+
+    pfd.fd = watch->events ? watch->fd : -1;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (watch->events & XMPP_IO_READ) pfd.events |= POLLIN;
+    if (watch->events & XMPP_IO_WRITE) pfd.events |= POLLOUT;
+
+    if (poll(&pfd, 1, next < 1 ? (int)next : 1) > 0) {
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+	    events |= XMPP_IO_READ;
+	if (pfd.revents & POLLOUT)
+	    events |= XMPP_IO_WRITE;
+	xmpp_conn_handle_io(watch->conn, events & watch->events);
+    }
+
+    xmpp_run_timers(watch->ctx);
+}
+
+static int message_handler(xmpp_conn_t * const conn,
+			   xmpp_stanza_t * const stanza,
+			   void * const userdata)
+{
+    messages++;
+    return 1;
+}
+
+static int timed_handler(xmpp_conn_t * const conn, void * const userdata)
+{
+    ticks++;
+    fired = time_stamp();
+    return 0;
+}
+
+/* the handler reports the socket the connection actually uses */
+static int test_session(watch_t * const watch, xmpp_conn_t * const conn)
+{
+    TEST_CHECK(watch->calls > 0);
+    TEST_CHECK(watch->conn == conn);
+    TEST_CHECK(watch->fd == xmpp_conn_get_fd(conn));
+    TEST_CHECK(watch->events == xmpp_conn_get_events(conn));
+    TEST_CHECK(watch->events == XMPP_IO_READ);
+
+    return 0;
+}
+
+/* stanzas from the server are read once the socket polls readable */
+static int test_read(fakeserver_t * const srv, xmpp_conn_t * const conn)
+{
+    int i;
+
+    xmpp_handler_add(conn, message_handler, NULL, "message", NULL, NULL);
+    fakeserver_send(srv, "<message id='s0'/><message id='s1'/>");
+    for (i = 0; i < 5000 && messages < 2; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(messages == 2);
+    xmpp_handler_delete(conn, message_handler);
+
+    return 0;
+}
+
+/* a write which fills the socket asks for write interest, which is
+ * dropped again once the queue is written */
+static int test_write(fakeserver_t * const srv, watch_t * const watch,
+		      xmpp_conn_t * const conn)
+{
+    int writes = watch->writes;
+
+    fakeserver_fill(srv, conn);
+    TEST_CHECK(xmpp_conn_get_send_queue_bytes(conn) > 0);
+    TEST_CHECK(watch->events == (XMPP_IO_READ | XMPP_IO_WRITE));
+    TEST_CHECK(xmpp_conn_get_events(conn) == watch->events);
+    TEST_CHECK(watch->writes == writes + 1);
+
+    fakeserver_message(conn, "c0", 0);
+    fakeserver_drain(srv, conn);
+    TEST_CHECK(fakeserver_received(srv, "c0"));
+    fakeserver_consume(srv, fakeserver_input_len(srv));
+    TEST_CHECK(watch->events == XMPP_IO_READ);
+    TEST_CHECK(xmpp_conn_get_events(conn) == XMPP_IO_READ);
+
+    return 0;
+}
+
+/* xmpp_run_timers() tells how long the application may wait, and fires
+ * the timed handler once that time has passed */
+static int test_timed(watch_t * const watch, xmpp_conn_t * const conn)
+{
+    uint64_t start;
+    unsigned long next;
+    int i;
+
+    start = time_stamp();
+    xmpp_timed_handler_add(conn, timed_handler, 40, NULL);
+    next = xmpp_run_timers(watch->ctx);
+    TEST_CHECK(next > 0 && next <= 40);
+    TEST_CHECK(ticks == 0);
+
+    for (i = 0; i < 100 && !ticks; i++) {
+	poll(NULL, 0, (int)next);
+	next = xmpp_run_timers(watch->ctx);
+    }
+    TEST_CHECK(ticks == 1);
+    TEST_CHECK(time_elapsed(start, fired) >= 35);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    watch_t watch;
+    int sndbuf = 8192, i;
+
+    memset(&watch, 0, sizeof(watch));
+    ctx = xmpp_ctx_new(NULL, NULL);
+    watch.ctx = ctx;
+    TEST_CHECK(xmpp_ctx_set_watch_handler(ctx, watch_handler, &watch) == 0);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+    fakeserver_set_driver(srv, drive, &watch);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    if (test_session(&watch, conn) || test_read(srv, conn) ||
+	test_write(srv, &watch, conn) || test_timed(&watch, conn))
+	return 1;
+
+    /* the socket is no longer to be watched once the server closed it */
+    fakeserver_drop(srv);
+    for (i = 0; i < 5000 && watch.events; i++)
+	drive(&watch);
+    TEST_CHECK(watch.events == 0);
+
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+/* test_wheel.c
+** libstrophe XMPP client library -- test routines for the timer wheel
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strophe.h"
+#include "common.h"
+#include "wheel.h"
+#include "test.h"
+
+/* the span of each level, 64 slots of the level below */
+#define LEVEL1 ((uint64_t)1 << 6)
+#define LEVEL2 ((uint64_t)1 << 12)
+#define LEVEL3 ((uint64_t)1 << 18)
+#define RANGE ((uint64_t)1 << 24)
+
+#define NTIMERS 1000
+
+typedef struct {
+    wheel_timer_t timer;
+    wheel_t *wheel;
+    uint64_t fired; /* when the callback ran last */
+    int count; /* times the callback ran */
+    int early; /* times it ran before the timer expired */
+    int rearm; /* times left to add the timer again */
+    uint64_t period;
+} test_timer_t;
+
+static void timer_fire(wheel_timer_t * const timer, const uint64_t now)
+{
+    test_timer_t *t = (test_timer_t *)timer->userdata;
+
+    t->fired = now;
+    t->count++;
+    if (now < timer->expires) t->early++;
+    if (t->rearm > 0) {
+	t->rearm--;
+	wheel_add(t->wheel, timer, now + t->period);
+    }
+}
+
+static void timer_init(test_timer_t * const t, wheel_t * const wheel)
+{
+    memset(t, 0, sizeof(*t));
+    t->wheel = wheel;
+    wheel_timer_init(&t->timer, timer_fire, t);
+}
+
+/* advance the wheel the way the event loop does, waking up when
+ * wheel_next() says.  returns the time when no timers were left */
+static uint64_t run_until_empty(wheel_t * const wheel, uint64_t now,
+				int * const steps)
+{
+    uint64_t next;
+
+    *steps = 0;
+    while ((next = wheel_next(wheel, now)) != (uint64_t)-1) {
+	now += next;
+	wheel_run(wheel, now);
+	(*steps)++;
+	if (*steps > 100000) break;
+    }
+
+    return now;
+}
+
+/* timers on every level are cascaded down and fire at exactly their
+ * expiry time, never before */
+static int test_cascade(xmpp_ctx_t * const ctx, const uint64_t start)
+{
+    static const uint64_t delays[] = {
+	0, 1, 5, LEVEL1 - 1, LEVEL1, LEVEL1 + 1, 1000, LEVEL2 - 1, LEVEL2,
+	LEVEL2 + 7, 100000, LEVEL3, LEVEL3 + 1, 5000000, RANGE - 2
+    };
+    const int n = sizeof(delays) / sizeof(delays[0]);
+    test_timer_t timers[sizeof(delays) / sizeof(delays[0])];
+    wheel_t *wheel;
+    int i, steps;
+
+    wheel = wheel_new(ctx, start);
+    TEST_CHECK(wheel != NULL);
+    for (i = 0; i < n; i++) {
+	timer_init(&timers[i], wheel);
+	wheel_add(wheel, &timers[i].timer, start + delays[i]);
+	TEST_CHECK(wheel_pending(&timers[i].timer));
+    }
+
+    run_until_empty(wheel, start, &steps);
+    for (i = 0; i < n; i++) {
+	if (timers[i].count != 1 ||
+	    timers[i].fired != start + delays[i]) {
+	    printf("timer at +%llu fired %d times, at +%llu\n",
+		   (unsigned long long)delays[i], timers[i].count,
+		   (unsigned long long)(timers[i].fired - start));
+	    return 1;
+	}
+	TEST_CHECK(!wheel_pending(&timers[i].timer));
+    }
+
+    /* waking up only for timers and cascades */
+    TEST_CHECK(steps < n * 4);
+
+    wheel_free(wheel);
+
+    return 0;
+}
+
+/* many timers at random times, the wheel advanced in random steps as a
+ * loop woken up by other events would: each timer fires once, on the
+ * first run at or after its expiry */
+static int test_random(xmpp_ctx_t * const ctx, const uint64_t start)
+{
+    test_timer_t *timers;
+    wheel_t *wheel;
+    uint64_t now, next, step, delay;
+    int i;
+
+    timers = malloc(NTIMERS * sizeof(test_timer_t));
+    TEST_CHECK(timers != NULL);
+    wheel = wheel_new(ctx, start);
+    for (i = 0; i < NTIMERS; i++) {
+	timer_init(&timers[i], wheel);
+	delay = ((uint64_t)rand() << 8 | rand() % 256) % (RANGE / 4);
+	wheel_add(wheel, &timers[i].timer, start + delay);
+    }
+
+    now = start;
+    while ((next = wheel_next(wheel, now)) != (uint64_t)-1) {
+	step = (uint64_t)rand() % 2048;
+	now += step < next ? step : next;
+	wheel_run(wheel, now);
+    }
+
+    for (i = 0; i < NTIMERS; i++) {
+	if (timers[i].count != 1 || timers[i].early) {
+	    printf("timer due at %llu fired %d times, last at %llu\n",
+		   (unsigned long long)timers[i].timer.expires,
+		   timers[i].count, (unsigned long long)timers[i].fired);
+	    return 1;
+	}
+	/* not later than the first run past its expiry either */
+	TEST_CHECK(timers[i].fired - timers[i].timer.expires < 2048);
+    }
+
+    wheel_free(wheel);
+    free(timers);
+
+    return 0;
+}
+
+/* cancelled timers never fire, whether they are still on their first
+ * level or were cascaded down already */
+static int test_cancel(xmpp_ctx_t * const ctx, const uint64_t start)
+{
+    test_timer_t timers[6];
+    wheel_t *wheel;
+    int i, steps;
+
+    wheel = wheel_new(ctx, start);
+    for (i = 0; i < 6; i++) timer_init(&timers[i], wheel);
+    wheel_add(wheel, &timers[0].timer, start + 10);
+    wheel_add(wheel, &timers[1].timer, start + 20);
+    wheel_add(wheel, &timers[2].timer, start + 3000);
+    wheel_add(wheel, &timers[3].timer, start + 3001);
+    wheel_add(wheel, &timers[4].timer, start + 300000);
+    wheel_add(wheel, &timers[5].timer, start + 300001);
+
+    /* before anything moved */
+    wheel_del(&timers[1].timer);
+    TEST_CHECK(!wheel_pending(&timers[1].timer));
+    wheel_del(&timers[1].timer);
+
+    /* after the level 2 slot was cascaded */
+    wheel_run(wheel, start + 2990);
+    TEST_CHECK(timers[0].count == 1);
+    TEST_CHECK(wheel_pending(&timers[3].timer));
+    wheel_del(&timers[3].timer);
+
+    /* the next timer is still the other one of the pair */
+    TEST_CHECK(wheel_next(wheel, start + 2990) <= 10);
+
+    /* moving a timer is cancelling and adding it */
+    wheel_add(wheel, &timers[5].timer, start + 4000);
+    wheel_del(&timers[4].timer);
+
+    run_until_empty(wheel, start + 2990, &steps);
+    TEST_CHECK(timers[1].count == 0 && timers[3].count == 0);
+    TEST_CHECK(timers[4].count == 0);
+    TEST_CHECK(timers[2].count == 1 && timers[2].fired == start + 3000);
+    TEST_CHECK(timers[5].count == 1 && timers[5].fired == start + 4000);
+
+    /* and nothing else is pending */
+    TEST_CHECK(wheel_next(wheel, start + 5000) == (uint64_t)-1);
+
+    wheel_free(wheel);
+
+    return 0;
+}
+
+/* timers further out than the wheel's range are parked on the top level
+ * and fire in time, and so do those whose top level slot is behind the
+ * current one */
+static int test_wrap(xmpp_ctx_t * const ctx)
+{
+    test_timer_t timers[4];
+    wheel_t *wheel;
+    uint64_t start;
+    int i, steps;
+
+    /* the last slot of the top level */
+    start = 5 * RANGE - 10;
+    wheel = wheel_new(ctx, start);
+    for (i = 0; i < 4; i++) timer_init(&timers[i], wheel);
+    wheel_add(wheel, &timers[0].timer, start + RANGE / 2);
+    wheel_add(wheel, &timers[1].timer, start + RANGE + 5);
+    wheel_add(wheel, &timers[2].timer, start + 3 * RANGE + 12345);
+    wheel_add(wheel, &timers[3].timer, start + 20);
+
+    TEST_CHECK(wheel_next(wheel, start) <= 20);
+    run_until_empty(wheel, start, &steps);
+
+    TEST_CHECK(timers[3].fired == start + 20);
+    TEST_CHECK(timers[0].fired == start + RANGE / 2);
+    TEST_CHECK(timers[1].fired == start + RANGE + 5);
+    TEST_CHECK(timers[2].fired == start + 3 * RANGE + 12345);
+    for (i = 0; i < 4; i++)
+	TEST_CHECK(timers[i].count == 1);
+
+    wheel_free(wheel);
+
+    return 0;
+}
+
+/* a callback adding its own timer again, as timed handlers do, gets it
+ * fired on a later run only, even if it is due already */
+static int test_rearm(xmpp_ctx_t * const ctx, const uint64_t start)
+{
+    test_timer_t periodic, immediate;
+    wheel_t *wheel;
+    uint64_t now;
+    int steps;
+
+    wheel = wheel_new(ctx, start);
+    timer_init(&periodic, wheel);
+    periodic.period = 100;
+    periodic.rearm = 9;
+    wheel_add(wheel, &periodic.timer, start + 100);
+
+    now = run_until_empty(wheel, start, &steps);
+    TEST_CHECK(periodic.count == 10);
+    TEST_CHECK(periodic.fired == start + 1000);
+    TEST_CHECK(now == start + 1000);
+
+    /* re-added as due right away */
+    timer_init(&immediate, wheel);
+    immediate.period = 0;
+    immediate.rearm = 2;
+    wheel_add(wheel, &immediate.timer, now);
+    wheel_run(wheel, now);
+    TEST_CHECK(immediate.count == 1);
+    TEST_CHECK(wheel_pending(&immediate.timer));
+    TEST_CHECK(wheel_next(wheel, now) == 0);
+    wheel_run(wheel, now);
+    TEST_CHECK(immediate.count == 2);
+    wheel_run(wheel, now + 1);
+    TEST_CHECK(immediate.count == 3);
+    TEST_CHECK(!wheel_pending(&immediate.timer));
+
+    wheel_free(wheel);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srand(1);
+
+    /* at the start of the wheel's levels and at an odd time */
+    if (test_cascade(ctx, 0) || test_cascade(ctx, 1234567891) ||
+	test_random(ctx, 987654321) || test_cancel(ctx, 1000) ||
+	test_cancel(ctx, RANGE - 1500) || test_wrap(ctx) ||
+	test_rearm(ctx, 4242))
+	return 1;
+
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/* test_writev.c
+** libstrophe XMPP client library -- test routines for gathered writes
+**
+** Copyright (C) 2005-2009 Collecta, Inc.
+**
+**  This software is provided AS-IS with no warranty, either express
+**  or implied.
+**
+**  This software is distributed under license and may not be copied,
+**  modified or distributed except as expressly authorized under the
+**  terms of the license contained in the file LICENSE.txt in this
+**  distribution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "strophe.h"
+#include "fakeserver.h"
+#include "test.h"
+
+/* items of odd sizes, so that short writes end in the middle of them */
+#define ITEMS 400
+#define ITEM_SIZE(i) (997 + ((i) * 131) % 2011)
+
+static void free_adopted(char * const data, void * const userdata)
+{
+    free(data);
+}
+
+/* fill data with a pattern unique to each item */
+static void fill_item(char * const data, const size_t len, const int i)
+{
+    size_t j;
+
+    for (j = 0; j < len; j++)
+	data[j] = 'a' + (i + j) % 26;
+    sprintf(data, "<i n='%d'/>", i);
+    data[strlen(data)] = ' ';
+}
+
+int main(int argc, char **argv)
+{
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;
+    fakeserver_t *srv;
+    char *expected, *data;
+    size_t total = 0, len, plateau;
+    int sndbuf = 8192;
+    int i;
+
+    ctx = xmpp_ctx_new(NULL, NULL);
+    srv = fakeserver_new(ctx);
+    TEST_CHECK(srv != NULL);
+
+    conn = xmpp_conn_new(ctx);
+    xmpp_conn_set_jid(conn, "u@localhost/r");
+    xmpp_conn_set_pass(conn, "p");
+    TEST_CHECK(fakeserver_start(srv, conn, "", NULL, NULL) == 0);
+
+    /* keep the socket small so that it fills up quickly */
+    setsockopt(xmpp_conn_get_fd(conn), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+	       sizeof(sndbuf));
+
+    for (i = 0; i < ITEMS; i++)
+	total += ITEM_SIZE(i);
+    expected = malloc(total);
+    TEST_CHECK(expected != NULL);
+
+    /* the server stops reading, and the queue is sent as far as the
+     * socket takes it, mixing copied and adopted items */
+    fakeserver_pause(srv, 1);
+    for (i = 0, len = 0; i < ITEMS; len += ITEM_SIZE(i), i++) {
+	fill_item(&expected[len], ITEM_SIZE(i), i);
+	if (i % 2) {
+	    xmpp_send_raw(conn, &expected[len], ITEM_SIZE(i));
+	} else {
+	    data = malloc(ITEM_SIZE(i));
+	    memcpy(data, &expected[len], ITEM_SIZE(i));
+	    xmpp_send_adopt(conn, data, ITEM_SIZE(i), free_adopted, NULL);
+	}
+    }
+    fakeserver_run(srv, 100);
+
+    /* the socket is full but the queue is not empty, so the last write
+     * stopped short */
+    plateau = xmpp_conn_get_send_queue_bytes(conn);
+    TEST_CHECK(plateau > 0 && plateau < total);
+    fakeserver_run(srv, 10);
+    TEST_CHECK(xmpp_conn_get_send_queue_bytes(conn) == plateau);
+
+    /* everything arrives once the server reads again, in order and
+     * with no byte repeated or lost where writes were cut */
+    fakeserver_pause(srv, 0);
+    for (i = 0; i < 5000 && fakeserver_input_len(srv) < total; i++)
+	fakeserver_run(srv, 1);
+    TEST_CHECK(fakeserver_input_len(srv) == total);
+    TEST_CHECK(memcmp(fakeserver_input(srv), expected, total) == 0);
+    TEST_CHECK(xmpp_conn_get_send_queue_bytes(conn) == 0);
+
+    free(expected);
+    xmpp_conn_release(conn);
+    fakeserver_free(srv);
+    xmpp_ctx_free(ctx);
+
+    return 0;
+}